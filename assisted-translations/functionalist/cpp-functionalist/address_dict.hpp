@@ -0,0 +1,159 @@
+#ifndef ADDRESS_DICT_H
+#define ADDRESS_DICT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "flat_table.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Dense 32-bit codes for the IPv4 and MAC addresses of an epoch, numbered
+// from 0 in order of first sight. A stage that looks an address up in
+// several tables codes it once and indexes a CodedTable with the code from
+// then on: one probe of 12-byte entries in place of one probe of packed
+// keys per table. Codes mean nothing across dictionaries, so one dictionary
+// must serve every table its codes index, for as long as they do.
+class AddressDictionary {
+ public:
+  // What coding one more address costs: its table entry and index slots,
+  // and its slot in the decoding array.
+  static constexpr size_t kBytesPerCode =
+      FlatTable<uint64_t, uint32_t>::kBytesPerKey + sizeof(OpResult);
+
+  explicit AddressDictionary(size_t expected = 16)
+      : codeOf(expected) {
+    addresses.reserve(expected);
+  }
+
+  static bool isAddress(const OpResult& val) {
+    return val.typ == OpResultType::IPv4 || val.typ == OpResultType::MAC;
+  }
+
+  // The code of address, the next unused one if it has none yet. Throws
+  // invalid_argument for a value that is not an address.
+  uint32_t encode(const OpResult& address) {
+    auto [code, inserted] = codeOf.findOrInsert(wordOf(address));
+    if (inserted) {
+      *code = static_cast<uint32_t>(addresses.size());
+      addresses.push_back(address);
+    }
+    return *code;
+  }
+
+  OpResult decode(uint32_t code) const { return addresses[code]; }
+
+  // Forgets every code but keeps the memory for the next epoch.
+  void clear() {
+    codeOf.clear();
+    addresses.clear();
+  }
+
+  size_t size() const { return addresses.size(); }
+  size_t bytes() const {
+    return codeOf.bytes() + addresses.capacity() * sizeof(OpResult);
+  }
+
+ private:
+  FlatTable<uint64_t, uint32_t> codeOf;
+  vector<OpResult> addresses;
+
+  // The payload with the type above it, so that an IPv4 address and a MAC
+  // address of the same bits get different codes.
+  static uint64_t wordOf(const OpResult& address) {
+    if (!isAddress(address)) {
+      throw invalid_argument(
+          "Error: only IPv4 and MAC addresses take dictionary codes");
+    }
+    return address.bits() | static_cast<uint64_t>(address.typ) << 56;
+  }
+};
+
+// Values keyed by the codes of one AddressDictionary, held in arrays indexed
+// by code, with FlatTable's interface. Finding a value is an array access;
+// the arrays grow to the largest code inserted and clear() touches only
+// what the last epoch used. V must be default constructible and copyable.
+template <typename V>
+class CodedTable {
+ public:
+  // A value and its presence flag; the arrays are sized by the codes of the
+  // dictionary rather than by the keys of this table, so this is a floor.
+  static constexpr size_t kBytesPerKey = sizeof(V) + 1;
+
+  explicit CodedTable(size_t expected = 16) {
+    values.reserve(expected);
+    present.reserve(expected);
+  }
+
+  V* find(uint32_t code) {
+    return code < used && present[code] ? &values[code] : nullptr;
+  }
+
+  const V* find(uint32_t code) const {
+    return code < used && present[code] ? &values[code] : nullptr;
+  }
+
+  pair<V*, bool> findOrInsert(uint32_t code) {
+    if (code >= used) {
+      if (code >= values.size()) {
+        size_t grown = max<size_t>(static_cast<size_t>(code) + 1,
+                                   values.size() * 2);
+        values.resize(grown);
+        present.resize(grown, 0);
+      }
+      used = code + 1;
+    }
+    if (present[code]) {
+      return {&values[code], false};
+    }
+    present[code] = 1;
+    values[code] = V();
+    count++;
+    return {&values[code], true};
+  }
+
+  bool erase(uint32_t code) {
+    if (code >= used || !present[code]) {
+      return false;
+    }
+    present[code] = 0;
+    count--;
+    return true;
+  }
+
+  // Visits the live entries in order of code.
+  template <typename F>
+  void forEach(F f) const {
+    for (uint32_t code = 0; code < used; code++) {
+      if (present[code]) {
+        f(code, values[code]);
+      }
+    }
+  }
+
+  void clear() {
+    fill(present.begin(), present.begin() + used, uint8_t{0});
+    used = 0;
+    count = 0;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  size_t bytes() const {
+    return values.capacity() * sizeof(V) + present.capacity();
+  }
+
+ private:
+  vector<V> values;
+  vector<uint8_t> present;
+  // Codes at or past used have never been inserted since the last clear.
+  uint32_t used = 0;
+  size_t count = 0;
+};
+
+#endif  // ADDRESS_DICT_H
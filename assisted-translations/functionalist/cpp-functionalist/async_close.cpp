@@ -0,0 +1,194 @@
+#include "async_close.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "flat_table.hpp"
+#include "metrics.hpp"
+#include "packed_key.hpp"
+
+EpochFlusher::EpochFlusher(AsyncCloseOptions options) : options(options) {
+  if (options.maxSealed == 0) {
+    throw invalid_argument(
+        "Error: an async close needs room for at least one sealed epoch");
+  }
+  worker = thread([this]() { run(); });
+}
+
+EpochFlusher::~EpochFlusher() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+}
+
+void EpochFlusher::submit(function<void()> close) {
+  checkFailed();
+  unique_lock<mutex> guard(lock);
+  space.wait(guard, [this]() { return queue.size() < options.maxSealed; });
+  queue.push_back(move(close));
+  wake.notify_one();
+}
+
+void EpochFlusher::run() {
+  if (options.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(options.cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+      error = make_exception_ptr(
+          runtime_error("Error: could not pin flusher thread to CPU " +
+                        to_string(options.cpu) + ": " + strerror(err)));
+      failed.store(true, memory_order_release);
+    }
+  }
+
+  unique_lock<mutex> guard(lock);
+  for (;;) {
+    wake.wait(guard, [this]() { return !queue.empty() || stopping; });
+    if (queue.empty()) {
+      return;
+    }
+    function<void()> close = move(queue.front());
+    queue.pop_front();
+    space.notify_one();
+    guard.unlock();
+
+    if (!failed.load(memory_order_relaxed)) {
+      try {
+        close();
+      } catch (...) {
+        error = current_exception();
+        failed.store(true, memory_order_release);
+      }
+    }
+    close = nullptr;
+
+    guard.lock();
+  }
+}
+
+namespace {
+
+// The table a stage fills on the calling thread, and the ones sealed before
+// it, which the flusher empties and hands back.
+template <typename Value>
+class AsyncTableState {
+ public:
+  using Table = FlatTable<PackedKey, Value, PackedKeyHash>;
+
+  AsyncTableState(Operator nextOp, AsyncCloseOptions options)
+      : nextOp(move(nextOp)),
+        gauge(meterTable()),
+        tableSize(initTableSize()),
+        current(make_shared<Table>(tableSize)),
+        flusher(options) {}
+
+  Table& table() { return *current; }
+
+  void checkFailed() const { flusher.checkFailed(); }
+
+  // Seals the current table and, on the flusher thread, passes
+  // emit(headers, key, value) on for each of its entries, then the reset.
+  template <typename Emit>
+  void close(const Headers& headers, Emit emit) {
+    if (gauge) {
+      gauge->record(current->size(), current->bytes());
+    }
+    shared_ptr<Table> sealed = move(current);
+    current = takeSpare();
+    flusher.submit([this, sealed, headers, emit]() {
+      sealed->forEach([&](const PackedKey& key, const Value& val) {
+        nextOp.next(emit(headers, key, val));
+      });
+      nextOp.reset(headers);
+      sealed->clear();
+      lock_guard<mutex> guard(spareLock);
+      spare.push_back(sealed);
+    });
+  }
+
+ private:
+  Operator nextOp;
+  shared_ptr<TableGauge> gauge;
+  size_t tableSize;
+  shared_ptr<Table> current;
+  mutex spareLock;
+  vector<shared_ptr<Table>> spare;
+  // Last, so that it is joined before anything its closes use goes away.
+  EpochFlusher flusher;
+
+  shared_ptr<Table> takeSpare() {
+    lock_guard<mutex> guard(spareLock);
+    if (spare.empty()) {
+      return make_shared<Table>(tableSize);
+    }
+    shared_ptr<Table> table = move(spare.back());
+    spare.pop_back();
+    return table;
+  }
+};
+
+}  // namespace
+
+OpCreator asyncGroupbyCreator(KeyProjector groupby, ReductionFunc reduct,
+                              string outKey, AsyncCloseOptions options) {
+  FieldId outKeyId = internField(outKey);
+
+  return [groupby, reduct, outKeyId, options](Operator nextOp) {
+    auto state = make_shared<AsyncTableState<OpResult>>(nextOp, options);
+
+    OpFunc next = [groupby, reduct, state](const Headers& headers) {
+      state->checkFailed();
+      ProjectedKey projected = groupby.project(headers);
+      auto [val, inserted] =
+          state->table().findOrInsertHashed(projected.key, projected.hash);
+      *val = reduct(inserted ? OpResult::Empty() : *val, headers);
+    };
+
+    OpFunc reset = [state, outKeyId](const Headers& headers) {
+      state->close(headers, [outKeyId](const Headers& headers,
+                                       const PackedKey& groupingKey,
+                                       const OpResult& val) {
+        Headers unionedHeaders = unionHeaders(headers, unpackKey(groupingKey));
+        unionedHeaders[outKeyId] = val;
+        return unionedHeaders;
+      });
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator asyncDistinctCreator(KeyProjector groupby,
+                               AsyncCloseOptions options) {
+  return [groupby, options](Operator nextOp) {
+    auto state = make_shared<AsyncTableState<bool>>(nextOp, options);
+
+    OpFunc next = [groupby, state](const Headers& headers) {
+      state->checkFailed();
+      ProjectedKey projected = groupby.project(headers);
+      *state->table()
+           .findOrInsertHashed(projected.key, projected.hash)
+           .first = true;
+    };
+
+    OpFunc reset = [state](const Headers& headers) {
+      state->close(headers, [](const Headers& headers, const PackedKey& key,
+                               bool _) {
+        return unionHeaders(headers, unpackKey(key));
+      });
+    };
+
+    return Operator(next, reset);
+  };
+}
@@ -0,0 +1,80 @@
+#ifndef ASYNC_CLOSE_H
+#define ASYNC_CLOSE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "builtins.hpp"
+#include "key_projector.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+struct AsyncCloseOptions {
+  // Sealed epochs that may wait for the flusher before a reset blocks.
+  size_t maxSealed = 2;
+  // Pins the flusher thread to this CPU when nonnegative.
+  int cpu = -1;
+};
+
+// A background thread that closes the epochs of one stateful stage. Closes
+// run one at a time, in the order they were submitted.
+class EpochFlusher {
+ public:
+  explicit EpochFlusher(AsyncCloseOptions options);
+  // Runs the closes still queued, then joins the thread.
+  ~EpochFlusher();
+
+  EpochFlusher(const EpochFlusher&) = delete;
+  EpochFlusher& operator=(const EpochFlusher&) = delete;
+
+  // Queues close behind every close submitted before it. Blocks while
+  // maxSealed closes are already waiting to run.
+  void submit(function<void()> close);
+  // Rethrows the exception of a failed close, if there was one. Once a close
+  // fails, later ones are dropped rather than run.
+  void checkFailed() const {
+    if (failed.load(memory_order_acquire)) {
+      rethrow_exception(error);
+    }
+  }
+
+ private:
+  AsyncCloseOptions options;
+  mutex lock;
+  condition_variable wake;
+  condition_variable space;
+  deque<function<void()>> queue;
+  bool stopping = false;
+  atomic<bool> failed{false};
+  exception_ptr error;
+  thread worker;
+
+  void run();
+};
+
+// groupbyCreator and distinctCreator with the epoch closed off the packet
+// path. At a reset the stage swaps its table for an empty one and carries on
+// with the next tuple at once; the sealed table goes to a flusher thread,
+// which emits its groups and passes the reset on exactly as the synchronous
+// stage would have, so nextOp sees the same tuples and resets in the same
+// order. Emptied tables are handed back for reuse, so in steady state no
+// table is allocated.
+//
+// Everything downstream runs on the flusher thread. The flusher drains and
+// exits when the last copy of the operator is dropped. An exception from
+// downstream is rethrown by the next call on the producing side.
+OpCreator asyncGroupbyCreator(KeyProjector groupby, ReductionFunc reduct,
+                              string outKey,
+                              AsyncCloseOptions options = AsyncCloseOptions());
+OpCreator asyncDistinctCreator(KeyProjector groupby,
+                               AsyncCloseOptions options = AsyncCloseOptions());
+
+#endif  // ASYNC_CLOSE_H
@@ -0,0 +1,397 @@
+#include "async_io.hpp"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+// One io_uring instance, driven through the raw system calls. Only its
+// owner touches it, so the ring memory needs ordering against the kernel
+// alone, not against other threads.
+class IoRing {
+ public:
+  // Throws runtime_error if the kernel will not set up a ring.
+  explicit IoRing(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    long ret = syscall(SYS_io_uring_setup, entries, &params);
+    if (ret < 0) {
+      throw runtime_error(string("Error: io_uring_setup: ") + strerror(errno));
+    }
+    fd = static_cast<int>(ret);
+
+    sqBytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+      sqBytes = cqBytes = max(sqBytes, cqBytes);
+    }
+    sqRing = map(sqBytes, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing : map(cqBytes, IORING_OFF_CQ_RING);
+    sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(map(sqesBytes, IORING_OFF_SQES));
+
+    char* sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    tail = *sqTail;
+    submitted = tail;
+  }
+
+  ~IoRing() { release(); }
+
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  // Throws runtime_error if the kernel will not pin them.
+  void registerBuffers(const vector<iovec>& buffers) {
+    if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                buffers.data(), static_cast<unsigned>(buffers.size())) < 0) {
+      throw runtime_error(string("Error: io_uring_register: ") +
+                          strerror(errno));
+    }
+  }
+
+  // A zeroed entry to fill in, queued for the next enter, or nullptr when
+  // the submission queue is full.
+  io_uring_sqe* entry() {
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+      return nullptr;
+    }
+    unsigned index = tail & sqMask;
+    sqArray[index] = index;
+    tail++;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // Hands the queued entries to the kernel, then waits until at least
+  // waitFor completions are ready. Throws runtime_error if it cannot.
+  void enter(unsigned waitFor) {
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    for (;;) {
+      unsigned toSubmit = tail - submitted;
+      long ret = syscall(SYS_io_uring_enter, fd, toSubmit, waitFor,
+                         waitFor > 0 ? IORING_ENTER_GETEVENTS : 0u, nullptr,
+                         0);
+      if (ret >= 0) {
+        submitted += static_cast<unsigned>(ret);
+        if (submitted == tail) {
+          return;
+        }
+      } else if (errno != EINTR) {
+        throw runtime_error(string("Error: io_uring_enter: ") +
+                            strerror(errno));
+      }
+    }
+  }
+
+  // Takes the oldest completion, if there is one.
+  bool pop(io_uring_cqe& cqe) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    cqe = cqes[head & cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  int fd = -1;
+  void* sqRing = nullptr;
+  void* cqRing = nullptr;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqBytes = 0;
+  size_t cqBytes = 0;
+  size_t sqesBytes = 0;
+
+  unsigned* sqHead = nullptr;
+  unsigned* sqTail = nullptr;
+  unsigned* sqArray = nullptr;
+  unsigned sqMask = 0;
+  unsigned sqEntries = 0;
+  unsigned* cqHead = nullptr;
+  unsigned* cqTail = nullptr;
+  unsigned cqMask = 0;
+  io_uring_cqe* cqes = nullptr;
+  // Entries queued so far, and those the kernel has taken.
+  unsigned tail = 0;
+  unsigned submitted = 0;
+
+  void release() {
+    if (sqes != nullptr) {
+      munmap(sqes, sqesBytes);
+    }
+    if (cqRing != nullptr && cqRing != sqRing) {
+      munmap(cqRing, cqBytes);
+    }
+    if (sqRing != nullptr) {
+      munmap(sqRing, sqBytes);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  void* map(size_t bytes, off_t offset) {
+    void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (addr == MAP_FAILED) {
+      int err = errno;
+      release();
+      throw runtime_error(string("Error: could not map io_uring: ") +
+                          strerror(err));
+    }
+    return addr;
+  }
+};
+
+namespace {
+
+// Read-ahead is requested this much at a time, so that a window is a
+// handful of requests.
+constexpr size_t kReadAheadStep = size_t{1} << 20;
+constexpr unsigned kReadAheadDepth = 16;
+
+}  // namespace
+
+AsyncFileWriter::AsyncFileWriter(const string& path, AsyncIoOptions options)
+    : path(path), options(move(options)) {
+  if (this->options.bufferBytes == 0 || this->options.buffers == 0) {
+    throw invalid_argument(
+        "Error: AsyncFileWriter needs at least one non-empty buffer");
+  }
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw runtime_error("Error: could not open \"" + path +
+                        "\": " + strerror(errno));
+  }
+  struct stat st;
+  seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+  memory.resize(this->options.buffers * this->options.bufferBytes);
+  slots.resize(this->options.buffers);
+  try {
+    ring = make_unique<IoRing>(static_cast<unsigned>(slots.size()));
+  } catch (const runtime_error&) {
+    // Blocking writes it is.
+  }
+  if (ring != nullptr) {
+    vector<iovec> iovecs;
+    for (size_t i = 0; i < slots.size(); i++) {
+      iovecs.push_back({slotData(i), this->options.bufferBytes});
+    }
+    try {
+      ring->registerBuffers(iovecs);
+      registered = true;
+    } catch (const runtime_error&) {
+      // Plain writes through the ring still leave the thread free.
+    }
+  }
+  if (this->options.stats) {
+    this->options.stats->ring = ring != nullptr;
+  }
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+  try {
+    while (inFlight > 0) {
+      reap(true);
+    }
+  } catch (...) {
+  }
+  close(fd);
+}
+
+char* AsyncFileWriter::write(size_t n) {
+  if (error != 0) {
+    failed(error);
+  }
+  if (n == 0) {
+    return buffer();
+  }
+  Slot& slot = slots[current];
+  slot.offset = offset;
+  slot.length = n;
+  slot.written = 0;
+  offset += n;
+  if (options.stats) {
+    options.stats->writes++;
+    options.stats->bytes += n;
+  }
+
+  if (ring == nullptr) {
+    writeNow(slot, slotData(current));
+    return buffer();
+  }
+  // Without offsets to keep them apart, writes must land one at a time.
+  while (!seekable && inFlight > 0) {
+    reap(true);
+  }
+  slot.busy = true;
+  inFlight++;
+  submit(current);
+  reap(false);
+
+  current = (current + 1) % slots.size();
+  if (slots[current].busy) {
+    if (options.stats) {
+      options.stats->waits++;
+    }
+    while (slots[current].busy) {
+      reap(true);
+    }
+  }
+  if (error != 0) {
+    failed(error);
+  }
+  return buffer();
+}
+
+void AsyncFileWriter::sync() {
+  while (inFlight > 0) {
+    reap(true);
+  }
+  if (error != 0) {
+    failed(error);
+  }
+}
+
+void AsyncFileWriter::writeNow(Slot& slot, const char* data) {
+  while (slot.written < slot.length) {
+    const char* from = data + slot.written;
+    size_t left = slot.length - slot.written;
+    ssize_t n = seekable ? pwrite(fd, from, left, slot.offset + slot.written)
+                         : ::write(fd, from, left);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = errno;
+      failed(error);
+    }
+    slot.written += static_cast<size_t>(n);
+  }
+}
+
+void AsyncFileWriter::submit(size_t index) {
+  io_uring_sqe* sqe;
+  while ((sqe = ring->entry()) == nullptr) {
+    reap(true);
+  }
+  Slot& slot = slots[index];
+  sqe->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = seekable ? slot.offset + slot.written : ~uint64_t{0};
+  sqe->addr = reinterpret_cast<uint64_t>(slotData(index) + slot.written);
+  sqe->len = static_cast<uint32_t>(slot.length - slot.written);
+  sqe->buf_index = static_cast<uint16_t>(index);
+  sqe->user_data = index;
+  ring->enter(0);
+}
+
+void AsyncFileWriter::reap(bool wait) {
+  if (wait) {
+    ring->enter(1);
+  }
+  io_uring_cqe cqe;
+  while (ring->pop(cqe)) {
+    size_t index = static_cast<size_t>(cqe.user_data);
+    Slot& slot = slots[index];
+    if (cqe.res > 0) {
+      slot.written += static_cast<size_t>(cqe.res);
+      if (slot.written < slot.length && error == 0) {
+        submit(index);
+        continue;
+      }
+    } else if (error == 0) {
+      error = cqe.res < 0 ? -cqe.res : EIO;
+    }
+    slot.busy = false;
+    inFlight--;
+  }
+}
+
+void AsyncFileWriter::failed(int err) const {
+  throw runtime_error("Error: could not write \"" + path +
+                      "\": " + strerror(err));
+}
+
+ReadAhead::ReadAhead(const string& path, size_t window)
+    : window(max(window, kReadAheadStep)) {
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size = static_cast<uint64_t>(st.st_size);
+  }
+  try {
+    ring = make_unique<IoRing>(kReadAheadDepth);
+  } catch (const runtime_error&) {
+    // posix_fadvise does the same, if on this thread.
+  }
+}
+
+ReadAhead::~ReadAhead() {
+  ring.reset();
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void ReadAhead::request(uint64_t offset) {
+  uint64_t target = min(size, offset + window);
+  if (ring != nullptr) {
+    io_uring_cqe cqe;
+    while (ring->pop(cqe)) {
+    }
+  }
+  bool queued = false;
+  while (requested < target) {
+    size_t len = static_cast<size_t>(min<uint64_t>(kReadAheadStep,
+                                                   target - requested));
+    if (ring != nullptr) {
+      io_uring_sqe* sqe = ring->entry();
+      if (sqe == nullptr) {
+        break;
+      }
+      sqe->opcode = IORING_OP_FADVISE;
+      sqe->fd = fd;
+      sqe->off = requested;
+      sqe->len = static_cast<uint32_t>(len);
+      sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+      queued = true;
+    } else {
+      posix_fadvise(fd, static_cast<off_t>(requested),
+                    static_cast<off_t>(len), POSIX_FADV_WILLNEED);
+    }
+    requested += len;
+  }
+  if (queued) {
+    try {
+      ring->enter(0);
+    } catch (const runtime_error&) {
+      ring.reset();
+    }
+  }
+}
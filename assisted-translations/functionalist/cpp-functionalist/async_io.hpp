@@ -0,0 +1,134 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// File I/O that does not hold up the thread issuing it, built on io_uring.
+// The kernel does the work; the owning thread only queues requests and reaps
+// their completions, both without locks, since nothing else touches the
+// ring. Where the kernel refuses io_uring, as under some seccomp policies,
+// the same calls fall back to plain blocking I/O.
+
+class IoRing;
+
+struct AsyncIoStats {
+  uint64_t writes = 0;
+  uint64_t bytes = 0;
+  // Times a full buffer had to wait for an earlier write to finish before
+  // the writer could go on: each one is a stall the disk caused.
+  uint64_t waits = 0;
+  // Whether the writes went through io_uring rather than the fallback.
+  bool ring = false;
+};
+
+struct AsyncIoOptions {
+  size_t bufferBytes = size_t{1} << 16;
+  // Buffers registered with the kernel; all but the one being filled may
+  // be in flight at once.
+  size_t buffers = 4;
+  // Updated by the writer when set.
+  shared_ptr<AsyncIoStats> stats;
+};
+
+// Writes a file front to back from a set of registered buffers: the caller
+// fills one while the kernel writes out the others. Must be used from one
+// thread at a time.
+class AsyncFileWriter {
+ public:
+  // Creates or truncates path. Throws runtime_error if it cannot be opened.
+  explicit AsyncFileWriter(const string& path,
+                           AsyncIoOptions options = AsyncIoOptions());
+  // Waits for the writes still in flight, then closes the file. Errors are
+  // dropped; call sync first to see them.
+  ~AsyncFileWriter();
+
+  AsyncFileWriter(const AsyncFileWriter&) = delete;
+  AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+  // The buffer to fill next, of capacity() bytes.
+  char* buffer() { return slotData(current); }
+  size_t capacity() const { return options.bufferBytes; }
+
+  // Queues the first n bytes of buffer() to be written after everything
+  // written before them, and returns the buffer to fill next. Blocks only
+  // while every other buffer is still being written. Throws runtime_error
+  // if an earlier write failed.
+  char* write(size_t n);
+  // Waits for every queued write. Throws runtime_error if one failed.
+  void sync();
+
+ private:
+  struct Slot {
+    uint64_t offset = 0;
+    size_t length = 0;
+    size_t written = 0;
+    bool busy = false;
+  };
+
+  string path;
+  AsyncIoOptions options;
+  int fd = -1;
+  // Pipes and devices take writes at the current position only.
+  bool seekable = false;
+  // The buffers, registered with ring when registered is set. Declared
+  // before ring so that they outlive it.
+  vector<char> memory;
+  vector<Slot> slots;
+  unique_ptr<IoRing> ring;
+  bool registered = false;
+  size_t current = 0;
+  size_t inFlight = 0;
+  uint64_t offset = 0;
+  // The errno of the first write that failed.
+  int error = 0;
+
+  char* slotData(size_t slot) {
+    return memory.data() + slot * options.bufferBytes;
+  }
+  // Writes slot from data on this thread, for when there is no ring.
+  void writeNow(Slot& slot, const char* data);
+  void submit(size_t slot);
+  // Reaps completions, waiting for at least one when wait is set.
+  void reap(bool wait);
+  [[noreturn]] void failed(int err) const;
+};
+
+// Keeps the kernel reading a file some way ahead of a consumer working
+// through it, typically through a MappedFile, so that the consumer finds
+// its pages cached rather than faulting on each one. Read-ahead is advisory:
+// a file that cannot be opened, or a kernel that refuses, just gets none.
+class ReadAhead {
+ public:
+  explicit ReadAhead(const string& path,
+                     size_t window = size_t{8} << 20);
+  ~ReadAhead();
+
+  ReadAhead(const ReadAhead&) = delete;
+  ReadAhead& operator=(const ReadAhead&) = delete;
+
+  // Tells it the consumer has reached offset. Cheap to call for every
+  // record: requests go out only once the consumer has used up half the
+  // window.
+  void advance(uint64_t offset) {
+    if (offset + window / 2 > requested && requested < size) {
+      request(offset);
+    }
+  }
+
+ private:
+  int fd = -1;
+  uint64_t size = 0;
+  size_t window;
+  uint64_t requested = 0;
+  unique_ptr<IoRing> ring;
+
+  void request(uint64_t offset);
+};
+
+#endif  // ASYNC_IO_H
@@ -0,0 +1,439 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+
+namespace {
+
+template <typename F>
+void forEachKnownColumn(Batch& batch, F f) {
+  f(Field::Time, batch.time);
+  f(Field::EthSrc, batch.ethSrc);
+  f(Field::EthDst, batch.ethDst);
+  f(Field::EthEthertype, batch.ethEthertype);
+  f(Field::Ipv4Hlen, batch.ipv4Hlen);
+  f(Field::Ipv4Proto, batch.ipv4Proto);
+  f(Field::Ipv4Len, batch.ipv4Len);
+  f(Field::Ipv4Src, batch.ipv4Src);
+  f(Field::Ipv4Dst, batch.ipv4Dst);
+  f(Field::L4Sport, batch.l4Sport);
+  f(Field::L4Dport, batch.l4Dport);
+  f(Field::L4Flags, batch.l4Flags);
+  f(Field::Eid, batch.eid);
+}
+
+}  // namespace
+
+void Batch::reserveColumns(uint64_t mask) {
+  columns |= mask;
+  forEachKnownColumn(*this, [this](Field field, auto& column) {
+    if (has(field)) {
+      column.resize(rows);
+    }
+  });
+}
+
+void Batch::resize(size_t n) {
+  rows = n;
+  forEachKnownColumn(*this, [this, n](Field field, auto& column) {
+    if (has(field)) {
+      column.resize(n);
+    }
+  });
+  for (auto& [id, column] : extra) {
+    column.resize(n);
+  }
+  sel.resize(n);
+  iota(sel.begin(), sel.end(), 0);
+}
+
+void Batch::clear() {
+  resize(0);
+  columns = 0;
+  extra.clear();
+}
+
+vector<OpResult>* Batch::extraColumn(FieldId id) {
+  for (auto& [colId, column] : extra) {
+    if (colId == id) {
+      return &column;
+    }
+  }
+  return nullptr;
+}
+
+const vector<OpResult>* Batch::extraColumn(FieldId id) const {
+  for (const auto& [colId, column] : extra) {
+    if (colId == id) {
+      return &column;
+    }
+  }
+  return nullptr;
+}
+
+OpResult Batch::value(FieldId id, uint32_t row) const {
+  if (!has(id)) {
+    throw out_of_range("Error: batch has no column for field \"" +
+                       fieldName(id) + "\"");
+  }
+  switch (static_cast<Field>(id)) {
+    case Field::Time:
+      return OpResult::Float(time[row]);
+    case Field::EthSrc:
+      return OpResult::MAC(MACAddress(ethSrc[row]));
+    case Field::EthDst:
+      return OpResult::MAC(MACAddress(ethDst[row]));
+    case Field::EthEthertype:
+      return OpResult::Int(ethEthertype[row]);
+    case Field::Ipv4Hlen:
+      return OpResult::Int(ipv4Hlen[row]);
+    case Field::Ipv4Proto:
+      return OpResult::Int(ipv4Proto[row]);
+    case Field::Ipv4Len:
+      return OpResult::Int(ipv4Len[row]);
+    case Field::Ipv4Src:
+      return OpResult::IPv4(IPv4Address(ipv4Src[row]));
+    case Field::Ipv4Dst:
+      return OpResult::IPv4(IPv4Address(ipv4Dst[row]));
+    case Field::L4Sport:
+      return OpResult::Int(l4Sport[row]);
+    case Field::L4Dport:
+      return OpResult::Int(l4Dport[row]);
+    case Field::L4Flags:
+      return OpResult::Int(l4Flags[row]);
+    case Field::Eid:
+      return OpResult::Int(eid[row]);
+    default:
+      return (*extraColumn(id))[row];
+  }
+}
+
+void Batch::set(FieldId id, uint32_t row, OpResult val) {
+  uint64_t bit = uint64_t{1} << id;
+  if (id >= fid(Field::Tuples)) {
+    if (!has(id)) {
+      columns |= bit;
+      extra.emplace_back(id, vector<OpResult>(rows));
+    }
+    (*extraColumn(id))[row] = val;
+    return;
+  }
+  if (!has(id)) {
+    reserveColumns(bit);
+  }
+  switch (static_cast<Field>(id)) {
+    case Field::Time:
+      time[row] = val.asFloat();
+      break;
+    case Field::EthSrc:
+      ethSrc[row] = val.asMAC().toUint64();
+      break;
+    case Field::EthDst:
+      ethDst[row] = val.asMAC().toUint64();
+      break;
+    case Field::EthEthertype:
+      ethEthertype[row] = static_cast<uint16_t>(val.asInt());
+      break;
+    case Field::Ipv4Hlen:
+      ipv4Hlen[row] = static_cast<uint8_t>(val.asInt());
+      break;
+    case Field::Ipv4Proto:
+      ipv4Proto[row] = static_cast<uint8_t>(val.asInt());
+      break;
+    case Field::Ipv4Len:
+      ipv4Len[row] = static_cast<uint16_t>(val.asInt());
+      break;
+    case Field::Ipv4Src:
+      ipv4Src[row] = val.asIPv4().toUint32();
+      break;
+    case Field::Ipv4Dst:
+      ipv4Dst[row] = val.asIPv4().toUint32();
+      break;
+    case Field::L4Sport:
+      l4Sport[row] = static_cast<uint16_t>(val.asInt());
+      break;
+    case Field::L4Dport:
+      l4Dport[row] = static_cast<uint16_t>(val.asInt());
+      break;
+    case Field::L4Flags:
+      l4Flags[row] = static_cast<uint8_t>(val.asInt());
+      break;
+    case Field::Eid:
+      eid[row] = val.asInt();
+      break;
+    default:
+      break;
+  }
+}
+
+Headers Batch::row(uint32_t row) const {
+  Headers headers;
+  for (uint64_t rest = columns; rest != 0; rest &= rest - 1) {
+    FieldId id = static_cast<FieldId>(__builtin_ctzll(rest));
+    headers[id] = value(id, row);
+  }
+  return headers;
+}
+
+void Batch::appendRow(const Headers& headers) {
+  uint32_t row = static_cast<uint32_t>(rows++);
+  forEachKnownColumn(*this, [this](Field field, auto& column) {
+    if (has(field)) {
+      column.resize(rows);
+    }
+  });
+  for (auto& [id, column] : extra) {
+    column.resize(rows);
+  }
+  sel.push_back(row);
+  for (auto it = headers.begin(); it != headers.end(); ++it) {
+    set(it.id(), row, headers.at(it.id()));
+  }
+}
+
+BatchOpCreator batchEpochCreator(double epochWidth, string keyOut) {
+  FieldId keyOutId = internField(keyOut);
+
+  return [epochWidth, keyOutId](BatchOperator nextOp) {
+    auto sharedNextOp = make_shared<BatchOperator>(nextOp);
+    auto epochBoundary = make_shared<double>(0.0);
+    auto eid = make_shared<int64_t>(0);
+    auto run = make_shared<vector<uint32_t>>();
+
+    // Rows are passed on in runs that share an eid; every epoch boundary
+    // inside the batch flushes the current run before the reset goes out.
+    BatchFunc next = [epochWidth, keyOutId, sharedNextOp, epochBoundary, eid,
+                      run](Batch& batch) {
+      vector<uint32_t> all;
+      all.swap(batch.sel);
+      run->clear();
+
+      auto flush = [&batch, &run, &sharedNextOp]() {
+        if (!run->empty()) {
+          batch.sel.swap(*run);
+          sharedNextOp->next(batch);
+          batch.sel.swap(*run);
+          run->clear();
+        }
+      };
+
+      for (uint32_t row : all) {
+        double time = batch.time[row];
+        if (*epochBoundary == 0.0) {
+          *epochBoundary = time + epochWidth;
+        } else {
+          while (time >= *epochBoundary) {
+            flush();
+            sharedNextOp->reset(singleton(fieldName(keyOutId),
+                                          OpResult::Int(*eid)));
+            *epochBoundary += epochWidth;
+            (*eid)++;
+          }
+        }
+        batch.set(keyOutId, row, OpResult::Int(*eid));
+        run->push_back(row);
+      }
+      flush();
+      batch.sel.swap(all);
+    };
+
+    OpFunc reset = [keyOutId, sharedNextOp, epochBoundary,
+                    eid](const Headers& _) {
+      sharedNextOp->reset(singleton(fieldName(keyOutId), OpResult::Int(*eid)));
+      *epochBoundary = 0.0;
+      *eid = 0;
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+vector<FieldId> internFields(const vector<string>& names) {
+  vector<FieldId> ids;
+  ids.reserve(names.size());
+  for (const auto& name : names) {
+    ids.push_back(internField(name));
+  }
+  sort(ids.begin(), ids.end());
+  ids.erase(unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
+PackedKey groupKeyOfRow(const vector<FieldId>& keyIds, const Batch& batch,
+                        uint32_t row) {
+  PackedKey key;
+  for (FieldId id : keyIds) {
+    if (batch.has(id)) {
+      key.push(id, batch.value(id, row));
+    }
+  }
+  return key;
+}
+
+void groupKeysOfRows(const vector<FieldId>& keyIds, const Batch& batch,
+                     vector<PackedKey>& keys, vector<size_t>& hashes) {
+  size_t n = batch.sel.size();
+  keys.resize(n);
+  hashes.resize(n);
+  PackedKeyHash hasher;
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = groupKeyOfRow(keyIds, batch, batch.sel[i]);
+    hashes[i] = hasher(keys[i]);
+  }
+}
+
+BatchToTupleOpCreator batchGroupbyCreator(vector<string> groupKeys,
+                                          BatchReductionFunc reduct,
+                                          string outKey) {
+  vector<FieldId> keyIds = internFields(groupKeys);
+  FieldId outKeyId = internField(outKey);
+
+  return [keyIds, reduct, outKeyId](Operator nextOp) {
+    using GroupTable = FlatTable<PackedKey, OpResult, PackedKeyHash>;
+    auto hTbl = make_shared<GroupTable>(initTableSize());
+    auto keys = make_shared<vector<PackedKey>>();
+    auto hashes = make_shared<vector<size_t>>();
+
+    BatchFunc next = [keyIds, reduct, hTbl, keys, hashes](Batch& batch) {
+      groupKeysOfRows(keyIds, batch, *keys, *hashes);
+      hTbl->findOrInsertBatch(
+          keys->data(), hashes->data(), keys->size(),
+          [&](size_t i, OpResult* val, bool inserted) {
+            *val = reduct(inserted ? OpResult::Empty() : *val, batch,
+                          batch.sel[i]);
+          });
+    };
+
+    OpFunc reset = [hTbl, nextOp, outKeyId](const Headers& headers) {
+      hTbl->forEach([&](const PackedKey& groupingKey, const OpResult& val) {
+        Headers unionedHeaders = unionHeaders(headers, unpackKey(groupingKey));
+        unionedHeaders[outKeyId] = val;
+        nextOp.next(unionedHeaders);
+      });
+      nextOp.reset(headers);
+      hTbl->clear();
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+BatchToTupleOpCreator batchDistinctCreator(vector<string> groupKeys) {
+  vector<FieldId> keyIds = internFields(groupKeys);
+
+  return [keyIds](Operator nextOp) {
+    using DistinctTable = FlatTable<PackedKey, bool, PackedKeyHash>;
+    auto hTbl = make_shared<DistinctTable>(initTableSize());
+    auto keys = make_shared<vector<PackedKey>>();
+    auto hashes = make_shared<vector<size_t>>();
+
+    BatchFunc next = [keyIds, hTbl, keys, hashes](Batch& batch) {
+      groupKeysOfRows(keyIds, batch, *keys, *hashes);
+      hTbl->findOrInsertBatch(keys->data(), hashes->data(), keys->size(),
+                              [](size_t, bool* seen, bool) { *seen = true; });
+    };
+
+    OpFunc reset = [hTbl, nextOp](const Headers& headers) {
+      hTbl->forEach([&](const PackedKey& key, bool _) {
+        nextOp.next(unionHeaders(headers, unpackKey(key)));
+      });
+      nextOp.reset(headers);
+      hTbl->clear();
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+OpResult batchCounter(OpResult val, const Batch& batch, uint32_t row) {
+  switch (val.typ) {
+    case OpResultType::Empty:
+      return OpResult::Int(1);
+    case OpResultType::Int:
+      return OpResult::Int(val.asInt() + 1);
+    default:
+      return val;
+  }
+}
+
+BatchReductionFunc batchSumInts(string searchKey) {
+  FieldId searchId = internField(searchKey);
+
+  return [searchId](OpResult val, const Batch& batch, uint32_t row) {
+    switch (val.typ) {
+      case OpResultType::Empty:
+        return OpResult::Int(0);
+      case OpResultType::Int:
+        if (!batch.has(searchId)) {
+          throw out_of_range(
+              "'sum_vals' function failed to find integer"
+              "value mapped to the given search key");
+        }
+        return OpResult::Int(val.asInt() + batch.value(searchId, row).asInt());
+      default:
+        return val;
+    }
+  };
+}
+
+BatchOperator batchFanout(vector<BatchOperator> ops) {
+  auto sharedOps = make_shared<vector<BatchOperator>>(move(ops));
+  auto saved = make_shared<vector<uint32_t>>();
+
+  BatchFunc next = [sharedOps, saved](Batch& batch) {
+    *saved = batch.sel;
+    for (size_t i = 0; i < sharedOps->size(); i++) {
+      if (i > 0) {
+        batch.sel = *saved;
+      }
+      (*sharedOps)[i].next(batch);
+    }
+  };
+
+  OpFunc reset = [sharedOps](const Headers& headers) {
+    for (auto& op : *sharedOps) {
+      op.reset(headers);
+    }
+  };
+
+  return BatchOperator(next, reset);
+}
+
+BatchOperator unbatch(Operator nextOp) {
+  BatchFunc next = [nextOp](Batch& batch) {
+    for (uint32_t row : batch.sel) {
+      nextOp.next(batch.row(row));
+    }
+  };
+
+  OpFunc reset = [nextOp](const Headers& headers) { nextOp.reset(headers); };
+
+  return BatchOperator(next, reset);
+}
+
+Operator batchTuples(BatchOperator nextOp, size_t batchSize) {
+  auto sharedNextOp = make_shared<BatchOperator>(nextOp);
+  auto pending = make_shared<Batch>();
+
+  auto flush = [sharedNextOp, pending]() {
+    if (pending->rows > 0) {
+      sharedNextOp->next(*pending);
+      pending->clear();
+    }
+  };
+
+  OpFunc next = [pending, batchSize, flush](const Headers& headers) {
+    pending->appendRow(headers);
+    if (pending->rows >= batchSize) {
+      flush();
+    }
+  };
+
+  OpFunc reset = [sharedNextOp, flush](const Headers& headers) {
+    flush();
+    sharedNextOp->reset(headers);
+  };
+
+  return Operator(next, reset);
+}
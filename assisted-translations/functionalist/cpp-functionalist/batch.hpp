@@ -0,0 +1,172 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "builtins.hpp"
+#include "schema.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+constexpr size_t kDefaultBatchSize = 2048;
+
+// A column-oriented block of tuples. The packet fields the queries read get
+// dedicated typed columns so that predicates over them are plain loops over
+// arrays; any other field lives in a generic OpResult column. Operators only
+// look at the rows listed in sel, and filters narrow sel instead of moving
+// data.
+struct Batch {
+  size_t rows = 0;
+  uint64_t columns = 0;
+
+  vector<double> time;
+  vector<uint64_t> ethSrc;
+  vector<uint64_t> ethDst;
+  vector<uint16_t> ethEthertype;
+  vector<uint8_t> ipv4Hlen;
+  vector<uint8_t> ipv4Proto;
+  vector<uint16_t> ipv4Len;
+  vector<uint32_t> ipv4Src;
+  vector<uint32_t> ipv4Dst;
+  vector<uint16_t> l4Sport;
+  vector<uint16_t> l4Dport;
+  vector<uint8_t> l4Flags;
+  vector<int64_t> eid;
+  vector<pair<FieldId, vector<OpResult>>> extra;
+
+  // Indices of the live rows, ascending.
+  vector<uint32_t> sel;
+
+  bool has(FieldId id) const { return columns & (uint64_t{1} << id); }
+  bool has(Field field) const { return has(fid(field)); }
+
+  // Marks the known fields in mask as present and sizes their columns to
+  // rows. Sources call this once and then write the columns directly.
+  void reserveColumns(uint64_t mask);
+
+  // Sizes every present column to n rows and selects all of them.
+  void resize(size_t n);
+  void clear();
+
+  OpResult value(FieldId id, uint32_t row) const;
+  void set(FieldId id, uint32_t row, OpResult val);
+
+  // Fallback conversions to and from the per-tuple representation.
+  Headers row(uint32_t row) const;
+  void appendRow(const Headers& headers);
+
+ private:
+  vector<OpResult>* extraColumn(FieldId id);
+  const vector<OpResult>* extraColumn(FieldId id) const;
+};
+
+using BatchFunc = function<void(Batch&)>;
+
+struct BatchOperator {
+  BatchFunc next;
+  OpFunc reset;
+
+  BatchOperator(BatchFunc next, OpFunc reset) : next(next), reset(reset) {};
+};
+
+using BatchOpCreator = function<BatchOperator(BatchOperator)>;
+using BatchToTupleOpCreator = function<BatchOperator(Operator)>;
+
+inline BatchOperator __(BatchOpCreator opCreator, BatchOperator nextOp) {
+  return opCreator(nextOp);
+}
+
+inline BatchOperator __(BatchToTupleOpCreator opCreator, Operator nextOp) {
+  return opCreator(nextOp);
+}
+
+// Reduction applied to one row of a batch; row indexes the batch columns.
+using BatchReductionFunc = function<OpResult(OpResult, const Batch&, uint32_t)>;
+
+// The ids of names, sorted and deduplicated, so that keys can be packed in
+// FieldId order.
+vector<FieldId> internFields(const vector<string>& names);
+// The grouping key of one row: the fields of keyIds the batch has.
+PackedKey groupKeyOfRow(const vector<FieldId>& keyIds, const Batch& batch,
+                        uint32_t row);
+// The grouping keys of the selected rows, in order, and their hashes, for
+// the batched probes of FlatTable::findOrInsertBatch.
+void groupKeysOfRows(const vector<FieldId>& keyIds, const Batch& batch,
+                     vector<PackedKey>& keys, vector<size_t>& hashes);
+
+BatchOpCreator batchEpochCreator(double epochWidth, string keyOut);
+BatchToTupleOpCreator batchGroupbyCreator(vector<string> groupKeys,
+                                          BatchReductionFunc reduct,
+                                          string outKey);
+BatchToTupleOpCreator batchDistinctCreator(vector<string> groupKeys);
+OpResult batchCounter(OpResult val, const Batch& batch, uint32_t row);
+BatchReductionFunc batchSumInts(string searchKey);
+
+// Passes every batch to each of ops in turn, restoring the selection between
+// them; the batch counterpart of split.
+BatchOperator batchFanout(vector<BatchOperator> ops);
+
+// Leaves batch mode: passes every selected row to nextOp as a tuple.
+BatchOperator unbatch(Operator nextOp);
+
+// Enters batch mode: buffers tuples into batches of batchSize rows, flushing
+// early on reset.
+Operator batchTuples(BatchOperator nextOp,
+                     size_t batchSize = kDefaultBatchSize);
+
+// Keeps the selected rows for which pred(batch, row) holds. pred is inlined
+// into the selection loop, so column comparisons compile to a tight loop with
+// no per-row indirect call.
+template <typename Pred>
+BatchOpCreator batchFilterCreator(Pred pred) {
+  return [pred](BatchOperator nextOp) {
+    auto sharedNextOp = make_shared<BatchOperator>(nextOp);
+
+    BatchFunc next = [pred, sharedNextOp](Batch& batch) {
+      size_t kept = 0;
+      for (uint32_t row : batch.sel) {
+        batch.sel[kept] = row;
+        kept += pred(static_cast<const Batch&>(batch), row) ? 1 : 0;
+      }
+      batch.sel.resize(kept);
+      if (kept > 0) {
+        sharedNextOp->next(batch);
+      }
+    };
+
+    OpFunc reset = [sharedNextOp](const Headers& headers) {
+      sharedNextOp->reset(headers);
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+// Applies f(batch, row) to every selected row; f writes its outputs straight
+// into the batch columns.
+template <typename F>
+BatchOpCreator batchMapCreator(F f) {
+  return [f](BatchOperator nextOp) {
+    auto sharedNextOp = make_shared<BatchOperator>(nextOp);
+
+    BatchFunc next = [f, sharedNextOp](Batch& batch) {
+      for (uint32_t row : batch.sel) {
+        f(batch, row);
+      }
+      sharedNextOp->next(batch);
+    };
+
+    OpFunc reset = [sharedNextOp](const Headers& headers) {
+      sharedNextOp->reset(headers);
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+#endif  // BATCH_H
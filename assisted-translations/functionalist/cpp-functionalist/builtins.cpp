@@ -1,64 +1,304 @@
 #include "builtins.hpp"
 
-Operator dump(ofstream out, bool showReset = false) {
-  OpFunc next = [](Headers headers) { dumpHeaders(headers, true); };
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
-  OpFunc reset = [showReset = move(showReset)](Headers headers) {
+#include "address_dict.hpp"
+#include "checkpoint.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "output.hpp"
+
+namespace {
+
+thread_local size_t buildingTableSize = kInitTableSize;
+
+using GroupTable = FlatTable<PackedKey, OpResult, PackedKeyHash>;
+using DistinctTable = FlatTable<PackedKey, bool, PackedKeyHash>;
+
+// The groups of a GroupingFunc whose key is too wide to pack, kept beside
+// the packed table. Checkpoints do not save them and budgets do not charge
+// them.
+using WideGroups = unordered_map<Headers, OpResult>;
+using WideKeys = unordered_set<Headers>;
+
+bool isWide(const Headers& key) { return key.size() > kMaxKeyFields; }
+
+// Where the tuple of a stage with a budget goes.
+enum class Admitted { Table, Spilled, Refused };
+
+// Admits key, of hash, to table. Under the Spill policy a tuple of a
+// spilled partition goes to the run file, and a new key the budget has no
+// room for spills the coldest partitions until there is room for it or its
+// own partition is spilled; under the others a refused key is left to the
+// caller.
+template <typename V>
+Admitted admitKey(TableAdmission& admission,
+                  FlatTable<PackedKey, V, PackedKeyHash>& table,
+                  const PackedKey& key, size_t hash, const Headers& headers) {
+  if (admission.policy() != BudgetPolicy::Spill) {
+    return table.findHashed(key, hash) != nullptr || admission.admit()
+               ? Admitted::Table
+               : Admitted::Refused;
+  }
+  GroupSpill& spill = admission.spill();
+  size_t partition = GroupSpill::partitionOf(hash);
+  spill.touch(partition);
+  while (!spill.spilled(partition)) {
+    if (table.findHashed(key, hash) != nullptr || admission.admit()) {
+      return Admitted::Table;
+    }
+    size_t groups = spill.spill(spill.coldest(), table);
+    admission.releaseKeys(groups);
+    admission.stats().countSpilled(groups);
+  }
+  spill.append(partition, headers);
+  admission.stats().countSpilled(1);
+  return Admitted::Spilled;
+}
+
+// A groupby key its budget had no room for: counted in the Sketch policy's
+// SpaceSaving, or dropped.
+void overflowGroup(TableAdmission& admission, const PackedKey& key) {
+  if (admission.policy() == BudgetPolicy::Sketch) {
+    admission.heavyGroups().add(key);
+    admission.stats().countSketched();
+  } else {
+    admission.stats().countShed();
+  }
+}
+
+// The tuples a reset passes on, built in one buffer: the reset's tuple, with
+// each group's key fields and value written over it in turn and put back
+// after, so that no tuple is built per group. A group whose value is below
+// atLeast is skipped before anything is written.
+class GroupEmitter {
+ public:
+  GroupEmitter(const Headers& headers, const Operator& nextOp,
+               FieldId outKeyId = 0, optional<int64_t> atLeast = nullopt)
+      : base(headers),
+        out(headers),
+        nextOp(nextOp),
+        outKeyId(outKeyId),
+        atLeast(atLeast) {}
+
+  void group(const PackedKey& key, const OpResult& val) {
+    if (atLeast && val.asInt() < *atLeast) {
+      return;
+    }
+    unpackKeyInto(key, out);
+    out[outKeyId] = val;
+    nextOp.next(out);
+    restore(key.fields | (uint64_t{1} << outKeyId));
+  }
+
+  // A distinct key, which has no value.
+  void key(const PackedKey& key) {
+    unpackKeyInto(key, out);
+    nextOp.next(out);
+    restore(key.fields);
+  }
+
+  void group(const Headers& key, const OpResult& val) {
+    if (atLeast && val.asInt() < *atLeast) {
+      return;
+    }
+    writeKey(key);
+    out[outKeyId] = val;
+    nextOp.next(out);
+    restore(key.fieldMask() | (uint64_t{1} << outKeyId));
+  }
+
+  void key(const Headers& key) {
+    writeKey(key);
+    nextOp.next(out);
+    restore(key.fieldMask());
+  }
+
+ private:
+  const Headers& base;
+  Headers out;
+  const Operator& nextOp;
+  FieldId outKeyId;
+  optional<int64_t> atLeast;
+
+  void writeKey(const Headers& key) {
+    for (auto it = key.begin(); it != key.end(); ++it) {
+      out[it.id()] = (*it).second;
+    }
+  }
+
+  void restore(uint64_t written) {
+    for (; written != 0; written &= written - 1) {
+      FieldId id = static_cast<FieldId>(__builtin_ctzll(written));
+      if (base.contains(id)) {
+        out[id] = base.at(id);
+      } else {
+        out.erase(id);
+      }
+    }
+  }
+};
+
+void emitGroups(const GroupTable& table, GroupEmitter& emit) {
+  table.forEach([&](const PackedKey& groupingKey, const OpResult& val) {
+    emit.group(groupingKey, val);
+  });
+}
+
+// Passes on the groups of the epoch the table could not hold, once its own
+// groups are passed on: those the Sketch policy counted, and those of the
+// partitions the Spill policy wrote out, folded back one partition at a
+// time in table by fold. Releases the epoch's charges.
+template <typename Fold>
+void closeGroupBudget(TableAdmission& admission, GroupTable& table,
+                      GroupEmitter& emit, Fold fold) {
+  admission.releaseAll();
+  if (admission.sketching()) {
+    SpaceSaving& groups = admission.heavyGroups();
+    for (const SpaceSaving::Counter& c : groups.top(groups.size())) {
+      emit.group(c.key, OpResult::Int(static_cast<int64_t>(c.count)));
+    }
+    admission.clearSketches();
+  }
+  if (admission.policy() == BudgetPolicy::Spill) {
+    table.clear();
+    admission.spill().merge<OpResult>(
+        [&](const PackedKey& key, const OpResult& val) {
+          *table.findOrInsert(key).first = val;
+        },
+        fold,
+        [&] {
+          emitGroups(table, emit);
+          table.clear();
+        });
+  }
+}
+
+// A distinct key its budget had no room for; true if it is to be passed on
+// now, as a key the Sketch policy's filter has not seen.
+bool overflowDistinct(TableAdmission& admission, uint64_t hash) {
+  if (admission.policy() == BudgetPolicy::Sketch) {
+    CuckooFilter& seen = admission.seenKeys();
+    if (seen.contains(hash)) {
+      admission.stats().countSketched();
+      return false;
+    }
+    if (seen.insert(hash)) {
+      admission.stats().countSketched();
+      return true;
+    }
+  }
+  admission.stats().countShed();
+  return false;
+}
+
+// closeGroupBudget for distinct, whose Sketch policy has passed its keys on
+// already.
+template <typename Fold>
+void closeDistinctBudget(TableAdmission& admission, DistinctTable& table,
+                         GroupEmitter& emit, Fold fold) {
+  admission.releaseAll();
+  admission.clearSketches();
+  if (admission.policy() == BudgetPolicy::Spill) {
+    table.clear();
+    admission.spill().merge<bool>(
+        [&](const PackedKey& key, bool) {
+          *table.findOrInsert(key).first = true;
+        },
+        fold,
+        [&] {
+          table.forEach([&](const PackedKey& key, bool) { emit.key(key); });
+          table.clear();
+        });
+  }
+}
+
+}  // namespace
+
+size_t initTableSize() { return buildingTableSize; }
+
+TableSizeScope::TableSizeScope(size_t expected) : saved(buildingTableSize) {
+  buildingTableSize = max<size_t>(expected, 16);
+}
+
+TableSizeScope::~TableSizeScope() { buildingTableSize = saved; }
+
+Operator dump(ofstream out, bool showReset) {
+  auto buffer = make_shared<OutputBuffer>(make_unique<ofstream>(move(out)));
+
+  OpFunc next = [buffer](const Headers& headers) {
+    buffer->appendHeaders(headers);
+    buffer->append('\n');
+  };
+
+  OpFunc reset = [buffer, showReset](const Headers& headers) {
     if (showReset) {
-      cout << "[reset]" << endl;
+      buffer->appendHeaders(headers);
+      buffer->append("\n[reset]\n");
     }
+    buffer->flush();
   };
 
   return Operator(next, reset);
 }
 
-Operator dumpAsCSV(optional<pair<string, string>> staticField,
-                   bool header = true) {
-  bool first = header;
+Operator dumpAsCSV(optional<pair<string, string>> staticField, bool header,
+                   ostream& outc) {
+  auto buffer = make_shared<OutputBuffer>(outc);
+  auto first = make_shared<bool>(header);
 
-  OpFunc next = [&first, staticField = move(staticField)](Headers headers) {
-    if (first) {
+  OpFunc next = [buffer, first,
+                 staticField = move(staticField)](const Headers& headers) {
+    if (*first) {
       if (staticField.has_value()) {
-        cout << staticField.value().first << ",";
-      } else {
-        return;
+        buffer->append(staticField->first);
+        buffer->append(',');
       }
-      for (const auto& [key, val] : headers) {
-        cout << key << ",";
+      for (auto it = headers.begin(); it != headers.end(); ++it) {
+        buffer->append(fieldName(it.id()));
+        buffer->append(',');
       }
-      cout << endl;
-      first = false;
+      buffer->append('\n');
+      *first = false;
     }
+    if (staticField.has_value()) {
+      buffer->append(staticField->second);
+      buffer->append(',');
+    }
+    for (auto it = headers.begin(); it != headers.end(); ++it) {
+      buffer->appendValue(headers.at(it.id()));
+      buffer->append(',');
+    }
+    buffer->append('\n');
   };
 
-  OpFunc reset = [](Headers _) { return; };
+  OpFunc reset = [buffer](const Headers& _) { buffer->flush(); };
 
   return Operator(next, reset);
 }
 
 Operator dumpWaltsCSV(string filename) {
-  auto shared = make_shared<ofstream>(filename);
-  bool first = true;
-
-  OpFunc next = [&first, shared](Headers headers) {
-    if (first) {
-      first = false;
-    }
-    string src_ip =
-        get<IPv4Address>(headers.find("src_ip")->second.val).toString();
-    string dst_ip =
-        get<IPv4Address>(headers.find("dst_ip")->second.val).toString();
-
-    *shared << src_ip << "," << dst_ip << ","
-            << get<IPv4Address>(headers.find("dst_ip")->second.val).toString()
-            << "," << get<int>(headers.find("src_l4_port")->second.val) << ","
-            << get<int>(headers.find("dst_l4_port")->second.val) << ","
-            << get<int>(headers.find("packet_count")->second.val) << ","
-            << get<int>(headers.find("byte_count")->second.val) << ","
-            << get<int>(headers.find("epoch_id")->second.val) << endl;
+  auto buffer =
+      make_shared<OutputBuffer>(make_unique<AsyncFileWriter>(filename));
+  array<FieldId, 7> columns = {
+      internField("src_ip"),       internField("dst_ip"),
+      internField("src_l4_port"),  internField("dst_l4_port"),
+      internField("packet_count"), internField("byte_count"),
+      internField("epoch_id")};
+
+  OpFunc next = [buffer, columns](const Headers& headers) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      buffer->appendValue(headers.at(columns[i]));
+      buffer->append(i + 1 < columns.size() ? ',' : '\n');
+    }
   };
 
-  OpFunc reset = [](Headers _) { return; };
+  OpFunc reset = [buffer](const Headers& _) { buffer->flush(); };
 
   return Operator(next, reset);
 }
@@ -72,27 +312,24 @@ OpResult getIpOrZero(string input) {
 
 OpCreator metaMeterCreator(string name, ofstream outc,
                            optional<string> staticField) {
-  auto shared = make_shared<ofstream>(new ofstream(move(outc)));
+  auto shared = make_shared<ofstream>(move(outc));
 
   return [name, shared, staticField](Operator nextOp) {
     auto sharedNextOp = make_shared<Operator>(nextOp);
-    int epochCount = 0;
-    int headersCount = 0;
+    auto epochCount = make_shared<int>(0);
+    auto headersCount = make_shared<int>(0);
 
-    OpFunc next = [&epochCount, &headersCount, sharedNextOp](Headers headers) {
-      headersCount++;
+    OpFunc next = [headersCount, sharedNextOp](const Headers& headers) {
+      (*headersCount)++;
       sharedNextOp->next(headers);
     };
 
-    OpFunc reset = [shared, &epochCount, name, &headersCount, staticField,
-                    sharedNextOp](Headers headers) {
-      stringstream str;
-      str << epochCount << "," << name << "," << headersCount
-          << staticField.has_value()
-          ? staticField.value()
-          : "";
-      headersCount = 0;
-      epochCount++;
+    OpFunc reset = [shared, epochCount, name, headersCount, staticField,
+                    sharedNextOp](const Headers& headers) {
+      *shared << *epochCount << "," << name << "," << *headersCount << ","
+              << staticField.value_or("") << "\n";
+      *headersCount = 0;
+      (*epochCount)++;
       sharedNextOp->reset(headers);
     };
 
@@ -102,49 +339,75 @@ OpCreator metaMeterCreator(string name, ofstream outc,
 
 Headers singleton(string keyOut, OpResult val) { return {{keyOut, val}}; }
 
-OpCreator epochCreator(float epochWidth, string keyOut) {
-  return [&epochWidth, keyOut](Operator nextOp) {
+OpCreator epochCreator(double epochWidth, string keyOut, bool aligned) {
+  FieldId keyOutId = internField(keyOut);
+
+  return [epochWidth, keyOut, keyOutId, aligned](Operator nextOp) {
     auto sharedNextOp = make_shared<Operator>(nextOp);
-    float epochBoundary = 0.0f;
-    int eid = 0;
-
-    OpFunc next = [&epochBoundary, &epochWidth, sharedNextOp, &eid,
-                   keyOut](Headers headers) {
-      float time = floatOfOpResult(headers.find("time")->second);
-      if (epochBoundary == 0.0f) {
-        epochBoundary = time + epochWidth;
-      } else {
-        while (time >= epochBoundary) {
-          (*sharedNextOp).reset(singleton(keyOut, OpResult::Int(eid)));
-          epochBoundary += epochWidth;
-          eid++;
+    auto epochBoundary = make_shared<double>(0.0);
+    auto eid = make_shared<int64_t>(0);
+    auto out = make_shared<Headers>();
+    shared_ptr<CheckpointState> checkpoint = checkpointState(
+        [epochBoundary, eid](StateWriter& state) {
+          state.putDouble(*epochBoundary);
+          state.putI64(*eid);
+        },
+        [epochBoundary, eid](StateReader& in) {
+          *epochBoundary = in.real();
+          *eid = in.i64();
+        });
+
+    OpFunc next = [epochBoundary, epochWidth, sharedNextOp, eid, keyOut,
+                   keyOutId, out, checkpoint,
+                   aligned](const Headers& headers) {
+      double time = headers.at(Field::Time).asFloat();
+      if (*epochBoundary == 0.0) {
+        if (aligned) {
+          *eid = static_cast<int64_t>(floor(time / epochWidth));
+          *epochBoundary = static_cast<double>(*eid + 1) * epochWidth;
+        } else {
+          *epochBoundary = time + epochWidth;
+        }
+        markChanged(checkpoint);
+      } else if (time >= *epochBoundary) {
+        while (time >= *epochBoundary) {
+          (*sharedNextOp).reset(singleton(keyOut, OpResult::Int(*eid)));
+          *epochBoundary += epochWidth;
+          (*eid)++;
+        }
+        if (checkpoint) {
+          checkpoint->changed = true;
+          checkpoint->registry->epochStarted(*eid);
         }
       }
-      headers[keyOut] = OpResult::Int(eid);
-      (*sharedNextOp).next(headers);
+      *out = headers;
+      (*out)[keyOutId] = OpResult::Int(*eid);
+      (*sharedNextOp).next(*out);
     };
 
-    OpFunc reset = [&keyOut, &eid, &epochBoundary, sharedNextOp](Headers _) {
-      (*sharedNextOp).reset(singleton(keyOut, OpResult::Int(eid)));
-      epochBoundary = 0.0f;
-      eid = 0;
+    OpFunc reset = [keyOut, eid, epochBoundary, sharedNextOp,
+                    checkpoint](const Headers& _) {
+      (*sharedNextOp).reset(singleton(keyOut, OpResult::Int(*eid)));
+      *epochBoundary = 0.0;
+      *eid = 0;
+      markChanged(checkpoint);
     };
 
     return Operator(next, reset);
   };
 }
 
-OpCreator filterCreator(function<bool(Headers)> f) {
+OpCreator filterCreator(function<bool(const Headers&)> f) {
   return [f](Operator nextOp) {
     auto sharedNextOp = make_shared<Operator>(nextOp);
 
-    OpFunc next = [f, sharedNextOp](Headers headers) {
+    OpFunc next = [f, sharedNextOp](const Headers& headers) {
       if (f(headers)) {
         sharedNextOp->next(headers);
       }
     };
 
-    OpFunc reset = [sharedNextOp](Headers headers) {
+    OpFunc reset = [sharedNextOp](const Headers& headers) {
       sharedNextOp->reset(headers);
     };
 
@@ -152,27 +415,39 @@ OpCreator filterCreator(function<bool(Headers)> f) {
   };
 }
 
-bool keyGeqInt(string key, int threshold, Headers headers) {
-  return intOfOpResult(headers.find(key)->second) >= threshold;
+bool keyGeqInt(string key, int threshold, const Headers& headers) {
+  return headers.find(key)->second.asInt() >= threshold;
+}
+
+int64_t getMappedInt(string key, const Headers& headers) {
+  return headers.find(key)->second.asInt();
+}
+
+double getMappedFloat(string key, const Headers& headers) {
+  return headers.find(key)->second.asFloat();
+}
+
+bool keyGeqInt(FieldId key, int threshold, const Headers& headers) {
+  return headers.at(key).asInt() >= threshold;
 }
 
-int getMappedInt(string key, Headers headers) {
-  intOfOpResult(headers.find(key)->second);
+int64_t getMappedInt(FieldId key, const Headers& headers) {
+  return headers.at(key).asInt();
 }
 
-float getMappedFloat(string key, Headers headers) {
-  floatOfOpResult(headers.find(key)->second);
+double getMappedFloat(FieldId key, const Headers& headers) {
+  return headers.at(key).asFloat();
 }
 
-OpCreator mapCreator(function<Headers(Headers)> f) {
+OpCreator mapCreator(function<Headers(const Headers&)> f) {
   return [f](Operator nextOp) {
     auto sharedNextOp = make_shared<Operator>(nextOp);
 
-    OpFunc next = [f, sharedNextOp](Headers headers) {
+    OpFunc next = [f, sharedNextOp](const Headers& headers) {
       sharedNextOp->next(f(headers));
     };
 
-    OpFunc reset = [sharedNextOp](Headers headers) {
+    OpFunc reset = [sharedNextOp](const Headers& headers) {
       sharedNextOp->reset(headers);
     };
 
@@ -180,51 +455,219 @@ OpCreator mapCreator(function<Headers(Headers)> f) {
   };
 }
 
-Headers unionHeaders(Headers h1, Headers h2) {
-  Headers newH;
-  for (const auto [key, val] : h1) {
-    newH[key] = val;
-  }
+OpCreator extendCreator(function<void(Headers&)> f) {
+  return [f](Operator nextOp) {
+    auto sharedNextOp = make_shared<Operator>(nextOp);
+    auto out = make_shared<Headers>();
+
+    OpFunc next = [f, sharedNextOp, out](const Headers& headers) {
+      *out = headers;
+      f(*out);
+      sharedNextOp->next(*out);
+    };
+
+    OpFunc reset = [sharedNextOp](const Headers& headers) {
+      sharedNextOp->reset(headers);
+    };
+
+    return Operator(next, reset);
+  };
+}
 
-  for (const auto [key, val] : h2) {
-    newH[key] = val;
+Headers unionHeaders(const Headers& h1, const Headers& h2) {
+  Headers newH = h1;
+  for (auto it = h2.begin(); it != h2.end(); ++it) {
+    newH[it.id()] = h2.at(it.id());
   }
+  return newH;
 }
 
 OpCreator groupbyCreator(GroupingFunc groupby, ReductionFunc reduct,
                          string outKey) {
-  return [groupby, reduct, &outKey](Operator nextOp) {
-    unordered_map<Headers, OpResult> hTbl;
-    int resetCounter = 0;
-
-    OpFunc next = [groupby, &hTbl, reduct](Headers headers) {
-      Headers groupingKey = groupby(headers);
-      OpResult val;
-      auto it = hTbl.find(groupingKey);
-      if (it != hTbl.end()) {
-        val = it->second;
-        hTbl[groupingKey] = reduct(val, headers);
-      } else {
-        hTbl[groupingKey] = reduct(OpResult::Empty(), headers);
+  FieldId outKeyId = internField(outKey);
+
+  return [groupby, reduct, outKeyId](Operator nextOp) {
+    auto hTbl = make_shared<GroupTable>(initTableSize());
+    auto wide = make_shared<WideGroups>();
+    auto resetCounter = make_shared<int>(0);
+    shared_ptr<TableGauge> gauge = meterTable();
+    shared_ptr<CheckpointState> checkpoint = checkpointTable(hTbl);
+    shared_ptr<TableAdmission> admission =
+        admitTable(GroupTable::kBytesPerKey);
+
+    OpFunc next = [groupby, hTbl, wide, reduct, checkpoint,
+                   admission](const Headers& headers) {
+      markChanged(checkpoint);
+      Headers grouping = groupby(headers);
+      if (isWide(grouping)) {
+        OpResult& val =
+            wide->try_emplace(move(grouping), OpResult::Empty()).first->second;
+        val = reduct(val, headers);
+        return;
+      }
+      PackedKey key = packKey(grouping);
+      size_t hash = PackedKeyHash()(key);
+      if (admission) {
+        Admitted to = admitKey(*admission, *hTbl, key, hash, headers);
+        if (to != Admitted::Table) {
+          if (to == Admitted::Refused) {
+            overflowGroup(*admission, key);
+          }
+          return;
+        }
+      }
+      auto [val, inserted] = hTbl->findOrInsertHashed(key, hash);
+      *val = reduct(inserted ? OpResult::Empty() : *val, headers);
+    };
+
+    OpFunc reset = [groupby, reduct, resetCounter, hTbl, wide, gauge, nextOp,
+                    outKeyId, checkpoint, admission](const Headers& headers) {
+      (*resetCounter)++;
+      markChanged(checkpoint);
+      if (gauge) {
+        gauge->record(hTbl->size(), hTbl->bytes());
+      }
+      GroupEmitter emit(headers, nextOp, outKeyId);
+      emitGroups(*hTbl, emit);
+      for (const auto& [key, val] : *wide) {
+        emit.group(key, val);
+      }
+      wide->clear();
+      if (admission) {
+        closeGroupBudget(*admission, *hTbl, emit,
+                         [&](const Headers& tuple) {
+                           auto [val, inserted] =
+                               hTbl->findOrInsert(packKey(groupby(tuple)));
+                           *val = reduct(
+                               inserted ? OpResult::Empty() : *val, tuple);
+                         });
+      }
+      nextOp.reset(headers);
+      hTbl->clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+namespace {
+
+// Whether reduct counts tuples, and so needs nothing of one but its key.
+bool countsOnly(const ReductionFunc& reduct) {
+  auto* f = reduct.target<OpResult (*)(OpResult, const Headers&)>();
+  return f != nullptr && *f == &counter;
+}
+
+// The probes put off by a stage whose table is exact only between tuples:
+// none while a budget or a checkpoint may look at it after any one of them.
+shared_ptr<DeferredKeys> deferProbes(
+    bool eligible, const shared_ptr<CheckpointState>& checkpoint,
+    const shared_ptr<TableAdmission>& admission) {
+  return eligible && !checkpoint && !admission ? make_shared<DeferredKeys>()
+                                               : nullptr;
+}
+
+void flushCounts(GroupTable& table, DeferredKeys& deferred) {
+  static const Headers none;
+  table.findOrInsertBatch(deferred.keys(), deferred.hashes(), deferred.size(),
+                          [](size_t _, OpResult* val, bool inserted) {
+                            *val = counter(
+                                inserted ? OpResult::Empty() : *val, none);
+                          });
+  deferred.clear();
+}
+
+void flushDistinct(DistinctTable& table, DeferredKeys& deferred) {
+  table.findOrInsertBatch(deferred.keys(), deferred.hashes(), deferred.size(),
+                          [](size_t _, bool* seen, bool inserted) {
+                            *seen = true;
+                          });
+  deferred.clear();
+}
+
+OpCreator projectedGroupby(KeyProjector groupby, ReductionFunc reduct,
+                           string outKey, optional<int64_t> atLeast) {
+  FieldId outKeyId = internField(outKey);
+
+  return [groupby, reduct, outKeyId, atLeast](Operator nextOp) {
+    auto hTbl = make_shared<GroupTable>(initTableSize());
+    auto resetCounter = make_shared<int>(0);
+    shared_ptr<TableGauge> gauge = meterTable();
+    shared_ptr<CheckpointState> checkpoint = checkpointTable(hTbl);
+    shared_ptr<TableAdmission> admission =
+        admitTable(GroupTable::kBytesPerKey);
+    shared_ptr<DeferredKeys> deferred =
+        deferProbes(countsOnly(reduct), checkpoint, admission);
+
+    OpFunc next = [groupby, hTbl, reduct, checkpoint, admission,
+                   deferred](const Headers& headers) {
+      markChanged(checkpoint);
+      ProjectedKey projected = groupby.project(headers);
+      if (deferred) {
+        if (deferred->add(projected)) {
+          flushCounts(*hTbl, *deferred);
+        }
+        return;
+      }
+      if (admission) {
+        Admitted to = admitKey(*admission, *hTbl, projected.key,
+                               projected.hash, headers);
+        if (to != Admitted::Table) {
+          if (to == Admitted::Refused) {
+            overflowGroup(*admission, projected.key);
+          }
+          return;
+        }
       }
+      auto [val, inserted] =
+          hTbl->findOrInsertHashed(projected.key, projected.hash);
+      *val = reduct(inserted ? OpResult::Empty() : *val, headers);
     };
 
-    OpFunc reset = [&resetCounter, &hTbl, nextOp, &outKey](Headers headers) {
-      resetCounter++;
-      for (const auto& [groupingKey, val] : hTbl) {
-        Headers unionedHeaders = unionHeaders(headers, groupingKey);
-        unionedHeaders[outKey] = val;
-        nextOp.next(unionedHeaders);
+    OpFunc reset = [groupby, reduct, resetCounter, hTbl, gauge, nextOp,
+                    outKeyId, atLeast, checkpoint, admission,
+                    deferred](const Headers& headers) {
+      (*resetCounter)++;
+      markChanged(checkpoint);
+      if (deferred) {
+        flushCounts(*hTbl, *deferred);
+      }
+      if (gauge) {
+        gauge->record(hTbl->size(), hTbl->bytes());
+      }
+      GroupEmitter emit(headers, nextOp, outKeyId, atLeast);
+      emitGroups(*hTbl, emit);
+      if (admission) {
+        closeGroupBudget(*admission, *hTbl, emit,
+                         [&](const Headers& tuple) {
+                           ProjectedKey projected = groupby.project(tuple);
+                           auto [val, inserted] = hTbl->findOrInsertHashed(
+                               projected.key, projected.hash);
+                           *val = reduct(
+                               inserted ? OpResult::Empty() : *val, tuple);
+                         });
       }
       nextOp.reset(headers);
-      hTbl.clear();
+      hTbl->clear();
     };
 
     return Operator(next, reset);
   };
 }
 
-Headers filterGroups(vector<string> inclKeys, Headers headers) {
+}  // namespace
+
+OpCreator groupbyCreator(KeyProjector groupby, ReductionFunc reduct,
+                         string outKey) {
+  return projectedGroupby(move(groupby), move(reduct), move(outKey), nullopt);
+}
+
+OpCreator groupbyCreator(KeyProjector groupby, ReductionFunc reduct,
+                         string outKey, int64_t atLeast) {
+  return projectedGroupby(move(groupby), move(reduct), move(outKey), atLeast);
+}
+
+Headers filterGroups(const vector<string>& inclKeys, const Headers& headers) {
   Headers newH;
   for (const auto& str : inclKeys) {
     auto it = headers.find(str);
@@ -235,59 +678,159 @@ Headers filterGroups(vector<string> inclKeys, Headers headers) {
   return newH;
 }
 
-Headers singleGroup(Headers _) {
+Headers singleGroup(const Headers& _) {
   Headers newH;
   return newH;
 }
 
-OpResult counter(OpResult val, Headers _) {
+OpResult counter(OpResult val, const Headers& _) {
   switch (val.typ) {
     case OpResultType::Empty:
       return OpResult::Int(1);
     case OpResultType::Int:
-      return OpResult::Int(get<int>(val.val) + 1);
+      return OpResult::Int(val.asInt() + 1);
     default:
       return val;
   }
 }
 
-OpResult sumInts(string searchKey, OpResult initVal, Headers headers) {
+OpResult sumInts(const string& searchKey, OpResult initVal,
+                 const Headers& headers) {
   switch (initVal.typ) {
     case OpResultType::Empty:
       return OpResult::Int(0);
-    case OpResultType::Int:
+    case OpResultType::Int: {
       auto it = headers.find(searchKey);
       if (it != headers.end()) {
-        return OpResult::Int(get<int>(initVal.val) + get<int>(it->second.val));
+        return OpResult::Int(initVal.asInt() + it->second.asInt());
       } else {
         throw out_of_range(
             "'sum_vals' function failed to find intege"
             "value mapped to the given search key");
       }
+    }
     default:
       return initVal;
   }
 }
 
 OpCreator distinctCreator(GroupingFunc groupby) {
-  unordered_map<Headers, bool> hTbl;
-  int resetCounter = 0;
+  return [groupby](Operator nextOp) {
+    auto hTbl = make_shared<DistinctTable>(initTableSize());
+    auto wide = make_shared<WideKeys>();
+    auto resetCounter = make_shared<int>(0);
+    shared_ptr<TableGauge> gauge = meterTable();
+    shared_ptr<CheckpointState> checkpoint = checkpointTable(hTbl);
+    shared_ptr<TableAdmission> admission =
+        admitTable(DistinctTable::kBytesPerKey);
 
-  return [groupby, &hTbl, &resetCounter](Operator nextOp) {
-    OpFunc next = [groupby, &hTbl](Headers headers) {
-      Headers groupingKey = groupby(headers);
-      hTbl[groupingKey] = true;
+    OpFunc next = [groupby, hTbl, wide, checkpoint, admission,
+                   nextOp](const Headers& headers) {
+      markChanged(checkpoint);
+      Headers grouping = groupby(headers);
+      if (isWide(grouping)) {
+        wide->insert(move(grouping));
+        return;
+      }
+      PackedKey key = packKey(grouping);
+      size_t hash = PackedKeyHash()(key);
+      if (admission) {
+        Admitted to = admitKey(*admission, *hTbl, key, hash, headers);
+        if (to != Admitted::Table) {
+          if (to == Admitted::Refused && overflowDistinct(*admission, hash)) {
+            nextOp.next(unpackKey(key));
+          }
+          return;
+        }
+      }
+      *hTbl->findOrInsertHashed(key, hash).first = true;
     };
 
-    OpFunc reset = [&resetCounter, &hTbl, nextOp](Headers headers) {
-      resetCounter++;
-      Headers unionedHeaders;
-      for (const auto& [key, _] : hTbl) {
-        unionedHeaders = unionHeaders(headers, key);
-        nextOp.next(unionedHeaders);
+    OpFunc reset = [groupby, resetCounter, hTbl, wide, gauge, nextOp,
+                    checkpoint, admission](const Headers& headers) {
+      (*resetCounter)++;
+      markChanged(checkpoint);
+      if (gauge) {
+        gauge->record(hTbl->size(), hTbl->bytes());
+      }
+      GroupEmitter emit(headers, nextOp);
+      hTbl->forEach([&](const PackedKey& key, bool _) { emit.key(key); });
+      for (const Headers& key : *wide) {
+        emit.key(key);
+      }
+      wide->clear();
+      if (admission) {
+        closeDistinctBudget(*admission, *hTbl, emit,
+                            [&](const Headers& tuple) {
+                              (*hTbl)[packKey(groupby(tuple))] = true;
+                            });
       }
       nextOp.reset(headers);
-      hTbl.clear();
+      hTbl->clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator distinctCreator(KeyProjector groupby) {
+  return [groupby](Operator nextOp) {
+    auto hTbl = make_shared<DistinctTable>(initTableSize());
+    auto resetCounter = make_shared<int>(0);
+    shared_ptr<TableGauge> gauge = meterTable();
+    shared_ptr<CheckpointState> checkpoint = checkpointTable(hTbl);
+    shared_ptr<TableAdmission> admission =
+        admitTable(DistinctTable::kBytesPerKey);
+    shared_ptr<DeferredKeys> deferred =
+        deferProbes(true, checkpoint, admission);
+
+    OpFunc next = [groupby, hTbl, checkpoint, admission, nextOp,
+                   deferred](const Headers& headers) {
+      markChanged(checkpoint);
+      ProjectedKey projected = groupby.project(headers);
+      if (deferred) {
+        if (deferred->add(projected)) {
+          flushDistinct(*hTbl, *deferred);
+        }
+        return;
+      }
+      if (admission) {
+        Admitted to = admitKey(*admission, *hTbl, projected.key,
+                               projected.hash, headers);
+        if (to != Admitted::Table) {
+          if (to == Admitted::Refused &&
+              overflowDistinct(*admission, projected.hash)) {
+            nextOp.next(unpackKey(projected.key));
+          }
+          return;
+        }
+      }
+      *hTbl->findOrInsertHashed(projected.key, projected.hash).first = true;
+    };
+
+    OpFunc reset = [groupby, resetCounter, hTbl, gauge, nextOp, checkpoint,
+                    admission, deferred](const Headers& headers) {
+      (*resetCounter)++;
+      markChanged(checkpoint);
+      if (deferred) {
+        flushDistinct(*hTbl, *deferred);
+      }
+      if (gauge) {
+        gauge->record(hTbl->size(), hTbl->bytes());
+      }
+      GroupEmitter emit(headers, nextOp);
+      hTbl->forEach([&](const PackedKey& key, bool _) { emit.key(key); });
+      if (admission) {
+        closeDistinctBudget(*admission, *hTbl, emit,
+                            [&](const Headers& tuple) {
+                              ProjectedKey projected = groupby.project(tuple);
+                              bool* seen = hTbl->findOrInsertHashed(
+                                  projected.key, projected.hash).first;
+                              *seen = true;
+                            });
+      }
+      nextOp.reset(headers);
+      hTbl->clear();
     };
 
     return Operator(next, reset);
@@ -299,12 +842,12 @@ DblOpAcceptorOpCreator split() {
     auto sharedL = make_shared<Operator>(move(nextOps.first));
     auto sharedR = make_shared<Operator>(move(nextOps.second));
 
-    OpFunc next = [sharedL, sharedR](Headers headers) {
+    OpFunc next = [sharedL, sharedR](const Headers& headers) {
       sharedL->next(headers);
       sharedR->next(headers);
     };
 
-    OpFunc reset = [sharedL, sharedR](Headers headers) {
+    OpFunc reset = [sharedL, sharedR](const Headers& headers) {
       sharedL->reset(headers);
       sharedR->reset(headers);
     };
@@ -313,68 +856,419 @@ DblOpAcceptorOpCreator split() {
   };
 }
 
-Operator handleJoinSide(unordered_map<Headers, Headers> currHtbl,
-                        unordered_map<Headers, Headers> otherHTbl,
-                        int currEpochOuter, int otherEpochOuter,
-                        KeyExtractor extractKey, Operator nextOp,
-                        string eidKey = "eid") {
-  auto sharedNextOp = make_shared<Operator>(move(nextOp));
-  OpFunc next = [extractKey, eidKey, &currEpochOuter, sharedNextOp, &otherHTbl,
-                 &currHtbl](Headers headers) {
-    auto [key, val] = extractKey(headers);
-    int currEpochInner = getMappedInt(eidKey, headers);
-
-    while (currEpochInner > currEpochOuter) {
-      if (currEpochOuter > currEpochInner) {
-        sharedNextOp->reset(singleton(eidKey, OpResult::Int(currEpochOuter)));
-        currEpochOuter++;
-      }
-    }
-    Headers newH;
-    newH[eidKey] = OpResult::Int(currEpochInner);
-    auto it = otherHTbl.find(newH);
-    if (it != otherHTbl.end()) {
-      otherHTbl.erase(newH);
-      Headers dblUnionedHeaders =
-          unionHeaders(newH, unionHeaders(val, it->second));
-    } else {
-      currHtbl[newH] = it->second;
+namespace {
+
+// The key or the values of a tuple of join side self, which pack into a
+// PackedKey like a grouping key does.
+void checkJoinWidth(size_t self, const Headers& tuple, const char* what) {
+  if (tuple.size() > kMaxKeyFields) {
+    string name = self == 0 ? "left" : "right";
+    throw invalid_argument("Error: the " + name + " side of a join has " +
+                           what + " of more than " +
+                           to_string(kMaxKeyFields) + " fields");
+  }
+}
+
+// Keys of a hashed join: the key tuple packed, in a FlatTable.
+struct PackedJoinKeys {
+  using Key = PackedKey;
+  using Table = FlatTable<PackedKey, PackedKey, PackedKeyHash>;
+  static constexpr size_t kBytesPerKey = Table::kBytesPerKey;
+
+  Key of(const Headers& key, int64_t) { return packKey(key); }
+  PackedKey packed(const Key& key, int64_t) const { return key; }
+  void unpackInto(const Key& key, int64_t, Headers& out) const {
+    unpackKeyInto(key, out);
+  }
+  void forget(int64_t) {}
+  size_t bytes() const { return 0; }
+};
+
+// Keys of a join on one address field: codes of a dictionary of the
+// epoch's, shared by both sides, in CodedTables.
+struct AddressJoinKeys {
+  using Key = uint32_t;
+  using Table = CodedTable<PackedKey>;
+  static constexpr size_t kBytesPerKey =
+      Table::kBytesPerKey + AddressDictionary::kBytesPerCode;
+
+  // The field every key is in, once one has been seen.
+  optional<FieldId> keyField;
+  map<int64_t, AddressDictionary> dictionaries;
+  vector<AddressDictionary> spare;
+  size_t tableSize = initTableSize();
+  // The dictionary of the latest epoch looked up, which nearly every
+  // tuple is of.
+  int64_t lastEpoch = 0;
+  AddressDictionary* last = nullptr;
+
+  AddressDictionary& dictionary(int64_t epoch) {
+    if (last != nullptr && lastEpoch == epoch) {
+      return *last;
     }
-  };
+    auto it = dictionaries.find(epoch);
+    if (it == dictionaries.end()) {
+      if (spare.empty()) {
+        it = dictionaries.emplace(epoch, AddressDictionary(tableSize)).first;
+      } else {
+        it = dictionaries.emplace(epoch, move(spare.back())).first;
+        spare.pop_back();
+      }
+    }
+    lastEpoch = epoch;
+    last = &it->second;
+    return *last;
+  }
+
+  Key of(const Headers& key, int64_t epoch) {
+    uint64_t fields = key.fieldMask();
+    FieldId id = static_cast<FieldId>(__builtin_ctzll(fields | 1ull << 63));
+    if ((fields & (fields - 1)) != 0 || fields == 0 ||
+        (keyField && *keyField != id) ||
+        !AddressDictionary::isAddress(key.at(id))) {
+      throw invalid_argument(
+          "Error: a join on address codes takes keys of one IPv4 or MAC "
+          "address field, the same on both sides");
+    }
+    keyField = id;
+    return dictionary(epoch).encode(key.at(id));
+  }
+
+  PackedKey packed(Key code, int64_t epoch) {
+    PackedKey key;
+    key.push(*keyField, dictionary(epoch).decode(code));
+    return key;
+  }
 
-  OpFunc reset = [eidKey, &currEpochOuter, otherEpochOuter,
-                  sharedNextOp](Headers headers) {
-    int currEpochInner = getMappedInt(eidKey, headers);
-    while (currEpochInner > currEpochOuter) {
-      if (otherEpochOuter > currEpochOuter) {
-        sharedNextOp->reset(singleton(eidKey, OpResult::Int(currEpochOuter)));
-        currEpochOuter++;
+  void unpackInto(Key code, int64_t epoch, Headers& out) {
+    out[*keyField] = dictionary(epoch).decode(code);
+  }
+
+  // Drops the dictionaries of epochs before epoch, which neither side holds
+  // entries of any more.
+  void forget(int64_t epoch) {
+    while (!dictionaries.empty() && dictionaries.begin()->first < epoch) {
+      if (last == &dictionaries.begin()->second) {
+        last = nullptr;
       }
+      dictionaries.begin()->second.clear();
+      spare.push_back(move(dictionaries.begin()->second));
+      dictionaries.erase(dictionaries.begin());
     }
-  };
+  }
 
-  return Operator(next, reset);
+  size_t bytes() const {
+    size_t total = 0;
+    for (const auto& [_, dictionary] : dictionaries) {
+      total += dictionary.bytes();
+    }
+    for (const AddressDictionary& dictionary : spare) {
+      total += dictionary.bytes();
+    }
+    return total;
+  }
 };
 
+template <typename Keys>
+struct JoinSide {
+  using Table = typename Keys::Table;
+
+  KeyExtractor extractKey;
+  // Unmatched entries by epoch; only the last few epochs are ever live.
+  map<int64_t, Table> epochs;
+  size_t entries = 0;
+  int64_t currEpoch = 0;
+};
+
+template <typename Keys>
+struct JoinState {
+  using Key = typename Keys::Key;
+  using Table = typename Keys::Table;
+
+  array<JoinSide<Keys>, 2> sides;
+  Keys keys;
+  FieldId eidId;
+  JoinOptions options;
+  shared_ptr<JoinStats> stats;
+  shared_ptr<TableGauge> gauge;
+  // Shared by both sides' tables.
+  shared_ptr<TableAdmission> admission;
+  Operator nextOp;
+  // Tables of dropped epochs, kept for reuse so that steady state does not
+  // allocate.
+  vector<Table> spare;
+  size_t tableSize = initTableSize();
+  Headers out;
+  Headers merged;
+
+  shared_ptr<CheckpointState> checkpoint;
+
+  JoinState(FieldId eidId, JoinOptions options, Operator nextOp)
+      : eidId(eidId),
+        options(move(options)),
+        stats(this->options.stats ? this->options.stats
+                                  : make_shared<JoinStats>()),
+        gauge(meterTable()),
+        admission(admitTable(Keys::kBytesPerKey)),
+        nextOp(move(nextOp)) {}
+
+  Table& table(JoinSide<Keys>& side, int64_t epoch) {
+    auto it = side.epochs.find(epoch);
+    if (it != side.epochs.end()) {
+      return it->second;
+    }
+    if (spare.empty()) {
+      return side.epochs.emplace(epoch, Table(tableSize)).first->second;
+    }
+    Table& fresh =
+        side.epochs.emplace(epoch, move(spare.back())).first->second;
+    spare.pop_back();
+    return fresh;
+  }
+
+  void drop(JoinSide<Keys>& side,
+            typename map<int64_t, Table>::iterator it, uint64_t& counter) {
+    size_t n = it->second.size();
+    counter += n;
+    side.entries -= n;
+    stats->entries -= n;
+    if (admission) {
+      admission->releaseKeys(n);
+    }
+    it->second.clear();
+    spare.push_back(move(it->second));
+    side.epochs.erase(it);
+  }
+
+  // Moves side self up to epoch, passing on a reset for every epoch the
+  // other side has already left, then drops the other side's tables that
+  // self can no longer match.
+  void advance(size_t self, int64_t epoch) {
+    JoinSide<Keys>& curr = sides[self];
+    JoinSide<Keys>& other = sides[1 - self];
+    while (epoch > curr.currEpoch) {
+      if (other.currEpoch > curr.currEpoch) {
+        nextOp.reset(singleton(fieldName(eidId),
+                               OpResult::Int(curr.currEpoch)));
+      }
+      curr.currEpoch++;
+    }
+    while (!other.epochs.empty() &&
+           other.epochs.begin()->first < curr.currEpoch) {
+      drop(other, other.epochs.begin(), stats->expired);
+    }
+    keys.forget(min(curr.currEpoch, other.currEpoch));
+  }
+
+  void insert(size_t self, int64_t epoch, const Key& key,
+              const PackedKey& vals, const Headers& valHeaders) {
+    JoinSide<Keys>& side = sides[self];
+    if (options.merge) {
+      auto it = side.epochs.find(epoch);
+      PackedKey* stored =
+          it != side.epochs.end() ? it->second.find(key) : nullptr;
+      if (stored != nullptr) {
+        merged.clear();
+        unpackKeyInto(*stored, merged);
+        options.merge(merged, valHeaders);
+        checkJoinWidth(self, merged, "merged values");
+        *stored = packKey(merged);
+        stats->merged++;
+        return;
+      }
+    }
+    size_t cap = options.maxEntries;
+    while (cap != 0 && side.entries >= cap) {
+      if (side.epochs.begin()->first >= epoch) {
+        stats->evicted++;
+        return;
+      }
+      drop(side, side.epochs.begin(), stats->evicted);
+    }
+    Table& tbl = table(side, epoch);
+    if (admission && tbl.find(key) == nullptr && !admission->admit()) {
+      admission->stats().countShed();
+      return;
+    }
+    auto [slot, inserted] = tbl.findOrInsert(key);
+    *slot = vals;
+    if (inserted) {
+      side.entries++;
+      stats->entries++;
+      stats->peakEntries = max(stats->peakEntries, stats->entries);
+    }
+  }
+
+  void next(size_t self, const Headers& headers) {
+    JoinSide<Keys>& curr = sides[self];
+    JoinSide<Keys>& other = sides[1 - self];
+    markChanged(checkpoint);
+    auto [key, vals] = curr.extractKey(headers);
+    checkJoinWidth(self, key, "a key");
+    checkJoinWidth(self, vals, "values");
+    int64_t epoch = getMappedInt(eidId, headers);
+    advance(self, epoch);
+
+    Key joinKey = keys.of(key, epoch);
+    PackedKey packedVals = packKey(vals);
+    auto it = other.epochs.find(epoch);
+    PackedKey* match =
+        it != other.epochs.end() ? it->second.find(joinKey) : nullptr;
+    if (match == nullptr) {
+      insert(self, epoch, joinKey, packedVals, vals);
+      return;
+    }
+
+    // Lowest precedence first, so later writes win.
+    out.clear();
+    unpackKeyInto(*match, out);
+    unpackKeyInto(packedVals, out);
+    out[eidId] = OpResult::Int(epoch);
+    keys.unpackInto(joinKey, epoch, out);
+    it->second.erase(joinKey);
+    if (admission) {
+      admission->releaseKeys(1);
+    }
+    other.entries--;
+    stats->entries--;
+    stats->matches++;
+    nextOp.next(out);
+  }
+
+  // For each side, its epoch and its tables, oldest first, with keys as
+  // packed tuples whatever the tables hold.
+  void save(StateWriter& out) {
+    for (const JoinSide<Keys>& side : sides) {
+      out.putI64(side.currEpoch);
+      out.putVarint(side.epochs.size());
+      for (const auto& [epoch, table] : side.epochs) {
+        out.putI64(epoch);
+        out.putVarint(table.size());
+        table.forEach([&](const Key& key, const PackedKey& vals) {
+          out.putKey(keys.packed(key, epoch));
+          out.putKey(vals);
+        });
+      }
+    }
+  }
+
+  void load(StateReader& in) {
+    for (JoinSide<Keys>& side : sides) {
+      while (!side.epochs.empty()) {
+        uint64_t dropped = 0;
+        drop(side, side.epochs.begin(), dropped);
+      }
+    }
+    keys.forget(INT64_MAX);
+    for (JoinSide<Keys>& side : sides) {
+      side.currEpoch = in.i64();
+      uint64_t epochs = in.varint();
+      for (uint64_t e = 0; e < epochs; e++) {
+        int64_t epoch = in.i64();
+        Table& tbl = table(side, epoch);
+        uint64_t n = in.varint();
+        for (uint64_t i = 0; i < n; i++) {
+          Key key = keys.of(unpackKey(in.key()), epoch);
+          auto [slot, inserted] = tbl.findOrInsert(key);
+          *slot = in.key();
+          if (inserted) {
+            side.entries++;
+            stats->entries++;
+          }
+        }
+      }
+    }
+    stats->peakEntries = max(stats->peakEntries, stats->entries);
+  }
+
+  void reset(size_t self, const Headers& headers) {
+    markChanged(checkpoint);
+    if (gauge) {
+      size_t bytes = keys.bytes();
+      for (const JoinSide<Keys>& side : sides) {
+        for (const auto& [_, table] : side.epochs) {
+          bytes += table.bytes();
+        }
+      }
+      for (const Table& table : spare) {
+        bytes += table.bytes();
+      }
+      gauge->record(sides[0].entries + sides[1].entries, bytes);
+    }
+    advance(self, getMappedInt(eidId, headers));
+  }
+};
+
+template <typename Keys>
+pair<Operator, Operator> buildJoin(const KeyExtractor& leftExtractor,
+                                   const KeyExtractor& rightExtractor,
+                                   FieldId eidId, const JoinOptions& options,
+                                   Operator nextOp) {
+  auto state = make_shared<JoinState<Keys>>(eidId, options, move(nextOp));
+  state->sides[0].extractKey = leftExtractor;
+  state->sides[1].extractKey = rightExtractor;
+  // Weak, so that the registry does not keep the join alive; a join
+  // already dropped saves an empty section.
+  weak_ptr<JoinState<Keys>> weak = state;
+  state->checkpoint = checkpointState(
+      [weak](StateWriter& out) {
+        if (auto live = weak.lock()) {
+          live->save(out);
+        }
+      },
+      [weak](StateReader& in) {
+        auto live = weak.lock();
+        if (live && !in.done()) {
+          live->load(in);
+        }
+      });
+
+  auto side = [state](size_t self) {
+    OpFunc next = [state, self](const Headers& headers) {
+      state->next(self, headers);
+    };
+    OpFunc reset = [state, self](const Headers& headers) {
+      state->reset(self, headers);
+    };
+    return Operator(next, reset);
+  };
+
+  return make_pair(side(0), side(1));
+}
+
+}  // namespace
+
 DblOpCreator join(KeyExtractor leftExtractor, KeyExtractor rightExtractor,
-                  string eidKey = "eid") {
-  unordered_map<Headers, Headers> hTbl1;
-  unordered_map<Headers, Headers> hTbl2;
-  int leftCurrEpoch = 0;
-  int rightCurrEpoch = 0;
-
-  return [&hTbl1, &hTbl2, &leftCurrEpoch, &rightCurrEpoch, leftExtractor,
-          rightExtractor](Operator nextOp) {
-    Operator op1 = handleJoinSide(hTbl1, hTbl2, leftCurrEpoch, rightCurrEpoch,
-                                  leftExtractor, nextOp);
-    Operator op2 = handleJoinSide(hTbl2, hTbl1, rightCurrEpoch, leftCurrEpoch,
-                                  rightExtractor, nextOp);
-    return make_pair(op1, op2);
+                  string eidKey, JoinOptions options) {
+  FieldId eidId = internField(eidKey);
+
+  return [leftExtractor, rightExtractor, eidId, options](Operator nextOp) {
+    if (options.addressCodes) {
+      return buildJoin<AddressJoinKeys>(leftExtractor, rightExtractor, eidId,
+                                        options, move(nextOp));
+    }
+    return buildJoin<PackedJoinKeys>(leftExtractor, rightExtractor, eidId,
+                                     options, move(nextOp));
+  };
+}
+
+JoinMerge joinSumMerge(const vector<string>& fields) {
+  vector<FieldId> ids;
+  for (const string& field : fields) {
+    ids.push_back(internField(field));
+  }
+  return [ids](Headers& stored, const Headers& arriving) {
+    for (FieldId id : ids) {
+      if (arriving.contains(id) && stored.contains(id)) {
+        stored[id] = OpResult::Int(stored.at(id).asInt() +
+                                   arriving.at(id).asInt());
+      }
+    }
   };
 }
 
-Headers renameFilteredKeys(vector<pair<string, string>> renamingPairs,
-                           Headers inHeaders) {
+Headers renameFilteredKeys(const vector<pair<string, string>>& renamingPairs,
+                           const Headers& inHeaders) {
   Headers newH;
   for (const auto& [oldKey, newKey] : renamingPairs) {
     auto it = inHeaders.find(oldKey);
@@ -8,43 +8,157 @@
 #include <variant>
 #include <iostream>
 #include <memory>
+#include "flat_table.hpp"
+#include "key_projector.hpp"
+#include "packed_key.hpp"
 #include "utils.hpp"
 
 using namespace std;
 
-using GroupingFunc = function<Headers(Headers)>;
-using ReductionFunc = function<OpResult(OpResult, Headers)>;
-using KeyExtractor = function<pair<Headers, Headers>(Headers)>;
+// Initial capacity hint for the per-epoch tables kept by groupby, distinct
+// and join, as in the original implementation.
+constexpr size_t kInitTableSize = 10000;
 
-Operator dumpHeaders(Headers headers, bool showReset);
-Operator dumpAsCSV(optional<pair<string, string>> staticField,
-                   bool header);
+// The capacity stages built on this thread give their tables: the expected
+// keys of the innermost TableSizeScope alive on it, or kInitTableSize.
+size_t initTableSize();
+
+// While alive, stages built on this thread size their tables for expected
+// keys, so that a query expected to see many keys per epoch does not grow
+// its tables through its first epochs.
+class TableSizeScope {
+ public:
+  explicit TableSizeScope(size_t expected);
+  ~TableSizeScope();
+
+  TableSizeScope(const TableSizeScope&) = delete;
+  TableSizeScope& operator=(const TableSizeScope&) = delete;
+
+ private:
+  size_t saved;
+};
+
+using GroupingFunc = function<Headers(const Headers&)>;
+using ReductionFunc = function<OpResult(OpResult, const Headers&)>;
+using KeyExtractor = function<pair<Headers, Headers>(const Headers&)>;
+
+// The sinks format into a buffer that is written out when full and at
+// every reset; dumpAsBinary in output.hpp is the binary counterpart.
+Operator dump(ofstream out, bool showReset = false);
+Operator dumpAsCSV(optional<pair<string, string>> staticField = nullopt,
+                   bool header = true, ostream& outc = cout);
+// Writes to filename through an AsyncFileWriter, so a reset hands its
+// buffer to the kernel rather than waiting on the disk. Throws
+// runtime_error if filename cannot be opened, and from a later call once a
+// write has failed.
 Operator dumpWaltsCSV(string filename);
 OpResult getIpOrZero(string input);
+// Passes everything through, and at each reset writes
+// "epoch,name,tuples,staticField" for the epoch just closed to outc.
+OpCreator metaMeterCreator(string name, ofstream outc,
+                           optional<string> staticField = nullopt);
 Headers singleton(string keyOut, OpResult val);
-OpCreator epochCreator(float epochWidth, string keyOut);
-OpCreator filterCreator(function<bool(Headers)> f);
-bool keyGeqInt(string key, int threshold, Headers headers);
-int getMappedInt(string key, Headers headers);
-float getMappedFloat(string key, Headers headers);
-OpCreator mapCreator(function<Headers(Headers)> f);
-Headers unionHeaders(Headers h1, Headers h2);
+// Tags every tuple with the id of its epoch of epochWidth seconds under
+// keyOut, and resets downstream at each epoch boundary. Epochs start at the
+// first tuple's time and are numbered from 0; when aligned, they start at
+// whole multiples of epochWidth and are numbered time / epochWidth, so that
+// processes seeing different slices of the traffic agree on them.
+OpCreator epochCreator(double epochWidth, string keyOut, bool aligned = false);
+OpCreator filterCreator(function<bool(const Headers&)> f);
+bool keyGeqInt(string key, int threshold, const Headers& headers);
+int64_t getMappedInt(string key, const Headers& headers);
+double getMappedFloat(string key, const Headers& headers);
+bool keyGeqInt(FieldId key, int threshold, const Headers& headers);
+int64_t getMappedInt(FieldId key, const Headers& headers);
+double getMappedFloat(FieldId key, const Headers& headers);
+OpCreator mapCreator(function<Headers(const Headers&)> f);
+// In-place form of mapCreator for stages that only add or overwrite fields:
+// f edits a copy of the tuple kept by the operator, so no new tuple is built
+// per call.
+OpCreator extendCreator(function<void(Headers&)> f);
+Headers unionHeaders(const Headers& h1, const Headers& h2);
+// Keys of up to kMaxKeyFields fields are packed into the stage's table;
+// wider ones, which only a GroupingFunc can build, are held in a map of
+// Headers beside it, which checkpoints do not save and memory budgets do
+// not charge. The same holds for distinctCreator's GroupingFunc form.
 OpCreator groupbyCreator(GroupingFunc groupby, ReductionFunc reduct,
                       string outKey);
-Headers filterGroups(vector<string> inclKeys, Headers headers);
-Headers singleGroup(Headers _);
-OpResult counter(OpResult val, Headers _);
-OpResult sumInts(string searchKey, OpResult initVal, Headers headers);
+// Grouping by a fixed set of fields: the key is packed and hashed straight
+// from each tuple, where the GroupingFunc forms build a tuple of the fields
+// and pack and hash that.
+OpCreator groupbyCreator(KeyProjector groupby, ReductionFunc reduct,
+                         string outKey);
+// With the threshold filter that usually follows a groupby fused into its
+// reset: only groups whose value, as an integer, is at least atLeast are
+// passed on, and no tuple is built for the rest. The same as following the
+// groupby with a filter on keyGeqInt(outKey, atLeast, .).
+OpCreator groupbyCreator(KeyProjector groupby, ReductionFunc reduct,
+                         string outKey, int64_t atLeast);
+Headers filterGroups(const vector<string>& inclKeys, const Headers& headers);
+Headers singleGroup(const Headers& _);
+OpResult counter(OpResult val, const Headers& _);
+OpResult sumInts(const string& searchKey, OpResult initVal,
+                 const Headers& headers);
 OpCreator distinctCreator(GroupingFunc groupby);
+OpCreator distinctCreator(KeyProjector groupby);
 DblOpAcceptorOpCreator split();
-Operator handleJoinSide(unordered_map<Headers, Headers> currHtbl,
-                        unordered_map<Headers, Headers> otherHTbl,
-                        int currEpochOuter, int otherEpochOuter,
-                        KeyExtractor extractKey, Operator nextOp,
-                        string eidKey = "eid");
+
+struct JoinStats {
+  uint64_t matches = 0;
+  // Tuples merged into an unmatched entry of their side with JoinOptions::
+  // merge.
+  uint64_t merged = 0;
+  // Unmatched entries dropped because the other side moved past their epoch,
+  // so that nothing could match them any more.
+  uint64_t expired = 0;
+  // Unmatched entries dropped to stay within JoinOptions::maxEntries.
+  uint64_t evicted = 0;
+  size_t entries = 0;
+  size_t peakEntries = 0;
+};
+
+// Folds the values of a tuple into those stored for its key on its side.
+using JoinMerge = function<void(Headers& stored, const Headers& arriving)>;
+
+struct JoinOptions {
+  // Cap on the unmatched entries each side holds; 0 leaves it unbounded.
+  // Past it the side's oldest epoch is dropped, or the new entry if only the
+  // current epoch is held.
+  size_t maxEntries = 0;
+  // For keys of one IPv4 or MAC address field, named alike on both sides,
+  // as the per-host joins of completedFlows and slowloris have: each epoch
+  // codes its addresses once, in an AddressDictionary both sides share, and
+  // keeps its entries in arrays indexed by code rather than in hash tables
+  // of packed keys. The join then throws invalid_argument for any other key.
+  bool addressCodes = false;
+  // What a tuple does to an unmatched entry of its key on its own side: by
+  // default it replaces it; with a merge set, the two are folded together,
+  // so that a key that comes in parts, such as partial counts, is matched
+  // once with its running aggregate.
+  JoinMerge merge;
+  // Updated as the join runs when set.
+  shared_ptr<JoinStats> stats;
+};
+
+// Symmetric hash join of two streams on the keys their extractors return,
+// within an epoch. Each side keeps its unmatched entries in one table per
+// epoch, keyed and valued by packed tuples, so the key and the value may each
+// hold up to kMaxKeyFields fields; a side throws invalid_argument, naming
+// itself, for a tuple whose key or values, or values once merged, hold more.
+// A side's tables for epochs the other side has moved past are dropped in
+// one step. A match is passed on with the key, the eid, then the arriving
+// side's values, then the stored side's values, earlier ones taking
+// precedence, as soon as the second side of a key arrives; the stored entry
+// is dropped then, so that a key costs memory only while one side of it is
+// waiting. A reset is passed on once both sides have moved past an epoch.
 DblOpCreator join(KeyExtractor leftExtractor, KeyExtractor rightExtractor,
-                  string eidKey = "eid");
-Headers renameFilteredKeys(vector<pair<string, string>> renamingPairs,
-                           Headers inHeaders);
+                  string eidKey = "eid", JoinOptions options = JoinOptions());
+
+// A JoinMerge that adds up the integer fields of fields, keeping the stored
+// values of the rest.
+JoinMerge joinSumMerge(const vector<string>& fields);
+
+Headers renameFilteredKeys(const vector<pair<string, string>>& renamingPairs,
+                           const Headers& inHeaders);
 
 #endif
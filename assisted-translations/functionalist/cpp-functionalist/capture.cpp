@@ -0,0 +1,203 @@
+#include "capture.hpp"
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "packet.hpp"
+
+namespace {
+
+[[noreturn]] void throwErrno(const string& what) {
+  throw runtime_error("Error: " + what + ": " + strerror(errno));
+}
+
+}  // namespace
+
+PacketCapture::PacketCapture(CaptureOptions options)
+    : options(move(options)) {
+  const CaptureOptions& opts = this->options;
+  if (opts.blockSize % opts.frameSize != 0) {
+    throw invalid_argument(
+        "Error: capture block size must be a multiple of the frame size");
+  }
+
+  fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd < 0) {
+    throwErrno("could not open packet socket");
+  }
+
+  try {
+    // Before the ring and the bind, so that no packet gets past it.
+    if (!opts.filter.empty()) {
+      static_assert(sizeof(BpfInsn) == sizeof(sock_filter),
+                    "BpfInsn must be laid out as sock_filter");
+      sock_fprog prog;
+      prog.len = static_cast<unsigned short>(opts.filter.size());
+      prog.filter = reinterpret_cast<sock_filter*>(
+          const_cast<BpfInsn*>(opts.filter.data()));
+      if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                     sizeof(prog)) != 0) {
+        throwErrno("could not attach the packet filter");
+      }
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) != 0) {
+      throwErrno("could not select TPACKET_V3");
+    }
+
+    tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = static_cast<unsigned>(opts.blockSize);
+    req.tp_block_nr = static_cast<unsigned>(opts.blockCount);
+    req.tp_frame_size = static_cast<unsigned>(opts.frameSize);
+    req.tp_frame_nr = static_cast<unsigned>(opts.blockSize / opts.frameSize *
+                                            opts.blockCount);
+    req.tp_retire_blk_tov = opts.blockTimeoutMs;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+      throwErrno("could not set up the receive ring");
+    }
+
+    ringSize = opts.blockSize * opts.blockCount;
+    void* addr = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      throwErrno("could not map the receive ring");
+    }
+    ring = static_cast<uint8_t*>(addr);
+
+    unsigned ifindex = if_nametoindex(opts.interface.c_str());
+    if (ifindex == 0) {
+      throwErrno("unknown interface \"" + opts.interface + "\"");
+    }
+    sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = static_cast<int>(ifindex);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&sll), sizeof(sll)) != 0) {
+      throwErrno("could not bind to \"" + opts.interface + "\"");
+    }
+
+    if (opts.promiscuous) {
+      packet_mreq mreq;
+      memset(&mreq, 0, sizeof(mreq));
+      mreq.mr_ifindex = static_cast<int>(ifindex);
+      mreq.mr_type = PACKET_MR_PROMISC;
+      if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                     sizeof(mreq)) != 0) {
+        throwErrno("could not enable promiscuous mode");
+      }
+    }
+
+    if (opts.fanoutGroup != 0) {
+      int fanout = opts.fanoutGroup | (PACKET_FANOUT_HASH << 16);
+      if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                     sizeof(fanout)) != 0) {
+        throwErrno("could not join fanout group");
+      }
+    }
+  } catch (...) {
+    if (ring != nullptr) {
+      munmap(ring, ringSize);
+    }
+    close(fd);
+    throw;
+  }
+
+  startPacketBatch(batch);
+}
+
+PacketCapture::~PacketCapture() {
+  if (ring != nullptr) {
+    munmap(ring, ringSize);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+tpacket_block_desc* PacketCapture::currentBlock() const {
+  return reinterpret_cast<tpacket_block_desc*>(ring +
+                                               current * options.blockSize);
+}
+
+bool PacketCapture::blockReady() const {
+  uint32_t status = __atomic_load_n(&currentBlock()->hdr.bh1.block_status,
+                                    __ATOMIC_ACQUIRE);
+  return (status & TP_STATUS_USER) != 0;
+}
+
+size_t PacketCapture::drainBlock(BatchOperator& op) {
+  tpacket_block_desc* block = currentBlock();
+  uint32_t count = block->hdr.bh1.num_pkts;
+  startPacketBatch(batch, count);
+  auto* hdr = reinterpret_cast<tpacket3_hdr*>(
+      reinterpret_cast<uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt);
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t* frame = reinterpret_cast<const uint8_t*>(hdr) + hdr->tp_mac;
+    double time = hdr->tp_sec + hdr->tp_nsec * 1e-9;
+    appendPacket(batch, frame, hdr->tp_snaplen, time);
+    hdr = reinterpret_cast<tpacket3_hdr*>(reinterpret_cast<uint8_t*>(hdr) +
+                                          hdr->tp_next_offset);
+  }
+
+  // The block goes back to the kernel before the batch is processed; its
+  // contents have already been copied out into the columns.
+  __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                   __ATOMIC_RELEASE);
+  current = (current + 1) % options.blockCount;
+
+  if (batch.rows > 0) {
+    op.next(batch);
+  }
+  return batch.rows;
+}
+
+size_t PacketCapture::poll(BatchOperator& op, int timeoutMs) {
+  if (!blockReady()) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR) {
+      throwErrno("poll on packet socket failed");
+    }
+  }
+  size_t packets = 0;
+  for (size_t n = 0; n < options.blockCount && blockReady(); n++) {
+    packets += drainBlock(op);
+  }
+  return packets;
+}
+
+void PacketCapture::run(BatchOperator& op, const atomic<bool>& stop) {
+  while (!stop.load(memory_order_relaxed)) {
+    poll(op, 100);
+  }
+}
+
+CaptureStats PacketCapture::stats() {
+  tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+  if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0) {
+    throwErrno("could not read capture statistics");
+  }
+  CaptureStats out;
+  out.packets = st.tp_packets;
+  out.drops = st.tp_drops;
+  out.freezes = st.tp_freeze_q_cnt;
+  return out;
+}
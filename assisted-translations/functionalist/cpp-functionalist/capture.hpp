@@ -0,0 +1,75 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "batch.hpp"
+#include "packet_filter.hpp"
+
+struct tpacket_block_desc;
+
+using namespace std;
+
+struct CaptureOptions {
+  string interface;
+  // The ring is blockCount blocks of blockSize bytes; the kernel hands over
+  // a whole block at a time, once it is full or blockTimeoutMs has passed.
+  size_t blockSize = size_t{1} << 20;
+  size_t blockCount = 64;
+  size_t frameSize = 2048;
+  unsigned blockTimeoutMs = 10;
+  bool promiscuous = true;
+  // Joins a PACKET_FANOUT group with this id when nonzero, so that several
+  // captures on one interface split its traffic by flow hash.
+  uint16_t fanoutGroup = 0;
+  // Attached to the socket when not empty, so that the kernel drops the
+  // packets it rejects before they reach the ring; see packet_filter.hpp.
+  vector<BpfInsn> filter;
+};
+
+struct CaptureStats {
+  uint64_t packets = 0;
+  uint64_t drops = 0;
+  uint64_t freezes = 0;
+};
+
+// Live capture from an AF_PACKET socket with a TPACKET_V3 ring mapped into
+// the process. Every retired block of the ring is decoded into one batch;
+// the only syscall on the receive path is the poll() made when the ring is
+// empty. Needs CAP_NET_RAW.
+class PacketCapture {
+ public:
+  // Throws runtime_error if the socket or ring cannot be set up.
+  explicit PacketCapture(CaptureOptions options);
+  ~PacketCapture();
+
+  PacketCapture(const PacketCapture&) = delete;
+  PacketCapture& operator=(const PacketCapture&) = delete;
+
+  // Hands every block in the ring to op, first waiting up to timeoutMs for
+  // one if the ring is empty. Returns the number of packets passed on.
+  size_t poll(BatchOperator& op, int timeoutMs);
+
+  // Polls until stop is set.
+  void run(BatchOperator& op, const atomic<bool>& stop);
+
+  // Kernel counters since the previous call.
+  CaptureStats stats();
+
+ private:
+  CaptureOptions options;
+  int fd = -1;
+  uint8_t* ring = nullptr;
+  size_t ringSize = 0;
+  size_t current = 0;
+  Batch batch;
+
+  tpacket_block_desc* currentBlock() const;
+  bool blockReady() const;
+  size_t drainBlock(BatchOperator& op);
+};
+
+#endif  // CAPTURE_H
@@ -0,0 +1,480 @@
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "mapped_file.hpp"
+
+void StateWriter::putVarint(uint64_t val) {
+  while (val >= 0x80) {
+    out += static_cast<char>(val | 0x80);
+    val >>= 7;
+  }
+  out += static_cast<char>(val);
+}
+
+void StateWriter::putU64(uint64_t val) {
+  for (size_t i = 0; i < 8; i++) {
+    out += static_cast<char>(val >> (8 * i));
+  }
+}
+
+void StateWriter::putDouble(double val) {
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  putU64(bits);
+}
+
+void StateWriter::putResult(const OpResult& val) {
+  out += static_cast<char>(val.typ);
+  putU64(val.bits());
+}
+
+// u8 fields, then each field's index, type and 8-byte payload.
+void StateWriter::putKey(const PackedKey& key) {
+  out += static_cast<char>(key.n);
+  uint64_t rest = key.fields;
+  for (uint8_t i = 0; i < key.n; i++, rest &= rest - 1) {
+    out += static_cast<char>(__builtin_ctzll(rest));
+    out += static_cast<char>(key.types[i]);
+    putU64(key.vals[i]);
+  }
+}
+
+// u8 fields, then each field's index and value.
+void StateWriter::putHeaders(const Headers& headers) {
+  out += static_cast<char>(headers.size());
+  for (auto it = headers.begin(); it != headers.end(); ++it) {
+    out += static_cast<char>(it.id());
+    putResult(headers.at(it.id()));
+  }
+}
+
+void StateWriter::putBytes(const void* data, size_t n) {
+  out.append(static_cast<const char*>(data), n);
+}
+
+void StateWriter::putText(const string& text) {
+  putVarint(text.size());
+  out += text;
+}
+
+namespace {
+
+// Thrown by StateReader, and given the file's name by restore.
+struct StateError : runtime_error {
+  using runtime_error::runtime_error;
+};
+
+[[noreturn]] void malformed(const string& what) {
+  throw StateError(what);
+}
+
+OpResultType resultType(uint8_t typ) {
+  if (typ > static_cast<uint8_t>(OpResultType::Empty)) {
+    malformed("malformed (bad value type)");
+  }
+  return static_cast<OpResultType>(typ);
+}
+
+}  // namespace
+
+uint64_t StateReader::varint() {
+  uint64_t val = 0;
+  for (int shift = 0; shift < 64 && p != end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*p++);
+    val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return val;
+    }
+  }
+  malformed(p == end ? "truncated" : "malformed (bad varint)");
+}
+
+uint64_t StateReader::u64() {
+  uint8_t raw[8];
+  bytes(raw, sizeof(raw));
+  uint64_t val = 0;
+  for (size_t i = 0; i < 8; i++) {
+    val |= static_cast<uint64_t>(raw[i]) << (8 * i);
+  }
+  return val;
+}
+
+double StateReader::real() {
+  uint64_t bits = u64();
+  double val;
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+OpResult StateReader::result() {
+  uint8_t typ;
+  bytes(&typ, 1);
+  return OpResult::fromBits(resultType(typ), u64());
+}
+
+PackedKey StateReader::key() {
+  uint8_t n;
+  bytes(&n, 1);
+  if (n > kMaxKeyFields) {
+    malformed("malformed (key has too many fields)");
+  }
+  // Ids in this process need not come in the file's order, and push wants
+  // them increasing.
+  array<pair<FieldId, OpResult>, kMaxKeyFields> entries;
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t index, typ;
+    bytes(&index, 1);
+    bytes(&typ, 1);
+    if (index >= fields.size()) {
+      malformed("malformed (bad field index)");
+    }
+    entries[i] = {fields[index], OpResult::fromBits(resultType(typ), u64())};
+  }
+  for (uint8_t i = 1; i < n; i++) {
+    for (uint8_t j = i; j > 0 && entries[j - 1].first > entries[j].first;
+         j--) {
+      swap(entries[j - 1], entries[j]);
+    }
+  }
+  PackedKey key;
+  for (uint8_t i = 0; i < n; i++) {
+    key.push(entries[i].first, entries[i].second);
+  }
+  return key;
+}
+
+Headers StateReader::headers() {
+  uint8_t n;
+  bytes(&n, 1);
+  Headers out;
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t index;
+    bytes(&index, 1);
+    if (index >= fields.size()) {
+      malformed("malformed (bad field index)");
+    }
+    out[fields[index]] = result();
+  }
+  return out;
+}
+
+void StateReader::bytes(void* data, size_t n) {
+  if (static_cast<size_t>(end - p) < n) {
+    malformed("truncated");
+  }
+  memcpy(data, p, n);
+  p += n;
+}
+
+string StateReader::text() {
+  uint64_t n = varint();
+  if (static_cast<uint64_t>(end - p) < n) {
+    malformed("truncated");
+  }
+  string out(p, n);
+  p += n;
+  return out;
+}
+
+CheckpointRegistry::CheckpointRegistry(string path, CheckpointOptions options)
+    : path(move(path)), options(options) {
+  this->options.everyEpochs = max<int64_t>(1, this->options.everyEpochs);
+  writer = thread([this]() { run(); });
+}
+
+CheckpointRegistry::~CheckpointRegistry() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  writer.join();
+}
+
+shared_ptr<CheckpointState> CheckpointRegistry::add(
+    const string& name, function<void(StateWriter&)> save,
+    function<void(StateReader&)> load) {
+  for (const auto& stage : stages) {
+    if (stage->name == name) {
+      throw invalid_argument("Error: checkpoint state \"" + name +
+                             "\" registered twice");
+    }
+  }
+  auto state = make_shared<CheckpointState>();
+  state->name = name;
+  state->save = move(save);
+  state->load = move(load);
+  state->registry = this;
+  stages.push_back(state);
+  return state;
+}
+
+string CheckpointRegistry::instanceName(const string& name) {
+  size_t instance = instances[name]++;
+  return instance == 0 ? name : name + "#" + to_string(instance);
+}
+
+void CheckpointRegistry::epochStarted(int64_t eid) {
+  if (eid > lastEpoch && eid % options.everyEpochs == 0) {
+    due = eid;
+  }
+}
+
+bool CheckpointRegistry::poll() {
+  if (!due) {
+    return false;
+  }
+  checkpoint(*due);
+  return true;
+}
+
+void CheckpointRegistry::checkpoint(int64_t epoch) {
+  checkFailed();
+  due.reset();
+  lastEpoch = max(lastEpoch, epoch);
+
+  Snapshot snapshot;
+  snapshot.epoch = epoch;
+  for (size_t id = 0; id < numFields(); id++) {
+    snapshot.fieldNames.push_back(fieldName(static_cast<FieldId>(id)));
+  }
+  uint64_t encoded = 0;
+  for (const auto& stage : stages) {
+    if (stage->changed || !stage->encoded) {
+      auto payload = make_shared<string>();
+      StateWriter out(*payload);
+      stage->save(out);
+      stage->encoded = move(payload);
+      stage->changed = false;
+      encoded++;
+    }
+    snapshot.sections.emplace_back(stage->name, stage->encoded);
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    counters.taken++;
+    counters.encoded += encoded;
+    counters.reused += stages.size() - encoded;
+    if (pending) {
+      counters.superseded++;
+    }
+    pending = move(snapshot);
+  }
+  wake.notify_one();
+}
+
+void CheckpointRegistry::flush() {
+  unique_lock<mutex> guard(lock);
+  idle.wait(guard, [this]() { return !pending && !writing; });
+  guard.unlock();
+  checkFailed();
+}
+
+optional<int64_t> CheckpointRegistry::restore() {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return nullopt;
+  }
+  MappedFile file(path);
+  const vector<FieldId> noFields;
+  StateReader header(file.data(), file.data() + file.size(), noFields);
+  auto fail = [this](const string& what) {
+    throw runtime_error("Error: checkpoint \"" + path + "\" is " + what);
+  };
+
+  char magic[5];
+  int64_t epoch = 0;
+  vector<FieldId> fields;
+  try {
+    header.bytes(magic, sizeof(magic));
+    if (memcmp(magic, kCheckpointMagic, 4) != 0) {
+      fail("not a checkpoint");
+    }
+    if (static_cast<uint8_t>(magic[4]) != kCheckpointVersion) {
+      fail("of an unsupported version");
+    }
+    epoch = static_cast<int64_t>(header.varint());
+    uint64_t numNames = header.varint();
+    if (numNames > kMaxFields) {
+      fail("malformed (too many fields)");
+    }
+    for (uint64_t i = 0; i < numNames; i++) {
+      string text = header.text();
+      try {
+        fields.push_back(internField(text));
+      } catch (const out_of_range&) {
+        fail("over the limit of " + to_string(kMaxFields) + " field names");
+      }
+    }
+  } catch (const StateError& e) {
+    fail(e.what());
+  }
+
+  unordered_map<string, shared_ptr<CheckpointState>> byName;
+  for (const auto& stage : stages) {
+    byName[stage->name] = stage;
+  }
+  string name;
+  try {
+    uint64_t sections = header.varint();
+    for (uint64_t i = 0; i < sections; i++) {
+      name = header.text();
+      string payload = header.text();
+      auto it = byName.find(name);
+      if (it == byName.end()) {
+        continue;
+      }
+      StateReader in(payload.data(), payload.data() + payload.size(), fields);
+      it->second->load(in);
+      if (!in.done()) {
+        malformed("malformed (trailing bytes)");
+      }
+      it->second->changed = true;
+    }
+  } catch (const StateError& e) {
+    fail(string(e.what()) + " in section \"" + name + "\"");
+  }
+  lastEpoch = epoch;
+  return epoch;
+}
+
+CheckpointStats CheckpointRegistry::stats() const {
+  lock_guard<mutex> guard(lock);
+  return counters;
+}
+
+void CheckpointRegistry::run() {
+  while (true) {
+    unique_lock<mutex> guard(lock);
+    wake.wait(guard, [this]() { return stopping || pending; });
+    if (!pending) {
+      return;
+    }
+    Snapshot snapshot = move(*pending);
+    pending.reset();
+    writing = true;
+    guard.unlock();
+
+    exception_ptr failure;
+    try {
+      write(snapshot);
+    } catch (...) {
+      failure = current_exception();
+    }
+
+    guard.lock();
+    writing = false;
+    if (failure) {
+      error = failure;
+    } else {
+      counters.written++;
+    }
+    guard.unlock();
+    idle.notify_all();
+  }
+}
+
+void CheckpointRegistry::write(const Snapshot& snapshot) {
+  string header;
+  StateWriter out(header);
+  out.putBytes(kCheckpointMagic, 4);
+  out.put(kCheckpointVersion);
+  out.putVarint(static_cast<uint64_t>(snapshot.epoch));
+  out.putVarint(snapshot.fieldNames.size());
+  for (const string& name : snapshot.fieldNames) {
+    out.putText(name);
+  }
+  out.putVarint(snapshot.sections.size());
+
+  string tmp = path + ".tmp";
+  ofstream file(tmp, ios::binary | ios::trunc);
+  if (!file) {
+    throw runtime_error("Error: could not open \"" + tmp + "\" for writing");
+  }
+  file.write(header.data(), header.size());
+  size_t bytes = header.size();
+  string framing;
+  for (const auto& [name, payload] : snapshot.sections) {
+    framing.clear();
+    StateWriter frame(framing);
+    frame.putText(name);
+    frame.putVarint(payload->size());
+    file.write(framing.data(), framing.size());
+    file.write(payload->data(), payload->size());
+    bytes += framing.size() + payload->size();
+  }
+  file.close();
+  if (!file) {
+    throw runtime_error("Error: failed writing checkpoint \"" + tmp + "\"");
+  }
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    throw runtime_error("Error: could not move \"" + tmp + "\" to \"" + path +
+                        "\"");
+  }
+  lock_guard<mutex> guard(lock);
+  counters.lastBytes = bytes;
+}
+
+void CheckpointRegistry::checkFailed() {
+  lock_guard<mutex> guard(lock);
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+namespace {
+
+struct CheckpointScope {
+  CheckpointRegistry* registry = nullptr;
+  string name;
+  size_t next = 0;
+};
+
+thread_local CheckpointScope building;
+
+// Sets the stage whose state is being built on this thread.
+class BuildScope {
+ public:
+  BuildScope(CheckpointRegistry& registry, const string& name)
+      : saved(move(building)) {
+    building = CheckpointScope{&registry, registry.instanceName(name), 0};
+  }
+  ~BuildScope() { building = move(saved); }
+
+ private:
+  CheckpointScope saved;
+};
+
+}  // namespace
+
+shared_ptr<CheckpointState> checkpointState(
+    function<void(StateWriter&)> save, function<void(StateReader&)> load) {
+  if (building.registry == nullptr) {
+    return nullptr;
+  }
+  return building.registry->add(
+      building.name + "/" + to_string(building.next++), move(save),
+      move(load));
+}
+
+OpCreator checkpointedCreator(string name, OpCreator stage,
+                              CheckpointRegistry& registry) {
+  return [name, stage, &registry](Operator nextOp) {
+    BuildScope scope(registry, name);
+    return stage(nextOp);
+  };
+}
+
+DblOpCreator checkpointedCreator(string name, DblOpCreator stage,
+                                 CheckpointRegistry& registry) {
+  return [name, stage, &registry](Operator nextOp) {
+    BuildScope scope(registry, name);
+    return stage(nextOp);
+  };
+}
@@ -0,0 +1,270 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "flat_table.hpp"
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Snapshots of the state of stateful stages, taken between tuples and
+// written out on a background thread, so that a restarted process can pick
+// up the epochs in flight instead of losing them.
+//
+// A snapshot file is the magic "FNCK" and a version byte, then, with all
+// integers little-endian and varints LEB128:
+//
+//   varint epoch, varint fields, then each field name as a varint length
+//   and its bytes; varint sections, then for each section a varint name
+//   length, the name, a varint payload length and the payload.
+//
+// Each section holds the state of one stage, in a layout of the stage's
+// own. Fields are written as indexes into the file's field names, so a
+// snapshot stays valid when the next process interns fields in another
+// order.
+
+constexpr char kCheckpointMagic[] = "FNCK";
+constexpr uint8_t kCheckpointVersion = 1;
+
+class StateWriter {
+ public:
+  explicit StateWriter(string& out) : out(out) {}
+
+  void putVarint(uint64_t val);
+  void putU64(uint64_t val);
+  void putI64(int64_t val) { putU64(static_cast<uint64_t>(val)); }
+  void putDouble(double val);
+  void putResult(const OpResult& val);
+  void putKey(const PackedKey& key);
+  void putHeaders(const Headers& headers);
+  void putBytes(const void* data, size_t n);
+  // A varint length, then the bytes.
+  void putText(const string& text);
+
+  // The value half of a table entry.
+  void put(const OpResult& val) { putResult(val); }
+  void put(const PackedKey& key) { putKey(key); }
+  void put(bool val) { out += static_cast<char>(val); }
+  template <typename V>
+  void put(const V& val) {
+    static_assert(is_trivially_copyable<V>::value,
+                  "StateWriter::put needs a trivially copyable value");
+    putBytes(&val, sizeof(val));
+  }
+
+ private:
+  string& out;
+};
+
+// Reads back what a StateWriter wrote. Throws runtime_error on a truncated
+// or malformed payload.
+class StateReader {
+ public:
+  StateReader(const char* begin, const char* end,
+              const vector<FieldId>& fields)
+      : p(begin), end(end), fields(fields) {}
+
+  uint64_t varint();
+  uint64_t u64();
+  int64_t i64() { return static_cast<int64_t>(u64()); }
+  double real();
+  OpResult result();
+  PackedKey key();
+  Headers headers();
+  void bytes(void* data, size_t n);
+  string text();
+
+  template <typename V>
+  V get() {
+    if constexpr (is_same<V, OpResult>::value) {
+      return result();
+    } else if constexpr (is_same<V, PackedKey>::value) {
+      return key();
+    } else if constexpr (is_same<V, bool>::value) {
+      uint8_t b;
+      bytes(&b, 1);
+      return b != 0;
+    } else {
+      static_assert(is_trivially_copyable<V>::value,
+                    "StateReader::get needs a trivially copyable value");
+      V val;
+      bytes(&val, sizeof(val));
+      return val;
+    }
+  }
+
+  bool done() const { return p == end; }
+
+ private:
+  const char* p;
+  const char* end;
+  // This process's id for each field index of the file.
+  const vector<FieldId>& fields;
+};
+
+class CheckpointRegistry;
+
+// The state of one stage, as registered with a CheckpointRegistry. The
+// stage sets changed whenever its state changes; a snapshot re-encodes only
+// the stages that changed since the one before and reuses the last encoding
+// of the rest.
+struct CheckpointState {
+  string name;
+  function<void(StateWriter&)> save;
+  function<void(StateReader&)> load;
+  CheckpointRegistry* registry;
+  bool changed = true;
+  shared_ptr<const string> encoded;
+};
+
+struct CheckpointOptions {
+  // An epoch stage makes a snapshot due every this many epochs.
+  int64_t everyEpochs = 1;
+};
+
+struct CheckpointStats {
+  uint64_t taken = 0;
+  uint64_t written = 0;
+  // Snapshots replaced by a newer one before the writer got to them.
+  uint64_t superseded = 0;
+  // Stages encoded afresh and stages whose last encoding was reused.
+  uint64_t encoded = 0;
+  uint64_t reused = 0;
+  size_t lastBytes = 0;
+};
+
+// The stages of the queries run on one thread, and the file their
+// snapshots go to. A snapshot is encoded on the calling thread and written
+// to path, through a temporary file renamed into place, by a thread of the
+// registry's own; if the writer is still busy when the next one is taken,
+// only the newest waits for it. The registry must outlive the queries built
+// with it.
+class CheckpointRegistry {
+ public:
+  explicit CheckpointRegistry(string path,
+                              CheckpointOptions options = CheckpointOptions());
+  // Writes the snapshot still waiting, then joins the writer.
+  ~CheckpointRegistry();
+
+  CheckpointRegistry(const CheckpointRegistry&) = delete;
+  CheckpointRegistry& operator=(const CheckpointRegistry&) = delete;
+
+  shared_ptr<CheckpointState> add(const string& name,
+                                  function<void(StateWriter&)> save,
+                                  function<void(StateReader&)> load);
+  // name, suffixed with the number of times it was passed before, so that
+  // stages built more than once under one name get sections of their own.
+  string instanceName(const string& name);
+
+  // Called by epoch stages as they move to epoch eid.
+  void epochStarted(int64_t eid);
+
+  // Takes the snapshot an epoch stage made due, if there is one. Call
+  // between tuples, from the thread running the queries, so that every
+  // stage is caught between the same two tuples.
+  bool poll();
+  // Takes a snapshot now, tagged with epoch.
+  void checkpoint(int64_t epoch);
+  // Waits until every snapshot taken so far is on disk, and rethrows the
+  // error of a failed write.
+  void flush();
+
+  // Loads every stage that has a section in the file at path, and returns
+  // the epoch of the snapshot, or nullopt if there is no file. Call after
+  // the queries are built and before any tuple is fed. Stages without a
+  // section keep their empty state; sections without a stage are ignored.
+  // Throws runtime_error if the file is not a snapshot or is malformed, or
+  // if its field names would take the intern table past kMaxFields.
+  optional<int64_t> restore();
+
+  CheckpointStats stats() const;
+
+ private:
+  struct Snapshot {
+    int64_t epoch;
+    vector<string> fieldNames;
+    vector<pair<string, shared_ptr<const string>>> sections;
+  };
+
+  string path;
+  CheckpointOptions options;
+  vector<shared_ptr<CheckpointState>> stages;
+  unordered_map<string, size_t> instances;
+  optional<int64_t> due;
+  int64_t lastEpoch = -1;
+
+  mutable mutex lock;
+  condition_variable wake;
+  condition_variable idle;
+  optional<Snapshot> pending;
+  bool writing = false;
+  bool stopping = false;
+  exception_ptr error;
+  CheckpointStats counters;
+  thread writer;
+
+  void run();
+  void write(const Snapshot& snapshot);
+  void checkFailed();
+};
+
+// The state of the stage under construction on this thread, registered
+// with the registry of the enclosing checkpointedCreator, or null outside
+// one. Stateful stages call it as they are built.
+shared_ptr<CheckpointState> checkpointState(function<void(StateWriter&)> save,
+                                            function<void(StateReader&)> load);
+
+inline void markChanged(const shared_ptr<CheckpointState>& state) {
+  if (state) {
+    state->changed = true;
+  }
+}
+
+// Registers a groupby or distinct table: its entries as a varint count,
+// then each key and value.
+template <typename V>
+shared_ptr<CheckpointState> checkpointTable(
+    shared_ptr<FlatTable<PackedKey, V, PackedKeyHash>> table) {
+  return checkpointState(
+      [table](StateWriter& out) {
+        out.putVarint(table->size());
+        table->forEach([&](const PackedKey& key, const V& val) {
+          out.putKey(key);
+          out.put(val);
+        });
+      },
+      [table](StateReader& in) {
+        table->clear();
+        uint64_t n = in.varint();
+        for (uint64_t i = 0; i < n; i++) {
+          PackedKey key = in.key();
+          *table->findOrInsert(key).first = in.get<V>();
+        }
+      });
+}
+
+// Builds stage with every stateful stage in it registered with registry,
+// under name. A stage built more than once under one name is told apart by
+// the order of building, which must then be the same in the process that
+// restores the snapshot.
+OpCreator checkpointedCreator(string name, OpCreator stage,
+                              CheckpointRegistry& registry);
+DblOpCreator checkpointedCreator(string name, DblOpCreator stage,
+                                 CheckpointRegistry& registry);
+
+#endif  // CHECKPOINT_H
@@ -0,0 +1,163 @@
+#include "concurrent_table.hpp"
+
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Waits out another thread's claim of a slot, which lasts only as long as
+// writing one key.
+inline void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#endif
+}
+
+}  // namespace
+
+int64_t AtomicReduction::identity() const {
+  switch (op) {
+    case Op::Min:
+      return numeric_limits<int64_t>::max();
+    case Op::Max:
+      return numeric_limits<int64_t>::min();
+    default:
+      return 0;
+  }
+}
+
+int64_t AtomicReduction::combine(int64_t a, int64_t b) const {
+  switch (op) {
+    case Op::Add:
+      return a + b;
+    case Op::Min:
+      return b < a ? b : a;
+    case Op::Max:
+      return b > a ? b : a;
+    case Op::Or:
+      return a | b;
+  }
+  return a;
+}
+
+void AtomicReduction::apply(atomic<int64_t>& cell, int64_t val) const {
+  switch (op) {
+    case Op::Add:
+      cell.fetch_add(val, memory_order_relaxed);
+      return;
+    case Op::Or:
+      cell.fetch_or(val, memory_order_relaxed);
+      return;
+    case Op::Min:
+    case Op::Max: {
+      int64_t now = cell.load(memory_order_relaxed);
+      while (combine(now, val) != now &&
+             !cell.compare_exchange_weak(now, combine(now, val),
+                                         memory_order_relaxed)) {
+      }
+      return;
+    }
+  }
+}
+
+ConcurrentAggTable::ConcurrentAggTable(size_t expected,
+                                       AtomicReduction reduction)
+    : fold(reduction) {
+  size_t cap = 16;
+  while (cap < expected * 2) {
+    cap *= 2;
+  }
+  slots.reset(new Slot[cap]);
+  mask = cap - 1;
+  shift = 64 - __builtin_ctzll(cap);
+  // Linear probing stays short up to three quarters full; writers racing
+  // past the limit overshoot it by at most one group each.
+  limit = cap / 4 * 3;
+}
+
+ConcurrentAggTable::Slot* ConcurrentAggTable::findOrInsert(
+    const PackedKey& key, size_t hash) {
+  uint64_t tag = tagOf(hash);
+  for (size_t pos = home(hash);; pos = (pos + 1) & mask) {
+    Slot& slot = slots[pos];
+    uint64_t seen = slot.tag.load(memory_order_acquire);
+    if (seen == 0) {
+      if (count.load(memory_order_relaxed) >= limit) {
+        return nullptr;
+      }
+      if (slot.tag.compare_exchange_strong(seen, kClaimed,
+                                           memory_order_acquire)) {
+        slot.key = key;
+        slot.value.store(fold.identity(), memory_order_relaxed);
+        slot.tag.store(tag, memory_order_release);
+        count.fetch_add(1, memory_order_relaxed);
+        return &slot;
+      }
+    }
+    while (seen == kClaimed) {
+      relax();
+      seen = slot.tag.load(memory_order_acquire);
+    }
+    if (seen == tag && slot.key == key) {
+      return &slot;
+    }
+  }
+}
+
+ConcurrentAggTable::Slot* ConcurrentAggTable::find(const PackedKey& key,
+                                                   size_t hash) {
+  uint64_t tag = tagOf(hash);
+  for (size_t pos = home(hash);; pos = (pos + 1) & mask) {
+    Slot& slot = slots[pos];
+    uint64_t seen = slot.tag.load(memory_order_relaxed);
+    if (seen == 0) {
+      return nullptr;
+    }
+    if (seen == tag && slot.key == key) {
+      return &slot;
+    }
+  }
+}
+
+ConcurrentAggWriter::ConcurrentAggWriter(ConcurrentAggTable& table,
+                                         size_t combineSlots)
+    : table(table) {
+  size_t n = 1;
+  while (n < combineSlots) {
+    n *= 2;
+  }
+  buffer.resize(n);
+  bufferMask = n - 1;
+}
+
+void ConcurrentAggWriter::miss(Pending& entry, const PackedKey& key,
+                               size_t hash, int64_t val) {
+  const AtomicReduction& fold = table.reduction();
+  ConcurrentAggTable::Slot* slot = table.findOrInsert(key, hash);
+  if (slot == nullptr) {
+    auto [cell, inserted] = spill.findOrInsertHashed(key, hash);
+    *cell = fold.combine(inserted ? fold.identity() : *cell, val);
+    return;
+  }
+  if (entry.slot != nullptr) {
+    fold.apply(entry.slot->value, entry.delta);
+    applied++;
+  }
+  entry.slot = slot;
+  entry.hash = hash;
+  entry.delta = val;
+}
+
+void ConcurrentAggWriter::flush() {
+  const AtomicReduction& fold = table.reduction();
+  for (Pending& entry : buffer) {
+    if (entry.slot != nullptr) {
+      fold.apply(entry.slot->value, entry.delta);
+      applied++;
+      entry = Pending();
+    }
+  }
+}
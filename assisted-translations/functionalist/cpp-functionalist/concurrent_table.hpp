@@ -0,0 +1,219 @@
+#ifndef CONCURRENT_TABLE_H
+#define CONCURRENT_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "flat_table.hpp"
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// A groupby table shared by several threads, for aggregations whose fold is
+// one atomic instruction, so that no key needs to be routed to any one
+// thread: see concurrentGroupbyCreator in shard.hpp.
+
+// The folds a ConcurrentAggTable applies to a group's 64-bit value. Each is
+// associative and commutative, so partial values gathered on different
+// threads combine into what one thread folding every tuple would have got.
+struct AtomicReduction {
+  enum class Op : uint8_t { Add, Min, Max, Or };
+
+  Op op = Op::Add;
+  // The integer field each tuple contributes; each tuple contributes 1 when
+  // unset.
+  optional<FieldId> field;
+
+  // counter.
+  static AtomicReduction count() { return AtomicReduction(); }
+  // sumInts over key, except that every tuple's value is added: which tuple
+  // of a group came first is not defined across threads, so it cannot be
+  // left out as sumInts leaves it.
+  static AtomicReduction sum(const string& key) {
+    return {Op::Add, internField(key)};
+  }
+  static AtomicReduction min(const string& key) {
+    return {Op::Min, internField(key)};
+  }
+  static AtomicReduction max(const string& key) {
+    return {Op::Max, internField(key)};
+  }
+  static AtomicReduction bitOr(const string& key) {
+    return {Op::Or, internField(key)};
+  }
+
+  int64_t valueOf(const Headers& headers) const {
+    return field ? headers.at(*field).asInt() : 1;
+  }
+  // The value of a group no tuple has been folded into.
+  int64_t identity() const;
+  int64_t combine(int64_t a, int64_t b) const;
+  // combine(cell, val) into cell, atomically.
+  void apply(atomic<int64_t>& cell, int64_t val) const;
+};
+
+class ConcurrentAggWriter;
+
+// Open-addressing table with linear probing whose inserts and updates are
+// lock-free, for any number of writer threads at once. A slot is claimed by
+// a compare-and-swap on its tag, its key written and the tag then published
+// with a release store, so a reader that finds the tag finds the key; slots
+// are never freed within an epoch, so a probe that reaches an empty slot has
+// seen every slot the key could be in. The table does not grow: once it
+// holds maxGroups() groups, inserts fail and writers keep further groups
+// to themselves. Slots fill a cache line each, so that writers updating
+// different groups do not contend.
+class ConcurrentAggTable {
+ public:
+  struct alignas(64) Slot {
+    // 0 while empty, kClaimed while its key is written, then the tag of the
+    // key's hash.
+    atomic<uint64_t> tag{0};
+    atomic<int64_t> value{0};
+    PackedKey key;
+  };
+
+  // Room for expected groups at half load.
+  ConcurrentAggTable(size_t expected, AtomicReduction reduction);
+
+  // The slot of key, of PackedKeyHash hash, claimed at the identity if
+  // absent; null if absent and the table is full. Safe from any thread.
+  Slot* findOrInsert(const PackedKey& key, size_t hash);
+  // Starts fetching the slot a key of hash starts probing at.
+  void prefetch(size_t hash) const { __builtin_prefetch(&slots[home(hash)]); }
+
+  // Visits every group and empties the table, as well as every writer's
+  // overflow, each group once with every thread's share combined. Not safe
+  // while any thread writes.
+  template <typename F>
+  void drain(const vector<ConcurrentAggWriter*>& writers, F f);
+
+  const AtomicReduction& reduction() const { return fold; }
+  size_t size() const { return count.load(memory_order_relaxed); }
+  size_t maxGroups() const { return limit; }
+  size_t bytes() const { return (mask + 1) * sizeof(Slot); }
+
+ private:
+  static constexpr uint64_t kClaimed = 2;
+
+  AtomicReduction fold;
+  unique_ptr<Slot[]> slots;
+  size_t mask;
+  int shift;
+  size_t limit;
+  atomic<size_t> count{0};
+
+  // Odd, so never 0 or kClaimed.
+  static uint64_t tagOf(size_t hash) {
+    return static_cast<uint64_t>(hash) | 1;
+  }
+  size_t home(size_t hash) const {
+    return static_cast<size_t>(
+        (static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >> shift);
+  }
+  // Lookup only, for drain.
+  Slot* find(const PackedKey& key, size_t hash);
+};
+
+// One thread's writes to a ConcurrentAggTable. Updates pass through a small
+// direct-mapped combining buffer of the thread's own, so that a hot group,
+// such as the single group of a count of everything, costs an atomic
+// instruction only when it is evicted or flushed rather than on every tuple.
+// Groups the table has no room for are kept in an overflow table of the
+// thread's own. Used by one thread at a time.
+class ConcurrentAggWriter {
+ public:
+  // combineSlots is rounded up to a power of two.
+  ConcurrentAggWriter(ConcurrentAggTable& table, size_t combineSlots);
+
+  void add(const PackedKey& key, size_t hash, int64_t val) {
+    Pending& entry = buffer[static_cast<size_t>(hash) & bufferMask];
+    if (entry.slot != nullptr && entry.hash == hash &&
+        entry.slot->key == key) {
+      entry.delta = table.reduction().combine(entry.delta, val);
+      combined++;
+      return;
+    }
+    miss(entry, key, hash, val);
+  }
+  // add over keys[0, n), with the combining buffer entry and the table slot
+  // of each key prefetched kProbePrefetchDistance keys ahead of its add.
+  void addBatch(const PackedKey* keys, const size_t* hashes,
+                const int64_t* vals, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      if (i + kProbePrefetchDistance < n) {
+        size_t ahead = hashes[i + kProbePrefetchDistance];
+        __builtin_prefetch(&buffer[ahead & bufferMask]);
+        table.prefetch(ahead);
+      }
+      add(keys[i], hashes[i], vals[i]);
+    }
+  }
+  // Applies every buffered update to the table; the thread's writes are
+  // then all in the table or its overflow.
+  void flush();
+
+  using Overflow = FlatTable<PackedKey, int64_t, PackedKeyHash>;
+  Overflow& overflow() { return spill; }
+
+  // Updates folded in the buffer, and applied to the table, since the
+  // writer was made.
+  uint64_t combinedUpdates() const { return combined; }
+  uint64_t atomicUpdates() const { return applied; }
+
+ private:
+  struct Pending {
+    ConcurrentAggTable::Slot* slot = nullptr;
+    uint64_t hash = 0;
+    int64_t delta = 0;
+  };
+
+  ConcurrentAggTable& table;
+  vector<Pending> buffer;
+  size_t bufferMask;
+  Overflow spill;
+  uint64_t combined = 0;
+  uint64_t applied = 0;
+
+  void miss(Pending& entry, const PackedKey& key, size_t hash, int64_t val);
+};
+
+template <typename F>
+void ConcurrentAggTable::drain(const vector<ConcurrentAggWriter*>& writers,
+                               F f) {
+  // Groups in an overflow that the table also holds are folded into the
+  // table; the rest are gathered in extra, across writers.
+  ConcurrentAggWriter::Overflow extra;
+  PackedKeyHash hasher;
+  for (ConcurrentAggWriter* writer : writers) {
+    writer->overflow().forEach([&](const PackedKey& key, int64_t val) {
+      Slot* slot = find(key, hasher(key));
+      if (slot != nullptr) {
+        int64_t now = slot->value.load(memory_order_relaxed);
+        slot->value.store(fold.combine(now, val), memory_order_relaxed);
+        return;
+      }
+      auto [cell, inserted] = extra.findOrInsert(key);
+      *cell = fold.combine(inserted ? fold.identity() : *cell, val);
+    });
+    writer->overflow().clear();
+  }
+
+  for (size_t i = 0; i <= mask; i++) {
+    Slot& slot = slots[i];
+    if (slot.tag.load(memory_order_relaxed) != 0) {
+      f(slot.key, slot.value.load(memory_order_relaxed));
+      slot.tag.store(0, memory_order_relaxed);
+    }
+  }
+  count.store(0, memory_order_relaxed);
+  extra.forEach(f);
+}
+
+#endif  // CONCURRENT_TABLE_H
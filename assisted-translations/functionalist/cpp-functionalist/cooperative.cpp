@@ -0,0 +1,164 @@
+#include "cooperative.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "ring.hpp"
+
+CoopScheduler::CoopScheduler(shared_ptr<CoopStats> stats)
+    : stats(stats ? move(stats) : make_shared<CoopStats>()) {}
+
+void CoopScheduler::spawn(Task task) { tasks.push_back(move(task)); }
+
+void CoopScheduler::run(const atomic<bool>* stop) {
+  Backoff backoff;
+  while (!tasks.empty()) {
+    if (stop != nullptr && stop->load(memory_order_relaxed)) {
+      return;
+    }
+    bool progressed = false;
+    for (size_t i = 0; i < tasks.size();) {
+      TaskState state = tasks[i]();
+      stats->steps++;
+      if (state == TaskState::Done) {
+        tasks.erase(tasks.begin() + static_cast<ptrdiff_t>(i));
+        stats->tasksDone++;
+        progressed = true;
+        continue;
+      }
+      progressed |= state == TaskState::Running;
+      i++;
+    }
+    if (progressed) {
+      backoff.reset();
+    } else {
+      stats->idleRounds++;
+      backoff.pause();
+    }
+  }
+}
+
+BatchChannel::BatchChannel(size_t depth) : depth(depth) {
+  if (depth == 0) {
+    throw invalid_argument("Error: a channel needs a nonzero depth");
+  }
+}
+
+size_t BatchChannel::addReader() {
+  cursors.push_back(base + items.size());
+  return cursors.size() - 1;
+}
+
+StreamItem& BatchChannel::append() {
+  if (spare.empty()) {
+    items.push_back(make_unique<StreamItem>());
+  } else {
+    items.push_back(move(spare.back()));
+    spare.pop_back();
+  }
+  StreamItem& item = *items.back();
+  item.hasBatch = false;
+  item.hasReset = false;
+  return item;
+}
+
+void BatchChannel::push(const Batch& batch) {
+  StreamItem& item = append();
+  // Copy-assigning keeps the columns' capacity from the item's last use.
+  item.batch = batch;
+  item.hasBatch = true;
+  recycle();
+}
+
+void BatchChannel::pushReset(const Headers& headers) {
+  // A reset right after a batch that no reader has passed rides with it.
+  bool unread = !items.empty() && items.back()->hasBatch &&
+                !items.back()->hasReset &&
+                all_of(cursors.begin(), cursors.end(), [this](uint64_t at) {
+                  return at < base + items.size();
+                });
+  StreamItem& item = unread ? *items.back() : append();
+  item.reset = headers;
+  item.hasReset = true;
+  recycle();
+}
+
+bool BatchChannel::full() const { return items.size() >= depth; }
+
+StreamItem* BatchChannel::peek(size_t reader) {
+  uint64_t at = cursors[reader];
+  return at < base + items.size() ? items[at - base].get() : nullptr;
+}
+
+void BatchChannel::take(size_t reader) {
+  cursors[reader]++;
+  recycle();
+}
+
+bool BatchChannel::drained(size_t reader) const {
+  return closed && cursors[reader] == base + items.size();
+}
+
+void BatchChannel::recycle() {
+  uint64_t oldest = base + items.size();
+  for (uint64_t at : cursors) {
+    oldest = min(oldest, at);
+  }
+  while (base < oldest) {
+    spare.push_back(move(items.front()));
+    items.pop_front();
+    base++;
+  }
+}
+
+Task sourceTask(BatchSource source, shared_ptr<BatchChannel> out) {
+  BatchOperator into(
+      [out](Batch& batch) { out->push(batch); },
+      [out](const Headers& headers) { out->pushReset(headers); });
+  return [source, out, into]() {
+    if (out->full()) {
+      return TaskState::Waiting;
+    }
+    if (!source(into)) {
+      out->close();
+      return TaskState::Done;
+    }
+    return TaskState::Running;
+  };
+}
+
+Task operatorTask(shared_ptr<BatchChannel> in, size_t reader,
+                  BatchOperator op, size_t itemsPerStep) {
+  auto saved = make_shared<vector<uint32_t>>();
+  return [in, reader, op, itemsPerStep, saved]() {
+    size_t n = 0;
+    for (; n < itemsPerStep; n++) {
+      StreamItem* item = in->peek(reader);
+      if (item == nullptr) {
+        break;
+      }
+      if (item->hasBatch) {
+        *saved = item->batch.sel;
+        op.next(item->batch);
+        item->batch.sel.swap(*saved);
+      }
+      if (item->hasReset) {
+        op.reset(item->reset);
+      }
+      in->take(reader);
+    }
+    if (n > 0) {
+      return TaskState::Running;
+    }
+    return in->drained(reader) ? TaskState::Done : TaskState::Waiting;
+  };
+}
+
+void spawnStream(CoopScheduler& scheduler, BatchSource source,
+                 const vector<BatchOperator>& ops, size_t depth) {
+  auto channel = make_shared<BatchChannel>(depth);
+  for (const BatchOperator& op : ops) {
+    scheduler.spawn(operatorTask(channel, channel->addReader(), op));
+  }
+  scheduler.spawn(sourceTask(move(source), channel));
+}
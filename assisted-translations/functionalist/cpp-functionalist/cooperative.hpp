@@ -0,0 +1,139 @@
+#ifndef COOPERATIVE_H
+#define COOPERATIVE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+
+using namespace std;
+
+// Cooperative multitasking of sources and queries on one thread. A task is
+// a step function that does a bounded piece of work, such as parsing one
+// window of a file or passing one batch through a query, and says whether
+// it can go on; a CoopScheduler runs the steps of many tasks in turn. A
+// source then yields batches into a BatchChannel instead of owning the loop
+// that drives the queries, and a query waiting on an empty channel, or a
+// source on a full one, gives the thread to the others, so that one thread
+// keeps several sources and queries busy without a thread per stage. Each
+// task keeps its own state between steps, as a coroutine frame would.
+
+enum class TaskState {
+  // Made progress; step again.
+  Running,
+  // Could not go on, for want of input or room for output; step again
+  // later.
+  Waiting,
+  // Finished; never stepped again.
+  Done,
+};
+
+using Task = function<TaskState()>;
+
+struct CoopStats {
+  uint64_t steps = 0;
+  // Rounds in which every task was waiting, so that the thread backed off.
+  uint64_t idleRounds = 0;
+  uint64_t tasksDone = 0;
+};
+
+// Runs tasks round-robin on the calling thread. Not thread-safe: a thread
+// that wants several cores of such tasks runs a scheduler on each.
+class CoopScheduler {
+ public:
+  explicit CoopScheduler(shared_ptr<CoopStats> stats = nullptr);
+
+  void spawn(Task task);
+
+  // Steps every task in turn until all are done or stop is set, backing
+  // off whenever a whole round made no progress. A task that throws stops
+  // the run, and the exception propagates. Tasks that wait on one another
+  // forever make it spin forever.
+  void run(const atomic<bool>* stop = nullptr);
+
+  size_t size() const { return tasks.size(); }
+
+ private:
+  vector<Task> tasks;
+  shared_ptr<CoopStats> stats;
+};
+
+// One unit of a stream: a batch, or a reset, or a batch then a reset.
+struct StreamItem {
+  Batch batch;
+  bool hasBatch = false;
+  bool hasReset = false;
+  Headers reset;
+};
+
+// Batches before a channel counts as full.
+constexpr size_t kDefaultChannelDepth = 4;
+
+// A stream of batches and resets from one producer to any number of readers,
+// all tasks of one scheduler, so that no lock is taken. Every reader sees
+// every item, in order, and an item is recycled once all of them have
+// passed it. Full while its slowest reader is depth items behind; pushing to
+// a full channel still succeeds, the depth being what producers wait on
+// before taking their next step.
+class BatchChannel {
+ public:
+  explicit BatchChannel(size_t depth = kDefaultChannelDepth);
+
+  // A reader that will see every item from the next one pushed on. Readers
+  // added after the first push miss what went before.
+  size_t addReader();
+
+  // Copies batch, its selection included, to the end of the stream.
+  void push(const Batch& batch);
+  void pushReset(const Headers& headers);
+  // Marks the end of the stream.
+  void close() { closed = true; }
+
+  bool full() const;
+  // The next item for reader, or nullptr when it has seen them all.
+  StreamItem* peek(size_t reader);
+  // Moves reader past the item peek returned.
+  void take(size_t reader);
+  // Whether reader has seen every item there will ever be.
+  bool drained(size_t reader) const;
+
+ private:
+  size_t depth;
+  // Items from sequence number base on.
+  deque<unique_ptr<StreamItem>> items;
+  uint64_t base = 0;
+  vector<uint64_t> cursors;
+  vector<unique_ptr<StreamItem>> spare;
+  bool closed = false;
+
+  StreamItem& append();
+  void recycle();
+};
+
+// A source in steps: each call passes a bounded amount of input, such as one
+// parsed chunk of a file, to op, and returns false once the input is used
+// up, the end of stream reset included.
+using BatchSource = function<bool(const BatchOperator& op)>;
+
+// Steps source whenever out has room, and closes out after its last step.
+Task sourceTask(BatchSource source, shared_ptr<BatchChannel> out);
+
+// Passes up to itemsPerStep items of in a step to op, as reader reader of
+// it, until in is drained. A batch reaches op with its selection restored
+// afterwards, so that every reader of the channel sees it whole.
+Task operatorTask(shared_ptr<BatchChannel> in, size_t reader,
+                  BatchOperator op, size_t itemsPerStep = 1);
+
+// The usual wiring: a source task feeding a new channel, and one operator
+// task per op reading it.
+void spawnStream(CoopScheduler& scheduler, BatchSource source,
+                 const vector<BatchOperator>& ops,
+                 size_t depth = kDefaultChannelDepth);
+
+#endif  // COOPERATIVE_H
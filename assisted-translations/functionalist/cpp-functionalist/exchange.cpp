@@ -0,0 +1,240 @@
+#include "exchange.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "ring.hpp"
+
+namespace {
+
+struct ExchangeMessage {
+  enum class Kind { Tuples, Reset, Stop };
+
+  Kind kind = Kind::Tuples;
+  size_t producer = 0;
+  vector<Headers> tuples;
+  Headers headers;
+};
+
+// State shared by the producer endpoints and the consumer thread of one
+// exchange. Emptied chunks go back to their producer through a ring of its
+// own, so that in steady state no chunk is allocated.
+template <typename Ring>
+class ExchangeState {
+ public:
+  ExchangeState(size_t numProducers, Operator nextOp, ExchangeOptions options)
+      : options(options), nextOp(move(nextOp)), ring(options.capacity) {
+    if (numProducers == 0) {
+      throw invalid_argument("Error: an exchange needs at least one producer");
+    }
+    if (options.chunkSize == 0) {
+      throw invalid_argument("Error: exchange chunks need a nonzero size");
+    }
+    for (size_t i = 0; i < numProducers; i++) {
+      producers.push_back(make_unique<Producer>(options));
+    }
+    consumer = thread([this]() { run(); });
+  }
+
+  ~ExchangeState() {
+    ExchangeMessage stop;
+    stop.kind = ExchangeMessage::Kind::Stop;
+    ring.push(move(stop));
+    consumer.join();
+  }
+
+  ExchangeState(const ExchangeState&) = delete;
+  ExchangeState& operator=(const ExchangeState&) = delete;
+
+  void next(size_t producer, const Headers& headers) {
+    checkFailed();
+    Producer& p = *producers[producer];
+    p.pending.push_back(headers);
+    if (p.pending.size() >= options.chunkSize) {
+      flush(producer);
+    }
+  }
+
+  void reset(size_t producer, const Headers& headers) {
+    checkFailed();
+    flush(producer);
+    ExchangeMessage msg;
+    msg.kind = ExchangeMessage::Kind::Reset;
+    msg.producer = producer;
+    msg.headers = headers;
+    ring.push(move(msg));
+  }
+
+ private:
+  struct Producer {
+    // Touched by the producing thread only.
+    vector<Headers> pending;
+    SpscRing<vector<Headers>> recycled;
+
+    // Touched by the consumer thread only.
+    bool waiting = false;
+    Headers resetHeaders;
+    deque<ExchangeMessage> held;
+
+    explicit Producer(const ExchangeOptions& options)
+        : recycled(options.capacity + 1) {
+      pending.reserve(options.chunkSize);
+    }
+  };
+
+  ExchangeOptions options;
+  Operator nextOp;
+  Ring ring;
+  vector<unique_ptr<Producer>> producers;
+  size_t waitingCount = 0;
+  atomic<bool> failed{false};
+  exception_ptr error;
+  thread consumer;
+
+  void checkFailed() {
+    if (failed.load(memory_order_acquire)) {
+      rethrow_exception(error);
+    }
+  }
+
+  void fail(exception_ptr e) {
+    if (!failed.load(memory_order_relaxed)) {
+      error = e;
+      failed.store(true, memory_order_release);
+    }
+  }
+
+  void flush(size_t producer) {
+    Producer& p = *producers[producer];
+    if (p.pending.empty()) {
+      return;
+    }
+    ExchangeMessage msg;
+    msg.producer = producer;
+    if (!p.recycled.tryPop(msg.tuples)) {
+      msg.tuples.reserve(options.chunkSize);
+    }
+    swap(msg.tuples, p.pending);
+    ring.push(move(msg));
+  }
+
+  void run() {
+    if (options.cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(options.cpu, &cpus);
+      int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+      if (err != 0) {
+        fail(make_exception_ptr(runtime_error(
+            "Error: could not pin exchange thread to CPU " +
+            to_string(options.cpu) + ": " + strerror(err))));
+      }
+    }
+
+    ExchangeMessage msg;
+    for (;;) {
+      ring.pop(msg);
+      if (msg.kind == ExchangeMessage::Kind::Stop) {
+        return;
+      }
+      handle(msg);
+      release();
+    }
+  }
+
+  // After a failure downstream is not called again; messages are still
+  // drained so that producers never block on a dead consumer.
+  void handle(ExchangeMessage& msg) {
+    Producer& p = *producers[msg.producer];
+    if (p.waiting) {
+      p.held.push_back(move(msg));
+      return;
+    }
+    if (msg.kind == ExchangeMessage::Kind::Tuples) {
+      if (!failed.load(memory_order_relaxed)) {
+        try {
+          for (const Headers& headers : msg.tuples) {
+            nextOp.next(headers);
+          }
+        } catch (...) {
+          fail(current_exception());
+        }
+      }
+      msg.tuples.clear();
+      p.recycled.tryPush(move(msg.tuples));
+    } else {
+      p.waiting = true;
+      p.resetHeaders = msg.headers;
+      waitingCount++;
+    }
+  }
+
+  // Passes on every reset all producers have reached, replaying what each
+  // of them sent after it.
+  void release() {
+    while (waitingCount == producers.size()) {
+      if (!failed.load(memory_order_relaxed)) {
+        try {
+          nextOp.reset(producers[0]->resetHeaders);
+        } catch (...) {
+          fail(current_exception());
+        }
+      }
+      waitingCount = 0;
+      for (auto& p : producers) {
+        p->waiting = false;
+      }
+      for (auto& p : producers) {
+        while (!p->waiting && !p->held.empty()) {
+          ExchangeMessage held = move(p->held.front());
+          p->held.pop_front();
+          handle(held);
+        }
+      }
+    }
+  }
+};
+
+template <typename Ring>
+Operator exchangeEndpoint(shared_ptr<ExchangeState<Ring>> state,
+                          size_t producer) {
+  OpFunc next = [state, producer](const Headers& headers) {
+    state->next(producer, headers);
+  };
+
+  OpFunc reset = [state, producer](const Headers& headers) {
+    state->reset(producer, headers);
+  };
+
+  return Operator(next, reset);
+}
+
+}  // namespace
+
+OpCreator exchangeCreator(ExchangeOptions options) {
+  return [options](Operator nextOp) {
+    auto state = make_shared<ExchangeState<SpscRing<ExchangeMessage>>>(
+        1, move(nextOp), options);
+    return exchangeEndpoint(state, 0);
+  };
+}
+
+vector<Operator> mergeExchange(size_t numProducers, Operator nextOp,
+                               ExchangeOptions options) {
+  auto state = make_shared<ExchangeState<MpscRing<ExchangeMessage>>>(
+      numProducers, move(nextOp), options);
+  vector<Operator> endpoints;
+  for (size_t i = 0; i < numProducers; i++) {
+    endpoints.push_back(exchangeEndpoint(state, i));
+  }
+  return endpoints;
+}
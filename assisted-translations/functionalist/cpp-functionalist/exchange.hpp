@@ -0,0 +1,38 @@
+#ifndef EXCHANGE_H
+#define EXCHANGE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "utils.hpp"
+
+using namespace std;
+
+struct ExchangeOptions {
+  // Chunks that may be in flight before producers block.
+  size_t capacity = 64;
+  // Tuples per chunk; a reset always ends the current chunk early.
+  size_t chunkSize = 256;
+  // Pins the consumer thread to this CPU when nonnegative.
+  int cpu = -1;
+};
+
+// A thread boundary between two stages. Tuples are gathered into chunks on
+// the calling thread and handed through a lock-free ring to a dedicated
+// consumer thread that runs everything downstream; resets travel through the
+// same ring, so they reach nextOp in order with the tuples around them. A
+// full ring blocks the producer. The consumer drains the ring and exits when
+// the last copy of the operator is dropped, which has to happen on the
+// producing thread. An exception from downstream is rethrown by the next
+// call on the producing side.
+OpCreator exchangeCreator(ExchangeOptions options = ExchangeOptions());
+
+// The many-to-one form of exchangeCreator: returns numProducers operators,
+// each of which may be driven by a thread of its own, feeding nextOp on one
+// consumer thread. A reset is passed on once every producer has sent it,
+// with the first producer's headers; tuples a producer sends after its reset
+// are held back until then, so the epochs of different producers line up.
+vector<Operator> mergeExchange(size_t numProducers, Operator nextOp,
+                               ExchangeOptions options = ExchangeOptions());
+
+#endif  // EXCHANGE_H
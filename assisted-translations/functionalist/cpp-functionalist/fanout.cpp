@@ -0,0 +1,185 @@
+#include "fanout.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+using Chunk = shared_ptr<const vector<Headers>>;
+
+// Counts the chunks still referenced by some consumer.
+struct FanoutFlow {
+  mutex lock;
+  condition_variable drained;
+  size_t inFlight = 0;
+};
+
+struct FanoutItem {
+  Chunk chunk;
+  bool reset = false;
+  Headers headers;
+};
+
+// One consumer and the queue of work waiting for it. At most one pool task
+// drains the queue at a time, which keeps the consumer's input in order.
+struct FanoutConsumer {
+  Operator op;
+  mutex lock;
+  deque<FanoutItem> queue;
+  bool scheduled = false;
+  bool failed = false;
+
+  explicit FanoutConsumer(Operator op) : op(move(op)) {}
+};
+
+struct FanoutState {
+  WorkStealingPool& pool;
+  FanoutOptions options;
+  vector<unique_ptr<FanoutConsumer>> consumers;
+  shared_ptr<FanoutFlow> flow = make_shared<FanoutFlow>();
+  vector<Headers> pending;
+
+  FanoutState(WorkStealingPool& pool, FanoutOptions options)
+      : pool(pool), options(options) {}
+};
+
+void drain(const shared_ptr<FanoutState>& state, size_t index) {
+  FanoutConsumer& consumer = *state->consumers[index];
+  exception_ptr error;
+  deque<FanoutItem> work;
+  for (;;) {
+    {
+      lock_guard<mutex> guard(consumer.lock);
+      if (consumer.queue.empty()) {
+        consumer.scheduled = false;
+        break;
+      }
+      work.swap(consumer.queue);
+    }
+    for (FanoutItem& item : work) {
+      if (consumer.failed) {
+        continue;
+      }
+      try {
+        if (item.reset) {
+          consumer.op.reset(item.headers);
+        } else {
+          for (const Headers& headers : *item.chunk) {
+            consumer.op.next(headers);
+          }
+        }
+      } catch (...) {
+        // The consumer's state is unknown from here on, so it is fed
+        // nothing more; the pool reports the error from wait().
+        consumer.failed = true;
+        error = current_exception();
+      }
+    }
+    work.clear();
+  }
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+void post(const shared_ptr<FanoutState>& state, const FanoutItem& item) {
+  for (size_t i = 0; i < state->consumers.size(); i++) {
+    FanoutConsumer& consumer = *state->consumers[i];
+    bool schedule;
+    {
+      lock_guard<mutex> guard(consumer.lock);
+      consumer.queue.push_back(item);
+      schedule = !consumer.scheduled;
+      consumer.scheduled = true;
+    }
+    if (schedule) {
+      state->pool.submit([state, i]() { drain(state, i); });
+    }
+  }
+}
+
+void flush(const shared_ptr<FanoutState>& state) {
+  if (state->pending.empty()) {
+    return;
+  }
+  shared_ptr<FanoutFlow> flow = state->flow;
+  {
+    unique_lock<mutex> guard(flow->lock);
+    flow->drained.wait(guard, [&flow, &state]() {
+      return flow->inFlight < state->options.maxInFlight;
+    });
+    flow->inFlight++;
+  }
+
+  // The last consumer to drop the chunk frees it and makes room for another.
+  FanoutItem item;
+  item.chunk = Chunk(new vector<Headers>(move(state->pending)),
+                     [flow](const vector<Headers>* chunk) {
+                       delete chunk;
+                       {
+                         lock_guard<mutex> guard(flow->lock);
+                         flow->inFlight--;
+                       }
+                       flow->drained.notify_one();
+                     });
+  state->pending.clear();
+  state->pending.reserve(state->options.chunkSize);
+  post(state, item);
+}
+
+// Held only by the copies of the operator parallelFanout returns, not by the
+// pool tasks, so that dropping the last copy hands on the tuples still being
+// gathered.
+struct FanoutInput {
+  shared_ptr<FanoutState> state;
+
+  explicit FanoutInput(shared_ptr<FanoutState> state) : state(move(state)) {}
+  ~FanoutInput() { flush(state); }
+};
+
+}  // namespace
+
+Operator parallelFanout(vector<Operator> ops, WorkStealingPool& pool,
+                        FanoutOptions options) {
+  if (options.chunkSize == 0 || options.maxInFlight == 0) {
+    throw invalid_argument(
+        "Error: fanout chunk size and in-flight limit must be nonzero");
+  }
+  auto state = make_shared<FanoutState>(pool, options);
+  for (Operator& op : ops) {
+    state->consumers.push_back(make_unique<FanoutConsumer>(move(op)));
+  }
+  state->pending.reserve(options.chunkSize);
+  auto input = make_shared<FanoutInput>(state);
+
+  OpFunc next = [input](const Headers& headers) {
+    FanoutState& state = *input->state;
+    state.pending.push_back(headers);
+    if (state.pending.size() >= state.options.chunkSize) {
+      flush(input->state);
+    }
+  };
+
+  OpFunc reset = [input](const Headers& headers) {
+    flush(input->state);
+    FanoutItem item;
+    item.reset = true;
+    item.headers = headers;
+    post(input->state, item);
+  };
+
+  return Operator(next, reset);
+}
+
+DblOpAcceptorOpCreator parallelSplit(WorkStealingPool& pool,
+                                     FanoutOptions options) {
+  return [&pool, options](pair<Operator, Operator> nextOps) {
+    return parallelFanout({move(nextOps.first), move(nextOps.second)}, pool,
+                          options);
+  };
+}
@@ -0,0 +1,38 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <cstddef>
+#include <vector>
+
+#include "builtins.hpp"
+#include "utils.hpp"
+#include "work_pool.hpp"
+
+using namespace std;
+
+struct FanoutOptions {
+  // Tuples gathered before a chunk is handed to the consumers; a reset
+  // always ends the current chunk early.
+  size_t chunkSize = 256;
+  // Chunks that may be waiting for some consumer before the caller blocks.
+  size_t maxInFlight = 64;
+};
+
+// Broadcasts every tuple to each of ops, running the ops as tasks on pool so
+// that they proceed in parallel. Tuples are copied once into a chunk that all
+// consumers read through the const reference they already take. Each
+// consumer sees its chunks and resets exactly in the order they arrived and
+// never runs on two threads at once, but consumers are not synchronised with
+// one another or with the caller. Dropping the last copy of the operator
+// hands on the tuples it is still gathering; after that, pool.wait() returns
+// once everything passed in has been processed. pool must outlive the
+// operator, and the ops must not share state, so the two inputs of a join
+// cannot be fanned out this way.
+Operator parallelFanout(vector<Operator> ops, WorkStealingPool& pool,
+                        FanoutOptions options = FanoutOptions());
+
+// split() with its two branches run by parallelFanout.
+DblOpAcceptorOpCreator parallelSplit(WorkStealingPool& pool,
+                                     FanoutOptions options = FanoutOptions());
+
+#endif  // FANOUT_H
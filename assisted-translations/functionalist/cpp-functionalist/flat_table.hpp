@@ -0,0 +1,285 @@
+#ifndef FLAT_TABLE_H
+#define FLAT_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// How far ahead of the key being probed findOrInsertBatch prefetches: far
+// enough that a line fetched from memory arrives before the probe reaches
+// it, near enough that the lines in flight stay in L1.
+constexpr size_t kProbePrefetchDistance = 8;
+
+// Open-addressing hash table with Robin Hood probing. Entries live densely,
+// in insertion order, in an append-only array that acts as a per-epoch arena;
+// the probed index holds only 8-byte slots pointing into it. Inserts never
+// allocate once the table has grown to its working size, growing rehashes
+// the index without moving any entry, and iteration touches live entries
+// only. clear() is constant time: it rewinds the arena and bumps a
+// generation stamp that turns every index slot stale at once, keeping all
+// memory for the next epoch. K and V must be default constructible and
+// copyable.
+template <typename K, typename V, typename Hash = hash<K>,
+          typename Eq = equal_to<K>>
+class FlatTable {
+ private:
+  struct Entry {
+    K key;
+    V value;
+  };
+
+  // A slot is live when its generation is the table's; dist is the probe
+  // distance plus one, and tag caches hash bits so that most mismatches are
+  // rejected without touching the entry.
+  struct Slot {
+    uint32_t index;
+    uint16_t tag;
+    uint8_t dist;
+    uint8_t generation;
+  };
+
+  vector<Slot> slots;
+  vector<Entry> entries;
+  size_t count = 0;
+  size_t mask = 0;
+  int shift = 64;
+  uint8_t generation = 1;
+  Hash hasher;
+  Eq eq;
+
+  static size_t capacityFor(size_t expected) {
+    size_t cap = 16;
+    while (cap * 7 / 8 < expected) {
+      cap *= 2;
+    }
+    return cap;
+  }
+
+  // Fibonacci hashing, so that weak hashes such as the identity hash of
+  // std::hash<int> still spread over the table. The top bits pick the home
+  // slot and the bits below them make the tag.
+  static uint64_t spreadHash(size_t hash) {
+    return static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL;
+  }
+  uint64_t spread(const K& key) const { return spreadHash(hasher(key)); }
+  size_t home(uint64_t h) const { return static_cast<size_t>(h >> shift); }
+  static uint16_t tagOf(uint64_t h) { return static_cast<uint16_t>(h >> 32); }
+
+  uint8_t distAt(size_t pos) const {
+    return slots[pos].generation == generation ? slots[pos].dist : 0;
+  }
+
+  void setCapacity(size_t cap) {
+    slots.assign(cap, Slot{0, 0, 0, 0});
+    generation = 1;
+    mask = cap - 1;
+    shift = 64 - __builtin_ctzll(cap);
+  }
+
+  void grow() {
+    setCapacity((mask + 1) * 2);
+    for (size_t i = 0; i < count; i++) {
+      place(static_cast<uint32_t>(i), spread(entries[i].key));
+    }
+  }
+
+  // Indexes the entry at index, known to be absent from the index.
+  void place(uint32_t index, uint64_t h) {
+    Slot slot{index, tagOf(h), 1, generation};
+    size_t pos = home(h);
+    while (true) {
+      uint8_t d = distAt(pos);
+      if (d == 0) {
+        slots[pos] = slot;
+        return;
+      }
+      if (d < slot.dist) {
+        // Steal the slot from the richer entry and keep placing that one.
+        swap(slot, slots[pos]);
+      }
+      pos = (pos + 1) & mask;
+      if (++slot.dist == UINT8_MAX) {
+        throw length_error("Error: FlatTable probe sequence too long");
+      }
+    }
+  }
+
+  // Starts fetching the entry of the first slot of h's probe whose tag
+  // matches, where a hit most likely is, once that slot is cached.
+  void prefetchEntry(size_t hash) const {
+    uint64_t h = spreadHash(hash);
+    const Slot& slot = slots[home(h)];
+    if (slot.generation == generation && slot.tag == tagOf(h) &&
+        slot.index < entries.size()) {
+      __builtin_prefetch(&entries[slot.index]);
+    }
+  }
+
+  size_t findSlot(const K& key, uint64_t h) const {
+    size_t pos = home(h);
+    uint16_t tag = tagOf(h);
+    for (uint8_t d = 1; distAt(pos) >= d; d++) {
+      const Slot& slot = slots[pos];
+      if (slot.dist == d && slot.tag == tag &&
+          eq(entries[slot.index].key, key)) {
+        return pos;
+      }
+      pos = (pos + 1) & mask;
+    }
+    return SIZE_MAX;
+  }
+
+ public:
+  // What one more key costs a table grown to hold it: its entry and about
+  // two index slots, the index being kept between 7/16 and 7/8 full.
+  static constexpr size_t kBytesPerKey = sizeof(Entry) + 2 * sizeof(Slot);
+
+  explicit FlatTable(size_t expected = 16) {
+    setCapacity(capacityFor(expected));
+    entries.reserve(expected);
+  }
+
+  V* find(const K& key) {
+    size_t pos = findSlot(key, spread(key));
+    return pos == SIZE_MAX ? nullptr : &entries[slots[pos].index].value;
+  }
+
+  const V* find(const K& key) const {
+    size_t pos = findSlot(key, spread(key));
+    return pos == SIZE_MAX ? nullptr : &entries[slots[pos].index].value;
+  }
+
+  // find for callers that already hold Hash()(key), as findOrInsertHashed.
+  V* findHashed(const K& key, size_t hash) {
+    size_t pos = findSlot(key, spreadHash(hash));
+    return pos == SIZE_MAX ? nullptr : &entries[slots[pos].index].value;
+  }
+
+  // Returns the value for key, default constructing it if absent; the flag
+  // is true when the key was inserted.
+  pair<V*, bool> findOrInsert(const K& key) {
+    return findOrInsertHashed(key, hasher(key));
+  }
+
+  // findOrInsert for callers that already hold Hash()(key), such as a
+  // KeyProjector; passing any other value corrupts the table.
+  pair<V*, bool> findOrInsertHashed(const K& key, size_t hash) {
+    uint64_t h = spreadHash(hash);
+    size_t pos = findSlot(key, h);
+    if (pos != SIZE_MAX) {
+      return {&entries[slots[pos].index].value, false};
+    }
+    if (count == UINT32_MAX) {
+      throw length_error("Error: FlatTable is full");
+    }
+    if ((count + 1) * 8 > (mask + 1) * 7) {
+      grow();
+    }
+    // Entries left over from earlier epochs are overwritten in place.
+    if (count < entries.size()) {
+      entries[count] = Entry{key, V()};
+    } else {
+      entries.push_back(Entry{key, V()});
+    }
+    place(static_cast<uint32_t>(count), h);
+    return {&entries[count++].value, true};
+  }
+
+  V& operator[](const K& key) { return *findOrInsert(key).first; }
+
+  // Starts fetching the index slot a key of Hash() hash starts probing at.
+  void prefetch(size_t hash) const {
+    __builtin_prefetch(&slots[home(spreadHash(hash))]);
+  }
+
+  // findOrInsertHashed over keys[0, n), calling f(i, value, inserted) for
+  // each in order, with the probes software-pipelined against cache misses:
+  // the index slot of key i + 2d is prefetched, then the entry that slot
+  // points to for key i + d, while key i is probed, d being
+  // kProbePrefetchDistance. Each f sees a value that stays put only until
+  // the next insert, as with findOrInsertHashed.
+  template <typename F>
+  void findOrInsertBatch(const K* keys, const size_t* hashes, size_t n, F f) {
+    constexpr size_t d = kProbePrefetchDistance;
+    for (size_t i = 0; i < n && i < 2 * d; i++) {
+      prefetch(hashes[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (i + 2 * d < n) {
+        prefetch(hashes[i + 2 * d]);
+      }
+      if (i + d < n) {
+        prefetchEntry(hashes[i + d]);
+      }
+      auto [val, inserted] = findOrInsertHashed(keys[i], hashes[i]);
+      f(i, val, inserted);
+    }
+  }
+
+  // Makes room for more new keys without moving any entry, so that the
+  // values findOrInsert points to stay put over the next that many inserts.
+  void reserve(size_t more) { entries.reserve(count + more); }
+
+  bool erase(const K& key) {
+    size_t pos = findSlot(key, spread(key));
+    if (pos == SIZE_MAX) {
+      return false;
+    }
+    uint32_t index = slots[pos].index;
+
+    // Backward-shift the rest of the cluster so no tombstones are needed.
+    size_t next = (pos + 1) & mask;
+    while (distAt(next) > 1) {
+      slots[pos] = slots[next];
+      slots[pos].dist--;
+      pos = next;
+      next = (next + 1) & mask;
+    }
+    slots[pos].dist = 0;
+
+    // Keep the arena dense by moving its last entry into the hole.
+    size_t last = count - 1;
+    if (index != last) {
+      size_t moved = findSlot(entries[last].key, spread(entries[last].key));
+      slots[moved].index = index;
+      entries[index] = move(entries[last]);
+    }
+    entries[last] = Entry();
+    count--;
+    return true;
+  }
+
+  // Visits the live entries in insertion order.
+  template <typename F>
+  void forEach(F f) const {
+    for (size_t i = 0; i < count; i++) {
+      f(entries[i].key, entries[i].value);
+    }
+  }
+
+  // Empties the table but keeps its capacity. Only when the one-byte
+  // generation wraps around does the index need wiping.
+  void clear() {
+    count = 0;
+    if (++generation == 0) {
+      memset(static_cast<void*>(slots.data()), 0,
+             slots.size() * sizeof(Slot));
+      generation = 1;
+    }
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  size_t capacity() const { return mask + 1; }
+  size_t bytes() const {
+    return slots.size() * sizeof(Slot) + entries.capacity() * sizeof(Entry);
+  }
+};
+
+#endif  // FLAT_TABLE_H
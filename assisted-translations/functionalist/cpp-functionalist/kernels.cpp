@@ -0,0 +1,591 @@
+#include "kernels.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNELS_NEON 1
+#endif
+
+namespace {
+
+template <typename T>
+void maskEqScalar(const T* col, size_t n, T mask, T value, uint64_t* out) {
+  for (size_t base = 0; base < n; base += 64) {
+    size_t end = min(n, base + 64);
+    uint64_t bits = 0;
+    for (size_t i = base; i < end; i++) {
+      bits |= static_cast<uint64_t>((col[i] & mask) == value) << (i - base);
+    }
+    out[base / 64] = bits;
+  }
+}
+
+template <typename T>
+void geqScalar(const T* col, size_t n, T threshold, uint64_t* out) {
+  for (size_t base = 0; base < n; base += 64) {
+    size_t end = min(n, base + 64);
+    uint64_t bits = 0;
+    for (size_t i = base; i < end; i++) {
+      bits |= static_cast<uint64_t>(col[i] >= threshold) << (i - base);
+    }
+    out[base / 64] = bits;
+  }
+}
+
+const FilterKernels kScalarKernels = {
+    maskEqScalar<uint8_t>, maskEqScalar<uint16_t>, maskEqScalar<uint32_t>,
+    geqScalar<uint8_t>,    geqScalar<uint16_t>,    geqScalar<uint32_t>,
+};
+
+#ifdef KERNELS_X86
+
+// Each SIMD kernel handles whole 64-row words and leaves the tail, which
+// always starts on a word boundary, to the scalar loop.
+
+__attribute__((target("avx2"))) inline __m256i load256(const void* p) {
+  return _mm256_loadu_si256(static_cast<const __m256i*>(p));
+}
+
+// Packs two 16-lane 16-bit comparison results into 32 bits, in row order.
+__attribute__((target("avx2"))) inline uint32_t movemask16x2(__m256i lo,
+                                                             __m256i hi) {
+  __m256i packed = _mm256_packs_epi16(lo, hi);
+  packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+  return static_cast<uint32_t>(_mm256_movemask_epi8(packed));
+}
+
+__attribute__((target("avx2"))) inline uint32_t movemask32(__m256i cmp) {
+  return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(cmp)));
+}
+
+__attribute__((target("avx2"))) void maskEq8Avx2(const uint8_t* col, size_t n,
+                                                 uint8_t mask, uint8_t value,
+                                                 uint64_t* out) {
+  const __m256i m = _mm256_set1_epi8(static_cast<char>(mask));
+  const __m256i v = _mm256_set1_epi8(static_cast<char>(value));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    __m256i a = _mm256_and_si256(load256(col + base), m);
+    __m256i b = _mm256_and_si256(load256(col + base + 32), m);
+    uint64_t lo = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, v)));
+    uint64_t hi = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, v)));
+    out[base / 64] = lo | (hi << 32);
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+__attribute__((target("avx2"))) void maskEq16Avx2(const uint16_t* col,
+                                                  size_t n, uint16_t mask,
+                                                  uint16_t value,
+                                                  uint64_t* out) {
+  const __m256i m = _mm256_set1_epi16(static_cast<short>(mask));
+  const __m256i v = _mm256_set1_epi16(static_cast<short>(value));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    __m256i c[4];
+    for (int k = 0; k < 4; k++) {
+      c[k] = _mm256_cmpeq_epi16(
+          _mm256_and_si256(load256(col + base + 16 * k), m), v);
+    }
+    uint64_t lo = movemask16x2(c[0], c[1]);
+    uint64_t hi = movemask16x2(c[2], c[3]);
+    out[base / 64] = lo | (hi << 32);
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+__attribute__((target("avx2"))) void maskEq32Avx2(const uint32_t* col,
+                                                  size_t n, uint32_t mask,
+                                                  uint32_t value,
+                                                  uint64_t* out) {
+  const __m256i m = _mm256_set1_epi32(static_cast<int>(mask));
+  const __m256i v = _mm256_set1_epi32(static_cast<int>(value));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+      __m256i a = _mm256_and_si256(load256(col + base + 8 * k), m);
+      bits |= static_cast<uint64_t>(movemask32(_mm256_cmpeq_epi32(a, v)))
+              << (8 * k);
+    }
+    out[base / 64] = bits;
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+// Unsigned x >= t is max(x, t) == x.
+
+__attribute__((target("avx2"))) void geq8Avx2(const uint8_t* col, size_t n,
+                                              uint8_t threshold,
+                                              uint64_t* out) {
+  const __m256i t = _mm256_set1_epi8(static_cast<char>(threshold));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    __m256i a = load256(col + base);
+    __m256i b = load256(col + base + 32);
+    uint64_t lo = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(a, t), a)));
+    uint64_t hi = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(b, t), b)));
+    out[base / 64] = lo | (hi << 32);
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+__attribute__((target("avx2"))) void geq16Avx2(const uint16_t* col, size_t n,
+                                               uint16_t threshold,
+                                               uint64_t* out) {
+  const __m256i t = _mm256_set1_epi16(static_cast<short>(threshold));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    __m256i c[4];
+    for (int k = 0; k < 4; k++) {
+      __m256i a = load256(col + base + 16 * k);
+      c[k] = _mm256_cmpeq_epi16(_mm256_max_epu16(a, t), a);
+    }
+    uint64_t lo = movemask16x2(c[0], c[1]);
+    uint64_t hi = movemask16x2(c[2], c[3]);
+    out[base / 64] = lo | (hi << 32);
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+__attribute__((target("avx2"))) void geq32Avx2(const uint32_t* col, size_t n,
+                                               uint32_t threshold,
+                                               uint64_t* out) {
+  const __m256i t = _mm256_set1_epi32(static_cast<int>(threshold));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+      __m256i a = load256(col + base + 8 * k);
+      bits |= static_cast<uint64_t>(
+                  movemask32(_mm256_cmpeq_epi32(_mm256_max_epu32(a, t), a)))
+              << (8 * k);
+    }
+    out[base / 64] = bits;
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+const FilterKernels kAvx2Kernels = {
+    maskEq8Avx2, maskEq16Avx2, maskEq32Avx2, geq8Avx2, geq16Avx2, geq32Avx2,
+};
+
+// AVX-512BW comparisons yield the bitmap directly as a mask register.
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+
+AVX512_TARGET inline __m512i load512(const void* p) {
+  return _mm512_loadu_si512(p);
+}
+
+AVX512_TARGET void maskEq8Avx512(const uint8_t* col, size_t n, uint8_t mask,
+                                 uint8_t value, uint64_t* out) {
+  const __m512i m = _mm512_set1_epi8(static_cast<char>(mask));
+  const __m512i v = _mm512_set1_epi8(static_cast<char>(value));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    out[base / 64] =
+        _mm512_cmpeq_epi8_mask(_mm512_and_si512(load512(col + base), m), v);
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+AVX512_TARGET void maskEq16Avx512(const uint16_t* col, size_t n,
+                                  uint16_t mask, uint16_t value,
+                                  uint64_t* out) {
+  const __m512i m = _mm512_set1_epi16(static_cast<short>(mask));
+  const __m512i v = _mm512_set1_epi16(static_cast<short>(value));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t lo = _mm512_cmpeq_epi16_mask(
+        _mm512_and_si512(load512(col + base), m), v);
+    uint64_t hi = _mm512_cmpeq_epi16_mask(
+        _mm512_and_si512(load512(col + base + 32), m), v);
+    out[base / 64] = lo | (hi << 32);
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+AVX512_TARGET void maskEq32Avx512(const uint32_t* col, size_t n,
+                                  uint32_t mask, uint32_t value,
+                                  uint64_t* out) {
+  const __m512i m = _mm512_set1_epi32(static_cast<int>(mask));
+  const __m512i v = _mm512_set1_epi32(static_cast<int>(value));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 4; k++) {
+      bits |= static_cast<uint64_t>(_mm512_cmpeq_epi32_mask(
+                  _mm512_and_si512(load512(col + base + 16 * k), m), v))
+              << (16 * k);
+    }
+    out[base / 64] = bits;
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+AVX512_TARGET void geq8Avx512(const uint8_t* col, size_t n, uint8_t threshold,
+                              uint64_t* out) {
+  const __m512i t = _mm512_set1_epi8(static_cast<char>(threshold));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    out[base / 64] = _mm512_cmpge_epu8_mask(load512(col + base), t);
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+AVX512_TARGET void geq16Avx512(const uint16_t* col, size_t n,
+                               uint16_t threshold, uint64_t* out) {
+  const __m512i t = _mm512_set1_epi16(static_cast<short>(threshold));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t lo = _mm512_cmpge_epu16_mask(load512(col + base), t);
+    uint64_t hi = _mm512_cmpge_epu16_mask(load512(col + base + 32), t);
+    out[base / 64] = lo | (hi << 32);
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+AVX512_TARGET void geq32Avx512(const uint32_t* col, size_t n,
+                               uint32_t threshold, uint64_t* out) {
+  const __m512i t = _mm512_set1_epi32(static_cast<int>(threshold));
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 4; k++) {
+      bits |= static_cast<uint64_t>(
+                  _mm512_cmpge_epu32_mask(load512(col + base + 16 * k), t))
+              << (16 * k);
+    }
+    out[base / 64] = bits;
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+#undef AVX512_TARGET
+
+const FilterKernels kAvx512Kernels = {
+    maskEq8Avx512, maskEq16Avx512, maskEq32Avx512,
+    geq8Avx512,    geq16Avx512,    geq32Avx512,
+};
+
+#endif  // KERNELS_X86
+
+#ifdef KERNELS_NEON
+
+// NEON has no movemask; weight each all-ones lane by its bit position and
+// sum across the vector instead.
+inline uint64_t movemask8x8(uint8x8_t cmp) {
+  static const uint8_t weights[8] = {1, 2, 4, 8, 16, 32, 64, 128};
+  return vaddv_u8(vand_u8(cmp, vld1_u8(weights)));
+}
+
+inline uint64_t movemask8x16(uint8x16_t cmp) {
+  return movemask8x8(vget_low_u8(cmp)) |
+         (movemask8x8(vget_high_u8(cmp)) << 8);
+}
+
+inline uint64_t movemask16x8(uint16x8_t cmp) {
+  return movemask8x8(vmovn_u16(cmp));
+}
+
+inline uint64_t movemask32x4x2(uint32x4_t lo, uint32x4_t hi) {
+  return movemask16x8(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+}
+
+void maskEq8Neon(const uint8_t* col, size_t n, uint8_t mask, uint8_t value,
+                 uint64_t* out) {
+  const uint8x16_t m = vdupq_n_u8(mask);
+  const uint8x16_t v = vdupq_n_u8(value);
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 4; k++) {
+      uint8x16_t a = vandq_u8(vld1q_u8(col + base + 16 * k), m);
+      bits |= movemask8x16(vceqq_u8(a, v)) << (16 * k);
+    }
+    out[base / 64] = bits;
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+void maskEq16Neon(const uint16_t* col, size_t n, uint16_t mask,
+                  uint16_t value, uint64_t* out) {
+  const uint16x8_t m = vdupq_n_u16(mask);
+  const uint16x8_t v = vdupq_n_u16(value);
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+      uint16x8_t a = vandq_u16(vld1q_u16(col + base + 8 * k), m);
+      bits |= movemask16x8(vceqq_u16(a, v)) << (8 * k);
+    }
+    out[base / 64] = bits;
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+void maskEq32Neon(const uint32_t* col, size_t n, uint32_t mask,
+                  uint32_t value, uint64_t* out) {
+  const uint32x4_t m = vdupq_n_u32(mask);
+  const uint32x4_t v = vdupq_n_u32(value);
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+      uint32x4_t lo = vandq_u32(vld1q_u32(col + base + 8 * k), m);
+      uint32x4_t hi = vandq_u32(vld1q_u32(col + base + 8 * k + 4), m);
+      bits |= movemask32x4x2(vceqq_u32(lo, v), vceqq_u32(hi, v)) << (8 * k);
+    }
+    out[base / 64] = bits;
+  }
+  maskEqScalar(col + base, n - base, mask, value, out + base / 64);
+}
+
+void geq8Neon(const uint8_t* col, size_t n, uint8_t threshold,
+              uint64_t* out) {
+  const uint8x16_t t = vdupq_n_u8(threshold);
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 4; k++) {
+      bits |= movemask8x16(vcgeq_u8(vld1q_u8(col + base + 16 * k), t))
+              << (16 * k);
+    }
+    out[base / 64] = bits;
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+void geq16Neon(const uint16_t* col, size_t n, uint16_t threshold,
+               uint64_t* out) {
+  const uint16x8_t t = vdupq_n_u16(threshold);
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+      bits |= movemask16x8(vcgeq_u16(vld1q_u16(col + base + 8 * k), t))
+              << (8 * k);
+    }
+    out[base / 64] = bits;
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+void geq32Neon(const uint32_t* col, size_t n, uint32_t threshold,
+               uint64_t* out) {
+  const uint32x4_t t = vdupq_n_u32(threshold);
+  size_t base = 0;
+  for (; base + 64 <= n; base += 64) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 8; k++) {
+      uint32x4_t lo = vld1q_u32(col + base + 8 * k);
+      uint32x4_t hi = vld1q_u32(col + base + 8 * k + 4);
+      bits |= movemask32x4x2(vcgeq_u32(lo, t), vcgeq_u32(hi, t)) << (8 * k);
+    }
+    out[base / 64] = bits;
+  }
+  geqScalar(col + base, n - base, threshold, out + base / 64);
+}
+
+const FilterKernels kNeonKernels = {
+    maskEq8Neon, maskEq16Neon, maskEq32Neon, geq8Neon, geq16Neon, geq32Neon,
+};
+
+#endif  // KERNELS_NEON
+
+bool isaSupported(KernelIsa isa) {
+  switch (isa) {
+    case KernelIsa::Scalar:
+      return true;
+#ifdef KERNELS_X86
+    case KernelIsa::Avx2:
+      return __builtin_cpu_supports("avx2");
+    case KernelIsa::Avx512:
+      return __builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512bw");
+#endif
+#ifdef KERNELS_NEON
+    case KernelIsa::Neon:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+const FilterKernels& kernelsFor(KernelIsa isa) {
+  switch (isa) {
+#ifdef KERNELS_X86
+    case KernelIsa::Avx2:
+      return kAvx2Kernels;
+    case KernelIsa::Avx512:
+      return kAvx512Kernels;
+#endif
+#ifdef KERNELS_NEON
+    case KernelIsa::Neon:
+      return kNeonKernels;
+#endif
+    default:
+      return kScalarKernels;
+  }
+}
+
+// Atomic so that forceKernelIsa may race with queries already filtering;
+// any of the kernel sets is correct, so relaxed order is enough.
+atomic<KernelIsa>& selectedIsa() {
+  static atomic<KernelIsa> isa{[] {
+    for (KernelIsa candidate :
+         {KernelIsa::Avx512, KernelIsa::Avx2, KernelIsa::Neon}) {
+      if (isaSupported(candidate)) {
+        return candidate;
+      }
+    }
+    return KernelIsa::Scalar;
+  }()};
+  return isa;
+}
+
+template <typename T>
+void evalColumn(const vector<T>& col, size_t rows, PredicateKind kind,
+                uint32_t mask, uint32_t value,
+                void (*maskEq)(const T*, size_t, T, T, uint64_t*),
+                void (*geq)(const T*, size_t, T, uint64_t*), uint64_t* out) {
+  constexpr uint32_t maxValue = numeric_limits<T>::max();
+  if (kind == PredicateKind::MaskEq) {
+    if ((value & ~mask) != 0 || value > maxValue) {
+      fill(out, out + bitmapWords(rows), 0);
+      return;
+    }
+    maskEq(col.data(), rows, static_cast<T>(mask), static_cast<T>(value),
+           out);
+  } else {
+    if (value > maxValue) {
+      fill(out, out + bitmapWords(rows), 0);
+      return;
+    }
+    geq(col.data(), rows, static_cast<T>(value), out);
+  }
+}
+
+}  // namespace
+
+const FilterKernels& filterKernels() {
+  return kernelsFor(selectedIsa().load(memory_order_relaxed));
+}
+
+KernelIsa activeKernelIsa() {
+  return selectedIsa().load(memory_order_relaxed);
+}
+
+string kernelIsaName(KernelIsa isa) {
+  switch (isa) {
+    case KernelIsa::Scalar:
+      return "scalar";
+    case KernelIsa::Avx2:
+      return "avx2";
+    case KernelIsa::Avx512:
+      return "avx512";
+    case KernelIsa::Neon:
+      return "neon";
+  }
+  return "unknown";
+}
+
+void forceKernelIsa(KernelIsa isa) {
+  if (!isaSupported(isa)) {
+    throw invalid_argument("Error: CPU does not support " +
+                           kernelIsaName(isa) + " filter kernels");
+  }
+  selectedIsa().store(isa, memory_order_relaxed);
+}
+
+void evalPredicate(const ColumnPredicate& pred, const Batch& batch,
+                   uint64_t* out) {
+  if (!batch.has(pred.field)) {
+    throw out_of_range("Error: batch has no column for field \"" +
+                       fieldName(fid(pred.field)) + "\"");
+  }
+  const FilterKernels& k = filterKernels();
+  size_t rows = batch.rows;
+  switch (pred.field) {
+    case Field::Ipv4Hlen:
+      return evalColumn(batch.ipv4Hlen, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq8, k.geq8, out);
+    case Field::Ipv4Proto:
+      return evalColumn(batch.ipv4Proto, rows, pred.kind, pred.mask,
+                        pred.value, k.maskEq8, k.geq8, out);
+    case Field::L4Flags:
+      return evalColumn(batch.l4Flags, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq8, k.geq8, out);
+    case Field::EthEthertype:
+      return evalColumn(batch.ethEthertype, rows, pred.kind, pred.mask,
+                        pred.value, k.maskEq16, k.geq16, out);
+    case Field::Ipv4Len:
+      return evalColumn(batch.ipv4Len, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq16, k.geq16, out);
+    case Field::L4Sport:
+      return evalColumn(batch.l4Sport, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq16, k.geq16, out);
+    case Field::L4Dport:
+      return evalColumn(batch.l4Dport, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq16, k.geq16, out);
+    case Field::Ipv4Src:
+      return evalColumn(batch.ipv4Src, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq32, k.geq32, out);
+    case Field::Ipv4Dst:
+      return evalColumn(batch.ipv4Dst, rows, pred.kind, pred.mask, pred.value,
+                        k.maskEq32, k.geq32, out);
+    default:
+      throw invalid_argument("Error: no filter kernel for field \"" +
+                             fieldName(fid(pred.field)) + "\"");
+  }
+}
+
+BatchOpCreator batchColumnFilterCreator(vector<ColumnPredicate> conjuncts) {
+  return [conjuncts](BatchOperator nextOp) {
+    auto sharedNextOp = make_shared<BatchOperator>(nextOp);
+    auto acc = make_shared<vector<uint64_t>>();
+    auto scratch = make_shared<vector<uint64_t>>();
+
+    BatchFunc next = [conjuncts, sharedNextOp, acc, scratch](Batch& batch) {
+      size_t words = bitmapWords(batch.rows);
+      acc->assign(words, ~uint64_t{0});
+      scratch->resize(words);
+      for (const auto& pred : conjuncts) {
+        evalPredicate(pred, batch, scratch->data());
+        for (size_t w = 0; w < words; w++) {
+          (*acc)[w] &= (*scratch)[w];
+        }
+      }
+
+      size_t kept = 0;
+      for (uint32_t row : batch.sel) {
+        batch.sel[kept] = row;
+        kept += ((*acc)[row >> 6] >> (row & 63)) & 1;
+      }
+      batch.sel.resize(kept);
+      if (kept > 0) {
+        sharedNextOp->next(batch);
+      }
+    };
+
+    OpFunc reset = [sharedNextOp](const Headers& headers) {
+      sharedNextOp->reset(headers);
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
@@ -0,0 +1,92 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "schema.hpp"
+#include "tcp_flags.hpp"
+
+using namespace std;
+
+// Predicate kernels over one column. Each writes a selection bitmap with bit
+// (i % 64) of out[i / 64] set when row i passes; out must hold
+// bitmapWords(n) words. maskEq tests (x & mask) == value, which covers both
+// plain equality (mask all ones) and flag tests ((flags & m) == m); geq
+// tests x >= threshold, unsigned.
+struct FilterKernels {
+  void (*maskEq8)(const uint8_t* col, size_t n, uint8_t mask, uint8_t value,
+                  uint64_t* out);
+  void (*maskEq16)(const uint16_t* col, size_t n, uint16_t mask,
+                   uint16_t value, uint64_t* out);
+  void (*maskEq32)(const uint32_t* col, size_t n, uint32_t mask,
+                   uint32_t value, uint64_t* out);
+  void (*geq8)(const uint8_t* col, size_t n, uint8_t threshold, uint64_t* out);
+  void (*geq16)(const uint16_t* col, size_t n, uint16_t threshold,
+                uint64_t* out);
+  void (*geq32)(const uint32_t* col, size_t n, uint32_t threshold,
+                uint64_t* out);
+};
+
+enum class KernelIsa {
+  Scalar,
+  Avx2,
+  Avx512,
+  Neon,
+};
+
+constexpr size_t bitmapWords(size_t n) { return (n + 63) / 64; }
+
+// The kernels for the widest instruction set the running CPU supports,
+// chosen once on first use.
+const FilterKernels& filterKernels();
+KernelIsa activeKernelIsa();
+string kernelIsaName(KernelIsa isa);
+
+// Overrides the runtime choice, e.g. to compare implementations. Safe to
+// call while other threads filter; each predicate evaluated uses one set of
+// kernels or the other. Throws if the CPU does not support isa.
+void forceKernelIsa(KernelIsa isa);
+
+enum class PredicateKind {
+  MaskEq,
+  Geq,
+};
+
+// One conjunct of a column filter, evaluated by the kernels above.
+struct ColumnPredicate {
+  Field field;
+  PredicateKind kind;
+  uint32_t mask;
+  uint32_t value;
+
+  static ColumnPredicate eq(Field field, uint32_t value) {
+    return {field, PredicateKind::MaskEq, ~0u, value};
+  }
+  static ColumnPredicate hasAll(Field field, uint32_t mask) {
+    return {field, PredicateKind::MaskEq, mask, mask};
+  }
+  static ColumnPredicate maskEq(Field field, uint32_t mask, uint32_t value) {
+    return {field, PredicateKind::MaskEq, mask, value};
+  }
+  static ColumnPredicate tcpFlags(TcpFlagTest test) {
+    return {Field::L4Flags, PredicateKind::MaskEq, test.mask, test.value};
+  }
+  static ColumnPredicate geq(Field field, uint32_t threshold) {
+    return {field, PredicateKind::Geq, 0, threshold};
+  }
+};
+
+// Evaluates pred over rows [0, batch.rows) into out.
+void evalPredicate(const ColumnPredicate& pred, const Batch& batch,
+                   uint64_t* out);
+
+// Keeps the selected rows that pass every conjunct. Only the 8-, 16- and
+// 32-bit packet columns can be filtered this way; anything else should use
+// batchFilterCreator.
+BatchOpCreator batchColumnFilterCreator(vector<ColumnPredicate> conjuncts);
+
+#endif  // KERNELS_H
@@ -0,0 +1,255 @@
+#include "key_hash.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include "kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEY_HASH_X86 1
+#endif
+
+namespace {
+
+constexpr uint64_t kMix1 = 0xbf58476d1ce4e5b9ULL;
+constexpr uint64_t kMix2 = 0x94d049bb133111ebULL;
+constexpr uint64_t kFieldCountMul = 0x9e3779b97f4a7c15ULL;
+constexpr uint64_t kTypeMul = 0xd6e8feb86659fd93ULL;
+
+// Rows of a batch column hashed per pass.
+constexpr size_t kColumnChunk = 256;
+
+// Zero until the field's tag is first asked for; racing threads compute
+// and store the same value.
+array<atomic<uint64_t>, kMaxFields> fieldTags;
+
+uint64_t startHash(uint64_t seed, size_t fields) {
+  return packedKeyMix(seed ^ (fields * kFieldCountMul));
+}
+
+uint64_t typeTerm(OpResultType typ) {
+  return (static_cast<uint64_t>(typ) + 1) * kTypeMul;
+}
+
+uint64_t step(uint64_t h, uint64_t tag, uint64_t bits, OpResultType typ) {
+  return packedKeyMix(packedKeyMix(h ^ tag ^ typeTerm(typ)) ^ bits);
+}
+
+void hashKeysScalar(const PackedKey* keys, size_t n, uint64_t* out,
+                    uint64_t seed) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = stableKeyHash(keys[i], seed);
+  }
+}
+
+void hashLanesScalar(uint64_t start, uint64_t tag, const uint64_t* bits,
+                     const OpResultType* types, size_t n, uint64_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = step(start, tag, bits[i], types[i]);
+  }
+}
+
+#ifdef KEY_HASH_X86
+
+// The low 64 bits of each lane times c, from three 32-bit multiplies.
+__attribute__((target("avx2"))) inline __m256i mulLo64(__m256i a,
+                                                       uint64_t c) {
+  __m256i b = _mm256_set1_epi64x(static_cast<int64_t>(c));
+  __m256i cross = _mm256_mullo_epi32(a, _mm256_shuffle_epi32(b, 0xB1));
+  __m256i high = _mm256_add_epi32(cross, _mm256_srli_epi64(cross, 32));
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+                          _mm256_slli_epi64(high, 32));
+}
+
+// packedKeyMix in each lane.
+__attribute__((target("avx2"))) inline __m256i mix4(__m256i x) {
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 30));
+  x = mulLo64(x, kMix1);
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 27));
+  x = mulLo64(x, kMix2);
+  return _mm256_xor_si256(x, _mm256_srli_epi64(x, 31));
+}
+
+__attribute__((target("avx2"))) inline __m256i step4(__m256i h, uint64_t tag,
+                                                     __m256i bits,
+                                                     __m256i types) {
+  h = _mm256_xor_si256(h, _mm256_set1_epi64x(static_cast<int64_t>(tag)));
+  h = mix4(_mm256_xor_si256(h, types));
+  return mix4(_mm256_xor_si256(h, bits));
+}
+
+__attribute__((target("avx2"))) inline __m256i typeTerms4(OpResultType a,
+                                                          OpResultType b,
+                                                          OpResultType c,
+                                                          OpResultType d) {
+  return _mm256_set_epi64x(
+      static_cast<int64_t>(typeTerm(d)), static_cast<int64_t>(typeTerm(c)),
+      static_cast<int64_t>(typeTerm(b)), static_cast<int64_t>(typeTerm(a)));
+}
+
+// Four keys at a time wherever the four hold the same fields, as the keys
+// projected from one batch nearly always do.
+__attribute__((target("avx2"))) void hashKeysAvx2(const PackedKey* keys,
+                                                  size_t n, uint64_t* out,
+                                                  uint64_t seed) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const PackedKey* k = keys + i;
+    uint64_t fields = k[0].fields;
+    if (k[1].fields != fields || k[2].fields != fields ||
+        k[3].fields != fields) {
+      hashKeysScalar(k, 4, out + i, seed);
+      continue;
+    }
+    __m256i h =
+        _mm256_set1_epi64x(static_cast<int64_t>(startHash(seed, k[0].n)));
+    uint64_t rest = fields;
+    for (uint8_t f = 0; f < k[0].n; f++, rest &= rest - 1) {
+      uint64_t tag =
+          stableFieldTag(static_cast<FieldId>(__builtin_ctzll(rest)));
+      __m256i bits = _mm256_set_epi64x(static_cast<int64_t>(k[3].vals[f]),
+                                       static_cast<int64_t>(k[2].vals[f]),
+                                       static_cast<int64_t>(k[1].vals[f]),
+                                       static_cast<int64_t>(k[0].vals[f]));
+      __m256i types = typeTerms4(k[0].types[f], k[1].types[f], k[2].types[f],
+                                 k[3].types[f]);
+      h = step4(h, tag, bits, types);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), h);
+  }
+  hashKeysScalar(keys + i, n - i, out + i, seed);
+}
+
+__attribute__((target("avx2"))) void hashLanesAvx2(uint64_t start,
+                                                   uint64_t tag,
+                                                   const uint64_t* bits,
+                                                   const OpResultType* types,
+                                                   size_t n, uint64_t* out) {
+  __m256i h = _mm256_set1_epi64x(static_cast<int64_t>(start));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bits + i));
+    __m256i t = typeTerms4(types[i], types[i + 1], types[i + 2], types[i + 3]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        step4(h, tag, b, t));
+  }
+  hashLanesScalar(start, tag, bits + i, types + i, n - i, out + i);
+}
+
+#endif  // KEY_HASH_X86
+
+bool useAvx2() {
+#ifdef KEY_HASH_X86
+  KernelIsa isa = activeKernelIsa();
+  return isa == KernelIsa::Avx2 || isa == KernelIsa::Avx512;
+#else
+  return false;
+#endif
+}
+
+void hashLanes(uint64_t start, uint64_t tag, const uint64_t* bits,
+               const OpResultType* types, size_t n, uint64_t* out) {
+#ifdef KEY_HASH_X86
+  if (useAvx2()) {
+    hashLanesAvx2(start, tag, bits, types, n, out);
+    return;
+  }
+#endif
+  hashLanesScalar(start, tag, bits, types, n, out);
+}
+
+// Widens rows of a typed column into bits and types.
+template <typename T>
+void widen(const vector<T>& column, OpResultType typ, const uint32_t* rows,
+           size_t n, uint64_t* bits, OpResultType* types) {
+  for (size_t i = 0; i < n; i++) {
+    bits[i] = static_cast<uint64_t>(column[rows[i]]);
+    types[i] = typ;
+  }
+}
+
+void widenColumn(const Batch& batch, FieldId id, const uint32_t* rows,
+                 size_t n, uint64_t* bits, OpResultType* types) {
+  switch (static_cast<Field>(id)) {
+    case Field::EthSrc:
+      return widen(batch.ethSrc, OpResultType::MAC, rows, n, bits, types);
+    case Field::EthDst:
+      return widen(batch.ethDst, OpResultType::MAC, rows, n, bits, types);
+    case Field::Ipv4Proto:
+      return widen(batch.ipv4Proto, OpResultType::Int, rows, n, bits, types);
+    case Field::Ipv4Src:
+      return widen(batch.ipv4Src, OpResultType::IPv4, rows, n, bits, types);
+    case Field::Ipv4Dst:
+      return widen(batch.ipv4Dst, OpResultType::IPv4, rows, n, bits, types);
+    case Field::L4Sport:
+      return widen(batch.l4Sport, OpResultType::Int, rows, n, bits, types);
+    case Field::L4Dport:
+      return widen(batch.l4Dport, OpResultType::Int, rows, n, bits, types);
+    case Field::L4Flags:
+      return widen(batch.l4Flags, OpResultType::Int, rows, n, bits, types);
+    default:
+      for (size_t i = 0; i < n; i++) {
+        OpResult val = batch.value(id, rows[i]);
+        bits[i] = val.bits();
+        types[i] = val.typ;
+      }
+  }
+}
+
+}  // namespace
+
+uint64_t stableFieldTag(FieldId id) {
+  uint64_t tag = fieldTags[id].load(memory_order_relaxed);
+  if (tag != 0) {
+    return tag;
+  }
+  // FNV-1a over the name, then mixed; never 0, which marks "not yet".
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (char c : fieldName(id)) {
+    h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  }
+  tag = packedKeyMix(h) | 1;
+  fieldTags[id].store(tag, memory_order_relaxed);
+  return tag;
+}
+
+uint64_t stableKeyHash(const PackedKey& key, uint64_t seed) {
+  uint64_t h = startHash(seed, key.n);
+  uint64_t rest = key.fields;
+  for (uint8_t i = 0; i < key.n; i++, rest &= rest - 1) {
+    h = step(h, stableFieldTag(static_cast<FieldId>(__builtin_ctzll(rest))),
+             key.vals[i], key.types[i]);
+  }
+  return h;
+}
+
+void stableKeyHashes(const PackedKey* keys, size_t n, uint64_t* out,
+                     uint64_t seed) {
+#ifdef KEY_HASH_X86
+  if (useAvx2()) {
+    hashKeysAvx2(keys, n, out, seed);
+    return;
+  }
+#endif
+  hashKeysScalar(keys, n, out, seed);
+}
+
+void stableColumnHashes(const Batch& batch, FieldId id, const uint32_t* rows,
+                        size_t n, uint64_t* out, uint64_t seed) {
+  if (!batch.has(id)) {
+    fill(out, out + n, startHash(seed, 0));
+    return;
+  }
+  uint64_t start = startHash(seed, 1);
+  uint64_t tag = stableFieldTag(id);
+  array<uint64_t, kColumnChunk> bits;
+  array<OpResultType, kColumnChunk> types;
+  for (size_t base = 0; base < n; base += kColumnChunk) {
+    size_t m = min(kColumnChunk, n - base);
+    widenColumn(batch, id, rows + base, m, bits.data(), types.data());
+    hashLanes(start, tag, bits.data(), types.data(), m, out + base);
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef KEY_HASH_H
+#define KEY_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "batch.hpp"
+#include "packed_key.hpp"
+#include "schema.hpp"
+
+using namespace std;
+
+// A seeded hash of grouping keys that gives the same value in every
+// process: fields enter it by a hash of their name rather than by their
+// FieldId, which depends on the order fields were interned in. Partitioning
+// that must agree between processes, such as sharding or shipping partial
+// aggregates to another node, uses it; the in-process tables keep the
+// cheaper PackedKeyHash.
+//
+// The hash starts from the seed and the number of fields, and steps once
+// per field in id order: it mixes in the field's name tag, then the value's
+// bits and type. The mixer is the multiply-xorshift of packedKeyMix, which
+// SIMD lanes evaluate bit for bit like the scalar code, so the batch forms
+// below hash four keys at a time on AVX2 and agree with stableKeyHash.
+
+constexpr uint64_t kDefaultKeyHashSeed = 0x5f3759df9e3779b9ULL;
+
+// The hash of the name of field id.
+uint64_t stableFieldTag(FieldId id);
+
+uint64_t stableKeyHash(const PackedKey& key,
+                       uint64_t seed = kDefaultKeyHashSeed);
+
+// stableKeyHash of keys[0, n) into out.
+void stableKeyHashes(const PackedKey* keys, size_t n, uint64_t* out,
+                     uint64_t seed = kDefaultKeyHashSeed);
+
+// stableKeyHash of the one-field keys {id: batch.value(id, row)} for each
+// of the n rows, into out. Rows of a batch without the column hash as the
+// empty key.
+void stableColumnHashes(const Batch& batch, FieldId id, const uint32_t* rows,
+                        size_t n, uint64_t* out,
+                        uint64_t seed = kDefaultKeyHashSeed);
+
+#endif  // KEY_HASH_H
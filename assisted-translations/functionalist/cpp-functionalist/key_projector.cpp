@@ -0,0 +1,49 @@
+#include "key_projector.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+KeyProjector::KeyProjector(const vector<string>& inclKeys) {
+  for (const string& key : inclKeys) {
+    mask |= uint64_t{1} << internField(key);
+  }
+  size_t count = __builtin_popcountll(mask);
+  if (count > kMaxKeyFields) {
+    throw length_error("Error: grouping key has more than " +
+                       to_string(kMaxKeyFields) + " fields");
+  }
+  // Ascending ids, the order in which PackedKey holds its fields.
+  uint64_t rest = mask;
+  for (; rest != 0; rest &= rest - 1) {
+    ids[n++] = static_cast<FieldId>(__builtin_ctzll(rest));
+  }
+}
+
+ProjectedKey KeyProjector::project(const Headers& headers) const {
+  ProjectedKey out;
+  PackedKey& key = out.key;
+  key.fields = headers.fieldMask() & mask;
+  size_t h = packedKeyHashStart(key.fields);
+  for (uint8_t i = 0; i < n; i++) {
+    FieldId id = ids[i];
+    if (key.fields & (uint64_t{1} << id)) {
+      const OpResult& val = headers.at(id);
+      key.vals[key.n] = val.bits();
+      key.types[key.n] = val.typ;
+      h = packedKeyHashStep(h, key.vals[key.n], val.typ);
+      key.n++;
+    }
+  }
+  out.hash = h;
+  return out;
+}
+
+Headers KeyProjector::operator()(const Headers& headers) const {
+  Headers out;
+  for (uint8_t i = 0; i < n; i++) {
+    if (headers.contains(ids[i])) {
+      out[ids[i]] = headers.at(ids[i]);
+    }
+  }
+  return out;
+}
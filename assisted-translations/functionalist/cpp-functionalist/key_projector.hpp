@@ -0,0 +1,80 @@
+#ifndef KEY_PROJECTOR_H
+#define KEY_PROJECTOR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// A grouping key packed straight out of a tuple, with its PackedKeyHash.
+struct ProjectedKey {
+  PackedKey key;
+  size_t hash;
+};
+
+// Compiled form of filterGroups(inclKeys, .) for grouping stages. The field
+// names are resolved to ids once, when the query is built, and projecting a
+// tuple packs the fields it holds of them into a fixed-width PackedKey while
+// hashing it, without building an intermediate Headers. A key has as many
+// words as the projector has fields; absent fields are left out, as
+// filterGroups does, so project(h).key == packKey(filterGroups(inclKeys, h)).
+class KeyProjector {
+ public:
+  // Throws length_error for more than kMaxKeyFields distinct fields.
+  KeyProjector(const vector<string>& inclKeys);
+  // So that groupbyCreator({"ipv4.src"}, ...) reads as filterGroups does.
+  KeyProjector(initializer_list<string> inclKeys)
+      : KeyProjector(vector<string>(inclKeys)) {}
+
+  ProjectedKey project(const Headers& headers) const;
+  // The projected fields as a tuple, for code that still wants one.
+  Headers operator()(const Headers& headers) const;
+
+  size_t size() const { return n; }
+  uint64_t fieldMask() const { return mask; }
+
+ private:
+  array<FieldId, kMaxKeyFields> ids{};
+  uint8_t n = 0;
+  uint64_t mask = 0;
+};
+
+// Keys projected from consecutive tuples whose table probes are put off
+// until kDeferredProbes of them are waiting and then made together, through
+// FlatTable::findOrInsertBatch or ConcurrentAggWriter::addBatch, so that
+// their cache misses overlap rather than follow one another. Only for
+// stages that need nothing of a tuple but its key and, optionally, one
+// integer taken from it, and that flush before they emit.
+constexpr size_t kDeferredProbes = 16;
+
+class DeferredKeys {
+ public:
+  // Queues projected with val; true once the group is full.
+  bool add(const ProjectedKey& projected, int64_t val = 0) {
+    keyBuf[n] = projected.key;
+    hashBuf[n] = projected.hash;
+    valBuf[n] = val;
+    return ++n == kDeferredProbes;
+  }
+
+  const PackedKey* keys() const { return keyBuf.data(); }
+  const size_t* hashes() const { return hashBuf.data(); }
+  const int64_t* vals() const { return valBuf.data(); }
+  size_t size() const { return n; }
+  void clear() { n = 0; }
+
+ private:
+  array<PackedKey, kDeferredProbes> keyBuf;
+  array<size_t, kDeferredProbes> hashBuf;
+  array<int64_t, kDeferredProbes> valBuf;
+  size_t n = 0;
+};
+
+#endif  // KEY_PROJECTOR_H
@@ -0,0 +1,144 @@
+#include "latency.hpp"
+
+#include "metrics.hpp"
+
+namespace {
+
+// What traceQuery keeps, all of it touched by the query's thread only.
+struct TraceState {
+  shared_ptr<QueryTrace> trace;
+  LatencyHistogram tuples;
+  LatencyHistogram delays;
+  uint64_t untilSample = kMeterSampleEvery;
+  // When the tuple being passed through arrived, and the one before it: a
+  // reset that happens while a tuple is in flight was set off by that
+  // tuple, so the epoch it closes ended with the one before.
+  uint64_t arrival = 0;
+  uint64_t previousArrival = 0;
+  bool inTuple = false;
+  // Tuples that had arrived when the latest delay was recorded, so that an
+  // epoch closed once on every input of the query counts once.
+  uint64_t arrivals = 0;
+  uint64_t arrivalsAtClose = 0;
+
+  explicit TraceState(shared_ptr<QueryTrace> trace) : trace(move(trace)) {}
+};
+
+Operator traceInput(shared_ptr<TraceState> state, Operator queryOp) {
+  OpFunc next = [state, queryOp](const Headers& headers) {
+    state->previousArrival = state->arrival;
+    state->arrival = readCycles();
+    state->arrivals++;
+    state->inTuple = true;
+    queryOp.next(headers);
+    if (--state->untilSample == 0) {
+      state->untilSample = kMeterSampleEvery;
+      state->tuples.record(readCycles() - state->arrival);
+    }
+    state->inTuple = false;
+  };
+
+  OpFunc reset = [state, queryOp](const Headers& headers) {
+    queryOp.reset(headers);
+  };
+
+  return Operator(next, reset);
+}
+
+Operator traceOutput(shared_ptr<TraceState> state, Operator nextOp) {
+  OpFunc reset = [state, nextOp](const Headers& headers) {
+    nextOp.reset(headers);
+    uint64_t before = state->arrivals - (state->inTuple ? 1 : 0);
+    if (before != state->arrivalsAtClose) {
+      uint64_t last =
+          state->inTuple ? state->previousArrival : state->arrival;
+      state->delays.record(readCycles() - last);
+      state->arrivalsAtClose = before;
+    }
+    state->trace->tupleLatency.publish(state->tuples);
+    state->trace->detectionDelay.publish(state->delays);
+  };
+
+  return Operator(nextOp.next, reset);
+}
+
+}  // namespace
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (size_t at = other.lo; at < other.hi; at++) {
+    counts[at] += other.counts[at];
+  }
+  if (other.lo < lo) {
+    lo = other.lo;
+  }
+  if (other.hi > hi) {
+    hi = other.hi;
+  }
+  total += other.total;
+  sum += other.sum;
+  if (other.largest > largest) {
+    largest = other.largest;
+  }
+}
+
+void LatencyHistogram::clear() {
+  for (size_t at = lo; at < hi; at++) {
+    counts[at] = 0;
+  }
+  lo = kBuckets;
+  hi = 0;
+  total = 0;
+  sum = 0;
+  largest = 0;
+}
+
+uint64_t LatencyHistogram::highestIn(size_t at) {
+  if (at < kLatencySubBuckets) {
+    return at;
+  }
+  size_t shift = at / kLatencySubBuckets - 1;
+  uint64_t lowest = (kLatencySubBuckets + at % kLatencySubBuckets) << shift;
+  return lowest + ((uint64_t{1} << shift) - 1);
+}
+
+uint64_t LatencyHistogram::valueAt(double q) const {
+  if (total == 0) {
+    return 0;
+  }
+  double wanted = q * static_cast<double>(total);
+  uint64_t seen = 0;
+  for (size_t at = lo; at < hi; at++) {
+    seen += counts[at];
+    if (seen > 0 && static_cast<double>(seen) >= wanted) {
+      return highestIn(at) < largest ? highestIn(at) : largest;
+    }
+  }
+  return largest;
+}
+
+void PublishedLatency::publish(LatencyHistogram& local) {
+  if (local.count() == 0) {
+    return;
+  }
+  {
+    lock_guard<mutex> guard(lock);
+    merged.merge(local);
+  }
+  local.clear();
+}
+
+LatencyHistogram PublishedLatency::snapshot() const {
+  lock_guard<mutex> guard(lock);
+  return merged;
+}
+
+vector<Operator> traceQuery(
+    const shared_ptr<QueryTrace>& trace,
+    const function<vector<Operator>(Operator)>& build, Operator nextOp) {
+  auto state = make_shared<TraceState>(trace);
+  vector<Operator> inputs = build(traceOutput(state, move(nextOp)));
+  for (Operator& input : inputs) {
+    input = traceInput(state, move(input));
+  }
+  return inputs;
+}
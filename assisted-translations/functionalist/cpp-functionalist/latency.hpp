@@ -0,0 +1,125 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+using namespace std;
+
+// Latency distributions for the stages and queries of metrics.hpp. Each
+// distribution is filled by the one thread that runs what it times, in a
+// histogram of its own that takes no lock, and merged into the copy readers
+// see once per epoch, so that recording costs a few instructions and
+// exporting never stalls the packet path.
+
+// Sub-buckets per power of two: values are kept to within 1 /
+// kLatencySubBuckets of their size, about 3%.
+constexpr size_t kLatencySubBits = 5;
+constexpr size_t kLatencySubBuckets = size_t{1} << kLatencySubBits;
+
+// Log-linear histogram of 64-bit values, such as readCycles() differences,
+// in the manner of HdrHistogram: values below kLatencySubBuckets get a
+// bucket each, and every power of two above that is split into
+// kLatencySubBuckets linear buckets. Recording is an index computation and
+// an increment.
+class LatencyHistogram {
+ public:
+  static constexpr size_t kBuckets =
+      (64 - kLatencySubBits + 1) * kLatencySubBuckets;
+
+  void record(uint64_t value) {
+    size_t at = bucketOf(value);
+    counts[at]++;
+    total++;
+    sum += value;
+    if (value > largest) {
+      largest = value;
+    }
+    if (at < lo) {
+      lo = at;
+    }
+    if (at >= hi) {
+      hi = at + 1;
+    }
+  }
+
+  // Adds other's values to this one's.
+  void merge(const LatencyHistogram& other);
+  // Touches only the buckets used since the last clear.
+  void clear();
+
+  uint64_t count() const { return total; }
+  uint64_t valueSum() const { return sum; }
+  uint64_t max() const { return largest; }
+  // The smallest value at least a share q of the recorded values are no
+  // greater than, to the histogram's precision; 0 when empty.
+  uint64_t valueAt(double q) const;
+
+ private:
+  array<uint64_t, kBuckets> counts{};
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t largest = 0;
+  // The buckets in use lie in [lo, hi).
+  size_t lo = kBuckets;
+  size_t hi = 0;
+
+  static size_t bucketOf(uint64_t value) {
+    if (value < kLatencySubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    size_t magnitude = 63 - static_cast<size_t>(__builtin_clzll(value));
+    size_t shift = magnitude - kLatencySubBits;
+    return (shift + 1) * kLatencySubBuckets +
+           static_cast<size_t>((value >> shift) & (kLatencySubBuckets - 1));
+  }
+  // The largest value of bucket at.
+  static uint64_t highestIn(size_t at);
+};
+
+// A histogram for readers: one thread fills a LatencyHistogram of its own
+// and publishes it here, typically at each epoch close; readers take a copy.
+class PublishedLatency {
+ public:
+  // Merges local in and clears it.
+  void publish(LatencyHistogram& local);
+  LatencyHistogram snapshot() const;
+
+ private:
+  mutable mutex lock;
+  LatencyHistogram merged;
+};
+
+// End-to-end timing of one query, for its SLOs: how long the whole query,
+// sink included, takes over a tuple, and its detection delay, from the last
+// packet of an epoch reaching the query to the query passing on the reset
+// that follows the epoch's last result. Registered with a MetricsRegistry
+// under the query's name.
+struct QueryTrace {
+  string name;
+  // Sampled, one tuple in kMeterSampleEvery, in readCycles() units.
+  PublishedLatency tupleLatency;
+  PublishedLatency detectionDelay;
+
+  explicit QueryTrace(string name) : name(move(name)) {}
+};
+
+// Wraps the operators a query is fed through and the one it passes results
+// to, so that trace times it. build is given the wrapped nextOp and returns
+// the query's inputs, which are returned wrapped. The query must be fed,
+// and pass on its resets, on one thread, as every query that closes its
+// epochs in line does; a query closed off the packet path, such as
+// ddosAsync, is timed only up to the hand-off.
+vector<Operator> traceQuery(
+    const shared_ptr<QueryTrace>& trace,
+    const function<vector<Operator>(Operator)>& build, Operator nextOp);
+
+#endif  // LATENCY_H
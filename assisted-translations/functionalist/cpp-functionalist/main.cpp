@@ -1,213 +1,430 @@
-#include "builtins.hpp"
-#include "utils.hpp"
+#include "main.h"
 
 Operator ident(Operator nextOp) {
-  __(mapCreator([](Headers headers) {
-       Headers newH;
-       for (const auto& [key, val] : headers) {
-         if (key != "eth.src" && key != "eth.dst") {
-           newH[key] = val;
-         }
-       }
-       return newH;
-     }),
-     nextOp);
+  return __(mapCreator([](const Headers& headers) {
+              Headers newH;
+              for (const auto& [key, val] : headers) {
+                if (key != "eth.src" && key != "eth.dst") {
+                  newH[key] = val;
+                }
+              }
+              return newH;
+            }),
+            nextOp);
 }
 
 Operator countPkts(Operator nextOp) {
-  __(epochCreator(1.0, "pkts"),
-     __(groupbyCreator(singleGroup, counter, "pkts"), nextOp));
+  return __(epochCreator(1.0, "pkts"),
+            __(groupbyCreator(singleGroup, counter, "pkts"), nextOp));
 }
 
 Operator pktsPerSrcDist(Operator nextOp) {
-  __(epochCreator(1.0, "eid"), __(groupbyCreator(
-                                      [](Headers headers) {
-                                        return filterGroups(
-                                            {"ipv4.src", "ipv4.dst"}, headers);
-                                      },
-                                      counter, "pkts"),
-                                  nextOp));
+  return __(epochCreator(1.0, "eid"),
+            __(groupbyCreator({"ipv4.src", "ipv4.dst"}, counter, "pkts"),
+               nextOp));
 }
 
-bool filterHelper(int proto, int flags, Headers headers) {
-  return getMappedInt("ipv4.proto", headers) == proto &&
-         getMappedInt("l4.flags", headers);
+bool filterHelper(int proto, TcpFlagTest flags, const Headers& headers) {
+  return getMappedInt(fid(Field::Ipv4Proto), headers) == proto &&
+         flags(getMappedInt(fid(Field::L4Flags), headers));
 }
 
 Operator distinctSrcs(Operator nextOp) {
-  __(epochCreator(1.0, "eid"),
-     __(distinctCreator([](Headers headers) {
-          return filterGroups({"ipv4.src"}, headers);
-        }),
-        __(groupbyCreator(singleGroup, counter, "srcs"), nextOp)));
+  return __(epochCreator(1.0, "eid"),
+            __(distinctCreator({"ipv4.src"}),
+               __(groupbyCreator(singleGroup, counter, "srcs"), nextOp)));
 }
 
+// The Sonata queries compute what their namesakes in original-ocaml/main.ml
+// do, stage for stage, with the reference's closing threshold filter fused
+// into the groupby before it.
+
+// Sonata 1: destinations of at least threshold new TCP connections.
 Operator tcpNewCons(Operator nextOp) {
   int threshold = 40;
   return __(epochCreator(1.0, "eid"),
-            __(filterCreator(
-                   [](Headers headers) { return filterHelper(6, 2, headers); }),
-               __(groupbyCreator(
-                      [](Headers headers) {
-                        return filterGroups({"ipv4.src", "ipv4.dst"}, headers);
-                      },
-                      counter, "cons"),
-                  __(filterCreator([threshold](Headers headers) {
-                       return keyGeqInt("cons", threshold, headers);
-                     }),
-                     nextOp))));
+            __(filterCreator([](const Headers& headers) {
+                 return filterHelper(6, kSynOnly, headers);
+               }),
+               __(groupbyCreator({"ipv4.dst"}, counter, "cons", threshold),
+                  nextOp)));
 }
 
+// Sonata 2: (destination, packet length) pairs that at least threshold
+// sources sent SSH packets of.
 Operator sshBruteForce(Operator nextOp) {
   int threshold = 40;
-  __(filterCreator(
-         [](Headers headers) { return filterHelper(6, 22, headers); }),
-     __(distinctCreator([](Headers headers) {
-          return filterGroups({"ipv4.src", "ipv4.dst", "ipv4.len"}, headers);
-        }),
-
-        __(groupbyCreator(
-               [](Headers headers) {
-                 return filterGroups({"ipv4.dst", "ipv4.len"}, headers);
-               },
-               counter, "srcs"),
-
-           __(filterCreator([threshold](Headers headers) {
-                return keyGeqInt("srcs", threshold, headers);
-              }),
-              nextOp))));
+  return __(epochCreator(1.0, "eid"),
+            __(filterCreator([](const Headers& headers) {
+                 return getMappedInt(fid(Field::Ipv4Proto), headers) == 6 &&
+                        getMappedInt(fid(Field::L4Dport), headers) == 22;
+               }),
+               __(distinctCreator({"ipv4.src", "ipv4.dst", "ipv4.len"}),
+                  __(groupbyCreator({"ipv4.dst", "ipv4.len"}, counter, "srcs",
+                                    threshold),
+                     nextOp))));
 }
 
+// Sonata 3: sources that sent to at least threshold destinations.
 Operator superSpreader(Operator nextOp) {
   int threshold = 40;
-  __(epochCreator(1.0, "eid"),
-     __(distinctCreator([](Headers headers) {
-          return filterGroups({"ipv4.src", "ipv4.dst"}, headers);
-        }),
-        __(filterCreator([threshold](Headers headers) {
-             return keyGeqInt("dsts", threshold, headers);
-           }),
-           nextOp)));
+  return __(epochCreator(1.0, "eid"),
+            __(distinctCreator({"ipv4.src", "ipv4.dst"}),
+               __(groupbyCreator({"ipv4.src"}, counter, "dsts", threshold),
+                  nextOp)));
 }
 
+// Sonata 4: sources that sent to at least threshold ports.
 Operator portScan(Operator nextOp) {
   int threshold = 40;
   return __(epochCreator(1.0, "eid"),
-            __(distinctCreator([](Headers headers) {
-                 return filterGroups({"ipv4.src", "l4.dport"}, headers);
+            __(distinctCreator({"ipv4.src", "l4.dport"}),
+               __(groupbyCreator({"ipv4.src"}, counter, "ports", threshold),
+                  nextOp)));
+}
+
+// Sonata 5: destinations that at least threshold sources sent to.
+Operator ddos(Operator nextOp) {
+  int threshold = 45;
+  return __(epochCreator(1.0, "eid"),
+            __(distinctCreator({"ipv4.src", "ipv4.dst"}),
+               __(groupbyCreator({"ipv4.dst"}, counter, "srcs", threshold),
+                  nextOp)));
+}
+
+// Sketch-backed versions of the queries above. Their memory is set by
+// SketchOptions rather than by the number of distinct keys in an epoch, at
+// the price of approximate counts.
+Operator distinctSrcsApprox(Operator nextOp) {
+  return __(epochCreator(1.0, "eid"),
+            __(approxDistinctCreator(
+                   singleGroup,
+                   [](const Headers& headers) {
+                     return filterGroups({"ipv4.src"}, headers);
+                   },
+                   "srcs"),
+               nextOp));
+}
+
+Operator tcpNewConsApprox(Operator nextOp) {
+  int threshold = 40;
+  return __(epochCreator(1.0, "eid"),
+            __(filterCreator([](const Headers& headers) {
+                 return filterHelper(6, kSynOnly, headers);
                }),
-               __(groupbyCreator(
-                      [](Headers headers) {
-                        return filterGroups({"ipv4.src"}, headers);
+               __(approxCountCreator(
+                      [](const Headers& headers) {
+                        return filterGroups({"ipv4.dst"}, headers);
                       },
-                      counter, "ports"),
-                  __(filterCreator([threshold](Headers headers) {
-                       return keyGeqInt("ports", threshold, headers);
+                      "cons", threshold),
+                  __(filterCreator([threshold](const Headers& headers) {
+                       return keyGeqInt("cons", threshold, headers);
                      }),
                      nextOp))));
 }
 
-Operator ddos(Operator nextOp) {
+Operator portScanApprox(Operator nextOp) {
+  int threshold = 40;
+  return __(epochCreator(1.0, "eid"),
+            __(approxDistinctCountCreator(
+                   [](const Headers& headers) {
+                     return filterGroups({"ipv4.src"}, headers);
+                   },
+                   [](const Headers& headers) {
+                     return filterGroups({"ipv4.src", "l4.dport"}, headers);
+                   },
+                   "ports", threshold),
+               __(filterCreator([threshold](const Headers& headers) {
+                    return keyGeqInt("ports", threshold, headers);
+                  }),
+                  nextOp)));
+}
+
+Operator ddosApprox(Operator nextOp) {
   int threshold = 45;
-  __(epochCreator(1.0, "eid"),
-     __(distinctCreator([](Headers headers) {
-          return filterGroups({"ipv4.src", "ipv4.dst"}, headers);
-        }),
-        __(groupbyCreator(
-               [](Headers headers) {
-                 return filterGroups({"ipv4.dst"}, headers);
-               },
-               counter, "srcs"),
-           nextOp)));
+  return __(epochCreator(1.0, "eid"),
+            __(approxDistinctCountCreator(
+                   [](const Headers& headers) {
+                     return filterGroups({"ipv4.dst"}, headers);
+                   },
+                   [](const Headers& headers) {
+                     return filterGroups({"ipv4.src", "ipv4.dst"}, headers);
+                   },
+                   "srcs", threshold),
+               __(filterCreator([threshold](const Headers& headers) {
+                    return keyGeqInt("srcs", threshold, headers);
+                  }),
+                  nextOp)));
 }
 
-vector<Operator> synFloodSonata(Operator nextOp) {
-  int threshold = 3;
-  float epochDur = 1.0f;
+// superSpreader and portScan with their distinct stages only deduplicating
+// ahead of the count, in a few bytes per key.
+Operator superSpreaderDedup(Operator nextOp) {
+  int threshold = 40;
+  return __(epochCreator(1.0, "eid"),
+            __(streamingDistinctCreator({"ipv4.src", "ipv4.dst"}),
+               __(groupbyCreator({"ipv4.src"}, counter, "dsts", threshold),
+                  nextOp)));
+}
 
-  OpCreator syns = [epochDur](Operator endOp) {
-    return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return filterHelper(6, 2, headers);
-                 }),
-                 __(groupbyCreator(
-                        [](Headers headers) {
-                          return filterGroups({"ipv4.dst"}, headers);
-                        },
-                        counter, "syns"),
-                    endOp)));
-  };
+Operator portScanDedup(Operator nextOp) {
+  int threshold = 40;
+  return __(epochCreator(1.0, "eid"),
+            __(streamingDistinctCreator({"ipv4.src", "l4.dport"}),
+               __(groupbyCreator({"ipv4.src"}, counter, "ports", threshold),
+                  nextOp)));
+}
 
-  OpCreator synacks = [](Operator endOp) {
-    return __(epochCreator(1.0, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return filterHelper(6, 18, headers);
-                 }),
-                 __(groupbyCreator(
-                        [](Headers headers) {
-                          return filterGroups({"ipv4.src"}, headers);
-                        },
-                        counter, "synacks"),
-                    endOp)));
-  };
+// The 100 destinations receiving the most packets in each epoch, largest
+// first, in memory fixed by k however many destinations there are.
+Operator topDestinations(Operator nextOp) {
+  return __(epochCreator(1.0, "eid"),
+            __(topKCreator(
+                   [](const Headers& headers) {
+                     return filterGroups({"ipv4.dst"}, headers);
+                   },
+                   100, "pkts"),
+               nextOp));
+}
 
-  OpCreator acks = [epochDur](Operator nextOp) {
-    return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return getMappedInt("ipv4.proto", headers) == 6 &&
-                          getMappedInt("l4.flags", headers) == 16;
-                 }),
-                 __(groupbyCreator(
-                        [](Headers headers) {
-                          return filterGroups({"ipv4.dst"}, headers);
-                        },
-                        counter, "acks"),
-                    nextOp)));
-  };
+Operator ddosSampled(Operator nextOp, SampleOptions options) {
+  int threshold = 45;
+  options.mode = SampleMode::Flow;
+  options.flowKeys = {"ipv4.src", "ipv4.dst"};
+  // The weight is the same for a whole epoch, so keeping it in the distinct
+  // key carries it through without splitting any flow.
+  return __(epochCreator(1.0, "eid"),
+            __(sampleCreator(options),
+               __(distinctCreator({"ipv4.src", "ipv4.dst", options.weightKey}),
+                  __(groupbyCreator({"ipv4.dst"},
+                                    sampledCounter(options.weightKey), "srcs",
+                                    threshold),
+                     nextOp))));
+}
 
-  auto [joinOp1, joinOp2] = ___(
-      join(
-          [](Headers headers) {
-            return std::make_pair(filterGroups({"host"}, headers),
-                                  filterGroups({"syns+synacks"}, headers));
-          },
-          [](Headers headers) {
-            return std::make_pair(
-                renameFilteredKeys({{"ipv4.dst", "host"}}, headers),
-                filterGroups({"acks"}, headers));
-          }),
-      __(mapCreator([](Headers headers) {
-           int syns_synacks = getMappedInt("syns+synacks", headers);
-           int acks = getMappedInt("acks", headers);
-           headers["syns+synacks-acks"] = OpResult::Int(syns_synacks - acks);
-           return headers;
-         }),
-         __(filterCreator([threshold](Headers headers) {
-              return keyGeqInt("syns+synacks-acks", threshold, headers);
-            }),
-            nextOp)));
+// Batch-mode versions of the Sonata queries above. Everything up to and
+// including the first stateful stage runs over column batches; the stages
+// after it see one tuple per group at reset, so they stay per-tuple.
+BatchOperator tcpNewConsBatch(Operator nextOp) {
+  int threshold = 40;
+  return __(batchEpochCreator(1.0, "eid"),
+            __(batchColumnFilterCreator(
+                   {ColumnPredicate::eq(Field::Ipv4Proto, 6),
+                    ColumnPredicate::tcpFlags(kSynOnly)}),
+               __(batchTypedGroupbyCreator({"ipv4.dst"}, CountReducer(),
+                                           "cons"),
+                  __(filterCreator([threshold](const Headers& headers) {
+                       return keyGeqInt("cons", threshold, headers);
+                     }),
+                     nextOp))));
+}
 
-  auto [joinOp3, joinOp4] =
-      ___(join(
-              [](Headers headers) {
+BatchOperator portScanBatch(Operator nextOp) {
+  int threshold = 40;
+  return __(batchEpochCreator(1.0, "eid"),
+            __(batchDistinctCreator({"ipv4.src", "l4.dport"}),
+               __(groupbyCreator({"ipv4.src"}, counter, "ports", threshold),
+                  nextOp)));
+}
+
+BatchOperator ddosBatch(Operator nextOp) {
+  int threshold = 45;
+  return __(batchEpochCreator(1.0, "eid"),
+            __(batchDistinctCreator({"ipv4.src", "ipv4.dst"}),
+               __(groupbyCreator({"ipv4.dst"}, counter, "srcs", threshold),
+                  nextOp)));
+}
+
+BatchOperator q3Offload(Operator nextOp, OffloadOptions options) {
+  return __(batchEpochCreator(100.0, "eid"),
+            __(offloadDistinctCreator({"ipv4.src", "ipv4.dst"}, options),
+               nextOp));
+}
+
+BatchOperator q4Offload(Operator nextOp, OffloadOptions options) {
+  return __(batchEpochCreator(10000.0, "eid"),
+            __(offloadCountCreator({"ipv4.dst"}, "pkts", options), nextOp));
+}
+
+// Multi-core versions of portScan and ddos. The epoch stage runs on the
+// calling thread and the stateful stages on numShards workers, partitioned by
+// the key their final groupby uses.
+Operator portScanSharded(Operator nextOp, size_t numShards,
+                         ShardOptions options) {
+  int threshold = 40;
+  // A heavy scanner's tuples are spread by port, which keeps each
+  // (src, dport) pair on one shard.
+  if (options.skew.spreadKeys.empty()) {
+    options.skew.spreadKeys = {"l4.dport"};
+    options.skew.combine = AtomicReduction::sum("ports");
+  }
+  return __(epochCreator(1.0, "eid"),
+            __(shardCreator(
+                   numShards, {"ipv4.src"},
+                   [](Operator next) {
+                     return __(distinctCreator({"ipv4.src", "l4.dport"}),
+                               __(groupbyCreator({"ipv4.src"},
+                                                 counter, "ports"),
+                                  next));
+                   },
+                   options),
+               __(filterCreator([threshold](const Headers& headers) {
+                    return keyGeqInt("ports", threshold, headers);
+                  }),
+                  nextOp)));
+}
+
+Operator ddosSharded(Operator nextOp, size_t numShards,
+                     ShardOptions options) {
+  int threshold = 45;
+  // A flooded destination would otherwise pile onto one shard. Spreading
+  // its tuples by source keeps each (src, dst) pair on one shard, so the
+  // shards' distinct sources for it are disjoint and their counts add up.
+  if (options.skew.spreadKeys.empty()) {
+    options.skew.spreadKeys = {"ipv4.src"};
+    options.skew.combine = AtomicReduction::sum("srcs");
+  }
+  return __(epochCreator(1.0, "eid"),
+            __(shardCreator(
+                   numShards, {"ipv4.dst"},
+                   [](Operator next) {
+                     return __(distinctCreator({"ipv4.src", "ipv4.dst"}),
+                               __(groupbyCreator({"ipv4.dst"}, counter, "srcs"),
+                                  next));
+                   },
+                   options),
+               __(filterCreator([threshold](const Headers& headers) {
+                    return keyGeqInt("srcs", threshold, headers);
+                  }),
+                  nextOp)));
+}
+
+// Multi-core version of countPkts. Its single group leaves nothing to
+// partition by, so the workers share one table instead.
+Operator countPktsConcurrent(Operator nextOp, size_t numWorkers,
+                             ConcurrentGroupbyOptions options) {
+  return __(epochCreator(1.0, "pkts"),
+            concurrentGroupbyCreator(numWorkers, nullptr, KeyProjector({}),
+                                     AtomicReduction::count(), "pkts",
+                                     options)(nextOp));
+}
+
+// The joins of synFloodSonata, after the counts: one input for the syns,
+// synacks and acks counts per epoch, in that order.
+vector<Operator> synFloodJoins(Operator nextOp) {
+  int threshold = 3;
+  // Counts that reach a join in parts are added up before they match.
+  JoinOptions summed;
+  summed.merge = joinSumMerge({"syns", "synacks", "syns+synacks", "acks"});
+
+  auto [joinOp1, joinOp2] = ___(
+      meteredCreator(
+          "synflood.join_acks",
+          join(
+              [](const Headers& headers) {
+                return std::make_pair(filterGroups({"host"}, headers),
+                                      filterGroups({"syns+synacks"}, headers));
+              },
+              [](const Headers& headers) {
                 return std::make_pair(
                     renameFilteredKeys({{"ipv4.dst", "host"}}, headers),
-                    filterGroups({"syns"}, headers));
+                    filterGroups({"acks"}, headers));
               },
-              [](Headers headers) {
-                return std::make_pair(
-                    renameFilteredKeys({{"ipv4.src", "host"}}, headers),
-                    filterGroups({"synacks"}, headers));
-              }),
-          __(mapCreator([](Headers headers) {
-               int syns = getMappedInt("syns", headers);
-               int synacks = getMappedInt("synacks", headers);
+              "eid", summed)),
+      __(meteredCreator("synflood.threshold",
+                        [threshold](Operator endOp) {
+                          return __(
+                              extendCreator([](Headers& headers) {
+                                int64_t syns_synacks =
+                                    getMappedInt("syns+synacks", headers);
+                                int64_t acks = getMappedInt("acks", headers);
+                                headers["syns+synacks-acks"] =
+                                    OpResult::Int(syns_synacks - acks);
+                              }),
+                              __(filterCreator(
+                                     [threshold](const Headers& headers) {
+                                       return keyGeqInt("syns+synacks-acks",
+                                                        threshold, headers);
+                                     }),
+                                 endOp));
+                        }),
+         nextOp));
+
+  auto [joinOp3, joinOp4] =
+      ___(meteredCreator(
+              "synflood.join_synacks",
+              join(
+                  [](const Headers& headers) {
+                    return std::make_pair(
+                        renameFilteredKeys({{"ipv4.dst", "host"}}, headers),
+                        filterGroups({"syns"}, headers));
+                  },
+                  [](const Headers& headers) {
+                    return std::make_pair(
+                        renameFilteredKeys({{"ipv4.src", "host"}}, headers),
+                        filterGroups({"synacks"}, headers));
+                  },
+                  "eid", summed)),
+          __(extendCreator([](Headers& headers) {
+               int64_t syns = getMappedInt("syns", headers);
+               int64_t synacks = getMappedInt("synacks", headers);
                headers["syns+synacks"] = OpResult::Int(syns + synacks);
-               return headers;
              }),
              joinOp1));
 
-  return {syns(joinOp3), synacks(joinOp4), acks(joinOp2)};
+  return {joinOp3, joinOp4, joinOp2};
+}
+
+// Every stage after the epoch stages is metered; metrics().prometheusText()
+// tells which is slow.
+vector<Operator> synFloodSonata(Operator nextOp) {
+  float epochDur = 1.0f;
+
+  OpCreator countSyns = meteredCreator("synflood.syns", [](Operator endOp) {
+    return __(filterCreator([](const Headers& headers) {
+                return filterHelper(6, kSynOnly, headers);
+              }),
+              __(groupbyCreator({"ipv4.dst"}, counter, "syns"),
+                 endOp));
+  });
+
+  OpCreator countSynacks =
+      meteredCreator("synflood.synacks", [](Operator endOp) {
+        return __(filterCreator([](const Headers& headers) {
+                    return filterHelper(6, kSynAckOnly, headers);
+                  }),
+                  __(groupbyCreator({"ipv4.src"}, counter, "synacks"),
+                     endOp));
+      });
+
+  OpCreator countAcks = meteredCreator("synflood.acks", [](Operator endOp) {
+    return __(filterCreator([](const Headers& headers) {
+                return filterHelper(6, kAckOnly, headers);
+              }),
+              __(groupbyCreator({"ipv4.dst"}, counter, "acks"),
+                 endOp));
+  });
+
+  OpCreator syns = [epochDur, countSyns](Operator endOp) {
+    return __(epochCreator(epochDur, "eid"), __(countSyns, endOp));
+  };
+
+  OpCreator synacks = [countSynacks](Operator endOp) {
+    return __(epochCreator(1.0, "eid"), __(countSynacks, endOp));
+  };
+
+  OpCreator acks = [epochDur, countAcks](Operator nextOp) {
+    return __(epochCreator(epochDur, "eid"), __(countAcks, nextOp));
+  };
+
+  vector<Operator> joins = synFloodJoins(nextOp);
+  return {syns(joins[0]), synacks(joins[1]), acks(joins[2])};
+}
+
+JoinOptions addressJoin() {
+  JoinOptions options;
+  options.addressCodes = true;
+  return options;
 }
 
 vector<Operator> completedFlows(Operator nextOp) {
@@ -216,51 +433,41 @@ vector<Operator> completedFlows(Operator nextOp) {
 
   OpCreator syns = [epochDur](Operator endOp) {
     return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return getMappedInt("ipv4.proto", headers) == 6 &&
-                          getMappedInt("l4.flags", headers) == 2;
+              __(filterCreator([](const Headers& headers) {
+                   return filterHelper(6, kSynOnly, headers);
                  }),
-                 __(groupbyCreator(
-                        [](Headers headers) {
-                          return filterGroups({"ipv4.dst"}, headers);
-                        },
-                        counter, "syns"),
+                 __(groupbyCreator({"ipv4.dst"}, counter, "syns"),
                     endOp)));
   };
 
   OpCreator fins = [epochDur](Operator endOp) {
     return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return getMappedInt("ipv4.proto", headers) == 6 &&
-                          (getMappedInt("l4.flags", headers) & 1) == 1;
+              __(filterCreator([](const Headers& headers) {
+                   return filterHelper(6, tcp::has(tcp::FIN), headers);
                  }),
-                 __(groupbyCreator(
-                        [](Headers headers) {
-                          return filterGroups({"ipv4.src"}, headers);
-                        },
-                        counter, "fins"),
+                 __(groupbyCreator({"ipv4.src"}, counter, "fins"),
                     endOp)));
   };
 
   auto [op1, op2] =
       ___(join(
-              [](Headers headers) {
+              [](const Headers& headers) {
                 return std::make_pair(
                     renameFilteredKeys({{"ipv4.dst", "host"}}, headers),
                     filterGroups({"syns"}, headers));
               },
-              [](Headers headers) {
+              [](const Headers& headers) {
                 return std::make_pair(
                     renameFilteredKeys({{"ipv4.src", "host"}}, headers),
                     filterGroups({"fins"}, headers));
-              }),
-          __(mapCreator([](Headers headers) {
-               int syn = getMappedInt("syns", headers);
-               int fin = getMappedInt("fins", headers);
+              },
+              "eid", addressJoin()),
+          __(extendCreator([](Headers& headers) {
+               int64_t syn = getMappedInt("syns", headers);
+               int64_t fin = getMappedInt("fins", headers);
                headers["diff"] = OpResult::Int(syn - fin);
-               return headers;
              }),
-             __(filterCreator([threshold](Headers headers) {
+             __(filterCreator([threshold](const Headers& headers) {
                   return keyGeqInt("diff", threshold, headers);
                 }),
                 nextOp)));
@@ -276,19 +483,12 @@ vector<Operator> slowloris(Operator nextOp) {
 
   OpCreator n_conns = [epochDur, t1](Operator nextOp) {
     return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return getMappedInt("ipv4.proto", headers) == 6;
+              __(filterCreator([](const Headers& headers) {
+                   return getMappedInt(fid(Field::Ipv4Proto), headers) == 6;
                  }),
-                 __(distinctCreator([](Headers headers) {
-                      return filterGroups({"ipv4.src", "ipv4.dst", "l4.sport"},
-                                          headers);
-                    }),
-                    __(groupbyCreator(
-                           [](Headers headers) {
-                             return filterGroups({"ipv4.dst"}, headers);
-                           },
-                           counter, "n_conns"),
-                       __(filterCreator([t1](Headers headers) {
+                 __(distinctCreator({"ipv4.src", "ipv4.dst", "l4.sport"}),
+                    __(groupbyCreator({"ipv4.dst"}, counter, "n_conns"),
+                       __(filterCreator([t1](const Headers& headers) {
                             return getMappedInt("n_conns", headers) >= t1;
                           }),
                           nextOp)))));
@@ -296,18 +496,13 @@ vector<Operator> slowloris(Operator nextOp) {
 
   OpCreator n_bytes = [epochDur, t2](Operator nextOp) {
     return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return getMappedInt("ipv4.proto", headers) == 6;
+              __(filterCreator([](const Headers& headers) {
+                   return getMappedInt(fid(Field::Ipv4Proto), headers) == 6;
                  }),
-                 __(groupbyCreator(
-                        [](Headers headers) {
-                          return filterGroups({"ipv4.dst"}, headers);
-                        },
-                        [](OpResult val, Headers headers) {
-                          return sumInts("ipv4.len", val, headers);
-                        },
-                        "n_bytes"),
-                    __(filterCreator([t2](Headers headers) {
+                 __(typedGroupbyCreator({"ipv4.dst"},
+                                        SumIntsReducer("ipv4.len"),
+                                        "n_bytes"),
+                    __(filterCreator([t2](const Headers& headers) {
                          return getMappedInt("n_bytes", headers) >= t2;
                        }),
                        nextOp))));
@@ -315,21 +510,21 @@ vector<Operator> slowloris(Operator nextOp) {
 
   auto [op1, op2] =
       ___(join(
-              [](Headers headers) {
+              [](const Headers& headers) {
                 return std::make_pair(filterGroups({"ipv4.dst"}, headers),
                                       filterGroups({"n_conns"}, headers));
               },
-              [](Headers headers) {
+              [](const Headers& headers) {
                 return std::make_pair(filterGroups({"ipv4.dst"}, headers),
                                       filterGroups({"n_bytes"}, headers));
-              }),
-          __(mapCreator([](Headers headers) {
-               int n_bytes = getMappedInt("n_bytes", headers);
-               int n_conns = getMappedInt("n_conns", headers);
+              },
+              "eid", addressJoin()),
+          __(extendCreator([](Headers& headers) {
+               int64_t n_bytes = getMappedInt("n_bytes", headers);
+               int64_t n_conns = getMappedInt("n_conns", headers);
                headers["bytes_per_conn"] = OpResult::Int(n_bytes / n_conns);
-               return headers;
              }),
-             __(filterCreator([t3](Headers headers) {
+             __(filterCreator([t3](const Headers& headers) {
                   return getMappedInt("bytes_per_conn", headers) <= t3;
                 }),
                 nextOp)));
@@ -337,53 +532,353 @@ vector<Operator> slowloris(Operator nextOp) {
   return {n_conns(op1), n_bytes(op2)};
 }
 
+// slowloris with a thread boundary after the stages its two branches share:
+// the epoch and the protocol filter run on the calling thread, the distinct,
+// both groupbys and the join on the exchange's consumer thread.
+Operator slowlorisPipelined(Operator nextOp, ExchangeOptions options) {
+  int t1 = 5;
+  int t2 = 500;
+  int t3 = 90;
+  float epochDur = 1.0f;
+
+  auto [op1, op2] =
+      ___(join(
+              [](const Headers& headers) {
+                return std::make_pair(filterGroups({"ipv4.dst"}, headers),
+                                      filterGroups({"n_conns"}, headers));
+              },
+              [](const Headers& headers) {
+                return std::make_pair(filterGroups({"ipv4.dst"}, headers),
+                                      filterGroups({"n_bytes"}, headers));
+              }),
+          __(extendCreator([](Headers& headers) {
+               int64_t n_bytes = getMappedInt("n_bytes", headers);
+               int64_t n_conns = getMappedInt("n_conns", headers);
+               headers["bytes_per_conn"] = OpResult::Int(n_bytes / n_conns);
+             }),
+             __(filterCreator([t3](const Headers& headers) {
+                  return getMappedInt("bytes_per_conn", headers) <= t3;
+                }),
+                nextOp)));
+
+  Operator n_conns =
+      __(distinctCreator({"ipv4.src", "ipv4.dst", "l4.sport"}),
+         __(groupbyCreator({"ipv4.dst"}, counter, "n_conns"),
+            __(filterCreator([t1](const Headers& headers) {
+                 return getMappedInt("n_conns", headers) >= t1;
+               }),
+               op1)));
+
+  Operator n_bytes =
+      __(typedGroupbyCreator({"ipv4.dst"}, SumIntsReducer("ipv4.len"),
+                             "n_bytes"),
+         __(filterCreator([t2](const Headers& headers) {
+              return getMappedInt("n_bytes", headers) >= t2;
+            }),
+            op2));
+
+  return __(epochCreator(epochDur, "eid"),
+            __(filterCreator([](const Headers& headers) {
+                 return getMappedInt(fid(Field::Ipv4Proto), headers) == 6;
+               }),
+               __(exchangeCreator(options), split()({n_conns, n_bytes}))));
+}
+
+// ddos with its first stateful stage closed off the packet path: at each
+// epoch boundary the distinct table is sealed and handed to a flusher
+// thread, which runs the groupby and the filter, while the calling thread
+// goes on with the next epoch.
+Operator ddosAsync(Operator nextOp, AsyncCloseOptions options) {
+  int threshold = 45;
+  return __(epochCreator(1.0, "eid"),
+            __(asyncDistinctCreator({"ipv4.src", "ipv4.dst"}, options),
+               __(groupbyCreator({"ipv4.dst"}, counter, "srcs", threshold),
+                  nextOp)));
+}
+
+Operator ddosReordered(Operator nextOp, WatermarkOptions options) {
+  int threshold = 45;
+  return __(watermarkEpochCreator(1.0, "eid", options),
+            __(distinctCreator({"ipv4.src", "ipv4.dst"}),
+               __(groupbyCreator({"ipv4.dst"}, counter, "srcs", threshold),
+                  nextOp)));
+}
+
+// ddos with its epoch, distinct and groupby state registered with registry,
+// so that a restarted process can restore the epoch in flight.
+Operator ddosCheckpointed(Operator nextOp, CheckpointRegistry& registry) {
+  return __(checkpointedCreator("ddos", ddos, registry), nextOp);
+}
+
+// Versions split between the nodes that see the traffic and one
+// aggregator (see partials.hpp). The Local half runs on every node, on
+// aligned epochs, up to its first stateful stage, whose output nextOp is to
+// send on; the Merge half runs on the aggregator over what the nodes sent.
+Operator tcpNewConsLocal(Operator nextOp) {
+  return __(epochCreator(1.0, "eid", true),
+            __(filterCreator([](const Headers& headers) {
+                 return filterHelper(6, kSynOnly, headers);
+               }),
+               __(groupbyCreator({"ipv4.dst"}, counter, "cons"), nextOp)));
+}
+
+Operator tcpNewConsMerge(Operator nextOp) {
+  int threshold = 40;
+  return __(typedGroupbyCreator({"ipv4.dst"}, SumReducer("cons"), "cons"),
+            __(filterCreator([threshold](const Headers& headers) {
+                 return keyGeqInt("cons", threshold, headers);
+               }),
+               nextOp));
+}
+
+Operator superSpreaderLocal(Operator nextOp) {
+  return __(epochCreator(1.0, "eid", true),
+            __(distinctCreator({"ipv4.src", "ipv4.dst"}), nextOp));
+}
+
+Operator superSpreaderMerge(Operator nextOp) {
+  int threshold = 40;
+  return __(distinctCreator({"ipv4.src", "ipv4.dst"}),
+            __(groupbyCreator({"ipv4.src"}, counter, "dsts", threshold),
+               nextOp));
+}
+
+Operator ddosLocal(Operator nextOp) {
+  return __(epochCreator(1.0, "eid", true),
+            __(distinctCreator({"ipv4.src", "ipv4.dst"}), nextOp));
+}
+
+Operator ddosMerge(Operator nextOp) {
+  int threshold = 45;
+  return __(distinctCreator({"ipv4.src", "ipv4.dst"}),
+            __(groupbyCreator({"ipv4.dst"}, counter, "srcs", threshold),
+               nextOp));
+}
+
+// Sliding-window versions, over windows of windowWidth seconds reported
+// every slide seconds. Each tuple is reduced once, into the pane of its
+// slide, rather than once for every window it falls in. The distinct stages
+// become a windowed count per distinct key, whose groups downstream groupbys
+// count at every slide.
+Operator ddosSliding(Operator nextOp, double windowWidth, double slide) {
+  int threshold = 45;
+  return __(slidingGroupbyCreator(windowWidth, slide, "eid",
+                                  {"ipv4.src", "ipv4.dst"}, windowCounter(),
+                                  "pkts"),
+            __(groupbyCreator({"ipv4.dst"}, counter, "srcs", threshold),
+               nextOp));
+}
+
+Operator slowlorisSliding(Operator nextOp, double windowWidth,
+                          double slide) {
+  int t1 = 5;
+  int t2 = 500;
+  int t3 = 90;
+
+  auto [op1, op2] =
+      ___(join(
+              [](const Headers& headers) {
+                return std::make_pair(filterGroups({"ipv4.dst"}, headers),
+                                      filterGroups({"n_conns"}, headers));
+              },
+              [](const Headers& headers) {
+                return std::make_pair(filterGroups({"ipv4.dst"}, headers),
+                                      filterGroups({"n_bytes"}, headers));
+              }),
+          __(extendCreator([](Headers& headers) {
+               int64_t n_bytes = getMappedInt("n_bytes", headers);
+               int64_t n_conns = getMappedInt("n_conns", headers);
+               headers["bytes_per_conn"] = OpResult::Int(n_bytes / n_conns);
+             }),
+             __(filterCreator([t3](const Headers& headers) {
+                  return getMappedInt("bytes_per_conn", headers) <= t3;
+                }),
+                nextOp)));
+
+  Operator n_conns =
+      __(slidingGroupbyCreator(windowWidth, slide, "eid",
+                               {"ipv4.src", "ipv4.dst", "l4.sport"},
+                               windowCounter(), "pkts"),
+         __(groupbyCreator({"ipv4.dst"}, counter, "n_conns"),
+            __(filterCreator([t1](const Headers& headers) {
+                 return getMappedInt("n_conns", headers) >= t1;
+               }),
+               op1)));
+
+  Operator n_bytes =
+      __(slidingGroupbyCreator(windowWidth, slide, "eid", {"ipv4.dst"},
+                               windowSumInts("ipv4.len"), "n_bytes"),
+         __(filterCreator([t2](const Headers& headers) {
+              return getMappedInt("n_bytes", headers) >= t2;
+            }),
+            op2));
+
+  return __(filterCreator([](const Headers& headers) {
+              return getMappedInt(fid(Field::Ipv4Proto), headers) == 6;
+            }),
+            split()({n_conns, n_bytes}));
+}
+
+// The join of joinTest, taking the syns and then the synacks.
+pair<Operator, Operator> joinTestJoin(Operator nextOp) {
+  return ___(join(
+                 [](const Headers& headers) {
+                   return std::make_pair(
+                       renameFilteredKeys({{"ipv4.src", "host"}}, headers),
+                       renameFilteredKeys({{"ipv4.dst", "remote"}}, headers));
+                 },
+                 [](const Headers& headers) {
+                   return std::make_pair(
+                       renameFilteredKeys({{"ipv4.dst", "host"}}, headers),
+                       filterGroups({"time"}, headers));
+                 }),
+             nextOp);
+}
+
 vector<Operator> joinTest(Operator nextOp) {
   float epochDur = 1.0f;
 
   OpCreator syns = [epochDur](Operator nextOp) {
     return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return filterHelper(6, 2, headers);
+              __(filterCreator([](const Headers& headers) {
+                   return filterHelper(6, kSynOnly, headers);
                  }),
                  nextOp));
   };
 
   OpCreator synacks = [epochDur](Operator nextOp) {
     return __(epochCreator(epochDur, "eid"),
-              __(filterCreator([](Headers headers) {
-                   return filterHelper(6, 18, headers);
+              __(filterCreator([](const Headers& headers) {
+                   return filterHelper(6, kSynAckOnly, headers);
                  }),
                  nextOp));
   };
 
-  auto [op1, op2] =
-      ___(join(
-              [](Headers headers) {
-                return std::make_pair(
-                    renameFilteredKeys({{"ipv4.src", "host"}}, headers),
-                    renameFilteredKeys({{"ipv4.dst", "remote"}}, headers));
-              },
-              [](Headers headers) {
-                return std::make_pair(
-                    renameFilteredKeys({{"ipv4.dst", "host"}}, headers),
-                    filterGroups({"time"}, headers));
-              }),
-          nextOp);
-
+  auto [op1, op2] = joinTestJoin(nextOp);
   return {syns(op1), synacks(op2)};
 }
 
+vector<Operator> sonataSuite(Operator nextOp) {
+  vector<Operator> ops = {tcpNewCons(nextOp),    sshBruteForce(nextOp),
+                          superSpreader(nextOp), portScan(nextOp),
+                          ddos(nextOp),          distinctSrcs(nextOp)};
+  for (vector<Operator> inputs : {synFloodSonata(nextOp), joinTest(nextOp)}) {
+    ops.insert(ops.end(), inputs.begin(), inputs.end());
+  }
+  return ops;
+}
+
+// Every query starts with the same epoch, so there is one epoch stage in the
+// compiled plan. tcpNewCons, the syns of synFloodSonata and joinTest share
+// the SYN filter after it, and superSpreader and ddos their distinct stage.
+plan::Plan sonataPlan(Operator nextOp) {
+  auto atLeast = [](string key, int threshold) {
+    return plan::filter(key + ">=" + to_string(threshold), {key},
+                        [key, threshold](const Headers& headers) {
+                          return keyGeqInt(key, threshold, headers);
+                        });
+  };
+  auto count = [](vector<string> groupKeys, string outKey) {
+    return plan::groupby(move(groupKeys), "counter", counter, outKey);
+  };
+
+  plan::Stage epoch = plan::epoch(1.0, "eid");
+  plan::Stage syns = plan::filter("tcp_syn", {"ipv4.proto", "l4.flags"},
+                                  [](const Headers& headers) {
+                                    return filterHelper(6, kSynOnly, headers);
+                                  });
+  plan::Stage synacks = plan::filter("tcp_synack", {"ipv4.proto", "l4.flags"},
+                                     [](const Headers& headers) {
+                                       return filterHelper(6, kSynAckOnly, headers);
+                                     });
+  plan::Stage acks = plan::filter(
+      "tcp_ack", {"ipv4.proto", "l4.flags"}, [](const Headers& headers) {
+        return filterHelper(6, kAckOnly, headers);
+      });
+  plan::Stage ssh = plan::filter(
+      "tcp_dport_22", {"ipv4.proto", "l4.dport"}, [](const Headers& headers) {
+        return getMappedInt(fid(Field::Ipv4Proto), headers) == 6 &&
+               getMappedInt(fid(Field::L4Dport), headers) == 22;
+      });
+
+  plan::Plan p;
+  p.add({epoch, syns, count({"ipv4.dst"}, "cons"), atLeast("cons", 40)},
+        nextOp);
+  p.add({epoch, ssh, plan::distinct({"ipv4.src", "ipv4.dst", "ipv4.len"}),
+         count({"ipv4.dst", "ipv4.len"}, "srcs"), atLeast("srcs", 40)},
+        nextOp);
+  p.add({epoch, plan::distinct({"ipv4.src", "ipv4.dst"}),
+         count({"ipv4.src"}, "dsts"), atLeast("dsts", 40)},
+        nextOp);
+  p.add({epoch, plan::distinct({"ipv4.src", "l4.dport"}),
+         count({"ipv4.src"}, "ports"), atLeast("ports", 40)},
+        nextOp);
+  p.add({epoch, plan::distinct({"ipv4.src", "ipv4.dst"}),
+         count({"ipv4.dst"}, "srcs"), atLeast("srcs", 45)},
+        nextOp);
+  p.add({epoch, plan::distinct({"ipv4.src"}), count({}, "srcs")}, nextOp);
+
+  vector<Operator> synFlood = synFloodJoins(nextOp);
+  p.add({epoch, syns, count({"ipv4.dst"}, "syns")}, synFlood[0]);
+  p.add({epoch, synacks, count({"ipv4.src"}, "synacks")}, synFlood[1]);
+  p.add({epoch, acks, count({"ipv4.dst"}, "acks")}, synFlood[2]);
+
+  auto [synsIn, synacksIn] = joinTestJoin(nextOp);
+  p.add({epoch, syns}, synsIn);
+  p.add({epoch, synacks}, synacksIn);
+  return p;
+}
+
+// tcpNewCons and synFloodSonata as query specs, compiled when called.
+// synFloodSpec takes the packet stream once: its three counts share the
+// epoch stage.
+const char kTcpNewConsSpec[] = R"(
+    query new_cons = input
+      |> epoch(1.0, eid)
+      |> filter(ipv4.proto == 6 && l4.flags == 2)
+      |> groupby([ipv4.dst], count, cons)
+      |> filter(cons >= 40);
+  )";
+
+const char kSynFloodSpec[] = R"(
+    query syns = input
+      |> epoch(1.0, eid)
+      |> filter(ipv4.proto == 6 && l4.flags == 2)
+      |> groupby([ipv4.dst], count, syns);
+    query synacks = input
+      |> epoch(1.0, eid)
+      |> filter(ipv4.proto == 6 && l4.flags == 18)
+      |> groupby([ipv4.src], count, synacks);
+    query acks = input
+      |> epoch(1.0, eid)
+      |> filter(ipv4.proto == 6 && l4.flags == 16)
+      |> groupby([ipv4.dst], count, acks);
+    query syns_synacks = join(syns by [ipv4.dst as host] with [syns],
+                              synacks by [ipv4.src as host] with [synacks])
+      |> map(`syns+synacks` = syns + synacks);
+    query synflood = join(syns_synacks by [host] with [`syns+synacks`],
+                          acks by [ipv4.dst as host] with [acks])
+      |> map(`syns+synacks-acks` = `syns+synacks` - acks)
+      |> filter(`syns+synacks-acks` >= 3);
+  )";
+
+Operator tcpNewConsSpec(Operator nextOp) {
+  return compileQuerySpec(kTcpNewConsSpec, nextOp).compile();
+}
+
+Operator synFloodSpec(Operator nextOp) {
+  return compileQuerySpec(kSynFloodSpec, nextOp).compile();
+}
+
 OpCreator q3 = [](Operator nextOp) {
   return __(epochCreator(100.0f, "eid"),
-            __(distinctCreator([](Headers headers) {
-                 return filterGroups({"ipv4.src", "ipv4.dst"}, headers);
-               }),
+            __(distinctCreator({"ipv4.src", "ipv4.dst"}),
                nextOp));
 };
 
 OpCreator q4 = [](Operator nextOp) {
   return __(epochCreator(10000.0f, "eid"), __(groupbyCreator(
-                                                  [](Headers headers) {
+                                                  [](const Headers& headers) {
                                                     return filterGroups(
                                                         {"ipv4.dst"}, headers);
                                                   },
@@ -391,31 +886,211 @@ OpCreator q4 = [](Operator nextOp) {
                                               nextOp));
 };
 
-vector<Operator> queries = {q4(dumpAsCSV())};
+namespace {
 
-void runQueries() {
-  for (int i = 0; i < 4; ++i) {
-    Headers tup;
+QueryInfo singleQuery(function<Operator(Operator)> query,
+                      vector<string> fields, double epochWidth = 1.0) {
+  QueryInfo info;
+  info.fields = move(fields);
+  info.epochWidth = epochWidth;
+  info.build = [query](Operator nextOp) {
+    return vector<Operator>{query(nextOp)};
+  };
+  return info;
+}
+
+QueryInfo multiQuery(function<vector<Operator>(Operator)> query,
+                     vector<string> fields) {
+  QueryInfo info;
+  info.fields = move(fields);
+  info.build = move(query);
+  return info;
+}
+
+QueryRegistry registerSonataQueries() {
+  const vector<string> srcDst = {"ipv4.src", "ipv4.dst"};
+  const vector<string> tcpSrcDst = {"ipv4.proto", "l4.flags", "ipv4.src",
+                                    "ipv4.dst"};
+
+  QueryRegistry registry;
+  registry.add("ident", singleQuery(ident, {}, 0.0));
+  QueryInfo countPktsInfo = singleQuery(countPkts, {});
+  countPktsInfo.buildSharded = [](Operator nextOp, size_t numShards) {
+    return countPktsConcurrent(nextOp, numShards);
+  };
+  registry.add("countPkts", move(countPktsInfo));
+  registry.add("pktsPerSrcDist", singleQuery(pktsPerSrcDist, srcDst));
+  registry.add("distinctSrcs", singleQuery(distinctSrcs, {"ipv4.src"}));
+  registry.add("tcpNewCons",
+               singleQuery(tcpNewCons, {"ipv4.proto", "l4.flags", "ipv4.dst"}));
+  registry.add("sshBruteForce",
+               singleQuery(sshBruteForce, {"ipv4.proto", "l4.dport",
+                                           "ipv4.src", "ipv4.dst", "ipv4.len"}));
+  registry.add("superSpreader", singleQuery(superSpreader, srcDst));
 
-    tup["time"] = OpResult::Float(0.0 + static_cast<float>(i));
-    tup["eth.src"] = OpResult::MAC(MACAddress("\x00\x11\x22\x33\x44\x55"));
-    tup["eth.dst"] = OpResult::MAC(MACAddress("\xAA\xBB\xCC\xDD\xEE\xFF"));
-    tup["eth.ethertype"] = OpResult::Int(0x0800);
+  QueryInfo portScanInfo = singleQuery(portScan, {"ipv4.src", "l4.dport"});
+  portScanInfo.buildSharded = [](Operator nextOp, size_t numShards) {
+    return portScanSharded(nextOp, numShards);
+  };
+  registry.add("portScan", move(portScanInfo));
+  QueryInfo ddosInfo = singleQuery(ddos, srcDst);
+  ddosInfo.buildSharded = [](Operator nextOp, size_t numShards) {
+    return ddosSharded(nextOp, numShards);
+  };
+  registry.add("ddos", move(ddosInfo));
+
+  registry.add("synFloodSonata", multiQuery(synFloodSonata, tcpSrcDst));
+  registry.add("completedFlows", multiQuery(completedFlows, tcpSrcDst));
+  registry.add("slowloris",
+               multiQuery(slowloris, {"ipv4.proto", "ipv4.src", "ipv4.dst",
+                                      "l4.sport", "ipv4.len"}));
+  registry.add("joinTest", multiQuery(joinTest, tcpSrcDst));
 
-    tup["ipv4.hlen"] = OpResult::Int(20 + i);
-    tup["ipv4.proto"] = OpResult::Int(6);
-    tup["ipv4.len"] = OpResult::Int(60);
-    tup["ipv4.src"] = OpResult::IPv4(IPv4Address("127.0.0.1"));
-    tup["ipv4.dst"] = OpResult::IPv4(IPv4Address("192.6.8.1"));
+  registry.add("distinctSrcsApprox",
+               singleQuery(distinctSrcsApprox, {"ipv4.src"}));
+  registry.add("tcpNewConsApprox",
+               singleQuery(tcpNewConsApprox,
+                           {"ipv4.proto", "l4.flags", "ipv4.dst"}));
+  registry.add("portScanApprox",
+               singleQuery(portScanApprox, {"ipv4.src", "l4.dport"}));
+  registry.add("ddosApprox", singleQuery(ddosApprox, srcDst));
+  registry.add("superSpreaderDedup", singleQuery(superSpreaderDedup, srcDst));
+  registry.add("portScanDedup",
+               singleQuery(portScanDedup, {"ipv4.src", "l4.dport"}));
+  registry.add("topDestinations", singleQuery(topDestinations, {"ipv4.dst"}));
+
+  registry.add("tcpNewConsSpec",
+               singleQuery(tcpNewConsSpec,
+                           {"ipv4.proto", "l4.flags", "ipv4.dst"}));
+  registry.add("synFloodSpec", singleQuery(synFloodSpec, tcpSrcDst));
+  registry.add("q3", singleQuery(q3, srcDst, 100.0));
+  registry.add("q4", singleQuery(q4, {"ipv4.dst"}, 10000.0));
+  return registry;
+}
 
-    tup["l4.sport"] = OpResult::Int(440);
-    tup["l4.dport"] = OpResult::Int(50000);
-    tup["l4.flags"] = OpResult::Int(10);
+// The queries of the drivers, once built.
+unique_ptr<vector<Operator>> active;
 
-    for (auto& query : queries) {
+}  // namespace
+
+const QueryRegistry& sonataQueries() {
+  static const QueryRegistry registry = registerSonataQueries();
+  return registry;
+}
+
+vector<Operator>& queries() {
+  if (!active) {
+    active = make_unique<vector<Operator>>(
+        sonataQueries().build({QueryConfig{"q4"}}));
+  }
+  return *active;
+}
+
+void loadQueries(const string& configFile) {
+  active = make_unique<vector<Operator>>(
+      sonataQueries().build(readQueryConfig(configFile)));
+}
+
+Headers syntheticTuple(int i) {
+  Headers tup;
+
+  tup[Field::Time] = OpResult::Float(0.0 + static_cast<double>(i));
+  tup[Field::EthSrc] = OpResult::MAC(MACAddress(0x001122334455));
+  tup[Field::EthDst] = OpResult::MAC(MACAddress(0xAABBCCDDEEFF));
+  tup[Field::EthEthertype] = OpResult::Int(0x0800);
+
+  tup[Field::Ipv4Hlen] = OpResult::Int(20 + i);
+  tup[Field::Ipv4Proto] = OpResult::Int(6);
+  tup[Field::Ipv4Len] = OpResult::Int(60);
+  tup[Field::Ipv4Src] = OpResult::IPv4(IPv4Address("127.0.0.1"));
+  tup[Field::Ipv4Dst] = OpResult::IPv4(IPv4Address("192.6.8.1"));
+
+  tup[Field::L4Sport] = OpResult::Int(440);
+  tup[Field::L4Dport] = OpResult::Int(50000);
+  tup[Field::L4Flags] = OpResult::Int((tcp::SYN | tcp::PSH).bits());
+
+  return tup;
+}
+
+void runQueries() {
+  for (int i = 0; i < 4; ++i) {
+    Headers tup = syntheticTuple(i);
+    for (auto& query : queries()) {
       query.next(tup);
     }
   }
 
   std::cout << "Done\n";
 }
+
+// runQueries with every query run as a task on a work-stealing pool of
+// numThreads threads, so that the queries proceed in parallel.
+void runQueriesParallel(size_t numThreads) {
+  WorkStealingPool pool(numThreads);
+  {
+    Operator dispatch = parallelFanout(queries(), pool);
+    for (int i = 0; i < 4; ++i) {
+      dispatch.next(syntheticTuple(i));
+    }
+  }
+  pool.wait();
+
+  std::cout << "Done\n";
+}
+
+void runQueriesScheduled(const string& configFile, size_t numThreads) {
+  QuerySchedulerOptions options;
+  options.numThreads = numThreads;
+  QueryScheduler scheduler(options);
+  sonataQueries().schedule(readQueryConfig(configFile), scheduler);
+  Operator input = scheduler.input();
+  for (int i = 0; i < 4; ++i) {
+    input.next(syntheticTuple(i));
+  }
+  scheduler.wait();
+
+  std::cout << "Done\n";
+}
+
+// Runs queries over live traffic from interface until stop is set.
+void runLiveQueries(const string& interface, const atomic<bool>& stop) {
+  vector<BatchOperator> ops;
+  for (auto& query : queries()) {
+    ops.push_back(unbatch(query));
+  }
+  BatchOperator fanout = batchFanout(ops);
+
+  CaptureOptions options;
+  options.interface = interface;
+  PacketCapture capture(options);
+  capture.run(fanout, stop);
+}
+
+void runLiveSpec(const string& interface, const string& spec, Operator nextOp,
+                 const atomic<bool>& stop) {
+  BatchOperator op = unbatch(compileQuerySpec(spec, nextOp).compile());
+
+  CaptureOptions options;
+  options.interface = interface;
+  options.filter = packetFilterForSpec(spec);
+  PacketCapture capture(options);
+  capture.run(op, stop);
+}
+
+// Replays a capture file through queries, as fast as possible when speed is
+// 0 and at speed times the recorded rate otherwise.
+ReplayStats replayQueries(const string& filename, double speed) {
+  ReplayOptions options;
+  options.speed = speed;
+  return replayPcap(filename, queries(), options);
+}
+
+TrafficStats runSyntheticQueries(const TrafficOptions& options,
+                                 uint64_t packets, size_t numThreads) {
+  vector<BatchOperator> ops;
+  for (auto& query : queries()) {
+    ops.push_back(unbatch(query));
+  }
+  BatchOperator fanout = batchFanout(ops);
+  return runTraffic(TrafficGenerator(options), fanout, packets, numThreads);
+}
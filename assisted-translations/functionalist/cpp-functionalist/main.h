@@ -0,0 +1,234 @@
+#ifndef MAIN_H
+#define MAIN_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "async_close.hpp"
+#include "batch.hpp"
+#include "builtins.hpp"
+#include "capture.hpp"
+#include "checkpoint.hpp"
+#include "exchange.hpp"
+#include "fanout.hpp"
+#include "kernels.hpp"
+#include "metrics.hpp"
+#include "offload.hpp"
+#include "output.hpp"
+#include "partials.hpp"
+#include "pcap.hpp"
+#include "pipeline.hpp"
+#include "plan.hpp"
+#include "query_registry.hpp"
+#include "query_spec.hpp"
+#include "reducers.hpp"
+#include "sampling.hpp"
+#include "shard.hpp"
+#include "sketch.hpp"
+#include "sliding_window.hpp"
+#include "tcp_flags.hpp"
+#include "topology.hpp"
+#include "traffic_gen.hpp"
+#include "tuple_log.hpp"
+#include "utils.hpp"
+#include "watermark.hpp"
+
+using namespace std;
+
+// The queries of the Sonata paper and the original implementation. Each
+// takes the operator to pass its results to; queries over several streams
+// return one input operator per stream.
+Operator ident(Operator nextOp);
+Operator countPkts(Operator nextOp);
+Operator pktsPerSrcDist(Operator nextOp);
+// The TCP segments in each direction of a handshake, with no other flag set.
+constexpr TcpFlagTest kSynOnly = tcp::is(tcp::SYN);
+constexpr TcpFlagTest kSynAckOnly = tcp::is(tcp::SYN | tcp::ACK);
+constexpr TcpFlagTest kAckOnly = tcp::is(tcp::ACK);
+bool filterHelper(int proto, TcpFlagTest flags, const Headers& headers);
+Operator distinctSrcs(Operator nextOp);
+Operator tcpNewCons(Operator nextOp);
+Operator sshBruteForce(Operator nextOp);
+Operator superSpreader(Operator nextOp);
+Operator portScan(Operator nextOp);
+Operator ddos(Operator nextOp);
+vector<Operator> synFloodJoins(Operator nextOp);
+vector<Operator> synFloodSonata(Operator nextOp);
+// JoinOptions of the joins keyed by one host address below.
+JoinOptions addressJoin();
+vector<Operator> completedFlows(Operator nextOp);
+vector<Operator> slowloris(Operator nextOp);
+pair<Operator, Operator> joinTestJoin(Operator nextOp);
+vector<Operator> joinTest(Operator nextOp);
+extern OpCreator q3;
+extern OpCreator q4;
+
+// The single-stream queries above, with synFloodSonata and joinTest, over
+// one input: the inputs of every query, each building its own stages.
+vector<Operator> sonataSuite(Operator nextOp);
+// The same queries as one plan, in which the stages they share are built
+// and run once.
+plan::Plan sonataPlan(Operator nextOp);
+
+// Versions compiled from query specs, and the specs.
+extern const char kTcpNewConsSpec[];
+extern const char kSynFloodSpec[];
+Operator tcpNewConsSpec(Operator nextOp);
+Operator synFloodSpec(Operator nextOp);
+
+// Sketch-based versions, in bounded memory.
+Operator distinctSrcsApprox(Operator nextOp);
+Operator tcpNewConsApprox(Operator nextOp);
+Operator portScanApprox(Operator nextOp);
+Operator ddosApprox(Operator nextOp);
+Operator superSpreaderDedup(Operator nextOp);
+Operator portScanDedup(Operator nextOp);
+Operator topDestinations(Operator nextOp);
+
+// ddos with load shedding: (src, dst) flows are sampled whole, at the rate
+// and backlog control of options, and the sources counted per destination
+// are scaled back up before the threshold. The mode and flow fields of
+// options are set by the query.
+Operator ddosSampled(Operator nextOp, SampleOptions options = SampleOptions());
+
+// Batch-mode versions.
+BatchOperator tcpNewConsBatch(Operator nextOp);
+BatchOperator portScanBatch(Operator nextOp);
+BatchOperator ddosBatch(Operator nextOp);
+
+// q3 and q4 with their tables aggregated off the packet path, for forensics
+// over whole traces; see offload.hpp.
+BatchOperator q3Offload(Operator nextOp,
+                        OffloadOptions options = OffloadOptions());
+BatchOperator q4Offload(Operator nextOp,
+                        OffloadOptions options = OffloadOptions());
+
+// Multi-threaded versions.
+Operator portScanSharded(Operator nextOp, size_t numShards,
+                         ShardOptions options = ShardOptions());
+Operator ddosSharded(Operator nextOp, size_t numShards,
+                     ShardOptions options = ShardOptions());
+Operator countPktsConcurrent(
+    Operator nextOp, size_t numWorkers,
+    ConcurrentGroupbyOptions options = ConcurrentGroupbyOptions());
+Operator slowlorisPipelined(Operator nextOp,
+                            ExchangeOptions options = ExchangeOptions());
+Operator ddosAsync(Operator nextOp,
+                   AsyncCloseOptions options = AsyncCloseOptions());
+
+// A version for input that arrives out of time order by up to
+// options.allowedLateness seconds.
+Operator ddosReordered(Operator nextOp,
+                       WatermarkOptions options = WatermarkOptions());
+
+// Versions whose state is snapshotted to, and restored from, registry.
+Operator ddosCheckpointed(Operator nextOp, CheckpointRegistry& registry);
+
+// Versions split between nodes and an aggregator: run the Local half on
+// each node into a partialSender, and the Merge half on the aggregator into
+// PartialAggregator::run.
+Operator tcpNewConsLocal(Operator nextOp);
+Operator tcpNewConsMerge(Operator nextOp);
+Operator superSpreaderLocal(Operator nextOp);
+Operator superSpreaderMerge(Operator nextOp);
+Operator ddosLocal(Operator nextOp);
+Operator ddosMerge(Operator nextOp);
+
+// Sliding-window versions.
+Operator ddosSliding(Operator nextOp, double windowWidth = 10.0,
+                     double slide = 1.0);
+Operator slowlorisSliding(Operator nextOp, double windowWidth = 10.0,
+                          double slide = 1.0);
+
+// Statically composed versions of the Sonata queries above. The whole chain,
+// sink included, is one concrete type; wrap it with pipeline::toOperator to
+// hand it to code expecting an Operator.
+template <typename Sink>
+auto tcpNewConsPipeline(Sink sink) {
+  int threshold = 40;
+  FieldId consId = internField("cons");
+  return pipeline::epoch(1.0, "eid") |
+         pipeline::filter([](const Headers& headers) {
+           return filterHelper(6, kSynOnly, headers);
+         }) |
+         pipeline::groupby(
+             [](const Headers& headers) {
+               return filterGroups({"ipv4.dst"}, headers);
+             },
+             counter, "cons") |
+         pipeline::filter([threshold, consId](const Headers& headers) {
+           return keyGeqInt(consId, threshold, headers);
+         }) |
+         sink;
+}
+
+template <typename Sink>
+auto portScanPipeline(Sink sink) {
+  int threshold = 40;
+  FieldId portsId = internField("ports");
+  return pipeline::epoch(1.0, "eid") |
+         pipeline::distinct([](const Headers& headers) {
+           return filterGroups({"ipv4.src", "l4.dport"}, headers);
+         }) |
+         pipeline::groupby(
+             [](const Headers& headers) {
+               return filterGroups({"ipv4.src"}, headers);
+             },
+             counter, "ports") |
+         pipeline::filter([threshold, portsId](const Headers& headers) {
+           return keyGeqInt(portsId, threshold, headers);
+         }) |
+         sink;
+}
+
+template <typename Sink>
+auto ddosPipeline(Sink sink) {
+  int threshold = 45;
+  FieldId srcsId = internField("srcs");
+  return pipeline::epoch(1.0, "eid") |
+         pipeline::distinct([](const Headers& headers) {
+           return filterGroups({"ipv4.src", "ipv4.dst"}, headers);
+         }) |
+         pipeline::groupby(
+             [](const Headers& headers) {
+               return filterGroups({"ipv4.dst"}, headers);
+             },
+             counter, "srcs") |
+         pipeline::filter([threshold, srcsId](const Headers& headers) {
+           return keyGeqInt(srcsId, threshold, headers);
+         }) |
+         sink;
+}
+
+// The single-stream queries above and the multi-stream ones that read one
+// packet stream, by name, for configs to pick from.
+const QueryRegistry& sonataQueries();
+
+// The queries run by the drivers below, built on first use: those of the
+// last loadQueries, or q4 to standard output.
+vector<Operator>& queries();
+// Builds the queries configFile names from sonataQueries, in place of the
+// current ones. Throws as readQueryConfig and QueryRegistry::build do.
+void loadQueries(const string& configFile);
+
+// A TCP packet from 127.0.0.1:440 to 192.6.8.1:50000 at time i.
+Headers syntheticTuple(int i);
+void runQueries();
+void runQueriesParallel(size_t numThreads = 0);
+// runQueries with the queries of configFile run by a QueryScheduler of
+// numThreads workers, each with the weight, CPU share and queue its config
+// gives.
+void runQueriesScheduled(const string& configFile, size_t numThreads = 0);
+void runLiveQueries(const string& interface, const atomic<bool>& stop);
+// Runs the queries of spec on the traffic of interface until stop is set,
+// with the packets none of them reads dropped by the kernel.
+void runLiveSpec(const string& interface, const string& spec, Operator nextOp,
+                 const atomic<bool>& stop);
+ReplayStats replayQueries(const string& filename, double speed = 0.0);
+// Runs queries over packets of the traffic of options, generated on
+// numThreads threads.
+TrafficStats runSyntheticQueries(const TrafficOptions& options,
+                                 uint64_t packets, size_t numThreads = 1);
+
+#endif  // MAIN_H
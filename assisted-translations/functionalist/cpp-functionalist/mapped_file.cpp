@@ -0,0 +1,64 @@
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+MappedFile::MappedFile(const string& filename) : filename(filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw runtime_error("Error: could not open \"" + filename +
+                        "\": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    throw runtime_error("Error: could not stat \"" + filename +
+                        "\": " + strerror(err));
+  }
+  length = static_cast<size_t>(st.st_size);
+  if (length > 0) {
+    void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      throw runtime_error("Error: could not map \"" + filename +
+                          "\": " + strerror(err));
+    }
+    madvise(addr, length, MADV_SEQUENTIAL);
+    base = static_cast<const char*>(addr);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() { unmap(); }
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : filename(move(other.filename)),
+      base(exchange(other.base, nullptr)),
+      length(exchange(other.length, 0)) {}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+  if (this != &other) {
+    unmap();
+    filename = move(other.filename);
+    base = exchange(other.base, nullptr);
+    length = exchange(other.length, 0);
+  }
+  return *this;
+}
+
+void MappedFile::unmap() {
+  if (base != nullptr) {
+    munmap(const_cast<char*>(base), length);
+    base = nullptr;
+    length = 0;
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+// A read-only memory mapping of a whole file, unmapped on destruction.
+class MappedFile {
+ public:
+  // Throws runtime_error if the file cannot be opened or mapped.
+  explicit MappedFile(const string& filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+
+  const char* data() const { return base; }
+  size_t size() const { return length; }
+  const string& name() const { return filename; }
+
+ private:
+  string filename;
+  const char* base = nullptr;
+  size_t length = 0;
+
+  void unmap();
+};
+
+#endif  // MAPPED_FILE_H
@@ -0,0 +1,152 @@
+#include "memory_budget.hpp"
+
+#include <stdexcept>
+
+#include "metrics.hpp"
+
+namespace {
+
+// The false-positive rate of the Sketch policy's distinct filters.
+constexpr double kSeenKeysRate = 1e-3;
+
+thread_local const BudgetScope* buildingBudget = nullptr;
+
+}  // namespace
+
+MemoryBudget::MemoryBudget(string name, size_t capBytes,
+                           shared_ptr<MemoryBudget> parent)
+    : budgetName(move(name)), capBytes(capBytes), parent(move(parent)) {}
+
+bool MemoryBudget::chargeHere(size_t bytes) {
+  size_t limit = cap();
+  uint64_t now = usedBytes.load(memory_order_relaxed);
+  do {
+    if (limit != 0 && now + bytes > limit) {
+      deniedCharges.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+  } while (!usedBytes.compare_exchange_weak(now, now + bytes,
+                                            memory_order_relaxed));
+  uint64_t high = peakBytes.load(memory_order_relaxed);
+  while (now + bytes > high &&
+         !peakBytes.compare_exchange_weak(high, now + bytes,
+                                          memory_order_relaxed)) {
+  }
+  return true;
+}
+
+bool MemoryBudget::tryCharge(size_t bytes) {
+  if (!chargeHere(bytes)) {
+    return false;
+  }
+  if (parent && !parent->tryCharge(bytes)) {
+    usedBytes.fetch_sub(bytes, memory_order_relaxed);
+    deniedCharges.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void MemoryBudget::release(size_t bytes) {
+  usedBytes.fetch_sub(bytes, memory_order_relaxed);
+  if (parent) {
+    parent->release(bytes);
+  }
+}
+
+const shared_ptr<MemoryBudget>& globalMemoryBudget() {
+  static const shared_ptr<MemoryBudget> global = [] {
+    auto budget = make_shared<MemoryBudget>("global");
+    metrics().addBudget(budget);
+    return budget;
+  }();
+  return global;
+}
+
+TableAdmission::TableAdmission(shared_ptr<MemoryBudget> budget,
+                               BudgetPolicy policy, size_t bytesPerKey,
+                               size_t sketchKeys, string spillDir)
+    : budget(move(budget)),
+      tablePolicy(policy),
+      bytesPerKey(bytesPerKey),
+      sketchKeys(sketchKeys),
+      spillDir(move(spillDir)) {}
+
+void TableAdmission::releaseKeys(size_t n) {
+  size_t bytes = min(charged, n * bytesPerKey);
+  charged -= bytes;
+  budget->release(bytes);
+  refusing = false;
+}
+
+void TableAdmission::releaseAll() {
+  budget->release(charged);
+  charged = 0;
+  refusing = false;
+}
+
+SpaceSaving& TableAdmission::heavyGroups() {
+  if (!groups) {
+    groups = make_unique<SpaceSaving>(sketchKeys);
+  }
+  return *groups;
+}
+
+CuckooFilter& TableAdmission::seenKeys() {
+  if (!seen) {
+    seen = make_unique<CuckooFilter>(sketchKeys, kSeenKeysRate);
+  }
+  return *seen;
+}
+
+GroupSpill& TableAdmission::spill() {
+  if (!runs) {
+    runs = make_unique<GroupSpill>(spillDir);
+  }
+  return *runs;
+}
+
+void TableAdmission::clearSketches() {
+  if (groups) {
+    groups->clear();
+  }
+  if (seen) {
+    seen->clear();
+  }
+}
+
+BudgetScope::BudgetScope(shared_ptr<MemoryBudget> budget, BudgetPolicy policy,
+                         size_t sketchKeys, string spillDir)
+    : saved(buildingBudget),
+      budget(move(budget)),
+      policy(policy),
+      sketchKeys(max<size_t>(sketchKeys, 1)),
+      spillDir(move(spillDir)) {
+  buildingBudget = this;
+}
+
+BudgetScope::~BudgetScope() { buildingBudget = saved; }
+
+shared_ptr<TableAdmission> admitTable(size_t bytesPerKey) {
+  if (buildingBudget == nullptr || !buildingBudget->budget) {
+    return nullptr;
+  }
+  return make_shared<TableAdmission>(buildingBudget->budget,
+                                     buildingBudget->policy, bytesPerKey,
+                                     buildingBudget->sketchKeys,
+                                     buildingBudget->spillDir);
+}
+
+BudgetPolicy parseBudgetPolicy(const string& text) {
+  if (text == "shed") {
+    return BudgetPolicy::Shed;
+  }
+  if (text == "sketch") {
+    return BudgetPolicy::Sketch;
+  }
+  if (text == "spill") {
+    return BudgetPolicy::Spill;
+  }
+  throw invalid_argument("Error: unknown budget policy \"" + text +
+                         "\"; expected shed, sketch or spill");
+}
@@ -0,0 +1,188 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "packed_key.hpp"
+#include "sketch.hpp"
+#include "spill.hpp"
+
+using namespace std;
+
+// Caps on the memory the groupby, distinct and join tables of a query may
+// hold within an epoch, so that a burst of new keys, such as a scan, cannot
+// grow them without bound. Tables charge their budget for each key they
+// add, at the bytes the key costs them, and release it all when the epoch
+// closes; a key the budget has no room for is handled by the policy of the
+// stage instead of being added. Stages built outside any BudgetScope are
+// not charged at all.
+
+// Keys each sketch of the Sketch policy tracks unless a BudgetScope says
+// otherwise.
+constexpr size_t kBudgetSketchKeys = 4096;
+
+// What a stage does with a new key its budget has no room for.
+enum class BudgetPolicy {
+  // Drop the tuple, counting it.
+  Shed,
+  // Track the key, and every other one past the cap, in a sketch of fixed
+  // size instead. A groupby keeps the heaviest such groups in a SpaceSaving
+  // and passes them on at reset with their approximate tuple count in its
+  // outKey, which only suits counting groupbys; a distinct passes each such
+  // key on at once unless its CuckooFilter has seen it. Join has no sketch
+  // form and sheds.
+  Sketch,
+  // Write the coldest partitions of the table out to a run file, as
+  // GroupSpill does, until the key fits or its own partition is spilled,
+  // and fold them back in at reset; exact for any reduction. Join has no
+  // spilling form and sheds.
+  Spill,
+};
+
+// A cap on bytes, shared by the tables charged to it and counted against
+// its parent too. Safe to use from any thread, so that the shards of one
+// query can share a budget.
+class MemoryBudget {
+ public:
+  // A capBytes of 0 leaves the budget unbounded, counting only.
+  explicit MemoryBudget(string name, size_t capBytes = 0,
+                        shared_ptr<MemoryBudget> parent = nullptr);
+
+  // Charges bytes to this budget and every ancestor and returns true, or
+  // charges nothing and returns false if any of them would go over its cap.
+  bool tryCharge(size_t bytes);
+  void release(size_t bytes);
+
+  const string& name() const { return budgetName; }
+  size_t cap() const { return capBytes.load(memory_order_relaxed); }
+  // Takes effect for charges from then on; bytes already charged stay.
+  void setCap(size_t bytes) { capBytes.store(bytes, memory_order_relaxed); }
+
+  uint64_t used() const { return usedBytes.load(memory_order_relaxed); }
+  uint64_t peak() const { return peakBytes.load(memory_order_relaxed); }
+  // Charges refused, here or by an ancestor.
+  uint64_t denied() const { return deniedCharges.load(memory_order_relaxed); }
+  // Tuples dropped, tuples handed to a sketch, and groups and tuples
+  // written to run files, for want of room.
+  uint64_t shed() const { return shedTuples.load(memory_order_relaxed); }
+  uint64_t sketched() const {
+    return sketchedTuples.load(memory_order_relaxed);
+  }
+
+  uint64_t spilled() const {
+    return spilledRecords.load(memory_order_relaxed);
+  }
+
+  void countShed() { shedTuples.fetch_add(1, memory_order_relaxed); }
+  void countSketched() { sketchedTuples.fetch_add(1, memory_order_relaxed); }
+  void countSpilled(uint64_t n) {
+    spilledRecords.fetch_add(n, memory_order_relaxed);
+  }
+
+ private:
+  string budgetName;
+  atomic<size_t> capBytes;
+  shared_ptr<MemoryBudget> parent;
+  atomic<uint64_t> usedBytes{0};
+  atomic<uint64_t> peakBytes{0};
+  atomic<uint64_t> deniedCharges{0};
+  atomic<uint64_t> shedTuples{0};
+  atomic<uint64_t> sketchedTuples{0};
+  atomic<uint64_t> spilledRecords{0};
+
+  bool chargeHere(size_t bytes);
+};
+
+// The process-wide budget, parent of the per-query budgets made by
+// QueryRegistry::build. Unbounded until given a cap; registered with
+// metrics().
+const shared_ptr<MemoryBudget>& globalMemoryBudget();
+
+// The budget of one table: charges its new keys to the stage's budget,
+// keeps what it has charged so the lot can be released at once, and holds
+// the sketches of the Sketch policy or the run file of the Spill policy,
+// made on first use. Used by the table's thread only.
+class TableAdmission {
+ public:
+  TableAdmission(shared_ptr<MemoryBudget> budget, BudgetPolicy policy,
+                 size_t bytesPerKey, size_t sketchKeys, string spillDir);
+
+  // Charges one more key; false if the budget has no room for it. Once it
+  // has refused one, it refuses every key until some are given back, so
+  // that no key of an epoch is split between the table and the policy.
+  bool admit() {
+    if (refusing || !budget->tryCharge(bytesPerKey)) {
+      refusing = true;
+      return false;
+    }
+    charged += bytesPerKey;
+    return true;
+  }
+  // Gives back n keys, as the table drops them.
+  void releaseKeys(size_t n);
+  // Gives back every key, as the table is cleared at the end of an epoch.
+  void releaseAll();
+
+  BudgetPolicy policy() const { return tablePolicy; }
+  MemoryBudget& stats() { return *budget; }
+
+  // The sketches of the Sketch policy, sized for sketchKeys keys.
+  SpaceSaving& heavyGroups();
+  CuckooFilter& seenKeys();
+  bool sketching() const { return groups || seen; }
+  void clearSketches();
+  // The spill of the Spill policy, writing to spillDir.
+  GroupSpill& spill();
+
+ private:
+  shared_ptr<MemoryBudget> budget;
+  BudgetPolicy tablePolicy;
+  size_t bytesPerKey;
+  size_t sketchKeys;
+  string spillDir;
+  size_t charged = 0;
+  bool refusing = false;
+  unique_ptr<SpaceSaving> groups;
+  unique_ptr<CuckooFilter> seen;
+  unique_ptr<GroupSpill> runs;
+};
+
+// While alive, the groupby, distinct and join stages built on this thread
+// charge their tables to budget, and handle keys past its cap by policy.
+// Sketches of the Sketch policy track up to sketchKeys keys each; run files
+// of the Spill policy go in spillDir, as for GroupSpill.
+class BudgetScope {
+ public:
+  explicit BudgetScope(shared_ptr<MemoryBudget> budget,
+                       BudgetPolicy policy = BudgetPolicy::Shed,
+                       size_t sketchKeys = kBudgetSketchKeys,
+                       string spillDir = "");
+  ~BudgetScope();
+
+  BudgetScope(const BudgetScope&) = delete;
+  BudgetScope& operator=(const BudgetScope&) = delete;
+
+ private:
+  const BudgetScope* saved;
+  shared_ptr<MemoryBudget> budget;
+  BudgetPolicy policy;
+  size_t sketchKeys;
+  string spillDir;
+
+  friend shared_ptr<TableAdmission> admitTable(size_t bytesPerKey);
+};
+
+// Admission for one more table of the stage being built on this thread,
+// charged bytesPerKey a key, or null outside any BudgetScope. Tables call it
+// as they are built.
+shared_ptr<TableAdmission> admitTable(size_t bytesPerKey);
+
+// Parses "shed", "sketch" or "spill"; throws invalid_argument for anything
+// else.
+BudgetPolicy parseBudgetPolicy(const string& text);
+
+#endif  // MEMORY_BUDGET_H
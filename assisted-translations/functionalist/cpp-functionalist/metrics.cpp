@@ -0,0 +1,576 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "memory_budget.hpp"
+#include "query_scheduler.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+// The counters are written by a single thread, so a relaxed load and store
+// stand in for a locked read-modify-write.
+void bump(atomic<uint64_t>& counter, uint64_t n = 1) {
+  counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t get(const atomic<uint64_t>& counter) {
+  return counter.load(memory_order_relaxed);
+}
+
+int64_t steadyNanos() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+thread_local shared_ptr<OperatorMetrics> building;
+
+// Sets the stage whose tables are being built on this thread.
+class MeterScope {
+ public:
+  explicit MeterScope(shared_ptr<OperatorMetrics> metrics)
+      : saved(move(building)) {
+    building = move(metrics);
+  }
+  ~MeterScope() { building = move(saved); }
+
+ private:
+  shared_ptr<OperatorMetrics> saved;
+};
+
+struct MeterState {
+  shared_ptr<OperatorMetrics> metrics;
+  // The epoch's latencies, published to metrics as it closes.
+  LatencyHistogram nextLatency;
+  LatencyHistogram closeLatency;
+  uint64_t untilSample = kMeterSampleEvery;
+  // Set while a call into the stage is timed, so that the time spent
+  // downstream of it can be taken out.
+  bool timing = false;
+  uint64_t downstreamCycles = 0;
+
+  explicit MeterState(shared_ptr<OperatorMetrics> metrics)
+      : metrics(move(metrics)) {}
+};
+
+// Counts what the stage passes on, and times it while the stage is timed.
+Operator meterOutput(shared_ptr<MeterState> state, Operator nextOp) {
+  OpFunc next = [state, nextOp](const Headers& headers) {
+    bump(state->metrics->tuplesOut);
+    if (!state->timing) {
+      nextOp.next(headers);
+      return;
+    }
+    uint64_t start = readCycles();
+    nextOp.next(headers);
+    state->downstreamCycles += readCycles() - start;
+  };
+
+  OpFunc reset = [state, nextOp](const Headers& headers) {
+    if (!state->timing) {
+      nextOp.reset(headers);
+      return;
+    }
+    uint64_t start = readCycles();
+    nextOp.reset(headers);
+    state->downstreamCycles += readCycles() - start;
+  };
+
+  return Operator(next, reset);
+}
+
+// Cycles spent in f, less those spent downstream of it.
+template <typename F>
+uint64_t timeOwnCycles(MeterState& state, F f) {
+  state.timing = true;
+  state.downstreamCycles = 0;
+  uint64_t start = readCycles();
+  f();
+  uint64_t spent = readCycles() - start;
+  state.timing = false;
+  return spent - min(spent, state.downstreamCycles);
+}
+
+Operator meterInput(shared_ptr<MeterState> state, Operator stageOp) {
+  OpFunc next = [state, stageOp](const Headers& headers) {
+    OperatorMetrics& metrics = *state->metrics;
+    bump(metrics.tuplesIn);
+    if (--state->untilSample != 0) {
+      stageOp.next(headers);
+      return;
+    }
+    state->untilSample = kMeterSampleEvery;
+    uint64_t spent = timeOwnCycles(*state, [&] { stageOp.next(headers); });
+    bump(metrics.sampledNextCycles, spent);
+    bump(metrics.sampledNextCalls);
+    state->nextLatency.record(spent);
+  };
+
+  OpFunc reset = [state, stageOp](const Headers& headers) {
+    OperatorMetrics& metrics = *state->metrics;
+    uint64_t spent = timeOwnCycles(*state, [&] { stageOp.reset(headers); });
+    bump(metrics.resets);
+    bump(metrics.resetCycles, spent);
+    metrics.lastResetCycles.store(spent, memory_order_relaxed);
+    if (spent > get(metrics.maxResetCycles)) {
+      metrics.maxResetCycles.store(spent, memory_order_relaxed);
+    }
+    state->closeLatency.record(spent);
+    metrics.nextLatency.publish(state->nextLatency);
+    metrics.closeLatency.publish(state->closeLatency);
+  };
+
+  return Operator(next, reset);
+}
+
+// Estimated total cycles in next, scaling the sampled calls up to all calls.
+double estimatedNextCycles(const OperatorMetrics& metrics) {
+  uint64_t calls = get(metrics.sampledNextCalls);
+  if (calls == 0) {
+    return 0.0;
+  }
+  return static_cast<double>(get(metrics.sampledNextCycles)) *
+         static_cast<double>(get(metrics.tuplesIn)) /
+         static_cast<double>(calls);
+}
+
+double perTuple(uint64_t num, uint64_t den) {
+  return den == 0 ? 0.0
+                  : static_cast<double>(num) / static_cast<double>(den);
+}
+
+struct Series {
+  const char* name;
+  const char* type;
+  const char* help;
+  function<double(const MetricsRegistry&, const OperatorMetrics&)> value;
+};
+
+const vector<Series>& allSeries() {
+  static const vector<Series> series = {
+      {"stream_tuples_in_total", "counter", "Tuples passed into the stage.",
+       [](const MetricsRegistry&, const OperatorMetrics& m) {
+         return static_cast<double>(get(m.tuplesIn));
+       }},
+      {"stream_tuples_out_total", "counter", "Tuples the stage passed on.",
+       [](const MetricsRegistry&, const OperatorMetrics& m) {
+         return static_cast<double>(get(m.tuplesOut));
+       }},
+      {"stream_epochs_total", "counter", "Epochs the stage has closed.",
+       [](const MetricsRegistry&, const OperatorMetrics& m) {
+         return static_cast<double>(get(m.resets));
+       }},
+      {"stream_selectivity", "gauge", "Tuples out per tuple in.",
+       [](const MetricsRegistry&, const OperatorMetrics& m) {
+         return perTuple(get(m.tuplesOut), get(m.tuplesIn));
+       }},
+      {"stream_next_seconds_total", "counter",
+       "Time spent passing tuples through the stage, excluding downstream, "
+       "estimated from sampled calls.",
+       [](const MetricsRegistry& r, const OperatorMetrics& m) {
+         return r.cyclesToNanos(
+                    static_cast<uint64_t>(estimatedNextCycles(m))) *
+                1e-9;
+       }},
+      {"stream_next_nanoseconds_per_tuple", "gauge",
+       "Mean time of a sampled call into the stage, excluding downstream.",
+       [](const MetricsRegistry& r, const OperatorMetrics& m) {
+         return r.cyclesToNanos(get(m.sampledNextCycles)) /
+                max<double>(1.0, static_cast<double>(get(m.sampledNextCalls)));
+       }},
+      {"stream_epoch_close_seconds_total", "counter",
+       "Time spent closing epochs, excluding downstream.",
+       [](const MetricsRegistry& r, const OperatorMetrics& m) {
+         return r.cyclesToNanos(get(m.resetCycles)) * 1e-9;
+       }},
+      {"stream_epoch_close_seconds_last", "gauge",
+       "Time the latest epoch close took, excluding downstream.",
+       [](const MetricsRegistry& r, const OperatorMetrics& m) {
+         return r.cyclesToNanos(get(m.lastResetCycles)) * 1e-9;
+       }},
+      {"stream_epoch_close_seconds_max", "gauge",
+       "Longest epoch close, excluding downstream.",
+       [](const MetricsRegistry& r, const OperatorMetrics& m) {
+         return r.cyclesToNanos(get(m.maxResetCycles)) * 1e-9;
+       }},
+      {"stream_table_entries", "gauge",
+       "Entries in the stage's tables as the latest epoch closed.",
+       [](const MetricsRegistry&, const OperatorMetrics& m) {
+         return static_cast<double>(m.tableEntries());
+       }},
+      {"stream_table_bytes", "gauge",
+       "Bytes held by the stage's tables as the latest epoch closed.",
+       [](const MetricsRegistry&, const OperatorMetrics& m) {
+         return static_cast<double>(m.tableBytes());
+       }},
+  };
+  return series;
+}
+
+struct BudgetSeries {
+  const char* name;
+  const char* type;
+  const char* help;
+  function<double(const MemoryBudget&)> value;
+};
+
+const vector<BudgetSeries>& allBudgetSeries() {
+  static const vector<BudgetSeries> series = {
+      {"stream_memory_budget_bytes", "gauge",
+       "Cap on the bytes the budget's tables may hold; 0 for none.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.cap()); }},
+      {"stream_memory_used_bytes", "gauge",
+       "Bytes the budget's tables are charged for now.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.used()); }},
+      {"stream_memory_peak_bytes", "gauge",
+       "Most bytes the budget's tables have been charged for at once.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.peak()); }},
+      {"stream_memory_denied_total", "counter",
+       "Keys refused for want of room under the budget or a parent.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.denied()); }},
+      {"stream_memory_shed_total", "counter",
+       "Tuples dropped for want of room.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.shed()); }},
+      {"stream_memory_sketched_total", "counter",
+       "Tuples of keys tracked by a sketch for want of room.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.sketched()); }},
+      {"stream_memory_spilled_total", "counter",
+       "Groups and tuples written to run files for want of room.",
+       [](const MemoryBudget& b) { return static_cast<double>(b.spilled()); }},
+  };
+  return series;
+}
+
+struct LatencySeries {
+  const char* name;
+  const char* help;
+  const PublishedLatency& (*of)(const OperatorMetrics&);
+};
+
+const vector<LatencySeries>& allLatencySeries() {
+  static const vector<LatencySeries> series = {
+      {"stream_next_latency_seconds",
+       "Sampled calls into the stage, excluding downstream.",
+       [](const OperatorMetrics& m) -> const PublishedLatency& {
+         return m.nextLatency;
+       }},
+      {"stream_epoch_close_latency_seconds",
+       "Epoch closes of the stage, excluding downstream.",
+       [](const OperatorMetrics& m) -> const PublishedLatency& {
+         return m.closeLatency;
+       }},
+  };
+  return series;
+}
+
+struct TraceSeries {
+  const char* name;
+  const char* help;
+  const PublishedLatency& (*of)(const QueryTrace&);
+};
+
+const vector<TraceSeries>& allTraceSeries() {
+  static const vector<TraceSeries> series = {
+      {"stream_query_tuple_latency_seconds",
+       "Sampled tuples through the whole query, sink included.",
+       [](const QueryTrace& t) -> const PublishedLatency& {
+         return t.tupleLatency;
+       }},
+      {"stream_detection_delay_seconds",
+       "From the last packet of an epoch reaching the query to the query "
+       "passing on the epoch's reset, after its last result.",
+       [](const QueryTrace& t) -> const PublishedLatency& {
+         return t.detectionDelay;
+       }},
+  };
+  return series;
+}
+
+struct LagSeries {
+  const char* name;
+  const char* type;
+  const char* help;
+  function<double(const QueryLag&)> value;
+};
+
+const vector<LagSeries>& allLagSeries() {
+  static const vector<LagSeries> series = {
+      {"stream_query_queued_tuples", "gauge",
+       "Tuples queued for the query and not yet passed to it.",
+       [](const QueryLag& l) { return static_cast<double>(get(l.queued)); }},
+      {"stream_query_lag_seconds", "gauge",
+       "How long the oldest tuple queued for the query has waited.",
+       [](const QueryLag& l) { return l.lagSeconds(); }},
+      {"stream_query_processed_total", "counter",
+       "Tuples passed to the query.",
+       [](const QueryLag& l) { return static_cast<double>(get(l.processed)); }},
+      {"stream_query_shed_total", "counter",
+       "Tuples dropped because the query's queue was full.",
+       [](const QueryLag& l) { return static_cast<double>(get(l.shed)); }},
+      {"stream_query_cpu_seconds_total", "counter",
+       "CPU time spent running the query.",
+       [](const QueryLag& l) {
+         return static_cast<double>(get(l.cpuNanos)) * 1e-9;
+       }},
+      {"stream_query_throttled_total", "counter",
+       "Times the query had input waiting but its CPU budget spent.",
+       [](const QueryLag& l) { return static_cast<double>(get(l.throttled)); }},
+  };
+  return series;
+}
+
+constexpr double kSummaryQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// The lines of one summary series; labels is what goes between the braces.
+void writeSummary(ostream& out, const MetricsRegistry& registry,
+                  const char* name, const string& labels,
+                  const LatencyHistogram& latency) {
+  for (double q : kSummaryQuantiles) {
+    out << name << "{" << labels << ",quantile=\"" << q << "\"} "
+        << registry.cyclesToNanos(latency.valueAt(q)) * 1e-9 << "\n";
+  }
+  out << name << "_sum{" << labels << "} "
+      << registry.cyclesToNanos(latency.valueSum()) * 1e-9 << "\n";
+  out << name << "_count{" << labels << "} " << latency.count() << "\n";
+}
+
+// Label values may hold any string; these are the escapes the format needs.
+string escapeLabel(const string& value) {
+  string out;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+}  // namespace
+
+uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(steadyNanos());
+#endif
+}
+
+void TableGauge::record(size_t entries, size_t bytes) {
+  this->entries.store(entries, memory_order_relaxed);
+  this->bytes.store(bytes, memory_order_relaxed);
+}
+
+shared_ptr<TableGauge> OperatorMetrics::addTable() {
+  lock_guard<mutex> guard(lock);
+  tables.push_back(make_shared<TableGauge>());
+  return tables.back();
+}
+
+uint64_t OperatorMetrics::tableEntries() const {
+  lock_guard<mutex> guard(lock);
+  uint64_t out = 0;
+  for (const auto& table : tables) {
+    out += get(table->entries);
+  }
+  return out;
+}
+
+uint64_t OperatorMetrics::tableBytes() const {
+  lock_guard<mutex> guard(lock);
+  uint64_t out = 0;
+  for (const auto& table : tables) {
+    out += get(table->bytes);
+  }
+  return out;
+}
+
+MetricsRegistry::MetricsRegistry()
+    : startCycles(readCycles()), startNanos(steadyNanos()) {}
+
+shared_ptr<OperatorMetrics> MetricsRegistry::add(const string& name) {
+  lock_guard<mutex> guard(lock);
+  size_t instance = 0;
+  for (const auto& stage : stages) {
+    if (stage->name == name) {
+      instance++;
+    }
+  }
+  stages.push_back(make_shared<OperatorMetrics>(name, instance));
+  previous.emplace_back();
+  return stages.back();
+}
+
+void MetricsRegistry::addBudget(shared_ptr<MemoryBudget> budget) {
+  lock_guard<mutex> guard(lock);
+  if (find(budgets.begin(), budgets.end(), budget) == budgets.end()) {
+    budgets.push_back(move(budget));
+  }
+}
+
+shared_ptr<QueryTrace> MetricsRegistry::addTrace(const string& name) {
+  lock_guard<mutex> guard(lock);
+  traces.push_back(make_shared<QueryTrace>(name));
+  return traces.back();
+}
+
+void MetricsRegistry::addQueryLag(shared_ptr<const QueryLag> lag) {
+  lock_guard<mutex> guard(lock);
+  lags.push_back(move(lag));
+}
+
+double MetricsRegistry::cyclesToNanos(uint64_t cycles) const {
+  // The rate is only trusted over at least a millisecond.
+  int64_t elapsed = steadyNanos() - startNanos;
+  if (elapsed < 1000000) {
+    this_thread::sleep_for(chrono::nanoseconds(1000000 - elapsed));
+  }
+  double nanos = static_cast<double>(steadyNanos() - startNanos);
+  double ticks = static_cast<double>(readCycles() - startCycles);
+  return ticks > 0.0 ? static_cast<double>(cycles) * nanos / ticks : 0.0;
+}
+
+string MetricsRegistry::prometheusText() const {
+  lock_guard<mutex> guard(lock);
+  stringstream out;
+  for (const Series& series : allSeries()) {
+    out << "# HELP " << series.name << " " << series.help << "\n";
+    out << "# TYPE " << series.name << " " << series.type << "\n";
+    for (const auto& stage : stages) {
+      out << series.name << "{operator=\"" << escapeLabel(stage->name)
+          << "\",instance=\"" << stage->instance << "\"} "
+          << series.value(*this, *stage) << "\n";
+    }
+  }
+  for (const LatencySeries& series : allLatencySeries()) {
+    out << "# HELP " << series.name << " " << series.help << "\n";
+    out << "# TYPE " << series.name << " summary\n";
+    for (const auto& stage : stages) {
+      writeSummary(out, *this, series.name,
+                   "operator=\"" + escapeLabel(stage->name) +
+                       "\",instance=\"" + to_string(stage->instance) + "\"",
+                   series.of(*stage).snapshot());
+    }
+  }
+  if (!budgets.empty()) {
+    for (const BudgetSeries& series : allBudgetSeries()) {
+      out << "# HELP " << series.name << " " << series.help << "\n";
+      out << "# TYPE " << series.name << " " << series.type << "\n";
+      for (const auto& budget : budgets) {
+        out << series.name << "{budget=\"" << escapeLabel(budget->name())
+            << "\"} " << series.value(*budget) << "\n";
+      }
+    }
+  }
+  if (!traces.empty()) {
+    for (const TraceSeries& series : allTraceSeries()) {
+      out << "# HELP " << series.name << " " << series.help << "\n";
+      out << "# TYPE " << series.name << " summary\n";
+      for (const auto& trace : traces) {
+        writeSummary(out, *this, series.name,
+                     "query=\"" + escapeLabel(trace->name) + "\"",
+                     series.of(*trace).snapshot());
+      }
+    }
+  }
+  if (!lags.empty()) {
+    for (const LagSeries& series : allLagSeries()) {
+      out << "# HELP " << series.name << " " << series.help << "\n";
+      out << "# TYPE " << series.name << " " << series.type << "\n";
+      for (const auto& lag : lags) {
+        out << series.name << "{query=\"" << escapeLabel(lag->name)
+            << "\",weight=\"" << lag->weight << "\"} " << series.value(*lag)
+            << "\n";
+      }
+    }
+  }
+  return out.str();
+}
+
+void MetricsRegistry::writeCSVHeader(ostream& out) {
+  out << "epoch,operator,instance,tuples_in,tuples_out,selectivity,"
+         "next_ns_per_tuple,epoch_close_ns,table_entries,table_bytes\n";
+}
+
+void MetricsRegistry::writeCSV(ostream& out, int64_t epoch) {
+  lock_guard<mutex> guard(lock);
+  for (size_t i = 0; i < stages.size(); i++) {
+    const OperatorMetrics& stage = *stages[i];
+    Snapshot now;
+    now.tuplesIn = get(stage.tuplesIn);
+    now.tuplesOut = get(stage.tuplesOut);
+    now.resets = get(stage.resets);
+    now.sampledNextCycles = get(stage.sampledNextCycles);
+    now.sampledNextCalls = get(stage.sampledNextCalls);
+    now.resetCycles = get(stage.resetCycles);
+    const Snapshot& last = previous[i];
+
+    uint64_t in = now.tuplesIn - last.tuplesIn;
+    uint64_t calls = now.sampledNextCalls - last.sampledNextCalls;
+    out << epoch << "," << stage.name << "," << stage.instance << "," << in
+        << "," << now.tuplesOut - last.tuplesOut << ","
+        << perTuple(now.tuplesOut - last.tuplesOut, in) << ","
+        << cyclesToNanos(now.sampledNextCycles - last.sampledNextCycles) /
+               max<double>(1.0, static_cast<double>(calls))
+        << "," << cyclesToNanos(now.resetCycles - last.resetCycles) << ","
+        << stage.tableEntries() << "," << stage.tableBytes() << "\n";
+    previous[i] = now;
+  }
+}
+
+MetricsRegistry& metrics() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+shared_ptr<TableGauge> meterTable() {
+  return building ? building->addTable() : nullptr;
+}
+
+OpCreator meteredCreator(string name, OpCreator stage,
+                         MetricsRegistry& registry) {
+  return [name, stage, &registry](Operator nextOp) {
+    auto state = make_shared<MeterState>(registry.add(name));
+    Operator output = meterOutput(state, move(nextOp));
+    MeterScope scope(state->metrics);
+    return meterInput(state, stage(output));
+  };
+}
+
+DblOpCreator meteredCreator(string name, DblOpCreator stage,
+                            MetricsRegistry& registry) {
+  return [name, stage, &registry](Operator nextOp) {
+    auto state = make_shared<MeterState>(registry.add(name));
+    Operator output = meterOutput(state, move(nextOp));
+    MeterScope scope(state->metrics);
+    auto [left, right] = stage(output);
+    return make_pair(meterInput(state, left), meterInput(state, right));
+  };
+}
+
+OpCreator metricsCSVCreator(shared_ptr<ostream> out, string eidKey,
+                            MetricsRegistry& registry) {
+  FieldId eidId = internField(eidKey);
+  MetricsRegistry::writeCSVHeader(*out);
+
+  return [out, eidId, &registry](Operator nextOp) {
+    OpFunc reset = [out, eidId, &registry, nextOp](const Headers& headers) {
+      nextOp.reset(headers);
+      int64_t epoch = headers.contains(eidId) ? headers.at(eidId).asInt() : -1;
+      registry.writeCSV(*out, epoch);
+    };
+
+    return Operator(nextOp.next, reset);
+  };
+}
@@ -0,0 +1,152 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "latency.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+class MemoryBudget;
+struct QueryLag;
+
+// One in this many calls to next is timed.
+constexpr uint64_t kMeterSampleEvery = 64;
+
+// Occupancy of one table as its epoch closed, written by the table's thread.
+struct TableGauge {
+  atomic<uint64_t> entries{0};
+  atomic<uint64_t> bytes{0};
+
+  void record(size_t entries, size_t bytes);
+};
+
+// Counters of one metered stage. Each is written only by the thread running
+// the stage, with plain relaxed loads and stores, and may be read from any
+// thread at any time.
+struct OperatorMetrics {
+  string name;
+  // Tells apart stages built more than once under the same name, such as
+  // the per-shard copies of a sharded stage.
+  size_t instance;
+
+  atomic<uint64_t> tuplesIn{0};
+  atomic<uint64_t> tuplesOut{0};
+  atomic<uint64_t> resets{0};
+
+  // Cycles spent in sampled calls to next, excluding the time spent
+  // downstream, and the number of such calls.
+  atomic<uint64_t> sampledNextCycles{0};
+  atomic<uint64_t> sampledNextCalls{0};
+
+  // Cycles spent closing epochs, excluding the time spent downstream, and
+  // the latest and longest close.
+  atomic<uint64_t> resetCycles{0};
+  atomic<uint64_t> maxResetCycles{0};
+  atomic<uint64_t> lastResetCycles{0};
+
+  // The distributions of the sampled calls to next and of the epoch closes
+  // above, published at each close.
+  PublishedLatency nextLatency;
+  PublishedLatency closeLatency;
+
+  OperatorMetrics(string name, size_t instance)
+      : name(move(name)), instance(instance) {}
+
+  // Gauge for one more groupby, distinct or join table of the stage.
+  shared_ptr<TableGauge> addTable();
+  // Entries and bytes held by the stage's tables at their last epoch close,
+  // summed over all of them.
+  uint64_t tableEntries() const;
+  uint64_t tableBytes() const;
+
+ private:
+  mutable mutex lock;
+  vector<shared_ptr<TableGauge>> tables;
+};
+
+// The stages registered with a registry, for export. Registration takes a
+// lock and happens while queries are built; updates never do.
+class MetricsRegistry {
+ public:
+  MetricsRegistry();
+
+  shared_ptr<OperatorMetrics> add(const string& name);
+  // Exports budget alongside the stages, labelled with its name.
+  void addBudget(shared_ptr<MemoryBudget> budget);
+  // A trace for the query name, exported alongside the stages; see
+  // traceQuery.
+  shared_ptr<QueryTrace> addTrace(const string& name);
+  // Exports the lag of a query run by a QueryScheduler, labelled with its
+  // name.
+  void addQueryLag(shared_ptr<const QueryLag> lag);
+
+  // The Prometheus text exposition format, one series per stage, then one
+  // per memory budget, then one per query trace, then one per scheduled
+  // query. Latency distributions are summaries, in seconds.
+  string prometheusText() const;
+
+  // One CSV row per stage with the change in each counter since the
+  // previous call, tagged with epoch.
+  static void writeCSVHeader(ostream& out);
+  void writeCSV(ostream& out, int64_t epoch);
+
+  // Converts timestamp-counter cycles to nanoseconds, with the rate
+  // measured since the registry was created.
+  double cyclesToNanos(uint64_t cycles) const;
+
+ private:
+  struct Snapshot {
+    uint64_t tuplesIn = 0;
+    uint64_t tuplesOut = 0;
+    uint64_t resets = 0;
+    uint64_t sampledNextCycles = 0;
+    uint64_t sampledNextCalls = 0;
+    uint64_t resetCycles = 0;
+  };
+
+  mutable mutex lock;
+  vector<shared_ptr<OperatorMetrics>> stages;
+  vector<Snapshot> previous;
+  vector<shared_ptr<MemoryBudget>> budgets;
+  vector<shared_ptr<QueryTrace>> traces;
+  vector<shared_ptr<const QueryLag>> lags;
+  uint64_t startCycles;
+  int64_t startNanos;
+};
+
+// The process-wide registry.
+MetricsRegistry& metrics();
+
+// A cheap timestamp: rdtsc where available, steady_clock nanoseconds
+// otherwise.
+uint64_t readCycles();
+
+// A gauge of the metered stage under construction on this thread, or null
+// outside meteredCreator. Tables call it as they are built and record their
+// occupancy into it at each epoch close.
+shared_ptr<TableGauge> meterTable();
+
+// Wraps stage so that tuples in and out, sampled time in next, epoch-close
+// latency, their distributions and table occupancy are recorded under name
+// in registry.
+OpCreator meteredCreator(string name, OpCreator stage,
+                         MetricsRegistry& registry = metrics());
+DblOpCreator meteredCreator(string name, DblOpCreator stage,
+                            MetricsRegistry& registry = metrics());
+
+// Passes everything through, and after passing on each reset writes the
+// registry as CSV to out, tagged with the eidKey value of the reset tuple.
+// Placed right after the epoch stage, each row then covers one whole epoch.
+OpCreator metricsCSVCreator(shared_ptr<ostream> out, string eidKey = "eid",
+                            MetricsRegistry& registry = metrics());
+
+#endif  // METRICS_H
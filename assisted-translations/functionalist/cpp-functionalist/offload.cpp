@@ -0,0 +1,312 @@
+#include "offload.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "builtins.hpp"
+#include "flat_table.hpp"
+
+namespace {
+
+// Aggregates on the offload thread with a FlatTable, the chunk's keys
+// repacked and probed a chunk at a time.
+class HostGroupbyBackend : public GroupbyBackend {
+ public:
+  explicit HostGroupbyBackend(const OffloadSpec& spec)
+      : spec(spec), groups(initTableSize()) {}
+
+  void aggregate(const OffloadChunk& chunk) override {
+    keys.resize(chunk.rows);
+    hashes.resize(chunk.rows);
+    PackedKeyHash hasher;
+    for (size_t row = 0; row < chunk.rows; row++) {
+      PackedKey& key = keys[row];
+      key = PackedKey();
+      for (size_t j = 0; j < spec.keyIds.size(); j++) {
+        uint8_t type = chunk.keyTypes[j][row];
+        if (type != kOffloadAbsent) {
+          key.push(spec.keyIds[j],
+                   OpResult::fromBits(static_cast<OpResultType>(type),
+                                      chunk.keyBits[j][row]));
+        }
+      }
+      hashes[row] = hasher(key);
+    }
+    OffloadKind kind = spec.kind;
+    groups.findOrInsertBatch(keys.data(), hashes.data(), chunk.rows,
+                             [&](size_t row, int64_t* val, bool inserted) {
+                               if (inserted) {
+                                 *val = 0;
+                               }
+                               if (kind == OffloadKind::Count) {
+                                 (*val)++;
+                               } else if (kind == OffloadKind::Sum) {
+                                 *val += chunk.vals[row];
+                               }
+                             });
+  }
+
+  void drain(
+      const function<void(const PackedKey&, int64_t)>& visit) override {
+    groups.forEach(
+        [&](const PackedKey& key, const int64_t& val) { visit(key, val); });
+    groups.clear();
+  }
+
+ private:
+  OffloadSpec spec;
+  FlatTable<PackedKey, int64_t, PackedKeyHash> groups;
+  vector<PackedKey> keys;
+  vector<size_t> hashes;
+};
+
+mutex backendsLock;
+
+map<string, GroupbyBackendFactory>& backends() {
+  static map<string, GroupbyBackendFactory> byName = {
+      {"host", [](const OffloadSpec& spec) -> unique_ptr<GroupbyBackend> {
+         return make_unique<HostGroupbyBackend>(spec);
+       }}};
+  return byName;
+}
+
+GroupbyBackendFactory findBackend(const string& name) {
+  lock_guard<mutex> guard(backendsLock);
+  auto it = backends().find(name);
+  if (it == backends().end()) {
+    throw invalid_argument("Error: no groupby backend named '" + name +
+                           "' is registered");
+  }
+  return it->second;
+}
+
+// The chunks of one stage and the thread that hands them to its backend.
+// The stage fills one chunk while the thread aggregates the others, and
+// waits only when every other buffer is still queued or being aggregated.
+class ChunkPipe {
+ public:
+  ChunkPipe(unique_ptr<GroupbyBackend> backend, const OffloadSpec& spec,
+            size_t chunkRows, size_t buffers, shared_ptr<OffloadStats> stats)
+      : backend(move(backend)), chunkRows(chunkRows), stats(move(stats)) {
+    for (size_t i = 0; i < buffers; i++) {
+      auto chunk = make_unique<OffloadChunk>();
+      chunk->keyBits.assign(spec.keyIds.size(), vector<uint64_t>(chunkRows));
+      chunk->keyTypes.assign(spec.keyIds.size(), vector<uint8_t>(chunkRows));
+      if (spec.kind == OffloadKind::Sum) {
+        chunk->vals.resize(chunkRows);
+      }
+      spare.push_back(move(chunk));
+    }
+    current = move(spare.back());
+    spare.pop_back();
+    worker = thread([this]() { run(); });
+  }
+
+  // Drops the chunks still queued, then joins the thread.
+  ~ChunkPipe() {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  ChunkPipe(const ChunkPipe&) = delete;
+  ChunkPipe& operator=(const ChunkPipe&) = delete;
+
+  OffloadChunk& filling() { return *current; }
+  bool full() const { return current->rows == chunkRows; }
+
+  // Queues the chunk being filled, if it holds any rows, and takes a free
+  // one in its place. Rethrows the exception of a failed aggregation.
+  void submit() {
+    if (current->rows == 0) {
+      return;
+    }
+    stats->chunks++;
+    stats->rows += current->rows;
+    unique_lock<mutex> guard(lock);
+    queue.push_back(move(current));
+    wake.notify_one();
+    if (spare.empty()) {
+      stats->stalls++;
+      space.wait(guard, [this]() { return !spare.empty(); });
+    }
+    current = move(spare.back());
+    spare.pop_back();
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+
+  // Submits what has been filled, waits for the backend to aggregate it
+  // all, and passes its groups to visit.
+  void drain(const function<void(const PackedKey&, int64_t)>& visit) {
+    submit();
+    {
+      unique_lock<mutex> guard(lock);
+      space.wait(guard, [this]() { return queue.empty() && !busy; });
+      if (error) {
+        rethrow_exception(error);
+      }
+    }
+    backend->drain(visit);
+  }
+
+ private:
+  unique_ptr<GroupbyBackend> backend;
+  size_t chunkRows;
+  shared_ptr<OffloadStats> stats;
+  unique_ptr<OffloadChunk> current;
+
+  mutex lock;
+  condition_variable wake;
+  condition_variable space;
+  deque<unique_ptr<OffloadChunk>> queue;
+  vector<unique_ptr<OffloadChunk>> spare;
+  bool busy = false;
+  bool stopping = false;
+  exception_ptr error;
+  thread worker;
+
+  void run() {
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+      wake.wait(guard, [this]() { return !queue.empty() || stopping; });
+      if (stopping) {
+        return;
+      }
+      unique_ptr<OffloadChunk> chunk = move(queue.front());
+      queue.pop_front();
+      busy = true;
+      bool failed = error != nullptr;
+      guard.unlock();
+
+      exception_ptr chunkError;
+      if (!failed) {
+        try {
+          backend->aggregate(*chunk);
+        } catch (...) {
+          chunkError = current_exception();
+        }
+      }
+      chunk->rows = 0;
+
+      guard.lock();
+      if (chunkError) {
+        error = chunkError;
+      }
+      busy = false;
+      spare.push_back(move(chunk));
+      space.notify_one();
+    }
+  }
+};
+
+BatchToTupleOpCreator offloadStage(vector<string> groupKeys, OffloadKind kind,
+                                   optional<FieldId> sumId,
+                                   optional<FieldId> outKeyId,
+                                   OffloadOptions options) {
+  OffloadSpec spec;
+  spec.keyIds = internFields(groupKeys);
+  spec.kind = kind;
+  if (spec.keyIds.size() > kMaxKeyFields) {
+    throw invalid_argument("Error: an offloaded groupby keys on at most " +
+                           to_string(kMaxKeyFields) + " fields");
+  }
+  if (options.buffers < 2) {
+    throw invalid_argument(
+        "Error: an offloaded groupby needs at least two buffers");
+  }
+  if (options.chunkRows == 0) {
+    throw invalid_argument(
+        "Error: an offloaded groupby needs a nonzero chunk size");
+  }
+  GroupbyBackendFactory factory = findBackend(options.backend);
+
+  return [spec, sumId, outKeyId, options, factory](Operator nextOp) {
+    shared_ptr<OffloadStats> stats =
+        options.stats ? options.stats : make_shared<OffloadStats>();
+    auto pipe = make_shared<ChunkPipe>(factory(spec), spec, options.chunkRows,
+                                       options.buffers, stats);
+
+    BatchFunc next = [spec, sumId, pipe](Batch& batch) {
+      if (sumId && !batch.sel.empty() && !batch.has(*sumId)) {
+        throw out_of_range(
+            "Error: an offloaded sum found no value for its field");
+      }
+      for (uint32_t row : batch.sel) {
+        OffloadChunk& chunk = pipe->filling();
+        size_t at = chunk.rows;
+        for (size_t j = 0; j < spec.keyIds.size(); j++) {
+          FieldId id = spec.keyIds[j];
+          if (batch.has(id)) {
+            OpResult val = batch.value(id, row);
+            chunk.keyBits[j][at] = val.bits();
+            chunk.keyTypes[j][at] = static_cast<uint8_t>(val.typ);
+          } else {
+            chunk.keyBits[j][at] = 0;
+            chunk.keyTypes[j][at] = kOffloadAbsent;
+          }
+        }
+        if (sumId) {
+          chunk.vals[at] = batch.value(*sumId, row).asInt();
+        }
+        chunk.rows++;
+        if (pipe->full()) {
+          pipe->submit();
+        }
+      }
+    };
+
+    OpFunc reset = [pipe, stats, outKeyId, nextOp](const Headers& headers) {
+      pipe->drain([&](const PackedKey& key, int64_t val) {
+        Headers out = unionHeaders(headers, unpackKey(key));
+        if (outKeyId) {
+          out[*outKeyId] = OpResult::Int(val);
+        }
+        stats->groups++;
+        nextOp.next(out);
+      });
+      nextOp.reset(headers);
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+}  // namespace
+
+void registerGroupbyBackend(const string& name,
+                            GroupbyBackendFactory factory) {
+  lock_guard<mutex> guard(backendsLock);
+  backends()[name] = move(factory);
+}
+
+BatchToTupleOpCreator offloadCountCreator(vector<string> groupKeys,
+                                          string outKey,
+                                          OffloadOptions options) {
+  return offloadStage(move(groupKeys), OffloadKind::Count, nullopt,
+                      internField(outKey), move(options));
+}
+
+BatchToTupleOpCreator offloadSumCreator(vector<string> groupKeys,
+                                        string sumKey, string outKey,
+                                        OffloadOptions options) {
+  return offloadStage(move(groupKeys), OffloadKind::Sum, internField(sumKey),
+                      internField(outKey), move(options));
+}
+
+BatchToTupleOpCreator offloadDistinctCreator(vector<string> groupKeys,
+                                             OffloadOptions options) {
+  return offloadStage(move(groupKeys), OffloadKind::Distinct, nullopt,
+                      nullopt, move(options));
+}
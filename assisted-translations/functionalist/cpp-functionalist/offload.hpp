@@ -0,0 +1,113 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Groupby, count and distinct over long windows, with the aggregation
+// handed to a backend off the packet path. The stage copies the key and
+// value columns of its batches into fixed-size chunks laid out for a bulk
+// copy, one flat array per column, and passes each full chunk to the
+// backend on a thread of its own while it fills the next: with two buffers
+// the copy of one chunk overlaps the aggregation of the one before. At a
+// reset the stage waits for the backend to catch up, takes its groups back
+// and emits them as groupbyCreator would. Meant for forensics over whole
+// traces and for windows like q4's, where the real-time stages would keep
+// one core busy for the length of the window.
+
+enum class OffloadKind {
+  // The number of rows of each group.
+  Count,
+  // The sum of an integer field over each group.
+  Sum,
+  // Each distinct key once.
+  Distinct,
+};
+
+// What a backend aggregates.
+struct OffloadSpec {
+  // Sorted, as internFields returns them; column j of a chunk holds field
+  // keyIds[j].
+  vector<FieldId> keyIds;
+  OffloadKind kind = OffloadKind::Count;
+};
+
+// The key type of a row whose batch lacked the field.
+constexpr uint8_t kOffloadAbsent = 0xff;
+
+// Rows in the layout a device copy wants. keyTypes holds the OpResultType
+// of each key value, or kOffloadAbsent, and keyBits its payload; vals is
+// filled for Sum only. Columns are sized to the chunk's capacity once and
+// reused, so only the first rows entries mean anything.
+struct OffloadChunk {
+  size_t rows = 0;
+  vector<vector<uint64_t>> keyBits;
+  vector<vector<uint8_t>> keyTypes;
+  vector<int64_t> vals;
+};
+
+// Where the aggregation runs. aggregate is called on the stage's offload
+// thread, one chunk at a time; drain on the stage's thread once every chunk
+// submitted has been aggregated.
+class GroupbyBackend {
+ public:
+  virtual ~GroupbyBackend() = default;
+
+  // Folds the rows of chunk into the groups of the epoch.
+  virtual void aggregate(const OffloadChunk& chunk) = 0;
+  // Visits every group with its count or sum (0 for Distinct), then forgets
+  // them all.
+  virtual void drain(
+      const function<void(const PackedKey&, int64_t)>& visit) = 0;
+};
+
+using GroupbyBackendFactory =
+    function<unique_ptr<GroupbyBackend>(const OffloadSpec&)>;
+
+// The backend of that name, for stages created from then on. "host", a
+// FlatTable on the offload thread, is always there; a build with a device
+// toolchain registers its own under another name. Replaces any backend of
+// the same name.
+void registerGroupbyBackend(const string& name, GroupbyBackendFactory factory);
+
+struct OffloadStats {
+  uint64_t chunks = 0;
+  uint64_t rows = 0;
+  // Chunks that were full before the backend had freed a buffer, so that
+  // the stage waited.
+  uint64_t stalls = 0;
+  uint64_t groups = 0;
+};
+
+struct OffloadOptions {
+  string backend = "host";
+  size_t chunkRows = 1 << 16;
+  // Chunks in flight or being filled; at least 2, so that copying and
+  // aggregating overlap.
+  size_t buffers = 2;
+  shared_ptr<OffloadStats> stats;
+};
+
+// Throws invalid_argument for a backend nobody registered, too few buffers,
+// an empty chunk, or a key of more than kMaxKeyFields fields. Sum throws
+// out_of_range for a batch without sumKey.
+BatchToTupleOpCreator offloadCountCreator(
+    vector<string> groupKeys, string outKey,
+    OffloadOptions options = OffloadOptions());
+BatchToTupleOpCreator offloadSumCreator(
+    vector<string> groupKeys, string sumKey, string outKey,
+    OffloadOptions options = OffloadOptions());
+BatchToTupleOpCreator offloadDistinctCreator(
+    vector<string> groupKeys, OffloadOptions options = OffloadOptions());
+
+#endif  // OFFLOAD_H
@@ -0,0 +1,280 @@
+#include "output.hpp"
+
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// "00" through "99", so that digits are written two at a time.
+constexpr char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+char* formatUnsigned(char* out, uint64_t val) {
+  char digits[kMaxIntChars];
+  char* start = digits + sizeof(digits);
+  while (val >= 100) {
+    start -= 2;
+    memcpy(start, kDigitPairs + 2 * (val % 100), 2);
+    val /= 100;
+  }
+  if (val >= 10) {
+    start -= 2;
+    memcpy(start, kDigitPairs + 2 * val, 2);
+  } else {
+    *--start = static_cast<char>('0' + val);
+  }
+  size_t n = digits + sizeof(digits) - start;
+  memcpy(out, start, n);
+  return out + n;
+}
+
+}  // namespace
+
+char* formatInt(char* out, int64_t val) {
+  if (val < 0) {
+    *out++ = '-';
+    return formatUnsigned(out, uint64_t{0} - static_cast<uint64_t>(val));
+  }
+  return formatUnsigned(out, static_cast<uint64_t>(val));
+}
+
+char* formatIPv4(char* out, IPv4Address addr) { return addr.format(out); }
+
+char* formatMAC(char* out, MACAddress addr) { return addr.format(out); }
+
+char* formatFloat(char* out, double val) {
+  return to_chars(out, out + kMaxFloatChars, val, chars_format::fixed, 6).ptr;
+}
+
+OutputBuffer::OutputBuffer(ostream& out, size_t capacity)
+    : out(&out),
+      buf(max(capacity, kMaxFloatChars)),
+      data(buf.data()),
+      capacity(buf.size()) {}
+
+OutputBuffer::OutputBuffer(unique_ptr<ostream> out, size_t capacity)
+    : owned(move(out)),
+      out(owned.get()),
+      buf(max(capacity, kMaxFloatChars)),
+      data(buf.data()),
+      capacity(buf.size()) {}
+
+OutputBuffer::OutputBuffer(unique_ptr<AsyncFileWriter> file)
+    : file(move(file)),
+      data(this->file->buffer()),
+      capacity(this->file->capacity()) {
+  if (capacity < kMaxFloatChars) {
+    throw invalid_argument("Error: OutputBuffer needs buffers of at least " +
+                           to_string(kMaxFloatChars) + " bytes");
+  }
+}
+
+OutputBuffer::~OutputBuffer() {
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+char* OutputBuffer::reserve(size_t n) {
+  if (capacity - used < n) {
+    writeOut();
+  }
+  return data + used;
+}
+
+void OutputBuffer::append(string_view text) {
+  if (capacity - used < text.size()) {
+    writeOut();
+    if (text.size() > capacity && out != nullptr) {
+      out->write(text.data(), static_cast<streamsize>(text.size()));
+      return;
+    }
+    while (text.size() > capacity) {
+      memcpy(data, text.data(), capacity);
+      used = capacity;
+      text.remove_prefix(capacity);
+      writeOut();
+    }
+  }
+  memcpy(data + used, text.data(), text.size());
+  used += text.size();
+}
+
+void OutputBuffer::appendValue(const OpResult& val) {
+  char* at;
+  switch (val.typ) {
+    case OpResultType::Float:
+      at = formatFloat(reserve(kMaxFloatChars), val.asFloat());
+      break;
+    case OpResultType::Int:
+      at = formatInt(reserve(kMaxIntChars + 1), val.asInt());
+      break;
+    case OpResultType::IPv4:
+      at = formatIPv4(reserve(kMaxIPv4Chars), val.asIPv4());
+      break;
+    case OpResultType::MAC:
+      at = formatMAC(reserve(kMaxMACChars), val.asMAC());
+      break;
+    default:
+      append("Empty");
+      return;
+  }
+  used = at - data;
+}
+
+void OutputBuffer::appendHeaders(const Headers& headers) {
+  for (auto it = headers.begin(); it != headers.end(); ++it) {
+    append('"');
+    append(fieldName(it.id()));
+    append("\" => ");
+    appendValue(headers.at(it.id()));
+    append(", ");
+  }
+}
+
+void OutputBuffer::appendLittleEndian(uint64_t val, size_t n) {
+  char* at = reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    at[i] = static_cast<char>(val >> (8 * i));
+  }
+  used += n;
+}
+
+void OutputBuffer::writeOut() {
+  if (used == 0) {
+    return;
+  }
+  if (file != nullptr) {
+    data = file->write(used);
+  } else {
+    out->write(data, static_cast<streamsize>(used));
+  }
+  used = 0;
+}
+
+void OutputBuffer::flush() {
+  writeOut();
+  if (out != nullptr) {
+    out->flush();
+  }
+}
+
+namespace {
+
+struct BinaryWriter {
+  OutputBuffer buffer;
+  // Fields of the last schema written; no tuple has every field.
+  uint64_t schema = ~uint64_t{0};
+
+  explicit BinaryWriter(const string& filename)
+      : buffer(make_unique<AsyncFileWriter>(filename)) {
+    buffer.append(string_view(kBinaryDumpMagic, 4));
+    buffer.append(static_cast<char>(kBinaryDumpVersion));
+  }
+
+  void write(char tag, const Headers& headers) {
+    if (headers.fieldMask() != schema) {
+      schema = headers.fieldMask();
+      buffer.append('S');
+      buffer.append(static_cast<char>(headers.size()));
+      for (auto it = headers.begin(); it != headers.end(); ++it) {
+        const string& name = fieldName(it.id());
+        if (name.size() > UINT8_MAX) {
+          throw length_error("Error: field name too long for a binary dump: " +
+                             name);
+        }
+        buffer.append(static_cast<char>(name.size()));
+        buffer.append(name);
+      }
+    }
+    buffer.append(tag);
+    for (auto it = headers.begin(); it != headers.end(); ++it) {
+      const OpResult& val = headers.at(it.id());
+      buffer.append(static_cast<char>(val.typ));
+      buffer.appendLittleEndian(val.bits(), 8);
+    }
+  }
+};
+
+uint8_t readByte(istream& in) {
+  int c = in.get();
+  if (c == EOF) {
+    throw runtime_error("Error: binary dump is truncated");
+  }
+  return static_cast<uint8_t>(c);
+}
+
+}  // namespace
+
+Operator dumpAsBinary(string filename) {
+  auto writer = make_shared<BinaryWriter>(filename);
+
+  OpFunc next = [writer](const Headers& headers) {
+    writer->write('T', headers);
+  };
+
+  OpFunc reset = [writer](const Headers& headers) {
+    writer->write('R', headers);
+    writer->buffer.flush();
+  };
+
+  return Operator(next, reset);
+}
+
+uint64_t readBinaryDump(istream& in, const Operator& op) {
+  char magic[5] = {};
+  in.read(magic, 4);
+  if (!in || memcmp(magic, kBinaryDumpMagic, 4) != 0) {
+    throw runtime_error("Error: not a binary dump");
+  }
+  uint8_t version = readByte(in);
+  if (version != kBinaryDumpVersion) {
+    throw runtime_error("Error: unsupported binary dump version " +
+                        to_string(version));
+  }
+
+  vector<FieldId> fields;
+  bool haveSchema = false;
+  uint64_t tuples = 0;
+  for (int tag = in.get(); tag != EOF; tag = in.get()) {
+    if (tag == 'S') {
+      fields.resize(readByte(in));
+      for (FieldId& id : fields) {
+        string name(readByte(in), '\0');
+        in.read(name.data(), static_cast<streamsize>(name.size()));
+        if (!in) {
+          throw runtime_error("Error: binary dump is truncated");
+        }
+        id = internField(name);
+      }
+      haveSchema = true;
+      continue;
+    }
+    if ((tag != 'T' && tag != 'R') || !haveSchema) {
+      throw runtime_error("Error: malformed binary dump record");
+    }
+    Headers headers;
+    for (FieldId id : fields) {
+      uint8_t typ = readByte(in);
+      if (typ > static_cast<uint8_t>(OpResultType::Empty)) {
+        throw runtime_error("Error: malformed binary dump value");
+      }
+      uint64_t bits = 0;
+      for (size_t i = 0; i < 8; i++) {
+        bits |= uint64_t{readByte(in)} << (8 * i);
+      }
+      headers[id] = OpResult::fromBits(static_cast<OpResultType>(typ), bits);
+    }
+    if (tag == 'T') {
+      tuples++;
+      op.next(headers);
+    } else {
+      op.reset(headers);
+    }
+  }
+  return tuples;
+}
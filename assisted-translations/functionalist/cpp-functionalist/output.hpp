@@ -0,0 +1,116 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "async_io.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Buffered output for the sinks. Values are formatted straight into one
+// reusable buffer, which is written out when it fills and whenever the sink
+// sees a reset, so that a stream sees one write per buffer or per epoch
+// rather than one per field. Written to an AsyncFileWriter instead, values
+// are formatted straight into its registered buffers and the writes happen
+// off the calling thread.
+
+constexpr size_t kOutputBufferBytes = size_t{1} << 16;
+
+// Room each formatter may need at out. Doubles are written in full, so the
+// largest prints 309 integer digits.
+constexpr size_t kMaxIntChars = 20;
+constexpr size_t kMaxIPv4Chars = IPv4Address::kFormatRoom;
+constexpr size_t kMaxMACChars = MACAddress::kMaxChars;
+constexpr size_t kMaxFloatChars = 320;
+
+// Each writes the text form of its value at out and returns one past the
+// last character written, as to_chars does. The text is that of
+// stringOfOpResult: decimal integers, dotted quads, lower-case colon
+// separated MACs and floats with six decimals.
+char* formatInt(char* out, int64_t val);
+char* formatIPv4(char* out, IPv4Address addr);
+char* formatMAC(char* out, MACAddress addr);
+char* formatFloat(char* out, double val);
+
+class OutputBuffer {
+ public:
+  // Writes to out, which must outlive the buffer.
+  explicit OutputBuffer(ostream& out, size_t capacity = kOutputBufferBytes);
+  explicit OutputBuffer(unique_ptr<ostream> out,
+                        size_t capacity = kOutputBufferBytes);
+  // Fills the buffers of file, handing each to it whole.
+  explicit OutputBuffer(unique_ptr<AsyncFileWriter> file);
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+  ~OutputBuffer();
+
+  void append(char c) {
+    if (used == capacity) {
+      writeOut();
+    }
+    data[used++] = c;
+  }
+  void append(string_view text);
+  // stringOfOpResult(val), without building the string.
+  void appendValue(const OpResult& val);
+  // "key" => value, for every field, as stringOfHeaders gives it.
+  void appendHeaders(const Headers& headers);
+  // n bytes of val, least significant first.
+  void appendLittleEndian(uint64_t val, size_t n);
+
+  // Writes out everything appended so far and flushes the stream. An
+  // AsyncFileWriter is handed the buffer but not waited for.
+  void flush();
+
+ private:
+  // Room for n more bytes, writing out first if need be; n is at most
+  // kMaxFloatChars.
+  char* reserve(size_t n);
+  // Writes out everything appended so far.
+  void writeOut();
+
+  unique_ptr<ostream> owned;
+  ostream* out = nullptr;
+  unique_ptr<AsyncFileWriter> file;
+  vector<char> buf;
+  // The buffer being filled: buf, or one of file's.
+  char* data;
+  size_t capacity;
+  size_t used = 0;
+};
+
+// Binary alternative to the CSV sinks: smaller than text and written and
+// read back without formatting or parsing any value. A file is the magic
+// "FNLB" and a version byte, then a sequence of records, each starting with
+// a tag byte:
+//
+//   'S'  schema: a field count byte, then each field name as a length byte
+//        and its bytes. It gives the fields of the records that follow, and
+//        is written before any record whose fields differ from the last.
+//   'T'  tuple: for each field of the schema, a type byte and the 8-byte
+//        little-endian bits() of its value.
+//   'R'  reset: a tuple passed to reset rather than next.
+//
+// Field names are written out since field ids are only meaningful within
+// one process.
+constexpr char kBinaryDumpMagic[] = "FNLB";
+constexpr uint8_t kBinaryDumpVersion = 1;
+
+// Writes every tuple and reset to filename in the format above, through an
+// AsyncFileWriter, handing the buffer over at each reset.
+Operator dumpAsBinary(string filename);
+
+// Replays a file written by dumpAsBinary through op, calling next and reset
+// in the order they were written, and returns the number of tuples read.
+// Throws runtime_error on a malformed or truncated file.
+uint64_t readBinaryDump(istream& in, const Operator& op);
+
+#endif  // OUTPUT_H
@@ -0,0 +1,44 @@
+#include "packed_key.hpp"
+
+#include <stdexcept>
+
+void PackedKey::push(FieldId id, OpResult val) {
+  if (n == kMaxKeyFields) {
+    throw length_error("Error: grouping key has more than " +
+                       to_string(kMaxKeyFields) + " fields");
+  }
+  fields |= uint64_t{1} << id;
+  vals[n] = val.bits();
+  types[n] = val.typ;
+  n++;
+}
+
+size_t PackedKeyHash::operator()(const PackedKey& key) const {
+  size_t h = packedKeyHashStart(key.fields);
+  for (uint8_t i = 0; i < key.n; i++) {
+    h = packedKeyHashStep(h, key.vals[i], key.types[i]);
+  }
+  return h;
+}
+
+PackedKey packKey(const Headers& headers) {
+  PackedKey key;
+  for (auto it = headers.begin(); it != headers.end(); ++it) {
+    key.push(it.id(), headers.at(it.id()));
+  }
+  return key;
+}
+
+Headers unpackKey(const PackedKey& key) {
+  Headers headers;
+  unpackKeyInto(key, headers);
+  return headers;
+}
+
+void unpackKeyInto(const PackedKey& key, Headers& headers) {
+  uint64_t rest = key.fields;
+  for (uint8_t i = 0; i < key.n; i++, rest &= rest - 1) {
+    FieldId id = static_cast<FieldId>(__builtin_ctzll(rest));
+    headers[id] = OpResult::fromBits(key.types[i], key.vals[i]);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef PACKED_KEY_H
+#define PACKED_KEY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "schema.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+constexpr size_t kMaxKeyFields = 4;
+
+// A grouping key flattened to fixed-size words: the set of fields it holds
+// and each field's tag and raw payload, in FieldId order. Comparing or
+// hashing one touches 48 bytes of plain integers rather than a whole Headers
+// record. Unused entries stay zero so that equal keys are bytewise equal.
+struct PackedKey {
+  uint64_t fields = 0;
+  array<uint64_t, kMaxKeyFields> vals{};
+  array<OpResultType, kMaxKeyFields> types{};
+  uint8_t n = 0;
+
+  // Appends one field; ids must arrive in increasing order. Throws
+  // length_error past kMaxKeyFields.
+  void push(FieldId id, OpResult val);
+
+  bool operator==(const PackedKey& other) const {
+    return fields == other.fields && vals == other.vals &&
+           types == other.types;
+  }
+};
+
+struct PackedKeyHash {
+  size_t operator()(const PackedKey& key) const;
+};
+
+inline uint64_t packedKeyMix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// PackedKeyHash one field at a time, for code that packs keys itself:
+// start from the key's field set, then step once per field in order.
+inline size_t packedKeyHashStart(uint64_t fields) {
+  return packedKeyMix(fields);
+}
+inline size_t packedKeyHashStep(size_t hash, uint64_t val, OpResultType type) {
+  return packedKeyMix(hash ^ val ^ (static_cast<uint64_t>(type) << 56));
+}
+
+PackedKey packKey(const Headers& headers);
+Headers unpackKey(const PackedKey& key);
+// Writes the fields of key into headers, overwriting any already there.
+void unpackKeyInto(const PackedKey& key, Headers& headers);
+
+#endif  // PACKED_KEY_H
@@ -0,0 +1,107 @@
+#include "packet.hpp"
+
+#include <cstring>
+
+namespace {
+
+constexpr size_t kEthHeaderLen = 14;
+constexpr size_t kVlanTagLen = 4;
+constexpr uint16_t kEthertypeIpv4 = 0x0800;
+constexpr uint16_t kEthertypeVlan = 0x8100;
+constexpr uint8_t kProtoTcp = 6;
+constexpr uint8_t kProtoUdp = 17;
+
+inline uint16_t load16(const uint8_t* p) {
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+inline uint32_t load32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return __builtin_bswap32(v);
+}
+
+inline uint64_t load48(const uint8_t* p) {
+  return (static_cast<uint64_t>(load16(p)) << 32) | load32(p + 2);
+}
+
+}  // namespace
+
+void startPacketBatch(Batch& batch, size_t capacity) {
+  batch.clear();
+  batch.reserveColumns(kPacketColumns);
+  batch.time.reserve(capacity);
+  batch.ethSrc.reserve(capacity);
+  batch.ethDst.reserve(capacity);
+  batch.ethEthertype.reserve(capacity);
+  batch.ipv4Hlen.reserve(capacity);
+  batch.ipv4Proto.reserve(capacity);
+  batch.ipv4Len.reserve(capacity);
+  batch.ipv4Src.reserve(capacity);
+  batch.ipv4Dst.reserve(capacity);
+  batch.l4Sport.reserve(capacity);
+  batch.l4Dport.reserve(capacity);
+  batch.l4Flags.reserve(capacity);
+  batch.sel.reserve(capacity);
+}
+
+bool appendPacket(Batch& batch, const uint8_t* frame, size_t caplen,
+                  double time) {
+  if (caplen < kEthHeaderLen) {
+    return false;
+  }
+  size_t offset = 12;
+  uint16_t ethertype = load16(frame + offset);
+  if (ethertype == kEthertypeVlan) {
+    if (caplen < kEthHeaderLen + kVlanTagLen) {
+      return false;
+    }
+    offset += kVlanTagLen;
+    ethertype = load16(frame + offset);
+  }
+  offset += 2;
+  if (ethertype != kEthertypeIpv4 || caplen < offset + 20) {
+    return false;
+  }
+
+  const uint8_t* ip = frame + offset;
+  if ((ip[0] >> 4) != 4) {
+    return false;
+  }
+  size_t hlen = static_cast<size_t>(ip[0] & 0x0f) * 4;
+  if (hlen < 20) {
+    return false;
+  }
+  uint8_t proto = ip[9];
+  bool firstFragment = (load16(ip + 6) & 0x1fff) == 0;
+
+  uint16_t sport = 0;
+  uint16_t dport = 0;
+  uint8_t flags = 0;
+  const uint8_t* l4 = ip + hlen;
+  size_t l4Avail = caplen > offset + hlen ? caplen - offset - hlen : 0;
+  if (firstFragment && (proto == kProtoTcp || proto == kProtoUdp) &&
+      l4Avail >= 4) {
+    sport = load16(l4);
+    dport = load16(l4 + 2);
+    if (proto == kProtoTcp && l4Avail >= 14) {
+      flags = l4[13];
+    }
+  }
+
+  batch.time.push_back(time);
+  batch.ethDst.push_back(load48(frame));
+  batch.ethSrc.push_back(load48(frame + 6));
+  batch.ethEthertype.push_back(ethertype);
+  batch.ipv4Hlen.push_back(static_cast<uint8_t>(hlen));
+  batch.ipv4Proto.push_back(proto);
+  batch.ipv4Len.push_back(load16(ip + 2));
+  batch.ipv4Src.push_back(load32(ip + 12));
+  batch.ipv4Dst.push_back(load32(ip + 16));
+  batch.l4Sport.push_back(sport);
+  batch.l4Dport.push_back(dport);
+  batch.l4Flags.push_back(flags);
+  batch.sel.push_back(static_cast<uint32_t>(batch.rows));
+  batch.rows++;
+  return true;
+}
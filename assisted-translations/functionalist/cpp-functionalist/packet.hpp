@@ -0,0 +1,37 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "batch.hpp"
+#include "schema.hpp"
+
+using namespace std;
+
+// The packet header fields the queries read, as decoded by appendPacket.
+constexpr uint64_t kPacketColumns = (uint64_t{1} << fid(Field::Time)) |
+                                    (uint64_t{1} << fid(Field::EthSrc)) |
+                                    (uint64_t{1} << fid(Field::EthDst)) |
+                                    (uint64_t{1} << fid(Field::EthEthertype)) |
+                                    (uint64_t{1} << fid(Field::Ipv4Hlen)) |
+                                    (uint64_t{1} << fid(Field::Ipv4Proto)) |
+                                    (uint64_t{1} << fid(Field::Ipv4Len)) |
+                                    (uint64_t{1} << fid(Field::Ipv4Src)) |
+                                    (uint64_t{1} << fid(Field::Ipv4Dst)) |
+                                    (uint64_t{1} << fid(Field::L4Sport)) |
+                                    (uint64_t{1} << fid(Field::L4Dport)) |
+                                    (uint64_t{1} << fid(Field::L4Flags));
+
+// Empties batch and sets it up to receive decoded packets.
+void startPacketBatch(Batch& batch, size_t capacity = kDefaultBatchSize);
+
+// Decodes an Ethernet frame (optionally carrying one 802.1Q tag) holding
+// IPv4, and appends it to a batch prepared by startPacketBatch. ipv4.hlen is
+// in bytes; the ports and flags are those of TCP or UDP, and zero for other
+// protocols and for non-first fragments. Returns false, appending nothing,
+// for frames that are not IPv4 or are too short to decode.
+bool appendPacket(Batch& batch, const uint8_t* frame, size_t caplen,
+                  double time);
+
+#endif  // PACKET_H
@@ -0,0 +1,285 @@
+#include "packet_filter.hpp"
+
+#include <linux/filter.h>
+
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+constexpr uint32_t kEthertypeIpv4 = 0x0800;
+constexpr uint32_t kEthertypeVlan = 0x8100;
+constexpr uint32_t kProtoTcp = 6;
+constexpr uint32_t kProtoUdp = 17;
+constexpr uint32_t kAccept = numeric_limits<uint32_t>::max();
+// Scratch slot holding the offset of the IPv4 header, which X also holds
+// between tests.
+constexpr uint32_t kIpOffsetSlot = 0;
+
+// Builds a program with forward jumps to labels, resolved by finish.
+class Assembler {
+ public:
+  using Label = size_t;
+
+  Label label() {
+    targets.push_back(kUnbound);
+    return targets.size() - 1;
+  }
+
+  void bind(Label l) { targets[l] = code.size(); }
+
+  void op(uint16_t opcode, uint32_t k = 0) {
+    code.push_back({opcode, 0, 0, k});
+  }
+
+  // Goes to t if the jump's condition holds and to f otherwise. Both must
+  // lie within 255 instructions.
+  void branch(uint16_t opcode, uint32_t k, Label t, Label f) {
+    fixups.push_back({code.size(), t, f});
+    op(BPF_JMP | opcode, k);
+  }
+
+  void jump(Label to) {
+    fixups.push_back({code.size(), to, kUnbound});
+    op(BPF_JMP | BPF_JA);
+  }
+
+  vector<BpfInsn> finish() {
+    for (const Fixup& fixup : fixups) {
+      BpfInsn& insn = code[fixup.at];
+      if (BPF_OP(insn.code) == BPF_JA) {
+        insn.k = static_cast<uint32_t>(distance(fixup, fixup.t));
+      } else {
+        insn.jt = shortDistance(fixup, fixup.t);
+        insn.jf = shortDistance(fixup, fixup.f);
+      }
+    }
+    return move(code);
+  }
+
+ private:
+  static constexpr size_t kUnbound = numeric_limits<size_t>::max();
+
+  struct Fixup {
+    size_t at;
+    Label t;
+    Label f;
+  };
+
+  vector<BpfInsn> code;
+  vector<size_t> targets;
+  vector<Fixup> fixups;
+
+  size_t distance(const Fixup& fixup, Label l) const {
+    if (targets[l] == kUnbound || targets[l] <= fixup.at) {
+      throw logic_error("Error: packet filter jump to an unbound label");
+    }
+    return targets[l] - fixup.at - 1;
+  }
+
+  uint8_t shortDistance(const Fixup& fixup, Label l) const {
+    size_t d = distance(fixup, l);
+    if (d > numeric_limits<uint8_t>::max()) {
+      throw logic_error("Error: packet filter branch out of range");
+    }
+    return static_cast<uint8_t>(d);
+  }
+};
+
+// Falls through if A op k holds, and goes to fail otherwise. The branch
+// itself only ever skips one instruction, however far fail is.
+void require(Assembler& a, PacketTest::Op op, uint32_t k,
+             Assembler::Label fail) {
+  Assembler::Label ok = a.label();
+  Assembler::Label no = a.label();
+  switch (op) {
+    case PacketTest::Op::Eq: a.branch(BPF_JEQ | BPF_K, k, ok, no); break;
+    case PacketTest::Op::Ne: a.branch(BPF_JEQ | BPF_K, k, no, ok); break;
+    case PacketTest::Op::Gt: a.branch(BPF_JGT | BPF_K, k, ok, no); break;
+    case PacketTest::Op::Le: a.branch(BPF_JGT | BPF_K, k, no, ok); break;
+    case PacketTest::Op::Ge: a.branch(BPF_JGE | BPF_K, k, ok, no); break;
+    case PacketTest::Op::Lt: a.branch(BPF_JGE | BPF_K, k, no, ok); break;
+  }
+  a.bind(no);
+  a.jump(fail);
+  a.bind(ok);
+}
+
+// Loads the L4 field at offset into A as appendPacket decodes it: 0 unless
+// the packet is the first fragment of a TCP (or, unless tcpOnly, UDP)
+// packet with need bytes of L4 header.
+void loadL4(Assembler& a, uint32_t offset, uint16_t size, bool tcpOnly,
+            uint32_t need) {
+  Assembler::Label l4 = a.label();
+  Assembler::Label zero = a.label();
+  Assembler::Label done = a.label();
+  a.op(BPF_LD | BPF_B | BPF_IND, 9);
+  if (tcpOnly) {
+    a.branch(BPF_JEQ | BPF_K, kProtoTcp, l4, zero);
+  } else {
+    Assembler::Label notTcp = a.label();
+    a.branch(BPF_JEQ | BPF_K, kProtoTcp, l4, notTcp);
+    a.bind(notTcp);
+    a.branch(BPF_JEQ | BPF_K, kProtoUdp, l4, zero);
+  }
+  a.bind(l4);
+  Assembler::Label first = a.label();
+  a.op(BPF_LD | BPF_H | BPF_IND, 6);
+  a.branch(BPF_JSET | BPF_K, 0x1fff, zero, first);
+  a.bind(first);
+  // X = the offset of the L4 header; then len - need >= X.
+  a.op(BPF_LD | BPF_B | BPF_IND, 0);
+  a.op(BPF_ALU | BPF_AND | BPF_K, 0x0f);
+  a.op(BPF_ALU | BPF_LSH | BPF_K, 2);
+  a.op(BPF_ALU | BPF_ADD | BPF_X);
+  a.op(BPF_MISC | BPF_TAX);
+  Assembler::Label whole = a.label();
+  a.op(BPF_LD | BPF_W | BPF_LEN);
+  a.op(BPF_ALU | BPF_SUB | BPF_K, need);
+  a.branch(BPF_JGE | BPF_X, 0, whole, zero);
+  a.bind(whole);
+  a.op(BPF_LD | size | BPF_IND, offset);
+  a.op(BPF_LDX | BPF_W | BPF_MEM, kIpOffsetSlot);
+  a.jump(done);
+  a.bind(zero);
+  a.op(BPF_LDX | BPF_W | BPF_MEM, kIpOffsetSlot);
+  a.op(BPF_LD | BPF_W | BPF_IMM, 0);
+  a.bind(done);
+}
+
+// Loads field into A, with X the offset of the IPv4 header before and
+// after.
+void loadField(Assembler& a, FieldId field) {
+  switch (static_cast<Field>(field)) {
+    case Field::Ipv4Hlen:
+      a.op(BPF_LD | BPF_B | BPF_IND, 0);
+      a.op(BPF_ALU | BPF_AND | BPF_K, 0x0f);
+      a.op(BPF_ALU | BPF_LSH | BPF_K, 2);
+      return;
+    case Field::Ipv4Proto:
+      return a.op(BPF_LD | BPF_B | BPF_IND, 9);
+    case Field::Ipv4Len:
+      return a.op(BPF_LD | BPF_H | BPF_IND, 2);
+    case Field::Ipv4Src:
+      return a.op(BPF_LD | BPF_W | BPF_IND, 12);
+    case Field::Ipv4Dst:
+      return a.op(BPF_LD | BPF_W | BPF_IND, 16);
+    case Field::L4Sport:
+      return loadL4(a, 0, BPF_H, false, 4);
+    case Field::L4Dport:
+      return loadL4(a, 2, BPF_H, false, 4);
+    case Field::L4Flags:
+      return loadL4(a, 13, BPF_B, true, 14);
+    default:
+      throw logic_error("Error: the packet filter cannot load field \"" +
+                        fieldName(field) + "\"");
+  }
+}
+
+// Whether test holds whatever the packet, fails whatever the packet, or
+// needs the packet: tests of the ethertype, which is always IPv4 once
+// decoded, and of constants no 32-bit value reaches are settled here.
+enum class Outcome { Holds, Fails, Depends };
+
+Outcome settle(const PacketTest& test) {
+  int64_t known;
+  if (test.field == fid(Field::EthEthertype)) {
+    known = kEthertypeIpv4;
+  } else if (test.k < 0) {
+    known = test.k + 1;
+  } else if (test.k > numeric_limits<uint32_t>::max()) {
+    known = test.k - 1;
+  } else {
+    return Outcome::Depends;
+  }
+  // For the out-of-range constants, known stands for every value the field
+  // can take: all above k, or all below it.
+  bool holds = false;
+  switch (test.op) {
+    case PacketTest::Op::Eq: holds = known == test.k; break;
+    case PacketTest::Op::Ne: holds = known != test.k; break;
+    case PacketTest::Op::Lt: holds = known < test.k; break;
+    case PacketTest::Op::Le: holds = known <= test.k; break;
+    case PacketTest::Op::Gt: holds = known > test.k; break;
+    case PacketTest::Op::Ge: holds = known >= test.k; break;
+  }
+  return holds ? Outcome::Holds : Outcome::Fails;
+}
+
+}  // namespace
+
+OpResultType packetTestType(FieldId field) {
+  switch (static_cast<Field>(field)) {
+    case Field::EthEthertype:
+    case Field::Ipv4Hlen:
+    case Field::Ipv4Proto:
+    case Field::Ipv4Len:
+    case Field::L4Sport:
+    case Field::L4Dport:
+    case Field::L4Flags:
+      return OpResultType::Int;
+    case Field::Ipv4Src:
+    case Field::Ipv4Dst:
+      return OpResultType::IPv4;
+    default:
+      return OpResultType::Empty;
+  }
+}
+
+vector<BpfInsn> compilePacketFilter(
+    const vector<vector<PacketTest>>& clauses) {
+  Assembler a;
+  Assembler::Label reject = a.label();
+
+  // X and M[0] = the offset of an IPv4 header, after at most one VLAN tag.
+  Assembler::Label vlan = a.label();
+  Assembler::Label plain = a.label();
+  Assembler::Label ip = a.label();
+  a.op(BPF_LD | BPF_H | BPF_ABS, 12);
+  a.branch(BPF_JEQ | BPF_K, kEthertypeVlan, vlan, plain);
+  a.bind(plain);
+  require(a, PacketTest::Op::Eq, kEthertypeIpv4, reject);
+  a.op(BPF_LDX | BPF_W | BPF_IMM, 14);
+  a.jump(ip);
+  a.bind(vlan);
+  a.op(BPF_LD | BPF_H | BPF_ABS, 16);
+  require(a, PacketTest::Op::Eq, kEthertypeIpv4, reject);
+  a.op(BPF_LDX | BPF_W | BPF_IMM, 18);
+  a.bind(ip);
+  a.op(BPF_STX, kIpOffsetSlot);
+  // Version 4, and a header of at least 20 bytes.
+  a.op(BPF_LD | BPF_B | BPF_IND, 0);
+  a.op(BPF_ALU | BPF_AND | BPF_K, 0xf0);
+  require(a, PacketTest::Op::Eq, 0x40, reject);
+  a.op(BPF_LD | BPF_B | BPF_IND, 0);
+  a.op(BPF_ALU | BPF_AND | BPF_K, 0x0f);
+  require(a, PacketTest::Op::Ge, 5, reject);
+
+  for (const vector<PacketTest>& clause : clauses) {
+    bool possible = true;
+    for (const PacketTest& test : clause) {
+      if (packetTestType(test.field) == OpResultType::Empty) {
+        throw invalid_argument(
+            "Error: the packet filter cannot read field \"" +
+            fieldName(test.field) + "\"");
+      }
+      possible = possible && settle(test) != Outcome::Fails;
+    }
+    if (!possible) {
+      continue;
+    }
+    Assembler::Label next = a.label();
+    for (const PacketTest& test : clause) {
+      if (settle(test) == Outcome::Depends) {
+        loadField(a, test.field);
+        require(a, test.op, static_cast<uint32_t>(test.k), next);
+      }
+    }
+    a.op(BPF_RET | BPF_K, kAccept);
+    a.bind(next);
+  }
+
+  a.bind(reject);
+  a.op(BPF_RET | BPF_K, 0);
+  return a.finish();
+}
@@ -0,0 +1,48 @@
+#ifndef PACKET_FILTER_H
+#define PACKET_FILTER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "schema.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Filters run by the kernel on captured packets before they are copied to
+// the capture ring, built from the filters that open the queries. They only
+// cut what reaches userspace: the queries still run their own filters, so a
+// packet filter may pass packets a query drops but must never drop one that
+// some query keeps.
+
+// One instruction of a classic BPF program, laid out as the kernel's
+// sock_filter.
+struct BpfInsn {
+  uint16_t code;
+  uint8_t jt;
+  uint8_t jf;
+  uint32_t k;
+};
+
+// field op k, over the value appendPacket decodes for field; addresses
+// compare as their 32-bit numbers.
+struct PacketTest {
+  enum class Op { Eq, Ne, Lt, Le, Gt, Ge };
+
+  FieldId field;
+  Op op;
+  int64_t k;
+};
+
+// The type of field as decoded, if a PacketTest can read it off the wire,
+// and Empty otherwise.
+OpResultType packetTestType(FieldId field);
+
+// A program that accepts the IPv4 packets for which every test of at least
+// one clause holds, and drops everything else, including packets
+// appendPacket would not decode. An empty clause accepts every IPv4 packet;
+// no clauses accept nothing. Throws invalid_argument for a test of a field
+// packetTestType does not allow.
+vector<BpfInsn> compilePacketFilter(const vector<vector<PacketTest>>& clauses);
+
+#endif  // PACKET_FILTER_H
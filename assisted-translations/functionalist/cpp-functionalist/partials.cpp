@@ -0,0 +1,536 @@
+#include "partials.hpp"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "async_close.hpp"
+#include "checkpoint.hpp"
+
+namespace {
+
+enum class FrameKind : uint8_t { Hello, Fields, Tuples, EpochEnd, Bye };
+
+// The u32 length and the u8 kind.
+constexpr size_t kFrameHeader = 5;
+constexpr size_t kRecvChunk = size_t{1} << 16;
+
+[[noreturn]] void throwErrno(const string& what) {
+  throw runtime_error("Error: " + what + ": " + strerror(errno));
+}
+
+// Starts a frame of kind at the end of out, and returns where it starts for
+// endFrame, which fills in its length.
+size_t beginFrame(string& out, FrameKind kind) {
+  size_t at = out.size();
+  out.append(4, '\0');
+  out += static_cast<char>(kind);
+  return at;
+}
+
+void endFrame(string& out, size_t at) {
+  uint32_t n = static_cast<uint32_t>(out.size() - at - kFrameHeader);
+  for (size_t i = 0; i < 4; i++) {
+    out[at + i] = static_cast<char>(n >> (8 * i));
+  }
+}
+
+void sendAll(int fd, const string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n =
+        send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throwErrno("could not send partial results");
+    }
+    done += static_cast<size_t>(n);
+  }
+}
+
+int connectTo(const string& host, uint16_t port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addrs;
+  int err = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addrs);
+  if (err != 0) {
+    throw runtime_error("Error: could not resolve \"" + host +
+                        "\": " + gai_strerror(err));
+  }
+  int fd = -1;
+  for (addrinfo* addr = addrs; addr != nullptr && fd < 0;
+       addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) {
+    throwErrno("could not connect to " + host + ":" + to_string(port));
+  }
+  // Frames are already batched; an EpochEnd should not wait for more.
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+class PartialSenderState {
+ public:
+  PartialSenderState(const string& host, uint16_t port,
+                     PartialSendOptions options)
+      : options(move(options)),
+        stats(this->options.stats ? this->options.stats
+                                  : make_shared<PartialStats>()) {
+    string node = this->options.node;
+    if (node.empty()) {
+      char name[256] = {};
+      gethostname(name, sizeof(name) - 1);
+      node = name;
+    }
+    fd = connectTo(host, port);
+
+    string hello;
+    StateWriter writer(hello);
+    size_t at = beginFrame(hello, FrameKind::Hello);
+    writer.putBytes(kPartialsMagic, 4);
+    writer.put(kPartialsVersion);
+    writer.putText(node);
+    endFrame(hello, at);
+    try {
+      sendAll(fd, hello);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+
+    AsyncCloseOptions senderOptions;
+    senderOptions.maxSealed = this->options.maxQueued;
+    sender = make_unique<EpochFlusher>(senderOptions);
+  }
+
+  ~PartialSenderState() {
+    try {
+      closeTuples();
+      endFrame(out, beginFrame(out, FrameKind::Bye));
+      ship();
+    } catch (...) {
+      // The aggregator sees the connection drop instead.
+    }
+    // Sends what is queued before the socket goes.
+    sender.reset();
+    close(fd);
+  }
+
+  void next(const Headers& headers) {
+    announceFields(headers);
+    if (tuples == string::npos) {
+      tuples = beginFrame(out, FrameKind::Tuples);
+    }
+    StateWriter(out).putHeaders(headers);
+    stats->tuples++;
+    if (out.size() >= options.frameBytes) {
+      closeTuples();
+      ship();
+    }
+  }
+
+  void reset(const Headers& headers) {
+    announceFields(headers);
+    closeTuples();
+    size_t at = beginFrame(out, FrameKind::EpochEnd);
+    StateWriter(out).putHeaders(headers);
+    endFrame(out, at);
+    stats->frames++;
+    stats->epochs++;
+    ship();
+  }
+
+ private:
+  PartialSendOptions options;
+  shared_ptr<PartialStats> stats;
+  int fd = -1;
+  unique_ptr<EpochFlusher> sender;
+
+  // Frames not yet handed to the sender, the last of which is an open
+  // Tuples frame starting at tuples unless that is npos.
+  string out;
+  size_t tuples = string::npos;
+  // Field ids [0, announced) have been named to the aggregator.
+  size_t announced = 0;
+
+  void closeTuples() {
+    if (tuples != string::npos) {
+      endFrame(out, tuples);
+      tuples = string::npos;
+      stats->frames++;
+    }
+  }
+
+  // Names every field id up to the highest headers uses, in a Fields frame
+  // ahead of the frame that uses them.
+  void announceFields(const Headers& headers) {
+    uint64_t mask = headers.fieldMask();
+    if (mask == 0) {
+      return;
+    }
+    size_t upTo = 64 - static_cast<size_t>(__builtin_clzll(mask));
+    if (upTo <= announced) {
+      return;
+    }
+    closeTuples();
+    StateWriter writer(out);
+    size_t at = beginFrame(out, FrameKind::Fields);
+    writer.putVarint(announced);
+    writer.putVarint(upTo - announced);
+    for (size_t id = announced; id < upTo; id++) {
+      writer.putText(fieldName(static_cast<FieldId>(id)));
+    }
+    endFrame(out, at);
+    stats->frames++;
+    announced = upTo;
+  }
+
+  // Hands the frames built so far to the sender thread as they are.
+  void ship() {
+    sender->checkFailed();
+    auto data = make_shared<const string>(move(out));
+    out = string();
+    out.reserve(options.frameBytes + options.frameBytes / 4);
+    stats->bytes += data->size();
+    int sock = fd;
+    sender->submit([sock, data]() { sendAll(sock, *data); });
+  }
+};
+
+struct Epoch {
+  int64_t eid;
+  Headers reset;
+  vector<string> frames;
+};
+
+struct Node {
+  explicit Node(int fd) : fd(fd) {}
+  ~Node() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  int fd;
+  string name = "?";
+  bool greeted = false;
+  bool done = false;
+  // Bytes received and not yet framed.
+  string in;
+  // This process's id for each of the node's field ids.
+  vector<FieldId> fields;
+  // The Tuples frames of the epoch in progress, and the epochs ended.
+  vector<string> open;
+  deque<Epoch> ended;
+
+  void finish() {
+    done = true;
+    open.clear();
+    close(fd);
+    fd = -1;
+  }
+};
+
+// Thrown for a stream found malformed here, as opposed to the bare
+// runtime_error a StateReader throws, which still needs the node's name.
+struct StreamError : runtime_error {
+  using runtime_error::runtime_error;
+};
+
+[[noreturn]] void badStream(const Node& node, const string& what) {
+  throw StreamError("Error: partial results from node \"" + node.name +
+                    "\" are " + what);
+}
+
+void handleFrame(Node& node, FrameKind kind, const char* begin,
+                 const char* end, FieldId epochKeyId) {
+  StateReader in(begin, end, node.fields);
+  if (!node.greeted && kind != FrameKind::Hello) {
+    badStream(node, "missing their Hello");
+  }
+  switch (kind) {
+    case FrameKind::Hello: {
+      char magic[4];
+      in.bytes(magic, 4);
+      if (node.greeted || memcmp(magic, kPartialsMagic, 4) != 0 ||
+          in.get<uint8_t>() != kPartialsVersion) {
+        badStream(node, "not a partials stream of this version");
+      }
+      node.name = in.text();
+      node.greeted = true;
+      return;
+    }
+    case FrameKind::Fields: {
+      uint64_t first = in.varint();
+      uint64_t n = in.varint();
+      if (first != node.fields.size() || n > kMaxFields - first) {
+        badStream(node, "malformed (bad field announcement)");
+      }
+      for (uint64_t i = 0; i < n; i++) {
+        string text = in.text();
+        try {
+          node.fields.push_back(internField(text));
+        } catch (const out_of_range&) {
+          badStream(node, "over the limit of " + to_string(kMaxFields) +
+                              " field names");
+        }
+      }
+      return;
+    }
+    case FrameKind::Tuples:
+      node.open.emplace_back(begin, end);
+      return;
+    case FrameKind::EpochEnd: {
+      Headers reset = in.headers();
+      if (!reset.contains(epochKeyId)) {
+        badStream(node, "missing the epoch id of a reset");
+      }
+      node.ended.push_back(
+          {reset.at(epochKeyId).asInt(), reset, move(node.open)});
+      node.open.clear();
+      return;
+    }
+    case FrameKind::Bye:
+      node.finish();
+      return;
+  }
+  badStream(node, "malformed (bad frame kind)");
+}
+
+// Receives what is waiting on node's socket and handles every whole frame.
+void receive(Node& node, FieldId epochKeyId, PartialStats& stats) {
+  size_t had = node.in.size();
+  node.in.resize(had + kRecvChunk);
+  ssize_t n = recv(node.fd, &node.in[had], kRecvChunk, 0);
+  if (n < 0) {
+    node.in.resize(had);
+    if (errno == EINTR || errno == EAGAIN) {
+      return;
+    }
+    throwErrno("could not receive from node \"" + node.name + "\"");
+  }
+  node.in.resize(had + static_cast<size_t>(n));
+  if (n == 0) {
+    // Gone without a Bye: its unfinished epoch is lost.
+    node.finish();
+    return;
+  }
+  stats.bytes += static_cast<size_t>(n);
+
+  size_t p = 0;
+  while (!node.done && node.in.size() - p >= kFrameHeader) {
+    uint32_t len = 0;
+    for (size_t i = 0; i < 4; i++) {
+      len |= static_cast<uint32_t>(static_cast<uint8_t>(node.in[p + i]))
+             << (8 * i);
+    }
+    if (node.in.size() - p - kFrameHeader < len) {
+      break;
+    }
+    auto kind = static_cast<FrameKind>(node.in[p + 4]);
+    const char* begin = node.in.data() + p + kFrameHeader;
+    try {
+      handleFrame(node, kind, begin, begin + len, epochKeyId);
+    } catch (const StreamError&) {
+      throw;
+    } catch (const runtime_error& e) {
+      badStream(node, e.what());
+    }
+    stats.frames++;
+    p += kFrameHeader + len;
+  }
+  if (!node.done) {
+    node.in.erase(0, p);
+  }
+}
+
+}  // namespace
+
+Operator partialSender(const string& host, uint16_t port,
+                       PartialSendOptions options) {
+  auto state = make_shared<PartialSenderState>(host, port, move(options));
+
+  OpFunc next = [state](const Headers& headers) { state->next(headers); };
+  OpFunc reset = [state](const Headers& headers) { state->reset(headers); };
+
+  return Operator(next, reset);
+}
+
+PartialAggregator::PartialAggregator(uint16_t port, size_t numNodes,
+                                     PartialMergeOptions options)
+    : numNodes(numNodes), options(move(options)) {
+  if (numNodes == 0) {
+    throw invalid_argument("Error: an aggregator needs at least one node");
+  }
+  if (!this->options.stats) {
+    this->options.stats = make_shared<PartialStats>();
+  }
+
+  listenFd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (listenFd < 0) {
+    throwErrno("could not open the aggregator socket");
+  }
+  try {
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // Accept IPv4 nodes as well.
+    int off = 0;
+    setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) !=
+        0) {
+      throwErrno("could not bind the aggregator to port " + to_string(port));
+    }
+    if (listen(listenFd, static_cast<int>(numNodes)) != 0) {
+      throwErrno("could not listen on port " + to_string(port));
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+    boundPort = ntohs(addr.sin6_port);
+  } catch (...) {
+    close(listenFd);
+    throw;
+  }
+}
+
+PartialAggregator::~PartialAggregator() { close(listenFd); }
+
+void PartialAggregator::run(Operator nextOp) {
+  FieldId epochKeyId = internField(options.epochKey);
+  PartialStats& stats = *options.stats;
+  vector<unique_ptr<Node>> nodes;
+  optional<int64_t> lastEid;
+  Headers tuple;
+
+  // Passes on every epoch that no connected node can still add to.
+  auto release = [&]() {
+    if (nodes.size() < numNodes) {
+      return;
+    }
+    for (;;) {
+      optional<int64_t> eid;
+      for (const auto& node : nodes) {
+        if (node->ended.empty()) {
+          if (!node->done) {
+            return;
+          }
+        } else if (!eid || node->ended.front().eid < *eid) {
+          eid = node->ended.front().eid;
+        }
+      }
+      if (!eid) {
+        return;
+      }
+
+      optional<Headers> reset;
+      for (auto& node : nodes) {
+        if (node->ended.empty() || node->ended.front().eid != *eid) {
+          continue;
+        }
+        Epoch& epoch = node->ended.front();
+        if (lastEid && *eid <= *lastEid) {
+          stats.late++;
+        } else {
+          for (const string& frame : epoch.frames) {
+            StateReader in(frame.data(), frame.data() + frame.size(),
+                           node->fields);
+            while (!in.done()) {
+              try {
+                tuple = in.headers();
+              } catch (const runtime_error& e) {
+                badStream(*node, e.what());
+              }
+              nextOp.next(tuple);
+              stats.tuples++;
+            }
+          }
+          if (!reset) {
+            reset = epoch.reset;
+          }
+        }
+        node->ended.pop_front();
+      }
+      if (reset) {
+        nextOp.reset(*reset);
+        stats.epochs++;
+        lastEid = eid;
+      }
+    }
+  };
+
+  vector<pollfd> fds;
+  vector<Node*> polled;
+  for (;;) {
+    release();
+    bool allDone = nodes.size() == numNodes;
+    for (const auto& node : nodes) {
+      allDone = allDone && node->done;
+    }
+    if (allDone) {
+      return;
+    }
+
+    fds.clear();
+    polled.clear();
+    if (nodes.size() < numNodes) {
+      fds.push_back({listenFd, POLLIN, 0});
+      polled.push_back(nullptr);
+    }
+    for (const auto& node : nodes) {
+      if (!node->done) {
+        fds.push_back({node->fd, POLLIN, 0});
+        polled.push_back(node.get());
+      }
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throwErrno("could not wait for nodes");
+    }
+
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      if (polled[i] == nullptr) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+          if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+          }
+          throwErrno("could not accept a node");
+        }
+        nodes.push_back(make_unique<Node>(fd));
+      } else {
+        receive(*polled[i], epochKeyId, stats);
+      }
+    }
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef PARTIALS_H
+#define PARTIALS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "utils.hpp"
+
+using namespace std;
+
+// Queries split across hosts: each node runs the front of a query, up to
+// and including its first stateful stage, and sends that stage's output
+// for every epoch to one aggregator, which merges the nodes' epochs and runs
+// the rest. For ddos the nodes keep the distinct (src, dst) pairs and the
+// aggregator takes their distinct union before counting; a groupby whose
+// reduction is a count is merged by summing the counts.
+//
+// Nodes number their epochs alike only if they use aligned epochs (see
+// epochCreator), so that the aggregator can line them up by id.
+//
+// A connection carries frames, each a u32 little-endian payload length, a
+// u8 kind and the payload, laid out with StateWriter:
+//
+//   Hello:    the magic "FNPX", a version byte and the node's name as text.
+//   Fields:   varint first id, varint count, then each field name as text;
+//             the names of the sender's field ids, announced in id order
+//             before a tuple uses them.
+//   Tuples:   varint count, then each tuple as putHeaders writes it.
+//   EpochEnd: the headers of the reset that closed the epoch.
+//   Bye:      empty; the node is done.
+
+constexpr char kPartialsMagic[] = "FNPX";
+constexpr uint8_t kPartialsVersion = 1;
+
+struct PartialStats {
+  uint64_t frames = 0;
+  uint64_t tuples = 0;
+  uint64_t epochs = 0;
+  uint64_t bytes = 0;
+  // Aggregator only: epochs that arrived after a later epoch had already
+  // been merged, and were dropped.
+  uint64_t late = 0;
+};
+
+struct PartialSendOptions {
+  // The name the node gives the aggregator; the host name when empty.
+  string node;
+  // A frame of tuples is sent once it holds this many bytes; a reset
+  // always ends the frame.
+  size_t frameBytes = size_t{1} << 16;
+  // Frames that may wait for the sender thread before the stage blocks.
+  size_t maxQueued = 16;
+  // Updated as the stage runs when set.
+  shared_ptr<PartialStats> stats;
+};
+
+// A sink that sends its tuples and resets to the aggregator listening at
+// host:port. Frames are built on the calling thread and handed whole to a
+// sender thread of the stage's own, so a slow network holds up the packet
+// path only once maxQueued frames are waiting. Throws runtime_error if it
+// cannot connect; a failed send is rethrown by the next call. Sends Bye and
+// closes the connection when the last copy of the operator is dropped.
+Operator partialSender(const string& host, uint16_t port,
+                       PartialSendOptions options = PartialSendOptions());
+
+struct PartialMergeOptions {
+  // The field of the reset headers holding the epoch id.
+  string epochKey = "eid";
+  // Updated as run goes when set.
+  shared_ptr<PartialStats> stats;
+};
+
+// The aggregator side: listens on port for numNodes partialSenders and
+// merges what they send into one stream. Each node's epoch is held until it
+// ends; epoch e is then passed on, the tuples of every node that had it
+// followed by one reset, once every node still connected has ended e or a
+// later epoch. Received frames are kept as they arrived and decoded only as
+// they are passed on.
+class PartialAggregator {
+ public:
+  // Binds and listens; port 0 picks a free port. Throws runtime_error on
+  // failure.
+  PartialAggregator(uint16_t port, size_t numNodes,
+                    PartialMergeOptions options = PartialMergeOptions());
+  ~PartialAggregator();
+
+  PartialAggregator(const PartialAggregator&) = delete;
+  PartialAggregator& operator=(const PartialAggregator&) = delete;
+
+  uint16_t port() const { return boundPort; }
+
+  // Accepts the nodes and feeds nextOp on the calling thread until every
+  // node has said Bye or disconnected. No epoch is passed on before all
+  // numNodes have connected. Throws runtime_error on a malformed stream,
+  // or on one whose field names would take the intern table past
+  // kMaxFields.
+  void run(Operator nextOp);
+
+ private:
+  int listenFd = -1;
+  uint16_t boundPort = 0;
+  size_t numNodes;
+  PartialMergeOptions options;
+};
+
+#endif  // PARTIALS_H
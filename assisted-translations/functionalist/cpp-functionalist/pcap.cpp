@@ -0,0 +1,269 @@
+#include "pcap.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include "packet.hpp"
+
+namespace {
+
+constexpr uint32_t kPcapMagicMicros = 0xa1b2c3d4;
+constexpr uint32_t kPcapMagicNanos = 0xa1b23c4d;
+constexpr uint32_t kPcapngSectionHeader = 0x0a0d0d0a;
+constexpr uint32_t kPcapngByteOrder = 0x1a2b3c4d;
+constexpr uint32_t kPcapngInterface = 1;
+constexpr uint32_t kPcapngSimplePacket = 3;
+constexpr uint32_t kPcapngEnhancedPacket = 6;
+constexpr uint16_t kPcapngOptEnd = 0;
+constexpr uint16_t kPcapngOptTsResol = 9;
+constexpr uint16_t kLinkTypeEthernet = 1;
+constexpr size_t kPcapHeaderLen = 24;
+constexpr size_t kPcapRecordLen = 16;
+
+inline size_t pad4(size_t n) { return (n + 3) & ~size_t{3}; }
+
+}  // namespace
+
+PcapReader::PcapReader(const string& filename)
+    : file(filename), readAhead(filename) {
+  if (file.size() < 4) {
+    malformed("file too short");
+  }
+  uint32_t magic;
+  memcpy(&magic, file.data(), sizeof(magic));
+  if (magic == kPcapngSectionHeader) {
+    ng = true;
+    return;
+  }
+
+  if (magic == kPcapMagicMicros || magic == kPcapMagicNanos) {
+    swapped = false;
+  } else if (__builtin_bswap32(magic) == kPcapMagicMicros ||
+             __builtin_bswap32(magic) == kPcapMagicNanos) {
+    swapped = true;
+    magic = __builtin_bswap32(magic);
+  } else {
+    malformed("not a pcap or pcapng file");
+  }
+  if (file.size() < kPcapHeaderLen) {
+    malformed("truncated file header");
+  }
+  tsUnit = magic == kPcapMagicNanos ? 1e-9 : 1e-6;
+  if ((read32(20) & 0xffff) != kLinkTypeEthernet) {
+    malformed("link type " + to_string(read32(20) & 0xffff) +
+              " is not Ethernet");
+  }
+  offset = kPcapHeaderLen;
+}
+
+uint16_t PcapReader::read16(size_t at) const {
+  uint16_t v;
+  memcpy(&v, file.data() + at, sizeof(v));
+  return swapped ? __builtin_bswap16(v) : v;
+}
+
+uint32_t PcapReader::read32(size_t at) const {
+  uint32_t v;
+  memcpy(&v, file.data() + at, sizeof(v));
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+void PcapReader::malformed(const string& what) const {
+  throw runtime_error("Error: " + file.name() + ": " + what);
+}
+
+bool PcapReader::next(PacketView& packet) {
+  readAhead.advance(offset);
+  return ng ? nextPcapng(packet) : nextPcap(packet);
+}
+
+bool PcapReader::nextPcap(PacketView& packet) {
+  if (offset == file.size()) {
+    return false;
+  }
+  if (file.size() - offset < kPcapRecordLen) {
+    malformed("truncated record header at byte " + to_string(offset));
+  }
+  uint32_t sec = read32(offset);
+  uint32_t frac = read32(offset + 4);
+  size_t caplen = read32(offset + 8);
+  offset += kPcapRecordLen;
+  if (file.size() - offset < caplen) {
+    malformed("truncated record at byte " + to_string(offset));
+  }
+  packet.data = reinterpret_cast<const uint8_t*>(file.data() + offset);
+  packet.caplen = caplen;
+  packet.time = sec + frac * tsUnit;
+  offset += caplen;
+  return true;
+}
+
+void PcapReader::readSectionHeader(size_t at, size_t len) {
+  if (len < 28) {
+    malformed("truncated section header");
+  }
+  if (read32(at + 8) != kPcapngByteOrder) {
+    malformed("bad byte-order magic in section header");
+  }
+  interfaces.clear();
+}
+
+void PcapReader::readInterface(size_t at, size_t len) {
+  if (len < 20) {
+    malformed("truncated interface description");
+  }
+  Interface iface;
+  iface.linkType = read16(at + 8);
+  iface.tsUnit = 1e-6;
+  size_t opt = at + 16;
+  size_t end = at + len - 4;
+  while (opt + 4 <= end) {
+    uint16_t code = read16(opt);
+    uint16_t optLen = read16(opt + 2);
+    if (code == kPcapngOptEnd || opt + 4 + optLen > end) {
+      break;
+    }
+    if (code == kPcapngOptTsResol && optLen >= 1) {
+      uint8_t resol = static_cast<uint8_t>(file.data()[opt + 4]);
+      iface.tsUnit = (resol & 0x80) ? ldexp(1.0, -(resol & 0x7f))
+                                    : pow(10.0, -static_cast<int>(resol));
+    }
+    opt += 4 + pad4(optLen);
+  }
+  interfaces.push_back(iface);
+}
+
+bool PcapReader::nextPcapng(PacketView& packet) {
+  while (offset < file.size()) {
+    if (file.size() - offset < 12) {
+      malformed("truncated block at byte " + to_string(offset));
+    }
+    uint32_t type;
+    memcpy(&type, file.data() + offset, sizeof(type));
+    if (type == kPcapngSectionHeader) {
+      // The byte order is only known once the section header is read.
+      uint32_t bom;
+      memcpy(&bom, file.data() + offset + 8, sizeof(bom));
+      swapped = bom != kPcapngByteOrder;
+    } else {
+      type = read32(offset);
+    }
+    size_t len = read32(offset + 4);
+    if (len < 12 || len % 4 != 0 || len > file.size() - offset) {
+      malformed("bad block length at byte " + to_string(offset));
+    }
+    size_t at = offset;
+    offset += len;
+
+    switch (type) {
+      case kPcapngSectionHeader:
+        readSectionHeader(at, len);
+        break;
+      case kPcapngInterface:
+        readInterface(at, len);
+        break;
+      case kPcapngEnhancedPacket: {
+        if (len < 32) {
+          malformed("truncated packet block at byte " + to_string(at));
+        }
+        uint32_t ifaceId = read32(at + 8);
+        if (ifaceId >= interfaces.size()) {
+          malformed("packet block names an undeclared interface");
+        }
+        const Interface& iface = interfaces[ifaceId];
+        uint64_t ts = (static_cast<uint64_t>(read32(at + 12)) << 32) |
+                      read32(at + 16);
+        size_t caplen = read32(at + 20);
+        if (caplen > len - 32) {
+          malformed("packet block overruns its length at byte " +
+                    to_string(at));
+        }
+        lastTime = static_cast<double>(ts) * iface.tsUnit;
+        if (iface.linkType != kLinkTypeEthernet) {
+          break;
+        }
+        packet.data = reinterpret_cast<const uint8_t*>(file.data() + at + 28);
+        packet.caplen = caplen;
+        packet.time = lastTime;
+        return true;
+      }
+      case kPcapngSimplePacket: {
+        // Simple packets carry no timestamp; they inherit the last one seen.
+        if (len < 16 || interfaces.empty()) {
+          malformed("bad simple packet block at byte " + to_string(at));
+        }
+        if (interfaces[0].linkType != kLinkTypeEthernet) {
+          break;
+        }
+        size_t origlen = read32(at + 8);
+        packet.data = reinterpret_cast<const uint8_t*>(file.data() + at + 12);
+        packet.caplen = min(origlen, len - 16);
+        packet.time = lastTime;
+        return true;
+      }
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+ReplayStats replayPcap(const string& filename, BatchOperator& op,
+                       ReplayOptions options) {
+  using Clock = chrono::steady_clock;
+
+  PcapReader reader(filename);
+  ReplayStats stats;
+  Batch batch;
+  startPacketBatch(batch, options.batchSize);
+  auto flush = [&batch, &op, &options]() {
+    if (batch.rows > 0) {
+      op.next(batch);
+      startPacketBatch(batch, options.batchSize);
+    }
+  };
+
+  PacketView packet;
+  Clock::time_point start;
+  double firstTime = 0.0;
+  while (reader.next(packet)) {
+    if (options.speed > 0.0) {
+      if (stats.frames == 0) {
+        start = Clock::now();
+        firstTime = packet.time;
+      }
+      auto due = start + chrono::duration_cast<Clock::duration>(
+                             chrono::duration<double>(
+                                 (packet.time - firstTime) / options.speed));
+      if (due > Clock::now()) {
+        // Hand over what is already due before waiting for this packet.
+        flush();
+        this_thread::sleep_until(due);
+      }
+    }
+    stats.frames++;
+    if (appendPacket(batch, packet.data, packet.caplen, packet.time)) {
+      stats.decoded++;
+      if (batch.rows >= options.batchSize) {
+        flush();
+      }
+    }
+  }
+  flush();
+  op.reset(Headers());
+  return stats;
+}
+
+ReplayStats replayPcap(const string& filename, const vector<Operator>& ops,
+                       ReplayOptions options) {
+  vector<BatchOperator> batchOps;
+  batchOps.reserve(ops.size());
+  for (const auto& op : ops) {
+    batchOps.push_back(unbatch(op));
+  }
+  BatchOperator fanout = batchFanout(batchOps);
+  return replayPcap(filename, fanout, options);
+}
@@ -0,0 +1,81 @@
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "async_io.hpp"
+#include "batch.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// One captured frame, pointing into the mapped file.
+struct PacketView {
+  const uint8_t* data;
+  size_t caplen;
+  double time;
+};
+
+// Sequential reader over a classic pcap or a pcapng file, told apart by
+// their magic numbers. Both byte orders and both microsecond and nanosecond
+// pcap timestamps are handled; for pcapng, Enhanced and Simple Packet Blocks
+// are read, honouring each interface's if_tsresol. Only Ethernet link types
+// are accepted. Frames are never copied; the kernel is kept reading the file
+// ahead of the reader so that they are rarely waited for.
+class PcapReader {
+ public:
+  // Throws runtime_error for unreadable or malformed files.
+  explicit PcapReader(const string& filename);
+
+  // Advances to the next frame; false at end of file.
+  bool next(PacketView& packet);
+
+ private:
+  struct Interface {
+    uint16_t linkType;
+    double tsUnit;
+  };
+
+  MappedFile file;
+  ReadAhead readAhead;
+  size_t offset = 0;
+  bool ng = false;
+  bool swapped = false;
+  double tsUnit = 1e-6;
+  vector<Interface> interfaces;
+  double lastTime = 0.0;
+
+  uint16_t read16(size_t at) const;
+  uint32_t read32(size_t at) const;
+  bool nextPcap(PacketView& packet);
+  bool nextPcapng(PacketView& packet);
+  void readSectionHeader(size_t at, size_t len);
+  void readInterface(size_t at, size_t len);
+  [[noreturn]] void malformed(const string& what) const;
+};
+
+struct ReplayOptions {
+  // 0 replays as fast as possible; otherwise packets are released when
+  // wall-clock time catches up with their capture time divided by speed,
+  // so 2.0 plays the capture back at twice its recorded rate.
+  double speed = 0.0;
+  size_t batchSize = kDefaultBatchSize;
+};
+
+struct ReplayStats {
+  uint64_t frames = 0;
+  uint64_t decoded = 0;
+};
+
+// Decodes every frame of a capture into batches for op (frames that are not
+// IPv4 are skipped), with ts from the capture in the time field, and resets
+// op once at the end so that epoch-based queries flush their last epoch.
+ReplayStats replayPcap(const string& filename, BatchOperator& op,
+                       ReplayOptions options = ReplayOptions());
+ReplayStats replayPcap(const string& filename, const vector<Operator>& ops,
+                       ReplayOptions options = ReplayOptions());
+
+#endif  // PCAP_H
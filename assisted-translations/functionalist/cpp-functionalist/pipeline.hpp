@@ -0,0 +1,353 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "builtins.hpp"
+#include "flat_table.hpp"
+#include "packed_key.hpp"
+#include "schema.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Statically composed queries. A pipeline is written left to right,
+//
+//   auto q = pipeline::epoch(1.0, "eid") |
+//            pipeline::filter([](const Headers& h) { ... }) |
+//            pipeline::groupby(keys, counter, "cons") | sink;
+//
+// and the result is one concrete operator type in which every stage holds
+// the next one by value. next() and reset() are plain member functions, so
+// the compiler can inline the whole chain; there is no std::function or
+// shared_ptr between stages. A stage is any type derived from StageTag with
+// a bind(next) member returning the operator for that stage. A sink is
+// anything else with next(const Headers&) and reset(const Headers&) members,
+// or a runtime Operator. toOperator() and runtime() cross back to the
+// type-erased Operator world where that is wanted.
+namespace pipeline {
+
+struct StageTag {};
+
+template <typename T>
+constexpr bool isStage = is_base_of<StageTag, decay_t<T>>::value;
+
+// A runtime Operator wrapped in the static operator interface, used where a
+// pipeline ends in or splices in a type-erased stage.
+class RuntimeOp {
+ public:
+  explicit RuntimeOp(Operator op) : op(move(op)) {}
+
+  void next(const Headers& headers) { op.next(headers); }
+  void reset(const Headers& headers) { op.reset(headers); }
+
+ private:
+  Operator op;
+};
+
+inline RuntimeOp adaptSink(Operator op) { return RuntimeOp(move(op)); }
+
+template <typename Sink>
+Sink adaptSink(Sink sink) {
+  return sink;
+}
+
+// Type-erases a bound pipeline back into an Operator.
+template <typename Op>
+Operator toOperator(Op op) {
+  auto shared = make_shared<Op>(move(op));
+  OpFunc next = [shared](const Headers& headers) { shared->next(headers); };
+  OpFunc reset = [shared](const Headers& headers) { shared->reset(headers); };
+  return Operator(next, reset);
+}
+
+template <typename... Stages>
+class Chain : public StageTag {
+ public:
+  explicit Chain(tuple<Stages...> stages) : stages(move(stages)) {}
+
+  template <typename Next>
+  auto bind(Next next) const {
+    return bindFrom<0>(move(next));
+  }
+
+  const tuple<Stages...>& parts() const { return stages; }
+
+ private:
+  tuple<Stages...> stages;
+
+  template <size_t I, typename Next>
+  auto bindFrom(Next next) const {
+    if constexpr (I == sizeof...(Stages)) {
+      return next;
+    } else {
+      return get<I>(stages).bind(bindFrom<I + 1>(move(next)));
+    }
+  }
+};
+
+template <typename S>
+auto asParts(const S& stage) {
+  return make_tuple(stage);
+}
+
+template <typename... Stages>
+auto asParts(const Chain<Stages...>& chain) {
+  return chain.parts();
+}
+
+template <typename... Stages>
+Chain<Stages...> makeChain(tuple<Stages...> stages) {
+  return Chain<Stages...>(move(stages));
+}
+
+// stage | stage extends the chain; stage | sink binds it.
+template <typename A, typename B, enable_if_t<isStage<A>, int> = 0>
+auto operator|(const A& lhs, B rhs) {
+  if constexpr (isStage<B>) {
+    return makeChain(tuple_cat(asParts(lhs), asParts(rhs)));
+  } else {
+    return lhs.bind(adaptSink(move(rhs)));
+  }
+}
+
+template <typename Next>
+class EpochOp {
+ public:
+  EpochOp(double epochWidth, string keyOut, Next downstream)
+      : epochWidth(epochWidth),
+        keyOut(move(keyOut)),
+        keyOutId(internField(this->keyOut)),
+        downstream(move(downstream)) {}
+
+  void next(const Headers& headers) {
+    double time = headers.at(Field::Time).asFloat();
+    if (epochBoundary == 0.0) {
+      epochBoundary = time + epochWidth;
+    } else {
+      while (time >= epochBoundary) {
+        downstream.reset(singleton(keyOut, OpResult::Int(eid)));
+        epochBoundary += epochWidth;
+        eid++;
+      }
+    }
+    Headers out = headers;
+    out[keyOutId] = OpResult::Int(eid);
+    downstream.next(out);
+  }
+
+  void reset(const Headers& _) {
+    downstream.reset(singleton(keyOut, OpResult::Int(eid)));
+    epochBoundary = 0.0;
+    eid = 0;
+  }
+
+ private:
+  double epochWidth;
+  string keyOut;
+  FieldId keyOutId;
+  double epochBoundary = 0.0;
+  int64_t eid = 0;
+  Next downstream;
+};
+
+struct EpochStage : StageTag {
+  double epochWidth;
+  string keyOut;
+
+  template <typename Next>
+  EpochOp<Next> bind(Next next) const {
+    return EpochOp<Next>(epochWidth, keyOut, move(next));
+  }
+};
+
+inline EpochStage epoch(double epochWidth, string keyOut) {
+  EpochStage stage;
+  stage.epochWidth = epochWidth;
+  stage.keyOut = move(keyOut);
+  return stage;
+}
+
+template <typename F, typename Next>
+class FilterOp {
+ public:
+  FilterOp(F f, Next downstream) : f(move(f)), downstream(move(downstream)) {}
+
+  void next(const Headers& headers) {
+    if (f(headers)) {
+      downstream.next(headers);
+    }
+  }
+
+  void reset(const Headers& headers) { downstream.reset(headers); }
+
+ private:
+  F f;
+  Next downstream;
+};
+
+template <typename F>
+struct FilterStage : StageTag {
+  F f;
+
+  explicit FilterStage(F f) : f(move(f)) {}
+
+  template <typename Next>
+  FilterOp<F, Next> bind(Next next) const {
+    return FilterOp<F, Next>(f, move(next));
+  }
+};
+
+template <typename F>
+FilterStage<F> filter(F f) {
+  return FilterStage<F>(move(f));
+}
+
+template <typename F, typename Next>
+class MapOp {
+ public:
+  MapOp(F f, Next downstream) : f(move(f)), downstream(move(downstream)) {}
+
+  void next(const Headers& headers) { downstream.next(f(headers)); }
+  void reset(const Headers& headers) { downstream.reset(headers); }
+
+ private:
+  F f;
+  Next downstream;
+};
+
+template <typename F>
+struct MapStage : StageTag {
+  F f;
+
+  explicit MapStage(F f) : f(move(f)) {}
+
+  template <typename Next>
+  MapOp<F, Next> bind(Next next) const {
+    return MapOp<F, Next>(f, move(next));
+  }
+};
+
+template <typename F>
+MapStage<F> map(F f) {
+  return MapStage<F>(move(f));
+}
+
+template <typename G, typename R, typename Next>
+class GroupbyOp {
+ public:
+  GroupbyOp(G groupby, R reduct, FieldId outKeyId, Next downstream)
+      : groupby(move(groupby)),
+        reduct(move(reduct)),
+        outKeyId(outKeyId),
+        hTbl(initTableSize()),
+        downstream(move(downstream)) {}
+
+  void next(const Headers& headers) {
+    auto [val, inserted] = hTbl.findOrInsert(packKey(groupby(headers)));
+    *val = reduct(inserted ? OpResult::Empty() : *val, headers);
+  }
+
+  void reset(const Headers& headers) {
+    hTbl.forEach([&](const PackedKey& groupingKey, const OpResult& val) {
+      Headers unionedHeaders = unionHeaders(headers, unpackKey(groupingKey));
+      unionedHeaders[outKeyId] = val;
+      downstream.next(unionedHeaders);
+    });
+    downstream.reset(headers);
+    hTbl.clear();
+  }
+
+ private:
+  G groupby;
+  R reduct;
+  FieldId outKeyId;
+  FlatTable<PackedKey, OpResult, PackedKeyHash> hTbl;
+  Next downstream;
+};
+
+template <typename G, typename R>
+struct GroupbyStage : StageTag {
+  G groupby;
+  R reduct;
+  FieldId outKeyId;
+
+  GroupbyStage(G groupby, R reduct, FieldId outKeyId)
+      : groupby(move(groupby)), reduct(move(reduct)), outKeyId(outKeyId) {}
+
+  template <typename Next>
+  GroupbyOp<G, R, Next> bind(Next next) const {
+    return GroupbyOp<G, R, Next>(groupby, reduct, outKeyId, move(next));
+  }
+};
+
+template <typename G, typename R>
+GroupbyStage<G, R> groupby(G groupby, R reduct, string outKey) {
+  return GroupbyStage<G, R>(move(groupby), move(reduct), internField(outKey));
+}
+
+template <typename G, typename Next>
+class DistinctOp {
+ public:
+  DistinctOp(G groupby, Next downstream)
+      : groupby(move(groupby)),
+        hTbl(initTableSize()),
+        downstream(move(downstream)) {}
+
+  void next(const Headers& headers) { hTbl[packKey(groupby(headers))] = true; }
+
+  void reset(const Headers& headers) {
+    hTbl.forEach([&](const PackedKey& key, bool _) {
+      downstream.next(unionHeaders(headers, unpackKey(key)));
+    });
+    downstream.reset(headers);
+    hTbl.clear();
+  }
+
+ private:
+  G groupby;
+  FlatTable<PackedKey, bool, PackedKeyHash> hTbl;
+  Next downstream;
+};
+
+template <typename G>
+struct DistinctStage : StageTag {
+  G groupby;
+
+  explicit DistinctStage(G groupby) : groupby(move(groupby)) {}
+
+  template <typename Next>
+  DistinctOp<G, Next> bind(Next next) const {
+    return DistinctOp<G, Next>(groupby, move(next));
+  }
+};
+
+template <typename G>
+DistinctStage<G> distinct(G groupby) {
+  return DistinctStage<G>(move(groupby));
+}
+
+// Splices a runtime OpCreator into a static pipeline. Everything downstream
+// of it is type-erased once, at this boundary.
+struct RuntimeStage : StageTag {
+  OpCreator opCreator;
+
+  template <typename Next>
+  RuntimeOp bind(Next next) const {
+    return RuntimeOp(opCreator(toOperator(move(next))));
+  }
+};
+
+inline RuntimeStage runtime(OpCreator opCreator) {
+  RuntimeStage stage;
+  stage.opCreator = move(opCreator);
+  return stage;
+}
+
+}  // namespace pipeline
+
+#endif  // PIPELINE_H
@@ -0,0 +1,252 @@
+#include "plan.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+#include "batch.hpp"
+#include "key_projector.hpp"
+
+namespace plan {
+
+namespace {
+
+string joinNames(const vector<string>& names) {
+  string out;
+  for (const string& name : names) {
+    if (!out.empty()) {
+      out += ',';
+    }
+    out += name;
+  }
+  return out;
+}
+
+// Passes every tuple and reset to each of ops in turn.
+Operator broadcast(vector<Operator> ops) {
+  if (ops.size() == 1) {
+    return ops[0];
+  }
+  auto shared = make_shared<vector<Operator>>(move(ops));
+
+  OpFunc next = [shared](const Headers& headers) {
+    for (const Operator& op : *shared) {
+      op.next(headers);
+    }
+  };
+
+  OpFunc reset = [shared](const Headers& headers) {
+    for (const Operator& op : *shared) {
+      op.reset(headers);
+    }
+  };
+
+  return Operator(next, reset);
+}
+
+bool sameStage(const Stage& a, const Stage& b) {
+  return a.kind == b.kind && a.signature == b.signature;
+}
+
+bool writes(const Stage& map, FieldId id) {
+  return find(map.fields.begin(), map.fields.end(), id) != map.fields.end();
+}
+
+// Whether a map is known to leave every field a filter reads as it was.
+bool commutes(const Stage& map, const Stage& filter) {
+  if (map.kind != StageKind::Map || !map.fieldsKnown) {
+    return false;
+  }
+  for (FieldId id : filter.fields) {
+    if (writes(map, id)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t dropRedundantEpochs(vector<Stage>& stages) {
+  size_t dropped = 0;
+  vector<Stage> kept;
+  // The epoch still in force at the end of kept, if any.
+  optional<size_t> last;
+  for (Stage& stage : stages) {
+    if (stage.kind == StageKind::Epoch) {
+      if (last && sameStage(kept[*last], stage)) {
+        dropped++;
+        continue;
+      }
+      last = kept.size();
+    } else if (last) {
+      FieldId keyOut = kept[*last].fields[0];
+      bool keepsEpoch =
+          stage.kind == StageKind::Filter ||
+          (stage.kind == StageKind::Map && stage.fieldsKnown &&
+           !writes(stage, keyOut) && !writes(stage, fid(Field::Time)));
+      if (!keepsEpoch) {
+        last.reset();
+      }
+    }
+    kept.push_back(move(stage));
+  }
+  stages = move(kept);
+  return dropped;
+}
+
+size_t pushDownFilters(vector<Stage>& stages) {
+  size_t moved = 0;
+  for (size_t i = 1; i < stages.size(); i++) {
+    if (stages[i].kind != StageKind::Filter) {
+      continue;
+    }
+    for (size_t j = i; j > 0 && commutes(stages[j - 1], stages[j]); j--) {
+      swap(stages[j - 1], stages[j]);
+      moved++;
+    }
+  }
+  return moved;
+}
+
+}  // namespace
+
+struct Plan::Node {
+  Stage stage;
+  vector<unique_ptr<Node>> children;
+  vector<Operator> sinks;
+
+  Node* child(Stage& next) {
+    for (auto& child : children) {
+      if (sameStage(child->stage, next)) {
+        return child.get();
+      }
+    }
+    children.push_back(make_unique<Node>());
+    children.back()->stage = move(next);
+    return children.back().get();
+  }
+
+  Operator build() const {
+    vector<Operator> ops;
+    for (const auto& child : children) {
+      ops.push_back(child->stage.creator(child->build()));
+    }
+    ops.insert(ops.end(), sinks.begin(), sinks.end());
+    return broadcast(move(ops));
+  }
+
+  size_t stages() const {
+    size_t total = children.size();
+    for (const auto& child : children) {
+      total += child->stages();
+    }
+    return total;
+  }
+
+  void explain(string& out, size_t depth) const {
+    for (const auto& child : children) {
+      out.append(2 * depth, ' ');
+      out += child->stage.signature;
+      if (!child->sinks.empty()) {
+        out += " -> " + to_string(child->sinks.size()) + " output" +
+               (child->sinks.size() == 1 ? "" : "s");
+      }
+      out += '\n';
+      child->explain(out, depth + 1);
+    }
+  }
+};
+
+Plan::Plan() = default;
+Plan::~Plan() = default;
+Plan::Plan(Plan&&) noexcept = default;
+Plan& Plan::operator=(Plan&&) noexcept = default;
+
+void Plan::add(vector<Stage> stages, Operator nextOp) {
+  for (const Stage& stage : stages) {
+    if (!stage.creator) {
+      throw invalid_argument("Error: plan stage \"" + stage.signature +
+                             "\" has no operator");
+    }
+  }
+  queries.emplace_back(move(stages), move(nextOp));
+}
+
+void Plan::optimize() {
+  planStats = PlanStats();
+  root = make_unique<Node>();
+  for (const auto& [written, nextOp] : queries) {
+    planStats.stagesAdded += written.size();
+    vector<Stage> stages = written;
+    planStats.epochsDropped += dropRedundantEpochs(stages);
+    planStats.filtersMoved += pushDownFilters(stages);
+
+    Node* node = root.get();
+    for (Stage& stage : stages) {
+      node = node->child(stage);
+    }
+    node->sinks.push_back(nextOp);
+  }
+  planStats.stagesBuilt = root->stages();
+}
+
+Operator Plan::compile() {
+  optimize();
+  return root->build();
+}
+
+string Plan::explain() {
+  optimize();
+  string out;
+  root->explain(out, 0);
+  return out;
+}
+
+Stage epoch(double epochWidth, string keyOut) {
+  char width[32];
+  snprintf(width, sizeof(width), "%.17g", epochWidth);
+  Stage stage{StageKind::Epoch, "epoch(" + string(width) + "," + keyOut + ")",
+              epochCreator(epochWidth, keyOut)};
+  stage.fields = {internField(keyOut)};
+  return stage;
+}
+
+Stage filter(string name, vector<string> reads,
+             function<bool(const Headers&)> pred) {
+  Stage stage{StageKind::Filter, "filter(" + name + ")",
+              filterCreator(move(pred))};
+  stage.fields = internFields(reads);
+  stage.fieldsKnown = true;
+  return stage;
+}
+
+Stage map(string name, function<Headers(const Headers&)> f) {
+  return {StageKind::Map, "map(" + name + ")", mapCreator(move(f))};
+}
+
+Stage extend(string name, vector<string> writes, function<void(Headers&)> f) {
+  Stage stage{StageKind::Map, "extend(" + name + ")", extendCreator(move(f))};
+  stage.fields = internFields(writes);
+  stage.fieldsKnown = true;
+  return stage;
+}
+
+Stage distinct(vector<string> groupKeys) {
+  return {StageKind::Stateful, "distinct(" + joinNames(groupKeys) + ")",
+          distinctCreator(KeyProjector(groupKeys))};
+}
+
+Stage groupby(vector<string> groupKeys, string reductName,
+              ReductionFunc reduct, string outKey) {
+  return {StageKind::Stateful,
+          "groupby(" + joinNames(groupKeys) + ";" + reductName + ";" + outKey +
+              ")",
+          groupbyCreator(KeyProjector(groupKeys), move(reduct), outKey)};
+}
+
+Stage stage(string name, OpCreator creator) {
+  return {StageKind::Stateful, name, move(creator)};
+}
+
+}  // namespace plan
@@ -0,0 +1,114 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "builtins.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Logical query plans. A query is written as the list of its stages and the
+// operator its last stage feeds,
+//
+//   plan::Plan p;
+//   p.add({plan::epoch(1.0, "eid"),
+//          plan::filter("tcp_syn", {"ipv4.proto", "l4.flags"}, isSyn),
+//          plan::groupby({"ipv4.dst"}, "counter", counter, "cons")},
+//         sink);
+//   Operator root = p.compile();
+//
+// rather than as nested __ calls, so that the stages can be looked at before
+// any operator is built. compile() first rewrites each query on its own:
+//
+//   - an epoch stage is dropped when the stages since the last one are only
+//     filters and maps that leave its key alone and that last one has the
+//     same width and key. The duplicate would only restart its count at each
+//     reset from the first; the epochs and their resets are the same
+//     without it, but eids count on rather than restarting at 0.
+//   - a filter is moved ahead of a map whose written fields it does not
+//     read, so that the map runs on fewer tuples.
+//
+// and then merges the queries into one DAG: the stages that are equal in
+// several queries up to some point are built once, and their output is
+// fanned out to wherever the queries part. Each query still sees exactly
+// the tuples and resets it would see on its own. Feeding the root every
+// tuple then costs about the union of the queries rather than their sum.
+//
+// Two stages are equal when their kinds and signatures are. The builders
+// below derive the signature from their parameters where they can; those
+// taking code are given a name for it, and stages of the same kind given
+// the same name must do the same thing.
+namespace plan {
+
+enum class StageKind { Epoch, Filter, Map, Stateful };
+
+struct Stage {
+  StageKind kind;
+  string signature;
+  OpCreator creator;
+  // Epoch: its key. Filter: the fields the predicate reads. Map: the fields
+  // it writes, if fieldsKnown, which says it leaves all others unchanged.
+  vector<FieldId> fields;
+  bool fieldsKnown = false;
+};
+
+Stage epoch(double epochWidth, string keyOut);
+Stage filter(string name, vector<string> reads,
+             function<bool(const Headers&)> pred);
+// mapCreator, which may rewrite any field: no filter moves ahead of it.
+Stage map(string name, function<Headers(const Headers&)> f);
+// extendCreator, where f only adds or overwrites the fields in writes.
+Stage extend(string name, vector<string> writes, function<void(Headers&)> f);
+Stage distinct(vector<string> groupKeys);
+Stage groupby(vector<string> groupKeys, string reductName,
+              ReductionFunc reduct, string outKey);
+// Any other single-input stage, under a name of its own.
+Stage stage(string name, OpCreator creator);
+
+struct PlanStats {
+  // Stages over all queries as added, and in the compiled DAG.
+  size_t stagesAdded = 0;
+  size_t stagesBuilt = 0;
+  size_t epochsDropped = 0;
+  size_t filtersMoved = 0;
+};
+
+class Plan {
+ public:
+  Plan();
+  ~Plan();
+
+  Plan(Plan&&) noexcept;
+  Plan& operator=(Plan&&) noexcept;
+
+  // Adds a query whose stages, in order, feed nextOp. With no stages the
+  // query sees the input itself.
+  void add(vector<Stage> stages, Operator nextOp);
+
+  // Optimizes the plan and builds it, returning the one operator to feed
+  // every query's input to. Compiling again builds a fresh copy.
+  Operator compile();
+
+  // The optimized DAG as indented text, one stage per line.
+  string explain();
+
+  const PlanStats& stats() const { return planStats; }
+
+ private:
+  struct Node;
+
+  vector<pair<vector<Stage>, Operator>> queries;
+  unique_ptr<Node> root;
+  PlanStats planStats;
+
+  void optimize();
+};
+
+}  // namespace plan
+
+#endif  // PLAN_H
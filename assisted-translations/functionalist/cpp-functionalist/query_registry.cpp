@@ -0,0 +1,274 @@
+#include "query_registry.hpp"
+
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include "builtins.hpp"
+#include "latency.hpp"
+#include "metrics.hpp"
+
+namespace {
+
+// A CSV sink together with the file it writes to, which must outlive it.
+struct FileSink {
+  shared_ptr<ofstream> file;
+  Operator op;
+};
+
+Operator fileSink(const shared_ptr<ofstream>& file) {
+  auto sink =
+      make_shared<FileSink>(FileSink{file, dumpAsCSV(nullopt, true, *file)});
+  return Operator([sink](const Headers& headers) { sink->op.next(headers); },
+                  [sink](const Headers& headers) { sink->op.reset(headers); });
+}
+
+size_t parseCount(const string& text, const string& what, size_t line) {
+  size_t used = 0;
+  unsigned long long n = 0;
+  try {
+    n = stoull(text, &used);
+  } catch (const logic_error&) {
+    used = 0;
+  }
+  if (used == 0 || used != text.size()) {
+    throw invalid_argument("Error: query config line " + to_string(line) +
+                           ": " + what + " must be a count, not \"" + text +
+                           "\"");
+  }
+  return static_cast<size_t>(n);
+}
+
+double parseFraction(const string& text, const string& what, size_t line) {
+  size_t used = 0;
+  double x = 0.0;
+  try {
+    x = stod(text, &used);
+  } catch (const logic_error&) {
+    used = 0;
+  }
+  if (used == 0 || used != text.size() || !(x >= 0.0)) {
+    throw invalid_argument("Error: query config line " + to_string(line) +
+                           ": " + what +
+                           " must be a nonnegative number, not \"" + text +
+                           "\"");
+  }
+  return x;
+}
+
+size_t parseBytes(string text, const string& what, size_t line) {
+  int shift = 0;
+  char unit = text.empty() ? '\0' : static_cast<char>(tolower(text.back()));
+  if (unit == 'k' || unit == 'm' || unit == 'g') {
+    shift = unit == 'k' ? 10 : unit == 'm' ? 20 : 30;
+    text.pop_back();
+  }
+  size_t n = parseCount(text, what, line);
+  if (n > (SIZE_MAX >> shift)) {
+    throw invalid_argument("Error: query config line " + to_string(line) +
+                           ": " + what + " is too large");
+  }
+  return n << shift;
+}
+
+}  // namespace
+
+void QueryRegistry::add(const string& name, QueryInfo info) {
+  if (!info.build) {
+    throw invalid_argument("Error: query \"" + name + "\" has no build");
+  }
+  if (!entries.emplace(name, move(info)).second) {
+    throw invalid_argument("Error: query \"" + name +
+                           "\" is already registered");
+  }
+}
+
+const QueryInfo* QueryRegistry::find(const string& name) const {
+  auto it = entries.find(name);
+  return it == entries.end() ? nullptr : &it->second;
+}
+
+vector<string> QueryRegistry::names() const {
+  vector<string> out;
+  out.reserve(entries.size());
+  for (const auto& entry : entries) {
+    out.push_back(entry.first);
+  }
+  return out;
+}
+
+vector<Operator> QueryRegistry::build(
+    const vector<QueryConfig>& configs) const {
+  vector<Operator> out;
+  for (BuiltQuery& query : buildEach(configs)) {
+    for (Operator& op : query.inputs) {
+      out.push_back(move(op));
+    }
+  }
+  return out;
+}
+
+void QueryRegistry::schedule(const vector<QueryConfig>& configs,
+                             QueryScheduler& scheduler) const {
+  vector<BuiltQuery> built = buildEach(configs);
+  for (size_t i = 0; i < built.size(); i++) {
+    QueryShare share;
+    share.name = built[i].name;
+    share.weight = configs[i].weight;
+    share.cpuShare = configs[i].cpuShare;
+    share.queueTuples = configs[i].queueTuples;
+    share.shedWhenFull = configs[i].shedWhenFull;
+    scheduler.add(move(share), move(built[i].inputs));
+  }
+}
+
+vector<QueryRegistry::BuiltQuery> QueryRegistry::buildEach(
+    const vector<QueryConfig>& configs) const {
+  // Check every config before building any query.
+  for (const QueryConfig& config : configs) {
+    const QueryInfo* info = find(config.name);
+    if (info == nullptr) {
+      throw invalid_argument("Error: no query named \"" + config.name + "\"");
+    }
+    if (config.shards > 1 && !info->shardable()) {
+      throw invalid_argument("Error: query \"" + config.name +
+                             "\" cannot be sharded");
+    }
+  }
+
+  map<string, shared_ptr<ofstream>> files;
+  map<string, size_t> budgetNames;
+  vector<BuiltQuery> out;
+  for (const QueryConfig& config : configs) {
+    const QueryInfo& info = *find(config.name);
+    bool toStdout = config.output.empty() || config.output == "-";
+    if (!toStdout && !files[config.output]) {
+      auto file = make_shared<ofstream>(config.output);
+      if (!*file) {
+        throw runtime_error("Error: could not open \"" + config.output +
+                            "\"");
+      }
+      files[config.output] = file;
+    }
+    Operator sink = toStdout ? dumpAsCSV() : fileSink(files[config.output]);
+
+    // A query configured more than once gets a budget, and a trace, per
+    // copy.
+    size_t copies = budgetNames[config.name]++;
+    string copyName =
+        copies == 0 ? config.name : config.name + "#" + to_string(copies);
+    auto budget = make_shared<MemoryBudget>(copyName, config.budgetBytes,
+                                            globalMemoryBudget());
+    metrics().addBudget(budget);
+
+    TableSizeScope size(config.expectedKeys > 0 ? config.expectedKeys
+                                                : kInitTableSize);
+    BudgetScope charged(budget, config.policy, kBudgetSketchKeys,
+                        config.spillDir);
+    function<vector<Operator>(Operator)> build =
+        [&info, &config](Operator nextOp) {
+          if (config.shards > 1) {
+            return vector<Operator>{info.buildSharded(nextOp, config.shards)};
+          }
+          return info.build(nextOp);
+        };
+    vector<Operator> inputs =
+        config.trace ? traceQuery(metrics().addTrace(copyName), build, sink)
+                     : build(sink);
+    out.push_back({copyName, move(inputs)});
+  }
+  return out;
+}
+
+vector<QueryConfig> parseQueryConfig(istream& in) {
+  vector<QueryConfig> out;
+  string text;
+  for (size_t line = 1; getline(in, text); line++) {
+    size_t hash = text.find('#');
+    if (hash != string::npos) {
+      text.resize(hash);
+    }
+    istringstream words(text);
+    QueryConfig config;
+    if (!(words >> config.name)) {
+      continue;
+    }
+    string word;
+    while (words >> word) {
+      size_t eq = word.find('=');
+      string key = word.substr(0, eq);
+      string val = eq == string::npos ? "" : word.substr(eq + 1);
+      if (eq == string::npos || val.empty()) {
+        throw invalid_argument("Error: query config line " + to_string(line) +
+                               ": expected key=value, not \"" + word + "\"");
+      }
+      if (key == "expected") {
+        config.expectedKeys = parseCount(val, key, line);
+      } else if (key == "shards") {
+        config.shards = parseCount(val, key, line);
+      } else if (key == "output") {
+        config.output = val;
+      } else if (key == "budget") {
+        config.budgetBytes = parseBytes(val, key, line);
+      } else if (key == "policy") {
+        try {
+          config.policy = parseBudgetPolicy(val);
+        } catch (const invalid_argument&) {
+          throw invalid_argument("Error: query config line " +
+                                 to_string(line) + ": policy must be " +
+                                 "shed, sketch or spill, not \"" + val +
+                                 "\"");
+        }
+      } else if (key == "spill") {
+        config.spillDir = val;
+      } else if (key == "trace") {
+        if (val != "on" && val != "off") {
+          throw invalid_argument("Error: query config line " +
+                                 to_string(line) + ": trace must be on or " +
+                                 "off, not \"" + val + "\"");
+        }
+        config.trace = val == "on";
+      } else if (key == "weight") {
+        size_t weight = parseCount(val, key, line);
+        if (weight == 0 || weight > UINT32_MAX) {
+          throw invalid_argument("Error: query config line " +
+                                 to_string(line) +
+                                 ": weight must be between 1 and " +
+                                 to_string(UINT32_MAX));
+        }
+        config.weight = static_cast<uint32_t>(weight);
+      } else if (key == "cpu") {
+        config.cpuShare = parseFraction(val, key, line);
+      } else if (key == "queue") {
+        config.queueTuples = parseCount(val, key, line);
+        if (config.queueTuples == 0) {
+          throw invalid_argument("Error: query config line " +
+                                 to_string(line) + ": queue must be nonzero");
+        }
+      } else if (key == "overflow") {
+        if (val != "block" && val != "shed") {
+          throw invalid_argument("Error: query config line " +
+                                 to_string(line) + ": overflow must be " +
+                                 "block or shed, not \"" + val + "\"");
+        }
+        config.shedWhenFull = val == "shed";
+      } else {
+        throw invalid_argument("Error: query config line " + to_string(line) +
+                               ": unknown key \"" + key + "\"");
+      }
+    }
+    out.push_back(move(config));
+  }
+  return out;
+}
+
+vector<QueryConfig> readQueryConfig(const string& filename) {
+  ifstream in(filename);
+  if (!in) {
+    throw runtime_error("Error: could not open \"" + filename + "\"");
+  }
+  return parseQueryConfig(in);
+}
@@ -0,0 +1,110 @@
+#ifndef QUERY_REGISTRY_H
+#define QUERY_REGISTRY_H
+
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "memory_budget.hpp"
+#include "query_scheduler.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Named queries that one binary can ship and a deployment can pick from. A
+// registered query is only a recipe: nothing of it is built, and none of
+// its state allocated, until a config asks for it.
+
+struct QueryInfo {
+  // The tuple fields the query reads besides the time its epoch stage
+  // reads, so that a deployment can check that its source provides them.
+  vector<string> fields;
+  // The width of the query's epochs, in seconds; 0 for queries without
+  // epochs.
+  double epochWidth = 1.0;
+  // Builds the query in front of nextOp: one operator per input stream, each
+  // to be fed every tuple.
+  function<vector<Operator>(Operator nextOp)> build;
+  // Builds it spread over numShards threads, its state split by key or
+  // shared; empty for queries that cannot be spread.
+  function<Operator(Operator nextOp, size_t numShards)> buildSharded;
+
+  bool shardable() const { return static_cast<bool>(buildSharded); }
+};
+
+// One query for a deployment to run, as its config gives it.
+struct QueryConfig {
+  string name;
+  // Keys the query's tables are sized for when built; 0 leaves them at
+  // kInitTableSize.
+  size_t expectedKeys = 0;
+  // Threads to split the query's state over; 0 or 1 leaves it unsplit.
+  size_t shards = 0;
+  // File its results are written to as CSV; standard output when empty or
+  // "-". Queries given the same file share it.
+  string output;
+  // Cap on the bytes its tables may hold within an epoch, counted against
+  // globalMemoryBudget() too; 0 leaves it uncapped but still accounted.
+  size_t budgetBytes = 0;
+  // What its stages do with new keys once the cap is reached.
+  BudgetPolicy policy = BudgetPolicy::Shed;
+  // Where the Spill policy puts its run files; the temporary directory
+  // when empty.
+  string spillDir;
+  // Whether to time the query end to end, as traceQuery does, under its
+  // budget's name.
+  bool trace = false;
+  // Its QueryShare when run by schedule(): its weight, the fraction of a
+  // core it may use, 0 for no cap, the tuples its queue holds, and whether
+  // it sheds input past them rather than make the input wait.
+  uint32_t weight = 1;
+  double cpuShare = 0.0;
+  size_t queueTuples = 1 << 16;
+  bool shedWhenFull = false;
+};
+
+class QueryRegistry {
+ public:
+  // Throws invalid_argument if name is taken or info has no build.
+  void add(const string& name, QueryInfo info);
+  // The query registered as name, or null.
+  const QueryInfo* find(const string& name) const;
+  // Every registered name, in order.
+  vector<string> names() const;
+
+  // Builds the queries of configs, each writing to its output and charging
+  // its tables to a budget of its own, registered with metrics() under its
+  // name along with its trace if it has one, and returns their input operators in config order. Throws
+  // invalid_argument for an unknown name or for shards on a query that is
+  // not shardable, and runtime_error for an output that cannot be opened.
+  vector<Operator> build(const vector<QueryConfig>& configs) const;
+  // Builds the queries of configs as build does and adds each to scheduler,
+  // its inputs together, under its budget's name and with the share its
+  // config gives.
+  void schedule(const vector<QueryConfig>& configs,
+                QueryScheduler& scheduler) const;
+
+ private:
+  map<string, QueryInfo> entries;
+
+  struct BuiltQuery {
+    string name;
+    vector<Operator> inputs;
+  };
+  vector<BuiltQuery> buildEach(const vector<QueryConfig>& configs) const;
+};
+
+// Reads a config of one query per line: its name, then any of expected=N,
+// shards=N, output=PATH, budget=BYTES, policy=shed|sketch|spill,
+// spill=DIR, trace=on|off, weight=N, cpu=FRACTION, queue=N and
+// overflow=block|shed, where BYTES may end in k, m or g for binary
+// multiples. Blank lines and anything after a '#' are skipped. Throws
+// invalid_argument for a malformed line, naming it.
+vector<QueryConfig> parseQueryConfig(istream& in);
+// parseQueryConfig of a file; throws runtime_error if it cannot be opened.
+vector<QueryConfig> readQueryConfig(const string& filename);
+
+#endif  // QUERY_REGISTRY_H
@@ -0,0 +1,334 @@
+#include "query_scheduler.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <utility>
+
+#include "metrics.hpp"
+
+namespace {
+
+int64_t steadyNanos() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// CPU time of the calling thread, so that a slice is charged what the query
+// used rather than the wall time the worker held it.
+int64_t threadCpuNanos() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+void bump(atomic<uint64_t>& counter, uint64_t n = 1) {
+  counter.fetch_add(n, memory_order_relaxed);
+}
+
+}  // namespace
+
+double QueryLag::lagSeconds() const {
+  int64_t since = oldestQueuedNanos.load(memory_order_relaxed);
+  return since == 0 ? 0.0 : static_cast<double>(steadyNanos() - since) * 1e-9;
+}
+
+QueryScheduler::QueryScheduler(QuerySchedulerOptions opts)
+    : options(move(opts)), gathering(make_shared<Chunk>()) {
+  if (!(options.sliceSeconds > 0.0) || !(options.budgetWindowSeconds > 0.0)) {
+    throw invalid_argument(
+        "Error: a query scheduler needs a positive slice and budget window");
+  }
+  if (options.chunkSize == 0) {
+    throw invalid_argument(
+        "Error: a query scheduler needs a nonzero chunk size");
+  }
+  size_t numThreads = options.numThreads;
+  if (numThreads == 0) {
+    numThreads = max<size_t>(thread::hardware_concurrency(), 1);
+  }
+  gathering->tuples.reserve(options.chunkSize);
+  for (size_t i = 0; i < numThreads; i++) {
+    workers.emplace_back([this]() { run(); });
+  }
+}
+
+QueryScheduler::~QueryScheduler() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  work.notify_all();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+shared_ptr<const QueryLag> QueryScheduler::add(QueryShare share,
+                                               vector<Operator> inputs) {
+  if (share.weight == 0) {
+    throw invalid_argument("Error: a scheduled query needs a nonzero weight");
+  }
+  if (share.cpuShare < 0.0) {
+    throw invalid_argument(
+        "Error: a scheduled query's CPU share cannot be negative");
+  }
+  if (share.queueTuples == 0) {
+    throw invalid_argument(
+        "Error: a scheduled query needs room for at least one tuple");
+  }
+  auto slot = make_unique<Slot>();
+  slot->lag = make_shared<QueryLag>();
+  slot->lag->name = share.name;
+  slot->lag->weight = share.weight;
+  slot->inputs = move(inputs);
+  slot->budgetNanos = share.cpuShare * options.budgetWindowSeconds * 1e9;
+  slot->refilledNanos = steadyNanos();
+  slot->share = move(share);
+  metrics().addQueryLag(slot->lag);
+
+  shared_ptr<const QueryLag> lag = slot->lag;
+  lock_guard<mutex> guard(lock);
+  slot->virtualTime = virtualNow;
+  slots.push_back(move(slot));
+  return lag;
+}
+
+Operator QueryScheduler::input() {
+  OpFunc next = [this](const Headers& headers) {
+    gathering->tuples.push_back(headers);
+    if (gathering->tuples.size() >= options.chunkSize) {
+      publish();
+    }
+  };
+  OpFunc reset = [this](const Headers& headers) {
+    gathering->hasReset = true;
+    gathering->reset = headers;
+    publish();
+  };
+  return Operator(next, reset);
+}
+
+void QueryScheduler::wait() {
+  publish();
+  unique_lock<mutex> guard(lock);
+  idle.wait(guard, [this]() { return drained(); });
+  if (error) {
+    exception_ptr e = error;
+    error = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+vector<shared_ptr<const QueryLag>> QueryScheduler::lags() const {
+  lock_guard<mutex> guard(lock);
+  vector<shared_ptr<const QueryLag>> out;
+  for (const auto& slot : slots) {
+    out.push_back(slot->lag);
+  }
+  return out;
+}
+
+void QueryScheduler::publish() {
+  if (gathering->tuples.empty() && !gathering->hasReset) {
+    return;
+  }
+  gathering->queuedNanos = steadyNanos();
+  shared_ptr<const Chunk> chunk = move(gathering);
+  gathering = make_shared<Chunk>();
+  gathering->tuples.reserve(options.chunkSize);
+  size_t n = chunk->tuples.size();
+  // What a shedding query gets of a chunk it has no room for.
+  shared_ptr<Chunk> resetOnly;
+
+  unique_lock<mutex> guard(lock);
+  for (auto& owned : slots) {
+    Slot& slot = *owned;
+    auto fits = [&slot, n]() {
+      return slot.failed || slot.queuedTuples == 0 ||
+             slot.queuedTuples + n <= slot.share.queueTuples;
+    };
+    if (!fits() && slot.share.shedWhenFull) {
+      bump(slot.lag->shed, n);
+      if (chunk->hasReset) {
+        if (!resetOnly) {
+          resetOnly = make_shared<Chunk>();
+          resetOnly->hasReset = true;
+          resetOnly->reset = chunk->reset;
+          resetOnly->queuedNanos = chunk->queuedNanos;
+        }
+        enqueue(slot, resetOnly);
+      }
+      continue;
+    }
+    space.wait(guard, fits);
+    enqueue(slot, chunk);
+  }
+  guard.unlock();
+  work.notify_all();
+}
+
+void QueryScheduler::enqueue(Slot& slot, const shared_ptr<const Chunk>& chunk) {
+  if (slot.failed) {
+    return;
+  }
+  if (slot.queue.empty()) {
+    slot.lag->oldestQueuedNanos.store(chunk->queuedNanos,
+                                      memory_order_relaxed);
+    // A query that has been idle starts level with the others rather than
+    // with the credit of the time it had nothing to do.
+    if (!slot.running) {
+      slot.virtualTime = max(slot.virtualTime, virtualNow);
+    }
+  }
+  slot.queue.push_back(chunk);
+  slot.queuedTuples += chunk->tuples.size();
+  slot.lag->queued.store(slot.queuedTuples, memory_order_relaxed);
+}
+
+void QueryScheduler::refill(Slot& slot, int64_t now) {
+  double cap = slot.share.cpuShare * options.budgetWindowSeconds * 1e9;
+  double earned =
+      static_cast<double>(now - slot.refilledNanos) * slot.share.cpuShare;
+  slot.budgetNanos = min(cap, slot.budgetNanos + earned);
+  slot.refilledNanos = now;
+}
+
+QueryScheduler::Slot* QueryScheduler::pick(int64_t now, int64_t& wakeAt) {
+  wakeAt = 0;
+  Slot* best = nullptr;
+  for (auto& owned : slots) {
+    Slot& slot = *owned;
+    if (slot.running || slot.failed || slot.queue.empty()) {
+      continue;
+    }
+    if (slot.share.cpuShare > 0.0) {
+      refill(slot, now);
+      if (slot.budgetNanos <= 0.0) {
+        bump(slot.lag->throttled);
+        int64_t ready =
+            now + static_cast<int64_t>(-slot.budgetNanos /
+                                       slot.share.cpuShare) + 1;
+        wakeAt = wakeAt == 0 ? ready : min(wakeAt, ready);
+        continue;
+      }
+    }
+    if (best == nullptr || slot.virtualTime < best->virtualTime) {
+      best = &slot;
+    }
+  }
+  if (best != nullptr) {
+    virtualNow = best->virtualTime;
+    best->running = true;
+    running++;
+  }
+  return best;
+}
+
+bool QueryScheduler::drained() const {
+  if (running > 0) {
+    return false;
+  }
+  for (const auto& slot : slots) {
+    if (!slot->failed && !slot->queue.empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void QueryScheduler::runSlice(Slot& slot) {
+  int64_t start = steadyNanos();
+  int64_t cpuStart = threadCpuNanos();
+  auto sliceNanos = static_cast<int64_t>(options.sliceSeconds * 1e9);
+  exception_ptr failure;
+  for (;;) {
+    shared_ptr<const Chunk> chunk;
+    {
+      lock_guard<mutex> guard(lock);
+      if (slot.queue.empty()) {
+        break;
+      }
+      chunk = move(slot.queue.front());
+      slot.queue.pop_front();
+      slot.queuedTuples -= chunk->tuples.size();
+      slot.lag->queued.store(slot.queuedTuples, memory_order_relaxed);
+      slot.lag->oldestQueuedNanos.store(
+          slot.queue.empty() ? 0 : slot.queue.front()->queuedNanos,
+          memory_order_relaxed);
+    }
+    space.notify_all();
+
+    try {
+      for (const Headers& tuple : chunk->tuples) {
+        for (Operator& op : slot.inputs) {
+          op.next(tuple);
+        }
+      }
+      if (chunk->hasReset) {
+        for (Operator& op : slot.inputs) {
+          op.reset(chunk->reset);
+        }
+      }
+    } catch (...) {
+      failure = current_exception();
+      break;
+    }
+    bump(slot.lag->processed, chunk->tuples.size());
+    if (steadyNanos() - start >= sliceNanos) {
+      break;
+    }
+  }
+  int64_t used = threadCpuNanos() - cpuStart;
+
+  {
+    lock_guard<mutex> guard(lock);
+    slot.running = false;
+    running--;
+    slot.virtualTime += static_cast<double>(used) / slot.share.weight;
+    if (slot.share.cpuShare > 0.0) {
+      slot.budgetNanos -= static_cast<double>(used);
+    }
+    bump(slot.lag->cpuNanos, static_cast<uint64_t>(max<int64_t>(used, 0)));
+    bump(slot.lag->slices);
+    if (failure) {
+      slot.failed = true;
+      slot.queue.clear();
+      slot.queuedTuples = 0;
+      slot.lag->queued.store(0, memory_order_relaxed);
+      slot.lag->oldestQueuedNanos.store(0, memory_order_relaxed);
+      if (!error) {
+        error = failure;
+      }
+    }
+  }
+  work.notify_all();
+  space.notify_all();
+  idle.notify_all();
+}
+
+void QueryScheduler::run() {
+  unique_lock<mutex> guard(lock);
+  for (;;) {
+    int64_t wakeAt;
+    Slot* slot = pick(steadyNanos(), wakeAt);
+    if (slot == nullptr) {
+      if (stopping && drained()) {
+        return;
+      }
+      if (wakeAt != 0) {
+        work.wait_until(guard, chrono::steady_clock::time_point(
+                                   chrono::nanoseconds(wakeAt)));
+      } else {
+        work.wait(guard);
+      }
+      continue;
+    }
+    guard.unlock();
+    runSlice(*slot);
+    guard.lock();
+  }
+}
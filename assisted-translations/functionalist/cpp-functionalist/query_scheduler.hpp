@@ -0,0 +1,163 @@
+#ifndef QUERY_SCHEDULER_H
+#define QUERY_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils.hpp"
+
+using namespace std;
+
+// Runs a set of queries over one stream on a pool of workers, each query
+// with a queue of its own, so that an expensive query falls behind on its
+// own rather than holding up the others as it does in a loop over every
+// query. Workers pick among the queries with input waiting by weighted
+// fair share of the CPU time they have used, run the one picked for a time
+// slice, and leave out any query that has used up its CPU budget until the
+// budget refills.
+
+// How far one query is behind, readable from any thread at any time.
+struct QueryLag {
+  string name;
+  uint32_t weight = 1;
+
+  // Tuples queued for the query and not yet passed to it.
+  atomic<uint64_t> queued{0};
+  // When the oldest of them was queued, in steady-clock nanoseconds; 0 with
+  // none queued.
+  atomic<int64_t> oldestQueuedNanos{0};
+  atomic<uint64_t> processed{0};
+  // Tuples dropped because the query's queue was full.
+  atomic<uint64_t> shed{0};
+  // CPU time spent running the query, and the slices it was run in.
+  atomic<uint64_t> cpuNanos{0};
+  atomic<uint64_t> slices{0};
+  // Times a worker found the query with input waiting but its CPU budget
+  // spent.
+  atomic<uint64_t> throttled{0};
+
+  // How long the oldest queued tuple has waited, in seconds.
+  double lagSeconds() const;
+};
+
+struct QueryShare {
+  // Names the query's lag in metrics().
+  string name;
+  // The query's share of the workers while others have input waiting too.
+  uint32_t weight = 1;
+  // CPU seconds per second of wall time the query may use, such as 0.5
+  // for half a core; 0 leaves it unbounded.
+  double cpuShare = 0.0;
+  // Tuples its queue holds before input for it waits or is shed.
+  size_t queueTuples = 1 << 16;
+  // Past queueTuples, drop the query's tuples, counting them, rather than
+  // make the input wait for it. Resets are never dropped.
+  bool shedWhenFull = false;
+};
+
+struct QuerySchedulerOptions {
+  // 0 means one per hardware thread.
+  size_t numThreads = 0;
+  // Most a query runs before its worker picks again; checked between
+  // chunks.
+  double sliceSeconds = 0.002;
+  // Tuples gathered before a chunk is queued; a reset always ends the
+  // current chunk early.
+  size_t chunkSize = 256;
+  // CPU budgets refill continuously, and a query may save up at most this
+  // long of its share to spend at once.
+  double budgetWindowSeconds = 0.1;
+};
+
+class QueryScheduler {
+ public:
+  // Throws invalid_argument for a nonpositive slice or window or an empty
+  // chunk.
+  explicit QueryScheduler(QuerySchedulerOptions options =
+                              QuerySchedulerOptions());
+  // Runs what is already queued, then joins the workers.
+  ~QueryScheduler();
+
+  QueryScheduler(const QueryScheduler&) = delete;
+  QueryScheduler& operator=(const QueryScheduler&) = delete;
+
+  // Adds a query, given by its input operators, each of which is passed
+  // every tuple in turn, as the loop over queries does. A query never runs
+  // on two workers at once, so its inputs may share state, as the two sides
+  // of a join do. Must be called before input() is used. Throws
+  // invalid_argument for a zero weight, a negative CPU share or an empty
+  // queue.
+  shared_ptr<const QueryLag> add(QueryShare share, vector<Operator> inputs);
+
+  // Feeds every query added. Tuples are copied once into chunks that every
+  // query's queue shares. Calls must come from one thread, and block while
+  // the queue of a query that does not shed is full.
+  Operator input();
+
+  // Queues the chunk being gathered, waits until every query has processed
+  // all its input, then rethrows the first exception a query raised, if
+  // any. A query that throws is dropped from then on. Must be called from
+  // the thread feeding input().
+  void wait();
+
+  vector<shared_ptr<const QueryLag>> lags() const;
+
+ private:
+  struct Chunk {
+    vector<Headers> tuples;
+    bool hasReset = false;
+    Headers reset;
+    int64_t queuedNanos = 0;
+  };
+
+  struct Slot {
+    vector<Operator> inputs;
+    QueryShare share;
+    shared_ptr<QueryLag> lag;
+    deque<shared_ptr<const Chunk>> queue;
+    size_t queuedTuples = 0;
+    // CPU nanoseconds used over weight: the query with the least runs next.
+    double virtualTime = 0.0;
+    // CPU nanoseconds the query may still use, and when that was last
+    // topped up.
+    double budgetNanos = 0.0;
+    int64_t refilledNanos = 0;
+    bool running = false;
+    bool failed = false;
+  };
+
+  QuerySchedulerOptions options;
+  vector<unique_ptr<Slot>> slots;
+  shared_ptr<Chunk> gathering;
+
+  mutable mutex lock;
+  condition_variable work;
+  condition_variable space;
+  condition_variable idle;
+  double virtualNow = 0.0;
+  size_t running = 0;
+  bool stopping = false;
+  exception_ptr error;
+  vector<thread> workers;
+
+  void publish();
+  void enqueue(Slot& slot, const shared_ptr<const Chunk>& chunk);
+  void refill(Slot& slot, int64_t now);
+  // The query to run next, or null; sets wakeAt to when a throttled query
+  // can next run, if one is waiting on its budget.
+  Slot* pick(int64_t now, int64_t& wakeAt);
+  bool drained() const;
+  void runSlice(Slot& slot);
+  void run();
+};
+
+#endif  // QUERY_SCHEDULER_H
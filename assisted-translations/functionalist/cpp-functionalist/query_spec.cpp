@@ -0,0 +1,951 @@
+#include "query_spec.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "key_projector.hpp"
+#include "reducers.hpp"
+
+namespace {
+
+enum class TokenKind { Name, Number, Symbol, End };
+
+struct Token {
+  TokenKind kind;
+  string text;
+  size_t line;
+  size_t column;
+};
+
+[[noreturn]] void failAt(const Token& at, const string& what) {
+  throw invalid_argument("Error: query spec line " + to_string(at.line) +
+                         ", column " + to_string(at.column) + ": " + what);
+}
+
+vector<Token> tokenize(const string& spec) {
+  static const char* const kTwoChar[] = {"|>", "==", "!=", "<=",
+                                         ">=", "&&", "||"};
+  vector<Token> tokens;
+  size_t line = 1;
+  size_t lineStart = 0;
+  size_t i = 0;
+  while (i < spec.size()) {
+    char c = spec[i];
+    if (c == '\n') {
+      line++;
+      lineStart = ++i;
+      continue;
+    }
+    if (isspace(static_cast<unsigned char>(c))) {
+      i++;
+      continue;
+    }
+    if (c == '#') {
+      while (i < spec.size() && spec[i] != '\n') {
+        i++;
+      }
+      continue;
+    }
+    Token token{TokenKind::Symbol, "", line, i - lineStart + 1};
+    if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
+      size_t start = i;
+      while (i < spec.size() &&
+             (isalnum(static_cast<unsigned char>(spec[i])) || spec[i] == '_' ||
+              spec[i] == '.')) {
+        i++;
+      }
+      token.kind = TokenKind::Name;
+      token.text = spec.substr(start, i - start);
+    } else if (isdigit(static_cast<unsigned char>(c))) {
+      size_t start = i;
+      while (i < spec.size() &&
+             (isdigit(static_cast<unsigned char>(spec[i])) || spec[i] == '.')) {
+        i++;
+      }
+      token.kind = TokenKind::Number;
+      token.text = spec.substr(start, i - start);
+    } else if (c == '`') {
+      size_t end = spec.find('`', i + 1);
+      if (end == string::npos || spec.find('\n', i) < end) {
+        failAt(token, "unterminated quoted name");
+      }
+      token.kind = TokenKind::Name;
+      token.text = spec.substr(i + 1, end - i - 1);
+      if (token.text.empty()) {
+        failAt(token, "empty quoted name");
+      }
+      i = end + 1;
+    } else {
+      token.text = string(1, c);
+      for (const char* symbol : kTwoChar) {
+        if (spec.compare(i, 2, symbol) == 0) {
+          token.text = symbol;
+        }
+      }
+      if (token.text.size() == 1 && string("()[],;=<>!+-*/%&|").find(c) ==
+                                        string::npos) {
+        failAt(token, string("unexpected character '") + c + "'");
+      }
+      i += token.text.size();
+    }
+    tokens.push_back(move(token));
+  }
+  tokens.push_back({TokenKind::End, "", line, i - lineStart + 1});
+  return tokens;
+}
+
+struct Expr {
+  enum class Kind { Field, Literal, Not, Neg, Binary };
+
+  Kind kind;
+  FieldId field = 0;
+  OpResult literal;
+  string op;
+  unique_ptr<Expr> lhs;
+  unique_ptr<Expr> rhs;
+};
+
+bool isComparison(const string& op) {
+  return op == "==" || op == "!=" || op == "<" || op == "<=" || op == ">" ||
+         op == ">=";
+}
+
+bool isLogical(const Expr& e) {
+  return e.kind == Expr::Kind::Not ||
+         (e.kind == Expr::Kind::Binary &&
+          (e.op == "&&" || e.op == "||" || isComparison(e.op)));
+}
+
+string quoteField(FieldId id) {
+  const string& name = fieldName(id);
+  bool plain = isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_';
+  for (char c : name) {
+    plain &= isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.';
+  }
+  return plain ? name : "`" + name + "`";
+}
+
+// A canonical text form, which serves as the stage's plan signature.
+string toString(const Expr& e) {
+  switch (e.kind) {
+    case Expr::Kind::Field:
+      return quoteField(e.field);
+    case Expr::Kind::Literal:
+      if (e.literal.typ == OpResultType::Float) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.17g", e.literal.f);
+        return text;
+      }
+      return stringOfOpResult(e.literal);
+    case Expr::Kind::Not:
+      return "!" + toString(*e.lhs);
+    case Expr::Kind::Neg:
+      return "-" + toString(*e.lhs);
+    case Expr::Kind::Binary:
+      return "(" + toString(*e.lhs) + " " + e.op + " " + toString(*e.rhs) +
+             ")";
+  }
+  return "";
+}
+
+void fieldsOf(const Expr& e, vector<string>& out) {
+  if (e.kind == Expr::Kind::Field) {
+    out.push_back(fieldName(e.field));
+  }
+  if (e.lhs) {
+    fieldsOf(*e.lhs, out);
+  }
+  if (e.rhs) {
+    fieldsOf(*e.rhs, out);
+  }
+}
+
+using ValueFn = function<OpResult(const Headers&)>;
+using PredFn = function<bool(const Headers&)>;
+
+bool isNumeric(const OpResult& val) {
+  return val.typ == OpResultType::Int || val.typ == OpResultType::Float;
+}
+
+double toDouble(const OpResult& val) {
+  return val.typ == OpResultType::Int ? static_cast<double>(val.i) : val.f;
+}
+
+template <typename T>
+bool compareAs(const string& op, T a, T b) {
+  if (op == "==") return a == b;
+  if (op == "!=") return a != b;
+  if (op == "<") return a < b;
+  if (op == "<=") return a <= b;
+  if (op == ">") return a > b;
+  return a >= b;
+}
+
+bool compareValues(const string& op, const OpResult& a, const OpResult& b) {
+  if (a.typ == OpResultType::Int && b.typ == OpResultType::Int) {
+    return compareAs(op, a.i, b.i);
+  }
+  if (isNumeric(a) && isNumeric(b)) {
+    return compareAs(op, toDouble(a), toDouble(b));
+  }
+  if (a.typ != b.typ) {
+    throw invalid_argument("Error: cannot compare " + stringOfOpResult(a) +
+                           " with " + stringOfOpResult(b));
+  }
+  return compareAs(op, a.bits(), b.bits());
+}
+
+// field op k, for an integer k: the common case, kept to one comparison
+// when the field holds an int.
+struct Comparison {
+  enum class Op { Eq, Ne, Lt, Le, Gt, Ge };
+
+  FieldId id;
+  Op op;
+  int64_t k;
+  string opText;
+
+  bool holds(const Headers& headers) const {
+    const OpResult& val = headers.at(id);
+    if (val.typ != OpResultType::Int) {
+      return compareValues(opText, val, OpResult::Int(k));
+    }
+    switch (op) {
+      case Op::Eq: return val.i == k;
+      case Op::Ne: return val.i != k;
+      case Op::Lt: return val.i < k;
+      case Op::Le: return val.i <= k;
+      case Op::Gt: return val.i > k;
+      case Op::Ge: return val.i >= k;
+    }
+    return false;
+  }
+};
+
+// Splits a comparison of a field with a literal, either way round, into
+// field op literal.
+bool splitComparison(const Expr& e, FieldId& field, OpResult& literal,
+                     string& op) {
+  if (e.kind != Expr::Kind::Binary || !isComparison(e.op)) {
+    return false;
+  }
+  const Expr* lhs = e.lhs.get();
+  const Expr* rhs = e.rhs.get();
+  op = e.op;
+  if (lhs->kind == Expr::Kind::Literal) {
+    swap(lhs, rhs);
+    // k op field is field op' k.
+    static const map<string, string> kFlipped = {
+        {"==", "=="}, {"!=", "!="}, {"<", ">"},
+        {"<=", ">="}, {">", "<"},   {">=", "<="}};
+    op = kFlipped.at(op);
+  }
+  if (lhs->kind != Expr::Kind::Field || rhs->kind != Expr::Kind::Literal) {
+    return false;
+  }
+  field = lhs->field;
+  literal = rhs->literal;
+  return true;
+}
+
+Comparison::Op comparisonOp(const string& op) {
+  static const map<string, Comparison::Op> kOps = {
+      {"==", Comparison::Op::Eq}, {"!=", Comparison::Op::Ne},
+      {"<", Comparison::Op::Lt},  {"<=", Comparison::Op::Le},
+      {">", Comparison::Op::Gt},  {">=", Comparison::Op::Ge}};
+  return kOps.at(op);
+}
+
+bool asComparison(const Expr& e, Comparison& out) {
+  FieldId field;
+  OpResult literal;
+  string op;
+  if (!splitComparison(e, field, literal, op) ||
+      literal.typ != OpResultType::Int) {
+    return false;
+  }
+  out = {field, comparisonOp(op), literal.i, op};
+  return true;
+}
+
+// The comparison as a test the kernel can run on packets, if it compares a
+// packet field with a literal of the field's own type.
+bool asPacketTest(const Expr& e, PacketTest& out) {
+  FieldId field;
+  OpResult literal;
+  string op;
+  if (!splitComparison(e, field, literal, op) ||
+      packetTestType(field) == OpResultType::Empty ||
+      literal.typ != packetTestType(field)) {
+    return false;
+  }
+  static const map<string, PacketTest::Op> kOps = {
+      {"==", PacketTest::Op::Eq}, {"!=", PacketTest::Op::Ne},
+      {"<", PacketTest::Op::Lt},  {"<=", PacketTest::Op::Le},
+      {">", PacketTest::Op::Gt},  {">=", PacketTest::Op::Ge}};
+  out = {field, kOps.at(op), static_cast<int64_t>(literal.bits())};
+  return true;
+}
+
+void conjuncts(const Expr& e, vector<const Expr*>& out) {
+  if (e.kind == Expr::Kind::Binary && e.op == "&&") {
+    conjuncts(*e.lhs, out);
+    conjuncts(*e.rhs, out);
+  } else {
+    out.push_back(&e);
+  }
+}
+
+PredFn compilePred(const Expr& e);
+
+template <typename F>
+ValueFn arithmetic(ValueFn lhs, ValueFn rhs, F f) {
+  return [lhs, rhs, f](const Headers& headers) {
+    return f(lhs(headers), rhs(headers));
+  };
+}
+
+int64_t intOperand(const OpResult& val, const string& op) {
+  if (val.typ != OpResultType::Int) {
+    throw invalid_argument("Error: operator " + op + " needs ints, not " +
+                           stringOfOpResult(val));
+  }
+  return val.i;
+}
+
+template <typename IntOp, typename FloatOp>
+ValueFn numeric(ValueFn lhs, ValueFn rhs, string op, IntOp intOp,
+                FloatOp floatOp) {
+  return arithmetic(lhs, rhs, [op, intOp, floatOp](OpResult a, OpResult b) {
+    if (a.typ == OpResultType::Int && b.typ == OpResultType::Int) {
+      return OpResult::Int(intOp(a.i, b.i));
+    }
+    if (!isNumeric(a) || !isNumeric(b)) {
+      throw invalid_argument("Error: operator " + op + " needs numbers, not " +
+                             stringOfOpResult(a) + " and " +
+                             stringOfOpResult(b));
+    }
+    return OpResult::Float(floatOp(toDouble(a), toDouble(b)));
+  });
+}
+
+ValueFn compileValue(const Expr& e) {
+  if (isLogical(e)) {
+    PredFn pred = compilePred(e);
+    return [pred](const Headers& headers) {
+      return OpResult::Int(pred(headers) ? 1 : 0);
+    };
+  }
+  switch (e.kind) {
+    case Expr::Kind::Field: {
+      FieldId id = e.field;
+      return [id](const Headers& headers) { return headers.at(id); };
+    }
+    case Expr::Kind::Literal: {
+      OpResult val = e.literal;
+      return [val](const Headers&) { return val; };
+    }
+    case Expr::Kind::Neg: {
+      ValueFn operand = compileValue(*e.lhs);
+      return [operand](const Headers& headers) {
+        OpResult val = operand(headers);
+        return val.typ == OpResultType::Float
+                   ? OpResult::Float(-val.f)
+                   : OpResult::Int(-intOperand(val, "-"));
+      };
+    }
+    default:
+      break;
+  }
+
+  ValueFn lhs = compileValue(*e.lhs);
+  ValueFn rhs = compileValue(*e.rhs);
+  const string& op = e.op;
+  if (op == "+") {
+    return numeric(lhs, rhs, op, [](int64_t a, int64_t b) { return a + b; },
+                   [](double a, double b) { return a + b; });
+  }
+  if (op == "-") {
+    return numeric(lhs, rhs, op, [](int64_t a, int64_t b) { return a - b; },
+                   [](double a, double b) { return a - b; });
+  }
+  if (op == "*") {
+    return numeric(lhs, rhs, op, [](int64_t a, int64_t b) { return a * b; },
+                   [](double a, double b) { return a * b; });
+  }
+  if (op == "/") {
+    return numeric(
+        lhs, rhs, op,
+        [](int64_t a, int64_t b) {
+          if (b == 0) {
+            throw invalid_argument("Error: division by zero in query spec");
+          }
+          return a / b;
+        },
+        [](double a, double b) { return a / b; });
+  }
+  return arithmetic(lhs, rhs, [op](OpResult a, OpResult b) {
+    int64_t x = intOperand(a, op);
+    int64_t y = intOperand(b, op);
+    if (op == "%") {
+      if (y == 0) {
+        throw invalid_argument("Error: division by zero in query spec");
+      }
+      return OpResult::Int(x % y);
+    }
+    return OpResult::Int(op == "&" ? (x & y) : (x | y));
+  });
+}
+
+PredFn compilePred(const Expr& e) {
+  vector<const Expr*> parts;
+  conjuncts(e, parts);
+  vector<Comparison> comparisons(parts.size());
+  bool simple = true;
+  for (size_t i = 0; i < parts.size() && simple; i++) {
+    simple = asComparison(*parts[i], comparisons[i]);
+  }
+  if (simple) {
+    if (comparisons.size() == 1) {
+      Comparison c = comparisons[0];
+      return [c](const Headers& headers) { return c.holds(headers); };
+    }
+    return [comparisons](const Headers& headers) {
+      for (const Comparison& c : comparisons) {
+        if (!c.holds(headers)) {
+          return false;
+        }
+      }
+      return true;
+    };
+  }
+
+  if (e.kind == Expr::Kind::Not) {
+    PredFn operand = compilePred(*e.lhs);
+    return [operand](const Headers& headers) { return !operand(headers); };
+  }
+  if (e.kind == Expr::Kind::Binary && (e.op == "&&" || e.op == "||")) {
+    PredFn lhs = compilePred(*e.lhs);
+    PredFn rhs = compilePred(*e.rhs);
+    if (e.op == "&&") {
+      return [lhs, rhs](const Headers& headers) {
+        return lhs(headers) && rhs(headers);
+      };
+    }
+    return [lhs, rhs](const Headers& headers) {
+      return lhs(headers) || rhs(headers);
+    };
+  }
+  if (e.kind == Expr::Kind::Binary && isComparison(e.op)) {
+    ValueFn lhs = compileValue(*e.lhs);
+    ValueFn rhs = compileValue(*e.rhs);
+    string op = e.op;
+    return [lhs, rhs, op](const Headers& headers) {
+      return compareValues(op, lhs(headers), rhs(headers));
+    };
+  }
+  // Any other value is true when it is a nonzero int.
+  ValueFn val = compileValue(e);
+  return [val](const Headers& headers) {
+    return intOperand(val(headers), "filter") != 0;
+  };
+}
+
+struct JoinSideDef {
+  Token query;
+  vector<pair<FieldId, FieldId>> key;
+  vector<FieldId> vals;
+};
+
+struct QueryDef {
+  Token name;
+  bool fromInput = true;
+  JoinSideDef left;
+  JoinSideDef right;
+  vector<plan::Stage> stages;
+  // The comparisons a packet filter can run from the filters the query
+  // opens with, past its epoch stages.
+  vector<PacketTest> packetTests;
+};
+
+class Parser {
+ public:
+  explicit Parser(const string& spec) : tokens(tokenize(spec)) {}
+
+  vector<QueryDef> queries() {
+    vector<QueryDef> out;
+    while (peek().kind != TokenKind::End) {
+      out.push_back(query());
+    }
+    return out;
+  }
+
+ private:
+  vector<Token> tokens;
+  size_t at = 0;
+
+  const Token& peek() const { return tokens[at]; }
+
+  const Token& take() {
+    const Token& token = tokens[at];
+    if (token.kind != TokenKind::End) {
+      at++;
+    }
+    return token;
+  }
+
+  bool accept(const string& text) {
+    if (peek().kind != TokenKind::Number && peek().text == text) {
+      at++;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(const string& text) {
+    if (!accept(text)) {
+      failAt(peek(), "expected '" + text + "'" + found());
+    }
+  }
+
+  string found() const {
+    return peek().kind == TokenKind::End ? " at end of spec"
+                                          : ", found '" + peek().text + "'";
+  }
+
+  Token name(const string& what) {
+    if (peek().kind != TokenKind::Name) {
+      failAt(peek(), "expected " + what + found());
+    }
+    return take();
+  }
+
+  FieldId field() { return intern(name("a field name")); }
+
+  // Field names are interned as the spec is read, so that one naming more
+  // fields than the table holds is rejected at load rather than by its
+  // first tuple.
+  FieldId intern(const Token& token) {
+    try {
+      return internField(token.text);
+    } catch (const out_of_range&) {
+      failAt(token, "too many distinct field names to intern '" +
+                        token.text + "'");
+    }
+  }
+
+  string internedName() {
+    Token token = name("a field name");
+    intern(token);
+    return token.text;
+  }
+
+  vector<string> fieldNames() {
+    vector<string> out;
+    expect("[");
+    if (!accept("]")) {
+      do {
+        out.push_back(internedName());
+      } while (accept(","));
+      expect("]");
+    }
+    return out;
+  }
+
+  // The fields of a groupby or distinct, which pack into a PackedKey.
+  vector<string> keyNames() {
+    Token open = peek();
+    vector<string> out = fieldNames();
+    if (internFields(out).size() > kMaxKeyFields) {
+      failAt(open, "a grouping key has more than " +
+                       to_string(kMaxKeyFields) + " fields");
+    }
+    return out;
+  }
+
+  QueryDef query() {
+    QueryDef def;
+    expect("query");
+    def.name = name("a query name");
+    expect("=");
+    if (accept("join")) {
+      def.fromInput = false;
+      expect("(");
+      def.left = joinSide();
+      expect(",");
+      def.right = joinSide();
+      expect(")");
+    } else {
+      expect("input");
+    }
+    vector<PacketTest>* tests = def.fromInput ? &def.packetTests : nullptr;
+    while (accept("|>")) {
+      def.stages.push_back(stage(tests));
+    }
+    expect(";");
+    return def;
+  }
+
+  JoinSideDef joinSide() {
+    JoinSideDef side;
+    side.query = name("a query name");
+    expect("by");
+    Token keyOpen = peek();
+    expect("[");
+    do {
+      FieldId from = field();
+      FieldId to = accept("as") ? field() : from;
+      side.key.emplace_back(from, to);
+    } while (accept(","));
+    expect("]");
+    vector<FieldId> renamed;
+    for (const auto& [from, to] : side.key) {
+      renamed.push_back(to);
+    }
+    sort(renamed.begin(), renamed.end());
+    renamed.erase(unique(renamed.begin(), renamed.end()), renamed.end());
+    if (renamed.size() > kMaxKeyFields) {
+      failAt(keyOpen, "a join key has more than " +
+                          to_string(kMaxKeyFields) + " fields");
+    }
+    expect("with");
+    Token valsOpen = peek();
+    side.vals = internFields(fieldNames());
+    if (side.vals.size() > kMaxKeyFields) {
+      failAt(valsOpen, "join values have more than " +
+                           to_string(kMaxKeyFields) + " fields");
+    }
+    return side;
+  }
+
+  // Adds the packet tests of a filter to tests, and stops collecting them at
+  // any stage but an epoch or a filter.
+  plan::Stage stage(vector<PacketTest>*& tests) {
+    Token kindToken = name("a stage");
+    const string& kind = kindToken.text;
+    expect("(");
+    plan::Stage out;
+    if (kind == "epoch") {
+      Token widthToken = peek();
+      double width = number();
+      if (!(width > 0)) {
+        failAt(widthToken, "epoch width must be positive");
+      }
+      expect(",");
+      string keyOut = internedName();
+      out = plan::epoch(width, keyOut);
+    } else if (kind == "filter") {
+      unique_ptr<Expr> pred = expr();
+      vector<string> reads;
+      fieldsOf(*pred, reads);
+      out = plan::filter(toString(*pred), reads, compilePred(*pred));
+      if (tests) {
+        vector<const Expr*> parts;
+        conjuncts(*pred, parts);
+        for (const Expr* part : parts) {
+          PacketTest test;
+          if (asPacketTest(*part, test)) {
+            tests->push_back(test);
+          }
+        }
+      }
+    } else if (kind == "map") {
+      tests = nullptr;
+      vector<pair<FieldId, ValueFn>> assigns;
+      vector<string> writes;
+      string signature;
+      do {
+        FieldId id = field();
+        expect("=");
+        unique_ptr<Expr> val = expr();
+        signature += (signature.empty() ? "" : ", ") + quoteField(id) + " = " +
+                     toString(*val);
+        assigns.emplace_back(id, compileValue(*val));
+        writes.push_back(fieldName(id));
+      } while (accept(","));
+      out = plan::extend(signature, writes, [assigns](Headers& headers) {
+        for (const auto& [id, val] : assigns) {
+          headers[id] = val(headers);
+        }
+      });
+    } else if (kind == "distinct") {
+      tests = nullptr;
+      out = plan::distinct(keyNames());
+    } else if (kind == "groupby") {
+      tests = nullptr;
+      out = groupby();
+    } else {
+      failAt(kindToken, "unknown stage '" + kind + "'");
+    }
+    expect(")");
+    return out;
+  }
+
+  plan::Stage groupby() {
+    vector<string> keys = keyNames();
+    expect(",");
+    Token reduction = name("a reduction");
+    string reductName = reduction.text;
+    string searchKey;
+    if (reductName != "count") {
+      if (reductName != "sum" && reductName != "min" && reductName != "max") {
+        failAt(reduction, "unknown reduction '" + reductName + "'");
+      }
+      expect("(");
+      searchKey = internedName();
+      expect(")");
+      reductName += "(" + searchKey + ")";
+    }
+    expect(",");
+    string outKey = internedName();
+
+    string signature = "groupby(";
+    for (size_t i = 0; i < keys.size(); i++) {
+      signature += (i ? "," : "") + keys[i];
+    }
+    signature += ";" + reductName + ";" + outKey + ")";
+    KeyProjector projector(keys);
+    OpCreator creator;
+    if (reduction.text == "count") {
+      creator = typedGroupbyCreator(projector, CountReducer(), outKey);
+    } else if (reduction.text == "sum") {
+      creator =
+          typedGroupbyCreator(projector, SumIntsReducer(searchKey), outKey);
+    } else if (reduction.text == "min") {
+      creator = typedGroupbyCreator(projector, MinReducer(searchKey), outKey);
+    } else {
+      creator = typedGroupbyCreator(projector, MaxReducer(searchKey), outKey);
+    }
+    return plan::stage(signature, creator);
+  }
+
+  double number() {
+    bool negative = accept("-");
+    if (peek().kind != TokenKind::Number) {
+      failAt(peek(), "expected a number" + found());
+    }
+    const Token& token = take();
+    size_t used = 0;
+    double val = 0.0;
+    try {
+      val = stod(token.text, &used);
+    } catch (const exception&) {
+    }
+    if (used != token.text.size()) {
+      failAt(token, "malformed number '" + token.text + "'");
+    }
+    return negative ? -val : val;
+  }
+
+  // Precedence climbing, from || down to the unary operators.
+  unique_ptr<Expr> expr(size_t level = 0) {
+    static const vector<vector<string>> kLevels = {
+        {"||"}, {"&&"}, {"==", "!=", "<", "<=", ">", ">="},
+        {"|"},  {"&"},  {"+", "-"},
+        {"*", "/", "%"}};
+    if (level == kLevels.size()) {
+      return unary();
+    }
+    unique_ptr<Expr> lhs = expr(level + 1);
+    for (;;) {
+      const string* op = nullptr;
+      for (const string& candidate : kLevels[level]) {
+        if (peek().kind == TokenKind::Symbol && peek().text == candidate) {
+          op = &candidate;
+        }
+      }
+      if (!op) {
+        return lhs;
+      }
+      take();
+      auto node = make_unique<Expr>();
+      node->kind = Expr::Kind::Binary;
+      node->op = *op;
+      node->lhs = move(lhs);
+      node->rhs = expr(level + 1);
+      lhs = move(node);
+    }
+  }
+
+  unique_ptr<Expr> unary() {
+    auto node = make_unique<Expr>();
+    if (accept("!")) {
+      node->kind = Expr::Kind::Not;
+      node->lhs = unary();
+    } else if (accept("-")) {
+      node->kind = Expr::Kind::Neg;
+      node->lhs = unary();
+    } else if (accept("(")) {
+      node = expr();
+      expect(")");
+    } else if (peek().kind == TokenKind::Name) {
+      node->kind = Expr::Kind::Field;
+      node->field = field();
+    } else if (peek().kind == TokenKind::Number) {
+      node->kind = Expr::Kind::Literal;
+      node->literal = literal(take());
+    } else {
+      failAt(peek(), "expected an expression" + found());
+    }
+    return node;
+  }
+
+  static OpResult literal(const Token& token) {
+    const string& text = token.text;
+    size_t dots = 0;
+    for (char c : text) {
+      dots += c == '.';
+    }
+    try {
+      size_t used = 0;
+      if (dots == 3) {
+        return OpResult::IPv4(IPv4Address(text));
+      }
+      if (dots == 1) {
+        double val = stod(text, &used);
+        if (used == text.size()) {
+          return OpResult::Float(val);
+        }
+      } else if (dots == 0) {
+        int64_t val = stoll(text, &used);
+        if (used == text.size()) {
+          return OpResult::Int(val);
+        }
+      }
+    } catch (const exception&) {
+    }
+    failAt(token, "malformed number '" + text + "'");
+  }
+};
+
+KeyExtractor extractor(const JoinSideDef& side) {
+  vector<pair<FieldId, FieldId>> key = side.key;
+  vector<FieldId> vals = side.vals;
+  return [key, vals](const Headers& headers) {
+    pair<Headers, Headers> out;
+    for (const auto& [from, to] : key) {
+      if (headers.contains(from)) {
+        out.first[to] = headers.at(from);
+      }
+    }
+    for (FieldId id : vals) {
+      if (headers.contains(id)) {
+        out.second[id] = headers.at(id);
+      }
+    }
+    return out;
+  };
+}
+
+// Adds each query to the plan, or, past a join, builds it, once for every
+// place its output goes.
+class Builder {
+ public:
+  explicit Builder(vector<QueryDef> defs) : defs(move(defs)) {
+    for (size_t i = 0; i < this->defs.size(); i++) {
+      const Token& name = this->defs[i].name;
+      if (!byName.emplace(name.text, i).second) {
+        failAt(name, "query '" + name.text + "' is defined twice");
+      }
+    }
+    for (const QueryDef& def : this->defs) {
+      if (!def.fromInput) {
+        consumed.insert(lookup(def.left.query));
+        consumed.insert(lookup(def.right.query));
+      }
+    }
+  }
+
+  plan::Plan build(Operator nextOp) {
+    for (size_t i = 0; i < defs.size(); i++) {
+      if (!consumed.count(i)) {
+        feed(i, nextOp);
+      }
+    }
+    // A query that is only ever joined with its own output is never reached.
+    for (size_t i = 0; i < defs.size(); i++) {
+      if (!fed.count(i)) {
+        failAt(defs[i].name,
+               "query '" + defs[i].name.text + "' joins its own output");
+      }
+    }
+    return move(p);
+  }
+
+ private:
+  vector<QueryDef> defs;
+  map<string, size_t> byName;
+  set<size_t> consumed;
+  set<size_t> building;
+  set<size_t> fed;
+  plan::Plan p;
+
+  size_t lookup(const Token& name) const {
+    auto it = byName.find(name.text);
+    if (it == byName.end()) {
+      failAt(name, "unknown query '" + name.text + "'");
+    }
+    return it->second;
+  }
+
+  void feed(size_t i, Operator downstream) {
+    const QueryDef& def = defs[i];
+    if (!building.insert(i).second) {
+      failAt(def.name, "query '" + def.name.text + "' joins its own output");
+    }
+    fed.insert(i);
+    if (def.fromInput) {
+      p.add(def.stages, downstream);
+    } else {
+      Operator op = downstream;
+      for (size_t s = def.stages.size(); s-- > 0;) {
+        op = def.stages[s].creator(op);
+      }
+      auto [left, right] =
+          ___(join(extractor(def.left), extractor(def.right)), op);
+      feed(lookup(def.left.query), left);
+      feed(lookup(def.right.query), right);
+    }
+    building.erase(i);
+  }
+};
+
+}  // namespace
+
+plan::Plan compileQuerySpec(const string& spec, Operator nextOp) {
+  return Builder(Parser(spec).queries()).build(nextOp);
+}
+
+string readQuerySpec(const string& filename) {
+  ifstream in(filename);
+  if (!in) {
+    throw runtime_error("Error: could not open query spec \"" + filename +
+                        "\"");
+  }
+  stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+plan::Plan loadQuerySpec(const string& filename, Operator nextOp) {
+  return compileQuerySpec(readQuerySpec(filename), nextOp);
+}
+
+vector<BpfInsn> packetFilterForSpec(const string& spec) {
+  vector<vector<PacketTest>> clauses;
+  for (const QueryDef& def : Parser(spec).queries()) {
+    if (def.fromInput) {
+      clauses.push_back(def.packetTests);
+    }
+  }
+  return compilePacketFilter(clauses);
+}
@@ -0,0 +1,78 @@
+#ifndef QUERY_SPEC_H
+#define QUERY_SPEC_H
+
+#include <string>
+#include <vector>
+
+#include "packet_filter.hpp"
+#include "plan.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Queries written as text and compiled when they are loaded, so that new
+// ones can be deployed without rebuilding. A spec is a list of queries,
+//
+//   # tcpNewCons
+//   query new_cons = input
+//     |> epoch(1.0, eid)
+//     |> filter(ipv4.proto == 6 && l4.flags == 2)
+//     |> groupby([ipv4.dst], count, cons)
+//     |> filter(cons >= 40);
+//
+// each reading the packet stream (input) or joining the outputs of two
+// others,
+//
+//   query both = join(syns by [ipv4.dst as host] with [syns],
+//                     synacks by [ipv4.src as host] with [synacks])
+//     |> map(total = syns + synacks);
+//
+// where each side names a query, the fields that make up its key, renamed
+// with as so that the two sides agree, and the fields it contributes; the
+// sides are matched within each value of eid, as join() does. Every query
+// whose output no join takes is passed on to nextOp. The stages mirror the
+// builtins:
+//
+//   epoch(width, key)                  epochCreator
+//   filter(expr)                       filterCreator
+//   map(field = expr, ...)             extendCreator, assigning in order
+//   distinct([fields])                 distinctCreator
+//   groupby([fields], reduction, out)  typedGroupbyCreator, where reduction
+//                                      is count, or sum, min or max of a
+//                                      field; sum starts each group at 0 as
+//                                      sumInts does
+//
+// Expressions have the usual operators, || && == != < <= > >= | & + - * /
+// % ! and unary -, over fields, integers, floats and dotted IPv4
+// addresses. A field name may hold dots, or be quoted as `syns+synacks`.
+// Arithmetic is on ints, or floats if either side is one; comparisons are
+// numeric, or between values of the same type.
+//
+// Field names are resolved to their slots, and the operators to their own
+// closures, when the spec is compiled; a filter that is a conjunction of
+// comparisons of fields with integers runs as one loop over the
+// comparisons. The result is a plan, so queries that start alike share
+// their first stages.
+//
+// Throws invalid_argument, giving the line and column, if the spec is
+// malformed or names an unknown query, if its joins form a cycle, if an
+// epoch is not of positive width, if a distinct or groupby key has more
+// than kMaxKeyFields fields, or if a field name does not fit in the intern
+// table, which holds kMaxFields names for the life of the process.
+plan::Plan compileQuerySpec(const string& spec, Operator nextOp);
+
+// The contents of filename. Throws runtime_error if it cannot be read.
+string readQuerySpec(const string& filename);
+
+// compileQuerySpec of the contents of filename.
+plan::Plan loadQuerySpec(const string& filename, Operator nextOp);
+
+// A packet filter (see packet_filter.hpp) for a live capture feeding the
+// queries of spec. Each query that reads the packet stream adds a clause:
+// the comparisons of packet fields with literals of their own type among
+// the conjuncts of the filters it opens with, past its epoch stages. The
+// other conjuncts, and everything from the first other stage on, are left
+// to userspace. Throws invalid_argument as compileQuerySpec does.
+vector<BpfInsn> packetFilterForSpec(const string& spec);
+
+#endif  // QUERY_SPEC_H
@@ -0,0 +1,326 @@
+#ifndef REDUCERS_H
+#define REDUCERS_H
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "batch.hpp"
+#include "builtins.hpp"
+#include "checkpoint.hpp"
+#include "flat_table.hpp"
+#include "key_projector.hpp"
+#include "metrics.hpp"
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Typed reductions for groupby. Where a ReductionFunc boxes its accumulator
+// in an OpResult and is called through a std::function, a reducer keeps a
+// raw State in the groupby table's value slot and is inlined into the
+// table loop. A reducer R provides
+//
+//   using State = ...;                        // trivially copyable
+//   State init(const Headers& first) const;   // the group's first tuple
+//   void update(State& state, const Headers& headers) const;
+//   OpResult result(const State& state) const;
+//
+// and, to run in batch mode, the same over batch rows, where updateRows
+// applies rows[i] to *states[i] for each i < n in one loop:
+//
+//   State initRow(const Batch& batch, uint32_t row) const;
+//   void updateRows(State* const* states, const Batch& batch,
+//                   const uint32_t* rows, size_t n) const;
+
+template <typename R, typename = void>
+struct IsReducer : false_type {};
+
+template <typename R>
+struct IsReducer<
+    R, void_t<typename R::State,
+              decltype(declval<const R&>().init(declval<const Headers&>())),
+              decltype(declval<const R&>().update(
+                  declval<typename R::State&>(), declval<const Headers&>())),
+              decltype(declval<const R&>().result(
+                  declval<const typename R::State&>()))>>
+    : is_trivially_copyable<typename R::State> {};
+
+template <typename R, typename = void>
+struct IsBatchReducer : false_type {};
+
+template <typename R>
+struct IsBatchReducer<
+    R, void_t<decltype(declval<const R&>().initRow(declval<const Batch&>(),
+                                                   uint32_t{0})),
+              decltype(declval<const R&>().updateRows(
+                  declval<typename R::State* const*>(),
+                  declval<const Batch&>(), declval<const uint32_t*>(),
+                  size_t{0}))>> : IsReducer<R> {};
+
+// Calls f(get), where get(row) reads field id of a batch at row in the
+// column's own type, so that a loop over rows in f compiles to a plain array
+// walk for the packet fields. Other fields are read as OpResults.
+template <typename F>
+void withBatchColumn(const Batch& batch, FieldId id, F f) {
+  if (!batch.has(id)) {
+    throw out_of_range("Error: batch has no column for field \"" +
+                       fieldName(id) + "\"");
+  }
+  switch (static_cast<Field>(id)) {
+    case Field::Time:
+      return f([&](uint32_t row) { return batch.time[row]; });
+    case Field::EthEthertype:
+      return f([&](uint32_t row) { return batch.ethEthertype[row]; });
+    case Field::Ipv4Hlen:
+      return f([&](uint32_t row) { return batch.ipv4Hlen[row]; });
+    case Field::Ipv4Proto:
+      return f([&](uint32_t row) { return batch.ipv4Proto[row]; });
+    case Field::Ipv4Len:
+      return f([&](uint32_t row) { return batch.ipv4Len[row]; });
+    case Field::L4Sport:
+      return f([&](uint32_t row) { return batch.l4Sport[row]; });
+    case Field::L4Dport:
+      return f([&](uint32_t row) { return batch.l4Dport[row]; });
+    case Field::L4Flags:
+      return f([&](uint32_t row) { return batch.l4Flags[row]; });
+    case Field::Eid:
+      return f([&](uint32_t row) { return batch.eid[row]; });
+    default:
+      return f([&](uint32_t row) { return batch.value(id, row); });
+  }
+}
+
+// Numeric views of a column value, whichever type withBatchColumn read it
+// as.
+template <typename T>
+enable_if_t<is_arithmetic_v<T>, int64_t> reducerInt(T val) {
+  return static_cast<int64_t>(val);
+}
+inline int64_t reducerInt(const OpResult& val) { return val.asInt(); }
+
+template <typename T>
+enable_if_t<is_arithmetic_v<T>, double> reducerFloat(T val) {
+  return static_cast<double>(val);
+}
+inline double reducerFloat(const OpResult& val) {
+  return val.typ == OpResultType::Int ? static_cast<double>(val.asInt())
+                                      : val.asFloat();
+}
+
+// Number of tuples in the group, as counter.
+struct CountReducer {
+  using State = int64_t;
+
+  State init(const Headers&) const { return 1; }
+  void update(State& state, const Headers&) const { state++; }
+  OpResult result(const State& state) const { return OpResult::Int(state); }
+
+  State initRow(const Batch&, uint32_t) const { return 1; }
+  void updateRows(State* const* states, const Batch&, const uint32_t*,
+                  size_t n) const {
+    for (size_t i = 0; i < n; i++) {
+      (*states[i])++;
+    }
+  }
+};
+
+// Reducers over an integer field. Op folds one more value into the
+// accumulator, which starts at the value of the group's first tuple, or at
+// 0 with kSkipFirst.
+template <typename Op, bool kSkipFirst = false>
+struct IntFieldReducer {
+  using State = int64_t;
+  FieldId id;
+
+  explicit IntFieldReducer(const string& key) : id(internField(key)) {}
+
+  State init(const Headers& first) const {
+    return kSkipFirst ? 0 : first.at(id).asInt();
+  }
+  void update(State& state, const Headers& headers) const {
+    state = Op()(state, headers.at(id).asInt());
+  }
+  OpResult result(const State& state) const { return OpResult::Int(state); }
+
+  State initRow(const Batch& batch, uint32_t row) const {
+    return kSkipFirst ? 0 : batch.value(id, row).asInt();
+  }
+  void updateRows(State* const* states, const Batch& batch,
+                  const uint32_t* rows, size_t n) const {
+    withBatchColumn(batch, id, [&](auto get) {
+      Op op;
+      for (size_t i = 0; i < n; i++) {
+        *states[i] = op(*states[i], reducerInt(get(rows[i])));
+      }
+    });
+  }
+};
+
+struct AddInts {
+  int64_t operator()(int64_t a, int64_t b) const { return a + b; }
+};
+struct MinInts {
+  int64_t operator()(int64_t a, int64_t b) const { return b < a ? b : a; }
+};
+struct MaxInts {
+  int64_t operator()(int64_t a, int64_t b) const { return b > a ? b : a; }
+};
+struct OrInts {
+  int64_t operator()(int64_t a, int64_t b) const { return a | b; }
+};
+
+using SumReducer = IntFieldReducer<AddInts>;
+using MinReducer = IntFieldReducer<MinInts>;
+using MaxReducer = IntFieldReducer<MaxInts>;
+// For instance the union of the TCP flags seen by a flow.
+using BitOrReducer = IntFieldReducer<OrInts>;
+// sumInts, typed: as sum_ints does, each group starts at 0 from its first
+// tuple, whose value is not added.
+using SumIntsReducer = IntFieldReducer<AddInts, true>;
+
+// Mean of a numeric field, as a Float.
+struct MeanReducer {
+  struct State {
+    double sum;
+    int64_t count;
+  };
+  FieldId id;
+
+  explicit MeanReducer(const string& key) : id(internField(key)) {}
+
+  State init(const Headers& first) const {
+    return {reducerFloat(first.at(id)), 1};
+  }
+  void update(State& state, const Headers& headers) const {
+    state.sum += reducerFloat(headers.at(id));
+    state.count++;
+  }
+  OpResult result(const State& state) const {
+    return OpResult::Float(state.sum / static_cast<double>(state.count));
+  }
+
+  State initRow(const Batch& batch, uint32_t row) const {
+    return {reducerFloat(batch.value(id, row)), 1};
+  }
+  void updateRows(State* const* states, const Batch& batch,
+                  const uint32_t* rows, size_t n) const {
+    withBatchColumn(batch, id, [&](auto get) {
+      for (size_t i = 0; i < n; i++) {
+        states[i]->sum += reducerFloat(get(rows[i]));
+        states[i]->count++;
+      }
+    });
+  }
+};
+
+// groupbyCreator with a typed reducer: groups as groupby does and, at each
+// reset, emits every group with outKey set to reducer.result.
+template <typename R>
+OpCreator typedGroupbyCreator(KeyProjector groupby, R reducer,
+                              string outKey) {
+  static_assert(IsReducer<R>::value,
+                "typedGroupbyCreator needs a reducer: State, init, update "
+                "and result");
+  FieldId outKeyId = internField(outKey);
+
+  return [groupby, reducer, outKeyId](Operator nextOp) {
+    using GroupTable = FlatTable<PackedKey, typename R::State, PackedKeyHash>;
+    auto hTbl = make_shared<GroupTable>(initTableSize());
+    shared_ptr<TableGauge> gauge = meterTable();
+    shared_ptr<CheckpointState> checkpoint = checkpointTable(hTbl);
+
+    OpFunc next = [groupby, reducer, hTbl,
+                   checkpoint](const Headers& headers) {
+      markChanged(checkpoint);
+      ProjectedKey projected = groupby.project(headers);
+      auto [state, inserted] =
+          hTbl->findOrInsertHashed(projected.key, projected.hash);
+      if (inserted) {
+        *state = reducer.init(headers);
+      } else {
+        reducer.update(*state, headers);
+      }
+    };
+
+    OpFunc reset = [reducer, hTbl, gauge, nextOp, outKeyId,
+                    checkpoint](const Headers& headers) {
+      markChanged(checkpoint);
+      if (gauge) {
+        gauge->record(hTbl->size(), hTbl->bytes());
+      }
+      hTbl->forEach(
+          [&](const PackedKey& groupingKey, const typename R::State& state) {
+            Headers unionedHeaders =
+                unionHeaders(headers, unpackKey(groupingKey));
+            unionedHeaders[outKeyId] = reducer.result(state);
+            nextOp.next(unionedHeaders);
+          });
+      nextOp.reset(headers);
+      hTbl->clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+// batchGroupbyCreator with a typed reducer. Each batch is applied in two
+// passes: the first looks up the group of every selected row in one batched
+// probe, starting the new ones, and the second hands the rest to
+// reducer.updateRows in one call.
+template <typename R>
+BatchToTupleOpCreator batchTypedGroupbyCreator(vector<string> groupKeys,
+                                               R reducer, string outKey) {
+  static_assert(IsBatchReducer<R>::value,
+                "batchTypedGroupbyCreator needs a reducer with initRow and "
+                "updateRows");
+  vector<FieldId> keyIds = internFields(groupKeys);
+  FieldId outKeyId = internField(outKey);
+
+  return [keyIds, reducer, outKeyId](Operator nextOp) {
+    using State = typename R::State;
+    using GroupTable = FlatTable<PackedKey, State, PackedKeyHash>;
+    auto hTbl = make_shared<GroupTable>(initTableSize());
+    auto states = make_shared<vector<State*>>();
+    auto rows = make_shared<vector<uint32_t>>();
+    auto keys = make_shared<vector<PackedKey>>();
+    auto hashes = make_shared<vector<size_t>>();
+
+    BatchFunc next = [keyIds, reducer, hTbl, states, rows, keys,
+                      hashes](Batch& batch) {
+      // No entry moves within the batch, so the pointers stay valid.
+      hTbl->reserve(batch.sel.size());
+      states->clear();
+      rows->clear();
+      groupKeysOfRows(keyIds, batch, *keys, *hashes);
+      hTbl->findOrInsertBatch(keys->data(), hashes->data(), keys->size(),
+                              [&](size_t i, State* state, bool inserted) {
+                                uint32_t row = batch.sel[i];
+                                if (inserted) {
+                                  *state = reducer.initRow(batch, row);
+                                } else {
+                                  states->push_back(state);
+                                  rows->push_back(row);
+                                }
+                              });
+      reducer.updateRows(states->data(), batch, rows->data(), rows->size());
+    };
+
+    OpFunc reset = [reducer, hTbl, nextOp, outKeyId](const Headers& headers) {
+      hTbl->forEach([&](const PackedKey& groupingKey, const State& state) {
+        Headers unionedHeaders = unionHeaders(headers, unpackKey(groupingKey));
+        unionedHeaders[outKeyId] = reducer.result(state);
+        nextOp.next(unionedHeaders);
+      });
+      nextOp.reset(headers);
+      hTbl->clear();
+    };
+
+    return BatchOperator(next, reset);
+  };
+}
+
+#endif  // REDUCERS_H
@@ -0,0 +1,214 @@
+#ifndef RING_H
+#define RING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+constexpr size_t kCacheLineSize = 64;
+
+// Waiting strategy for the blocking ring operations: spin for a short while,
+// then yield, then sleep in short steps, so that an idle consumer gives its
+// core back without adding much latency to a busy one.
+class Backoff {
+ public:
+  void pause() {
+    if (count < kSpins) {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    } else if (count < kSpins + kYields) {
+      this_thread::yield();
+    } else {
+      this_thread::sleep_for(chrono::microseconds(50));
+    }
+    count++;
+  }
+
+  void reset() { count = 0; }
+
+ private:
+  static constexpr unsigned kSpins = 64;
+  static constexpr unsigned kYields = 64;
+  unsigned count = 0;
+};
+
+inline size_t ringCapacity(size_t capacity) {
+  if (capacity == 0) {
+    throw invalid_argument("Error: a ring needs a nonzero capacity");
+  }
+  size_t out = 1;
+  while (out < capacity) {
+    out <<= 1;
+  }
+  return out;
+}
+
+// Bounded single-producer single-consumer queue. Each side owns one index and
+// keeps a cached copy of the other's, so in the common case a push or pop
+// touches no cache line written by the other thread. Capacity is rounded up
+// to a power of two.
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : slots(ringCapacity(capacity)), mask(slots.size() - 1) {}
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Leaves value untouched and returns false if the ring is full.
+  bool tryPush(T&& value) {
+    size_t pos = tail.load(memory_order_relaxed);
+    if (pos - cachedHead > mask) {
+      cachedHead = head.load(memory_order_acquire);
+      if (pos - cachedHead > mask) {
+        return false;
+      }
+    }
+    slots[pos & mask] = move(value);
+    tail.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  bool tryPop(T& out) {
+    size_t pos = head.load(memory_order_relaxed);
+    if (pos == cachedTail) {
+      cachedTail = tail.load(memory_order_acquire);
+      if (pos == cachedTail) {
+        return false;
+      }
+    }
+    out = move(slots[pos & mask]);
+    head.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  // Blocks while the ring is full.
+  void push(T value) {
+    Backoff backoff;
+    while (!tryPush(move(value))) {
+      backoff.pause();
+    }
+  }
+
+  // Blocks while the ring is empty.
+  void pop(T& out) {
+    Backoff backoff;
+    while (!tryPop(out)) {
+      backoff.pause();
+    }
+  }
+
+  size_t capacity() const { return slots.size(); }
+  // Items queued, as of some moment during the call; from a third thread,
+  // only an indication of how far the consumer is behind.
+  size_t size() const {
+    size_t consumed = head.load(memory_order_acquire);
+    return tail.load(memory_order_acquire) - consumed;
+  }
+
+ private:
+  vector<T> slots;
+  size_t mask;
+
+  // Consumer side.
+  alignas(kCacheLineSize) atomic<size_t> head{0};
+  size_t cachedTail = 0;
+
+  // Producer side.
+  alignas(kCacheLineSize) atomic<size_t> tail{0};
+  size_t cachedHead = 0;
+};
+
+// Bounded multi-producer single-consumer queue. Every slot carries a
+// sequence number saying whose turn it is, so producers only contend on the
+// compare-and-swap that claims a position and the consumer needs no atomic
+// read-modify-write at all.
+template <typename T>
+class MpscRing {
+ public:
+  explicit MpscRing(size_t capacity)
+      : mask(ringCapacity(capacity) - 1), slots(new Slot[mask + 1]) {
+    for (size_t i = 0; i <= mask; i++) {
+      slots[i].seq.store(i, memory_order_relaxed);
+    }
+  }
+
+  MpscRing(const MpscRing&) = delete;
+  MpscRing& operator=(const MpscRing&) = delete;
+
+  // Leaves value untouched and returns false if the ring is full.
+  bool tryPush(T&& value) {
+    size_t pos = tail.load(memory_order_relaxed);
+    for (;;) {
+      Slot& slot = slots[pos & mask];
+      size_t seq = slot.seq.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       memory_order_relaxed)) {
+          slot.value = move(value);
+          slot.seq.store(pos + 1, memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T& out) {
+    Slot& slot = slots[head & mask];
+    size_t seq = slot.seq.load(memory_order_acquire);
+    if (seq != head + 1) {
+      return false;
+    }
+    out = move(slot.value);
+    slot.seq.store(head + mask + 1, memory_order_release);
+    head++;
+    return true;
+  }
+
+  // Blocks while the ring is full.
+  void push(T value) {
+    Backoff backoff;
+    while (!tryPush(move(value))) {
+      backoff.pause();
+    }
+  }
+
+  // Blocks while the ring is empty.
+  void pop(T& out) {
+    Backoff backoff;
+    while (!tryPop(out)) {
+      backoff.pause();
+    }
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+ private:
+  struct alignas(kCacheLineSize) Slot {
+    atomic<size_t> seq;
+    T value;
+  };
+
+  size_t mask;
+  unique_ptr<Slot[]> slots;
+
+  alignas(kCacheLineSize) atomic<size_t> tail{0};
+  alignas(kCacheLineSize) size_t head = 0;
+};
+
+#endif  // RING_H
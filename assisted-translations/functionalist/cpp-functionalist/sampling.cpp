@@ -0,0 +1,248 @@
+#include "sampling.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+#include "packed_key.hpp"
+
+namespace {
+
+bool isPowerOfTwo(uint32_t n) { return n != 0 && (n & (n - 1)) == 0; }
+
+// A uniform 64-bit draw per call; splitmix64.
+class SampleRandom {
+ public:
+  explicit SampleRandom(uint64_t seed) : state(seed) {}
+
+  uint64_t next() {
+    state += 0x9e3779b97f4a7c15ULL;
+    return packedKeyMix(state);
+  }
+
+  // Uniform in (0, 1].
+  double unit() {
+    return static_cast<double>((next() >> 11) + 1) * 0x1.0p-53;
+  }
+
+ private:
+  uint64_t state;
+};
+
+struct HeldTuple {
+  double priority;
+  double weight;
+  Headers tuple;
+};
+
+// Orders a heap with the smallest priority on top.
+bool higherPriority(const HeldTuple& a, const HeldTuple& b) {
+  return a.priority > b.priority;
+}
+
+struct SampleState {
+  SampleOptions options;
+  shared_ptr<SampleStats> stats;
+  // Flow mode: the fields that name a flow, hashed straight from the tuple
+  // rather than packed, so that a flow may have any number of them.
+  uint64_t flowMask;
+  FieldId weightId;
+  optional<FieldId> priorityId;
+  SampleRandom random;
+  uint32_t every;
+  // The tuple passed on, so that tagging one copies into storage kept by
+  // the stage.
+  Headers tagged;
+  // Priority mode: at most budget() + 1 tuples, the one of smallest
+  // priority on top.
+  vector<HeldTuple> held;
+
+  SampleState(SampleOptions opts, uint64_t flowMask)
+      : options(move(opts)),
+        stats(options.stats ? options.stats : make_shared<SampleStats>()),
+        flowMask(flowMask),
+        weightId(internField(options.weightKey)),
+        random(options.seed),
+        every(options.every) {
+    if (!options.priorityKey.empty()) {
+      priorityId = internField(options.priorityKey);
+    }
+    stats->every = every;
+  }
+
+  size_t budget() const { return max<size_t>(options.reservoir / every, 1); }
+
+  bool keeps(const Headers& headers) {
+    uint64_t mask = every - 1;
+    if (options.mode == SampleMode::Flow) {
+      uint64_t fields = headers.fieldMask() & flowMask;
+      size_t hash = packedKeyHashStart(fields);
+      for (uint64_t rest = fields; rest != 0; rest &= rest - 1) {
+        const OpResult& val =
+            headers.at(static_cast<FieldId>(__builtin_ctzll(rest)));
+        hash = packedKeyHashStep(hash, val.bits(), val.typ);
+      }
+      return (packedKeyMix(hash ^ options.seed) & mask) == 0;
+    }
+    return (random.next() & mask) == 0;
+  }
+
+  void hold(const Headers& headers) {
+    double weight = 1.0;
+    if (priorityId && headers.contains(*priorityId)) {
+      weight = max(static_cast<double>(headers.at(*priorityId).asInt()), 1.0);
+    }
+    double priority = weight / random.unit();
+    if (held.size() <= budget()) {
+      held.push_back({priority, weight, headers});
+      push_heap(held.begin(), held.end(), higherPriority);
+    } else if (priority > held.front().priority) {
+      pop_heap(held.begin(), held.end(), higherPriority);
+      held.back() = {priority, weight, headers};
+      push_heap(held.begin(), held.end(), higherPriority);
+    }
+  }
+
+  // Passes the held tuples on, the one of smallest priority setting tau if
+  // more were offered than the budget holds.
+  void release(const Operator& nextOp) {
+    double tau = 0.0;
+    if (held.size() > budget()) {
+      pop_heap(held.begin(), held.end(), higherPriority);
+      tau = held.back().priority;
+      held.pop_back();
+    }
+    for (const HeldTuple& h : held) {
+      tagged = h.tuple;
+      tagged[weightId] = OpResult::Float(max(h.weight, tau) / h.weight);
+      stats->kept++;
+      nextOp.next(tagged);
+    }
+    held.clear();
+  }
+
+  // The rate of the next epoch, from the backlog at the end of this one.
+  void adapt() {
+    if (!options.backlog) {
+      return;
+    }
+    size_t depth = options.backlog();
+    if (depth > options.highWater && every < options.maxEvery) {
+      every *= 2;
+      stats->raised++;
+    } else if (depth < options.lowWater && every > 1) {
+      every /= 2;
+      stats->lowered++;
+    }
+    stats->every = every;
+  }
+};
+
+OpResult weighted(int64_t val, const OpResult& weight) {
+  if (weight.typ == OpResultType::Int) {
+    return OpResult::Int(val * weight.asInt());
+  }
+  return OpResult::Float(static_cast<double>(val) * weight.asFloat());
+}
+
+double asNumber(const OpResult& val) {
+  return val.typ == OpResultType::Int ? static_cast<double>(val.asInt())
+                                      : val.asFloat();
+}
+
+// Adds amount to the running total, which stays Int while both are.
+OpResult accumulate(const OpResult& total, const OpResult& amount) {
+  if (total.typ == OpResultType::Empty) {
+    return amount;
+  }
+  if (total.typ == OpResultType::Int && amount.typ == OpResultType::Int) {
+    return OpResult::Int(total.asInt() + amount.asInt());
+  }
+  return OpResult::Float(asNumber(total) + asNumber(amount));
+}
+
+OpResult weightOf(FieldId weightId, const Headers& headers) {
+  return headers.contains(weightId) ? headers.at(weightId) : OpResult::Int(1);
+}
+
+}  // namespace
+
+OpCreator sampleCreator(SampleOptions options) {
+  if (!isPowerOfTwo(options.every) || !isPowerOfTwo(options.maxEvery)) {
+    throw invalid_argument(
+        "Error: sampling rates must be powers of two, one in every");
+  }
+  if (options.maxEvery < options.every) {
+    throw invalid_argument(
+        "Error: the coarsest sampling rate is finer than the first");
+  }
+  if (options.mode == SampleMode::Flow && options.flowKeys.empty()) {
+    throw invalid_argument("Error: flow sampling needs the fields of a flow");
+  }
+  if (options.mode == SampleMode::Priority && options.reservoir == 0) {
+    throw invalid_argument(
+        "Error: priority sampling needs a nonzero reservoir");
+  }
+  if (options.backlog && options.lowWater > options.highWater) {
+    throw invalid_argument(
+        "Error: a sampler's low-water mark is above its high-water mark");
+  }
+  uint64_t flowMask = 0;
+  if (options.mode == SampleMode::Flow) {
+    for (const string& key : options.flowKeys) {
+      flowMask |= uint64_t{1} << internField(key);
+    }
+  }
+
+  return [options, flowMask](Operator nextOp) {
+    auto state = make_shared<SampleState>(options, flowMask);
+
+    OpFunc next = [state, nextOp](const Headers& headers) {
+      state->stats->seen++;
+      if (state->options.mode == SampleMode::Priority) {
+        state->hold(headers);
+        return;
+      }
+      if (!state->keeps(headers)) {
+        return;
+      }
+      state->tagged = headers;
+      state->tagged[state->weightId] =
+          OpResult::Int(static_cast<int64_t>(state->every));
+      state->stats->kept++;
+      nextOp.next(state->tagged);
+    };
+
+    OpFunc reset = [state, nextOp](const Headers& headers) {
+      if (state->options.mode == SampleMode::Priority) {
+        state->release(nextOp);
+      }
+      state->stats->epochs++;
+      state->adapt();
+      nextOp.reset(headers);
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+ReductionFunc sampledCounter(string weightKey) {
+  FieldId weightId = internField(weightKey);
+  return [weightId](OpResult val, const Headers& headers) {
+    return accumulate(val, weightOf(weightId, headers));
+  };
+}
+
+ReductionFunc sampledSumInts(string searchKey, string weightKey) {
+  FieldId searchId = internField(searchKey);
+  FieldId weightId = internField(weightKey);
+  return [searchId, weightId](OpResult val, const Headers& headers) {
+    if (!headers.contains(searchId)) {
+      throw out_of_range(
+          "Error: a sampled sum found no value for its field");
+    }
+    return accumulate(val, weighted(headers.at(searchId).asInt(),
+                                    weightOf(weightId, headers)));
+  };
+}
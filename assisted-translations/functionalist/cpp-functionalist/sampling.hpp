@@ -0,0 +1,93 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "builtins.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Load shedding by sampling: a sampleCreator stage in front of a groupby or
+// distinct passes on only some of its tuples, each tagged with its weight,
+// the inverse of the chance it had of being kept. sampledCounter and
+// sampledSumInts then weigh what they fold by it, so that the groups they
+// emit estimate what counter and sumInts would have over every tuple.
+
+// The field sampleCreator writes weights to by default.
+constexpr const char* kSampleWeightKey = "sample.weight";
+
+enum class SampleMode {
+  // Each tuple is kept with chance 1/every, independently of the others.
+  Uniform,
+  // Each flow, as named by flowKeys, is kept whole or dropped whole, with
+  // chance 1/every: the choice is a function of the flow's key, so that a
+  // distinct over a superset of flowKeys sees every tuple of the flows it
+  // sees at all.
+  Flow,
+  // Priority sampling: the reservoir / every tuples of largest priority,
+  // weight / u for u uniform in (0, 1], are held to the end of the epoch
+  // and passed on at its reset, each with weight max(w, tau) / w for tau
+  // the largest priority not held. Heavy tuples are kept preferentially,
+  // and sums of priorityKey are estimated with the least variance.
+  Priority,
+};
+
+struct SampleStats {
+  uint64_t seen = 0;
+  uint64_t kept = 0;
+  uint64_t epochs = 0;
+  // The 1-in-every rate the current epoch samples at.
+  uint32_t every = 1;
+  // Epoch boundaries at which the backlog made the rate coarser or finer.
+  uint64_t raised = 0;
+  uint64_t lowered = 0;
+};
+
+struct SampleOptions {
+  SampleMode mode = SampleMode::Uniform;
+  // The rate of the first epoch, one in every; a power of two.
+  uint32_t every = 1;
+  // The coarsest rate the backlog may drive every to; a power of two.
+  uint32_t maxEvery = 1024;
+  // Flow mode: the fields that name a flow, as many as it takes, such as
+  // the 5-tuple.
+  vector<string> flowKeys;
+  // Priority mode: the tuples held per epoch at every = 1, and the integer
+  // field that weighs them, weights below 1 counting as 1. With no
+  // priorityKey every tuple weighs 1 and the mode is a reservoir sample.
+  size_t reservoir = 4096;
+  string priorityKey;
+  string weightKey = kSampleWeightKey;
+  // The depth of the queue feeding the query, such as SpscRing::size of
+  // its input ring. When set, every doubles at each epoch boundary where
+  // backlog() is above highWater and halves where it is below lowWater, so
+  // that the rate is fixed within an epoch and a flow is never split.
+  function<size_t()> backlog;
+  size_t highWater = 0;
+  size_t lowWater = 0;
+  uint64_t seed = 0;
+  shared_ptr<SampleStats> stats;
+};
+
+// Weights are Int in Uniform and Flow modes, so that the estimates of the
+// sampled reductions stay integers a threshold can compare, and Float in
+// Priority mode. Throws invalid_argument for rates that are not powers of
+// two, a maxEvery below every, a Flow sample with no flowKeys, an empty
+// reservoir, or a lowWater above highWater.
+OpCreator sampleCreator(SampleOptions options);
+
+// counter and sumInts over a sampled stream: a tuple counts for its weight,
+// or once if it has none. The result is Int while every weight folded in
+// was, and Float from the first Float weight on. sampledSumInts throws
+// out_of_range for a tuple without searchKey.
+ReductionFunc sampledCounter(string weightKey = kSampleWeightKey);
+ReductionFunc sampledSumInts(string searchKey,
+                             string weightKey = kSampleWeightKey);
+
+#endif  // SAMPLING_H
@@ -0,0 +1,79 @@
+#include "schema.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+struct Registry {
+  mutex lock;
+  unordered_map<string, FieldId> ids;
+  array<string, kMaxFields> names;
+  // Names are written before count is published, so readers that only go
+  // through fieldName need no lock.
+  atomic<size_t> count{0};
+
+  Registry() {
+    for (const char* name :
+         {"time", "eth.src", "eth.dst", "eth.ethertype", "ipv4.hlen",
+          "ipv4.proto", "ipv4.len", "ipv4.src", "ipv4.dst", "l4.sport",
+          "l4.dport", "l4.flags", "eid", "tuples", "packet_count",
+          "byte_count"}) {
+      size_t next = count.load(memory_order_relaxed);
+      ids[name] = static_cast<FieldId>(next);
+      names[next] = name;
+      count.store(next + 1, memory_order_release);
+    }
+  }
+};
+
+Registry& registry() {
+  static Registry reg;
+  return reg;
+}
+
+}  // namespace
+
+FieldId internField(const string& name) {
+  Registry& reg = registry();
+  lock_guard<mutex> guard(reg.lock);
+  auto it = reg.ids.find(name);
+  if (it != reg.ids.end()) {
+    return it->second;
+  }
+  size_t next = reg.count.load(memory_order_relaxed);
+  if (next >= kMaxFields) {
+    throw out_of_range("Error: too many distinct field names to intern \"" +
+                       name + "\"");
+  }
+  FieldId id = static_cast<FieldId>(next);
+  reg.ids[name] = id;
+  reg.names[next] = name;
+  reg.count.store(next + 1, memory_order_release);
+  return id;
+}
+
+optional<FieldId> findField(const string& name) {
+  Registry& reg = registry();
+  lock_guard<mutex> guard(reg.lock);
+  auto it = reg.ids.find(name);
+  if (it == reg.ids.end()) {
+    return nullopt;
+  }
+  return it->second;
+}
+
+const string& fieldName(FieldId id) {
+  Registry& reg = registry();
+  if (id >= reg.count.load(memory_order_acquire)) {
+    throw out_of_range("Error: field id has not been interned");
+  }
+  return reg.names[id];
+}
+
+size_t numFields() {
+  return registry().count.load(memory_order_acquire);
+}
@@ -0,0 +1,55 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+using namespace std;
+
+using FieldId = uint8_t;
+
+// Maximum number of distinct field names a process can intern; a Headers
+// record reserves one slot per id.
+constexpr size_t kMaxFields = 64;
+
+// Fields produced by the packet parsers and the builtin operators, interned
+// up front so that queries can refer to them without any string lookup.
+enum class Field : FieldId {
+  Time,
+  EthSrc,
+  EthDst,
+  EthEthertype,
+  Ipv4Hlen,
+  Ipv4Proto,
+  Ipv4Len,
+  Ipv4Src,
+  Ipv4Dst,
+  L4Sport,
+  L4Dport,
+  L4Flags,
+  Eid,
+  Tuples,
+  PacketCount,
+  ByteCount,
+  NumKnown,
+};
+
+constexpr FieldId fid(Field field) { return static_cast<FieldId>(field); }
+
+// Returns the id for name, assigning the next free one if it has not been
+// seen before. Meant to be called while a query is being built, not per
+// tuple. Names are never freed, and past kMaxFields of them this throws
+// out_of_range; code that interns names read from outside the process, such
+// as a spec, a checkpoint or a stream, reports that as its own error.
+FieldId internField(const string& name);
+
+// Returns the id for name without interning it.
+optional<FieldId> findField(const string& name);
+
+const string& fieldName(FieldId id);
+
+size_t numFields();
+
+#endif  // SCHEMA_H
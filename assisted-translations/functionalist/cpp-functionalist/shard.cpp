@@ -0,0 +1,500 @@
+#include "shard.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "builtins.hpp"
+#include "key_hash.hpp"
+#include "metrics.hpp"
+#include "packed_key.hpp"
+#include "sketch.hpp"
+#include "topology.hpp"
+
+namespace {
+
+struct ShardMessage {
+  enum class Kind { Tuples, Reset, Stop };
+
+  Kind kind;
+  vector<Headers> tuples;
+  Headers headers;
+};
+
+// One copy of the sharded chain and the thread that drives it. The
+// dispatching thread fills pending and posts it as a chunk; the worker
+// appends whatever the chain emits to out, which the dispatching thread only
+// reads once the worker has acknowledged a reset.
+class Shard {
+ public:
+  // Runs on cpu, or wherever the scheduler likes if it is -1.
+  Shard(const OpCreator& stage, int cpu)
+      : cpu(cpu), chain(build(stage)), worker([this]() { run(); }) {
+    pending.reserve(kShardChunkSize);
+  }
+
+  ~Shard() {
+    post({ShardMessage::Kind::Stop, {}, Headers()});
+    worker.join();
+  }
+
+  Shard(const Shard&) = delete;
+  Shard& operator=(const Shard&) = delete;
+
+  void add(const Headers& headers) {
+    pending.push_back(headers);
+    if (pending.size() >= kShardChunkSize) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (pending.empty()) {
+      return;
+    }
+    vector<Headers> chunk = takeSpare();
+    swap(chunk, pending);
+    post({ShardMessage::Kind::Tuples, move(chunk), Headers()});
+  }
+
+  void startReset(const Headers& headers) {
+    flush();
+    post({ShardMessage::Kind::Reset, {}, headers});
+  }
+
+  // Returns the worker's failure, if it has had one.
+  exception_ptr awaitReset() {
+    unique_lock<mutex> guard(lock);
+    resetDone.wait(guard, [this]() { return acked; });
+    acked = false;
+    return error;
+  }
+
+  vector<Headers> out;
+  Headers outReset;
+  bool sawReset = false;
+
+ private:
+  int cpu;
+  Operator chain;
+  vector<Headers> pending;
+
+  mutex lock;
+  condition_variable notEmpty;
+  condition_variable notFull;
+  condition_variable resetDone;
+  deque<ShardMessage> inbox;
+  vector<vector<Headers>> spare;
+  bool acked = false;
+  exception_ptr error;
+
+  thread worker;
+
+  Operator build(const OpCreator& stage) {
+    NodeMemoryScope local(cpu < 0 ? -1 : cpuTopology().nodeOf(cpu));
+    return stage(Operator(
+        [this](const Headers& headers) { out.push_back(headers); },
+        [this](const Headers& headers) {
+          outReset = headers;
+          sawReset = true;
+        }));
+  }
+
+  void post(ShardMessage msg) {
+    unique_lock<mutex> guard(lock);
+    notFull.wait(guard, [this]() { return inbox.size() < kShardQueueDepth; });
+    inbox.push_back(move(msg));
+    notEmpty.notify_one();
+  }
+
+  vector<Headers> takeSpare() {
+    lock_guard<mutex> guard(lock);
+    if (spare.empty()) {
+      vector<Headers> chunk;
+      chunk.reserve(kShardChunkSize);
+      return chunk;
+    }
+    vector<Headers> chunk = move(spare.back());
+    spare.pop_back();
+    return chunk;
+  }
+
+  void run() {
+    if (cpu >= 0) {
+      try {
+        pinThread(cpu, "shard thread");
+      } catch (...) {
+        error = current_exception();
+      }
+    }
+    for (;;) {
+      ShardMessage msg;
+      {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this]() { return !inbox.empty(); });
+        msg = move(inbox.front());
+        inbox.pop_front();
+        notFull.notify_one();
+      }
+
+      // After a failure the chain's state is unknown, so the worker only
+      // keeps draining its queue and acknowledging resets.
+      switch (msg.kind) {
+        case ShardMessage::Kind::Stop:
+          return;
+        case ShardMessage::Kind::Tuples:
+          if (!error) {
+            try {
+              for (const Headers& headers : msg.tuples) {
+                chain.next(headers);
+              }
+            } catch (...) {
+              error = current_exception();
+            }
+          }
+          msg.tuples.clear();
+          {
+            lock_guard<mutex> guard(lock);
+            spare.push_back(move(msg.tuples));
+          }
+          break;
+        case ShardMessage::Kind::Reset:
+          if (!error) {
+            try {
+              chain.reset(msg.headers);
+            } catch (...) {
+              error = current_exception();
+            }
+          }
+          {
+            lock_guard<mutex> guard(lock);
+            acked = true;
+          }
+          resetDone.notify_one();
+          break;
+      }
+    }
+  }
+};
+
+// The shards of a shardCreator stage, and what the dispatching thread keeps
+// for SkewOptions: a sample of the epoch's partition keys, and the keys
+// found heavy in the last one, which are routed by spread instead.
+struct ShardSet {
+  vector<FieldId> keys;
+  vector<unique_ptr<Shard>> shards;
+
+  vector<FieldId> spread;
+  size_t sampleEvery = 0;
+  size_t tick = 0;
+  uint64_t sampled = 0;
+  unique_ptr<SpaceSaving> sample;
+  FlatTable<PackedKey, bool, PackedKeyHash> heavy;
+  uint64_t spreadTuples = 0;
+
+  Shard& route(const Headers& headers) {
+    PackedKey key;
+    for (FieldId id : keys) {
+      key.push(id, headers.at(id));
+    }
+    if (sample) {
+      if (++tick == sampleEvery) {
+        tick = 0;
+        sample->add(key);
+        sampled++;
+      }
+      if (!heavy.empty() && heavy.find(key) != nullptr) {
+        PackedKey by;
+        for (FieldId id : spread) {
+          by.push(id, headers.at(id));
+        }
+        spreadTuples++;
+        return *shards[stableKeyHash(by) % shards.size()];
+      }
+    }
+    return *shards[stableKeyHash(key) % shards.size()];
+  }
+
+  bool isHeavy(const Headers& headers) {
+    PackedKey key;
+    for (FieldId id : keys) {
+      key.push(id, headers.at(id));
+    }
+    return heavy.find(key) != nullptr;
+  }
+
+  // The keys that took at least share of this epoch's sample are heavy
+  // through the next.
+  void pickHeavy(double share) {
+    heavy.clear();
+    double least = share * static_cast<double>(sampled);
+    for (const SpaceSaving::Counter& counter : sample->top(sample->size())) {
+      if (static_cast<double>(counter.count) < least) {
+        break;
+      }
+      heavy[counter.key] = true;
+    }
+    sample->clear();
+    sampled = 0;
+  }
+};
+
+// Each group of a heavy key, as the first shard to report it gave it, with
+// the partial results of the others folded into combine's field.
+struct Combined {
+  Headers headers;
+  int64_t value;
+};
+
+// The workers of a concurrentGroupbyCreator stage and the table they share.
+// Shards are dealt whole chunks in turn.
+struct ConcurrentSet {
+  unique_ptr<ConcurrentAggTable> table;
+  vector<unique_ptr<ConcurrentAggWriter>> writers;
+  vector<unique_ptr<Shard>> workers;
+  size_t current = 0;
+  size_t dealt = 0;
+
+  Shard& deal() {
+    if (dealt == kShardChunkSize) {
+      dealt = 0;
+      current = (current + 1) % workers.size();
+    }
+    dealt++;
+    return *workers[current];
+  }
+};
+
+}  // namespace
+
+OpCreator shardCreator(size_t numShards, vector<string> partitionKeys,
+                       OpCreator stage, ShardOptions options) {
+  if (numShards == 0) {
+    throw invalid_argument("Error: a sharded stage needs at least one shard");
+  }
+  if (partitionKeys.empty() || partitionKeys.size() > kMaxKeyFields) {
+    throw invalid_argument("Error: a sharded stage needs between 1 and " +
+                           to_string(kMaxKeyFields) + " partition keys");
+  }
+  vector<FieldId> keys;
+  for (const string& key : partitionKeys) {
+    keys.push_back(internField(key));
+  }
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+  const SkewOptions& skew = options.skew;
+  bool skewed = !skew.spreadKeys.empty() && numShards > 1;
+  if (skewed) {
+    if (skew.spreadKeys.size() > kMaxKeyFields) {
+      throw invalid_argument("Error: a sharded stage spreads heavy keys by "
+                             "at most " + to_string(kMaxKeyFields) +
+                             " fields");
+    }
+    if (!skew.combine.field) {
+      throw invalid_argument(
+          "Error: combining heavy keys needs a field to fold");
+    }
+    if (skew.sampleEvery == 0 || skew.counters == 0 ||
+        !(skew.heavyShare > 0.0 && skew.heavyShare <= 1.0)) {
+      throw invalid_argument(
+          "Error: skew handling needs a sample, counters and a heavy share "
+          "in (0, 1]");
+    }
+  }
+  vector<FieldId> spread;
+  for (const string& key : skew.spreadKeys) {
+    spread.push_back(internField(key));
+  }
+  KeyProjector groups(skew.groupKeys.empty() ? partitionKeys
+                                             : skew.groupKeys);
+
+  return [numShards, keys, stage, options, skewed, spread,
+          groups](Operator nextOp) {
+    auto set = make_shared<ShardSet>();
+    set->keys = keys;
+    if (skewed) {
+      set->spread = spread;
+      set->sampleEvery = options.skew.sampleEvery;
+      set->sample = make_unique<SpaceSaving>(options.skew.counters);
+    }
+    for (size_t i = 0; i < numShards; i++) {
+      int cpu = options.cpus.empty() ? -1
+                                     : options.cpus[i % options.cpus.size()];
+      set->shards.push_back(make_unique<Shard>(stage, cpu));
+    }
+
+    OpFunc next = [set](const Headers& headers) {
+      set->route(headers).add(headers);
+    };
+
+    OpFunc reset = [set, nextOp, options, groups](const Headers& headers) {
+      for (auto& shard : set->shards) {
+        shard->startReset(headers);
+      }
+      exception_ptr error;
+      for (auto& shard : set->shards) {
+        exception_ptr shardError = shard->awaitReset();
+        if (shardError && !error) {
+          error = shardError;
+        }
+      }
+      if (error) {
+        rethrow_exception(error);
+      }
+
+      // Results for heavy keys are partial, one from each shard that was
+      // spread some of its tuples; the rest pass straight on.
+      const AtomicReduction& combine = options.skew.combine;
+      bool combining = !set->heavy.empty();
+      FlatTable<PackedKey, Combined, PackedKeyHash> partials;
+      Headers outReset = headers;
+      bool sawReset = false;
+      for (auto& shard : set->shards) {
+        for (const Headers& out : shard->out) {
+          if (!combining || !set->isHeavy(out)) {
+            nextOp.next(out);
+            continue;
+          }
+          ProjectedKey group = groups.project(out);
+          auto [partial, inserted] =
+              partials.findOrInsertHashed(group.key, group.hash);
+          if (inserted) {
+            *partial = {out, combine.valueOf(out)};
+          } else {
+            partial->value = combine.combine(partial->value,
+                                             combine.valueOf(out));
+          }
+        }
+        shard->out.clear();
+        if (shard->sawReset && !sawReset) {
+          outReset = shard->outReset;
+          sawReset = true;
+        }
+        shard->sawReset = false;
+      }
+      partials.forEach([&](const PackedKey&, const Combined& partial) {
+        Headers out = partial.headers;
+        out[*combine.field] = OpResult::Int(partial.value);
+        nextOp.next(out);
+      });
+
+      if (set->sample) {
+        set->pickHeavy(options.skew.heavyShare);
+        if (options.skew.stats) {
+          SkewStats& stats = *options.skew.stats;
+          stats.heavyKeys = set->heavy.size();
+          stats.spreadTuples = set->spreadTuples;
+          stats.combinedGroups += partials.size();
+        }
+      }
+      nextOp.reset(outReset);
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator concurrentGroupbyCreator(size_t numWorkers, OpCreator stage,
+                                   KeyProjector groupby,
+                                   AtomicReduction reduction, string outKey,
+                                   ConcurrentGroupbyOptions options) {
+  if (numWorkers == 0) {
+    throw invalid_argument(
+        "Error: a concurrent groupby needs at least one worker");
+  }
+  FieldId outKeyId = internField(outKey);
+
+  return [numWorkers, stage, groupby, reduction, outKeyId,
+          options](Operator nextOp) {
+    auto set = make_shared<ConcurrentSet>();
+    set->table = make_unique<ConcurrentAggTable>(initTableSize(), reduction);
+    shared_ptr<TableGauge> gauge = meterTable();
+    for (size_t i = 0; i < numWorkers; i++) {
+      set->writers.push_back(make_unique<ConcurrentAggWriter>(
+          *set->table, options.combineSlots));
+      ConcurrentAggWriter* writer = set->writers.back().get();
+      // The worker's chain ends in its writer, so the output Shard collects
+      // stays empty; the reset that reaches the writer is the worker's last
+      // act of the epoch.
+      // Tuples reach the writer kDeferredProbes at a time, so that their
+      // probes of the shared table overlap.
+      auto deferred = make_shared<DeferredKeys>();
+      auto flushDeferred = [writer, deferred]() {
+        writer->addBatch(deferred->keys(), deferred->hashes(),
+                         deferred->vals(), deferred->size());
+        deferred->clear();
+      };
+      Operator sink(
+          [groupby, reduction, deferred,
+           flushDeferred](const Headers& headers) {
+            if (deferred->add(groupby.project(headers),
+                              reduction.valueOf(headers))) {
+              flushDeferred();
+            }
+          },
+          [writer, flushDeferred](const Headers&) {
+            flushDeferred();
+            writer->flush();
+          });
+      OpCreator chain = [stage, sink](Operator) {
+        return stage ? stage(sink) : sink;
+      };
+      int cpu = options.cpus.empty() ? -1
+                                     : options.cpus[i % options.cpus.size()];
+      set->workers.push_back(make_unique<Shard>(chain, cpu));
+    }
+
+    OpFunc next = [set](const Headers& headers) {
+      set->deal().add(headers);
+    };
+
+    OpFunc reset = [set, gauge, nextOp, outKeyId,
+                    options](const Headers& headers) {
+      for (auto& worker : set->workers) {
+        worker->startReset(headers);
+      }
+      exception_ptr error;
+      for (auto& worker : set->workers) {
+        exception_ptr workerError = worker->awaitReset();
+        if (workerError && !error) {
+          error = workerError;
+        }
+      }
+      if (error) {
+        rethrow_exception(error);
+      }
+
+      size_t resident = set->table->size();
+      if (gauge) {
+        gauge->record(resident, set->table->bytes());
+      }
+      vector<ConcurrentAggWriter*> writers;
+      ConcurrentGroupbyStats now;
+      for (auto& writer : set->writers) {
+        writers.push_back(writer.get());
+        now.combined += writer->combinedUpdates();
+        now.atomicUpdates += writer->atomicUpdates();
+      }
+      set->table->drain(writers, [&](const PackedKey& key, int64_t val) {
+        Headers unionedHeaders = unionHeaders(headers, unpackKey(key));
+        unionedHeaders[outKeyId] = OpResult::Int(val);
+        nextOp.next(unionedHeaders);
+        now.groups++;
+      });
+      now.overflowGroups = now.groups - min<uint64_t>(now.groups, resident);
+      if (options.stats) {
+        *options.stats = now;
+      }
+      nextOp.reset(headers);
+    };
+
+    return Operator(next, reset);
+  };
+}
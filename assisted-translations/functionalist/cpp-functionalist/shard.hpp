@@ -0,0 +1,130 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "concurrent_table.hpp"
+#include "key_projector.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Tuples are handed to a shard in chunks of this many, so that a worker is
+// woken once per chunk rather than once per tuple.
+constexpr size_t kShardChunkSize = 256;
+
+// Chunks a shard may have queued before the dispatching thread blocks.
+constexpr size_t kShardQueueDepth = 64;
+
+struct SkewStats {
+  // Partition keys found heavy at the latest reset, to be spread over
+  // every shard through the next epoch.
+  uint64_t heavyKeys = 0;
+  // Tuples spread rather than routed by their partition key, and groups
+  // combined from several shards' partial results, over the stage's life.
+  uint64_t spreadTuples = 0;
+  uint64_t combinedGroups = 0;
+};
+
+// Two-phase handling of heavy keys, such as the victim of a DDoS, which
+// routing by key would pile onto one shard. The dispatching thread counts a
+// sample of the partition keys of each epoch in a SpaceSaving; a key that
+// took at least heavyShare of them is heavy through the next epoch. Its
+// tuples are then routed by spreadKeys instead, so that every shard folds a
+// share of them, and at reset the shards' partial results for each of its
+// groups are folded into one by combine.
+struct SkewOptions {
+  // Fields whose values spread a heavy key's tuples over the shards; empty
+  // turns skew handling off. Spreading must keep together the tuples that
+  // stage's state needs together: for a distinct over (src, dst) followed by
+  // a count per dst, partitioned by dst, spreading by src does.
+  vector<string> spreadKeys;
+  // The fields that identify a group in stage's output, which must include
+  // the partition keys; the partition keys when empty.
+  vector<string> groupKeys;
+  // Folds partial results: combine.field names the output field folded,
+  // combine.op how. The default sums a count held in "count".
+  AtomicReduction combine = AtomicReduction::sum("count");
+  double heavyShare = 0.1;
+  // One tuple in sampleEvery is counted, in a SpaceSaving of counters.
+  size_t sampleEvery = 16;
+  size_t counters = 64;
+  // Updated at every reset when set.
+  shared_ptr<SkewStats> stats;
+};
+
+struct ShardOptions {
+  // Pins shard i's thread to cpus[i % cpus.size()] when not empty, and
+  // places its tables on that CPU's NUMA node: they are built under a
+  // NodeMemoryScope for it, and grow on the pinned thread. placeWorkers and
+  // interfaceNode (see topology.hpp) give CPUs near a NIC.
+  vector<int> cpus;
+  SkewOptions skew;
+};
+
+// Runs numShards copies of the chain built by stage, each on a thread of its
+// own, and routes every tuple to one of them by the stableKeyHash of its
+// partitionKeys fields, so that a key lands on the same shard in every
+// process. Each copy keeps its own groupby and distinct tables, so
+// partitionKeys must be a subset of every grouping key in stage: then all
+// tuples of a group land on the same shard and each shard's results are final
+// for that shard.
+//
+// A reset is broadcast to every shard and waited for; the tuples the shards
+// produced since the previous reset are then passed on together, shard by
+// shard, followed by a single reset. The epoch stage therefore belongs
+// upstream of the sharded stage, so that every shard closes the same windows.
+// With options.skew, the partial results of heavy keys are combined first;
+// stage must then end in the groupby whose results are combined, with any
+// filter on them downstream of the sharded stage.
+// Throws invalid_argument if numShards is 0 or partitionKeys is empty; an
+// exception raised on a worker is rethrown by the next reset.
+OpCreator shardCreator(size_t numShards, vector<string> partitionKeys,
+                       OpCreator stage, ShardOptions options = ShardOptions());
+
+// Combining buffer slots each worker of concurrentGroupbyCreator keeps.
+constexpr size_t kConcurrentCombineSlots = 64;
+
+struct ConcurrentGroupbyStats {
+  // Tuples folded in a worker's combining buffer, and updates the workers
+  // applied to the shared table with an atomic instruction, since the stage
+  // was built.
+  uint64_t combined = 0;
+  uint64_t atomicUpdates = 0;
+  // Groups of the latest epoch, and those of them the shared table had no
+  // room for, which were kept per worker and merged at reset.
+  uint64_t groups = 0;
+  uint64_t overflowGroups = 0;
+};
+
+struct ConcurrentGroupbyOptions {
+  // As for shardCreator.
+  vector<int> cpus;
+  size_t combineSlots = kConcurrentCombineSlots;
+  // Updated at every reset when set.
+  shared_ptr<ConcurrentGroupbyStats> stats;
+};
+
+// stage followed by groupbyCreator(groupby, reduction, outKey), run on
+// numWorkers threads that share a single groupby table, for the queries
+// shardCreator cannot spread: those with few groups, such as a count of
+// everything, and those whose traffic piles onto a few keys. Tuples are
+// dealt out to the workers a chunk at a time, whatever their key; each
+// worker runs a copy of stage, which may be empty, and folds what it emits
+// into a ConcurrentAggTable sized by initTableSize(). At reset every worker
+// is waited for, and the table, frozen, is drained through nextOp as a
+// groupby's table is, followed by the reset. reduction must be one of the
+// AtomicReduction folds, and stage must keep no state of its own that
+// depends on seeing all of a key's tuples. Throws invalid_argument if
+// numWorkers is 0; an exception raised on a worker is rethrown by the next
+// reset.
+OpCreator concurrentGroupbyCreator(
+    size_t numWorkers, OpCreator stage, KeyProjector groupby,
+    AtomicReduction reduction, string outKey,
+    ConcurrentGroupbyOptions options = ConcurrentGroupbyOptions());
+
+#endif  // SHARD_H
@@ -0,0 +1,721 @@
+#include "sketch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+
+#include "flat_table.hpp"
+#include "packed_key.hpp"
+
+namespace {
+
+uint64_t mix(uint64_t x) {
+  x ^= x >> 31;
+  x *= 0x7fb5d329728ea185ULL;
+  x ^= x >> 27;
+  x *= 0x81dadef4bc2dd44dULL;
+  x ^= x >> 33;
+  return x;
+}
+
+size_t roundUpPow2(size_t n) {
+  size_t out = 1;
+  while (out < n) {
+    out <<= 1;
+  }
+  return out;
+}
+
+// Cell of row for a key, by double hashing from a single 64-bit hash.
+size_t cellIndex(uint64_t hash, size_t row, size_t width) {
+  uint64_t step = mix(hash) | 1;
+  return row * width + ((hash + row * step) & (width - 1));
+}
+
+double hllAlpha(size_t m) {
+  switch (m) {
+    case 16:
+      return 0.673;
+    case 32:
+      return 0.697;
+    case 64:
+      return 0.709;
+    default:
+      return 0.7213 / (1.0 + 1.079 / static_cast<double>(m));
+  }
+}
+
+uint64_t hashOf(const Headers& headers) {
+  return PackedKeyHash()(packKey(headers));
+}
+
+using TrackedTable = FlatTable<PackedKey, bool, PackedKeyHash>;
+
+// Remembers key unless the table is already full.
+void track(TrackedTable& tracked, const PackedKey& key, size_t cap) {
+  if (tracked.size() < cap || tracked.find(key) != nullptr) {
+    tracked[key] = true;
+  }
+}
+
+// Passes on every tracked group with estimate(group) in outKey, then the
+// reset itself.
+template <typename Estimate>
+void emitTracked(const TrackedTable& tracked, const Headers& headers,
+                 FieldId outKeyId, const Operator& nextOp, Estimate estimate) {
+  tracked.forEach([&](const PackedKey& key, bool) {
+    Headers out = unionHeaders(headers, unpackKey(key));
+    out[outKeyId] = OpResult::Int(estimate(PackedKeyHash()(key)));
+    nextOp.next(out);
+  });
+  nextOp.reset(headers);
+}
+
+uint64_t weightOf(const Headers& headers, optional<FieldId> weightKeyId) {
+  if (!weightKeyId) {
+    return 1;
+  }
+  return static_cast<uint64_t>(
+      max<int64_t>(0, getMappedInt(*weightKeyId, headers)));
+}
+
+void emitTop(const Headers& headers, const PackedKey& key, uint64_t count,
+             uint64_t error, FieldId outKeyId, optional<FieldId> errorKeyId,
+             const Operator& nextOp) {
+  Headers out = unionHeaders(headers, unpackKey(key));
+  out[outKeyId] = OpResult::Int(static_cast<int64_t>(count));
+  if (errorKeyId) {
+    out[*errorKeyId] = OpResult::Int(static_cast<int64_t>(error));
+  }
+  nextOp.next(out);
+}
+
+void checkShape(const SketchOptions& options) {
+  if (options.width == 0 || options.depth == 0) {
+    throw invalid_argument("Error: sketch width and depth must be nonzero");
+  }
+}
+
+}  // namespace
+
+HyperLogLog::HyperLogLog(uint8_t precision) : bits(precision) {
+  if (precision < 4 || precision > 16) {
+    throw invalid_argument("Error: HyperLogLog precision must be in [4, 16]");
+  }
+  registers.resize(size_t{1} << precision);
+  clear();
+}
+
+void HyperLogLog::set(size_t index, uint8_t rank) {
+  uint8_t old = registers[index];
+  if (rank <= old) {
+    return;
+  }
+  if (old == 0) {
+    zeros--;
+  }
+  inverseSum += ldexp(1.0, -rank) - ldexp(1.0, -old);
+  registers[index] = rank;
+}
+
+void HyperLogLog::add(uint64_t hash) {
+  size_t index = static_cast<size_t>(hash >> (64 - bits));
+  uint64_t rest = (hash << bits) | (uint64_t{1} << (bits - 1));
+  set(index, static_cast<uint8_t>(__builtin_clzll(rest) + 1));
+}
+
+double HyperLogLog::estimate() const {
+  double m = static_cast<double>(registers.size());
+  double raw = hllAlpha(registers.size()) * m * m / inverseSum;
+  if (raw <= 2.5 * m && zeros > 0) {
+    // Linear counting is more accurate while many registers are empty.
+    return m * log(m / static_cast<double>(zeros));
+  }
+  return raw;
+}
+
+void HyperLogLog::merge(const HyperLogLog& other) {
+  if (other.bits != bits) {
+    throw invalid_argument(
+        "Error: cannot merge HyperLogLogs of different precisions");
+  }
+  for (size_t i = 0; i < registers.size(); i++) {
+    set(i, other.registers[i]);
+  }
+}
+
+void HyperLogLog::clear() {
+  fill(registers.begin(), registers.end(), 0);
+  inverseSum = static_cast<double>(registers.size());
+  zeros = registers.size();
+}
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth)
+    : width(roundUpPow2(width)), depth(depth) {
+  if (width == 0 || depth == 0) {
+    throw invalid_argument("Error: sketch width and depth must be nonzero");
+  }
+  counters.assign(this->width * depth, 0);
+}
+
+uint64_t CountMinSketch::add(uint64_t hash, uint64_t count) {
+  uint64_t target = estimate(hash) + count;
+  for (size_t row = 0; row < depth; row++) {
+    uint64_t& cell = counters[cellIndex(hash, row, width)];
+    cell = max(cell, target);
+  }
+  return target;
+}
+
+uint64_t CountMinSketch::estimate(uint64_t hash) const {
+  uint64_t out = UINT64_MAX;
+  for (size_t row = 0; row < depth; row++) {
+    out = min(out, counters[cellIndex(hash, row, width)]);
+  }
+  return out;
+}
+
+void CountMinSketch::clear() { fill(counters.begin(), counters.end(), 0); }
+
+DistinctCountSketch::DistinctCountSketch(size_t width, size_t depth,
+                                         uint8_t precision)
+    : width(roundUpPow2(width)), depth(depth) {
+  if (width == 0 || depth == 0) {
+    throw invalid_argument("Error: sketch width and depth must be nonzero");
+  }
+  cells.assign(this->width * depth, HyperLogLog(precision));
+}
+
+double DistinctCountSketch::add(uint64_t keyHash, uint64_t itemHash) {
+  double out = HUGE_VAL;
+  for (size_t row = 0; row < depth; row++) {
+    HyperLogLog& cell = cells[cellIndex(keyHash, row, width)];
+    cell.add(itemHash);
+    out = min(out, cell.estimate());
+  }
+  return out;
+}
+
+double DistinctCountSketch::estimate(uint64_t keyHash) const {
+  double out = HUGE_VAL;
+  for (size_t row = 0; row < depth; row++) {
+    out = min(out, cells[cellIndex(keyHash, row, width)].estimate());
+  }
+  return out;
+}
+
+void DistinctCountSketch::clear() {
+  for (HyperLogLog& cell : cells) {
+    cell.clear();
+  }
+}
+
+size_t DistinctCountSketch::bytes() const {
+  return cells.size() * cells.front().bytes();
+}
+
+CuckooFilter::CuckooFilter(size_t capacity, double targetRate) {
+  if (!(targetRate > 0.0 && targetRate < 1.0)) {
+    throw invalid_argument(
+        "Error: cuckoo filter false-positive rate must be in (0, 1)");
+  }
+  // A lookup checks two full buckets of fingerprints.
+  double need = ceil(log2(2.0 * kSlots / targetRate));
+  bits = static_cast<unsigned>(min(16.0, max(4.0, need)));
+  fpMask = (uint64_t{1} << bits) - 1;
+  size_t buckets = roundUpPow2(max<size_t>(
+      1, static_cast<size_t>(ceil(capacity / (kSlots * 0.95)))));
+  mask = buckets - 1;
+  // One word of slack, since a bucket may straddle two words.
+  words.assign(buckets * kSlots * bits / 64 + 2, 0);
+}
+
+uint64_t CuckooFilter::load(size_t bucket) const {
+  size_t width = kSlots * bits;
+  size_t pos = bucket * width;
+  size_t off = pos % 64;
+  uint64_t slots = words[pos / 64] >> off;
+  if (off + width > 64) {
+    slots |= words[pos / 64 + 1] << (64 - off);
+  }
+  return width == 64 ? slots : slots & ((uint64_t{1} << width) - 1);
+}
+
+void CuckooFilter::store(size_t bucket, uint64_t slots) {
+  size_t width = kSlots * bits;
+  size_t pos = bucket * width;
+  size_t off = pos % 64;
+  uint64_t all = width == 64 ? ~uint64_t{0} : (uint64_t{1} << width) - 1;
+  uint64_t& low = words[pos / 64];
+  low = (low & ~(all << off)) | (slots << off);
+  if (off + width > 64) {
+    uint64_t spill = (uint64_t{1} << (off + width - 64)) - 1;
+    uint64_t& high = words[pos / 64 + 1];
+    high = (high & ~spill) | (slots >> (64 - off));
+  }
+}
+
+bool CuckooFilter::has(size_t bucket, uint32_t fp) const {
+  uint64_t slots = load(bucket);
+  for (size_t j = 0; j < kSlots; j++) {
+    if (slot(slots, j) == fp) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CuckooFilter::place(size_t bucket, uint32_t fp) {
+  uint64_t slots = load(bucket);
+  for (size_t j = 0; j < kSlots; j++) {
+    if (slot(slots, j) == 0) {
+      store(bucket, slots | (static_cast<uint64_t>(fp) << (j * bits)));
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t CuckooFilter::other(size_t bucket, uint32_t fp) const {
+  return (bucket ^ static_cast<size_t>(packedKeyMix(fp))) & mask;
+}
+
+bool CuckooFilter::contains(uint64_t hash) const {
+  uint32_t fp = static_cast<uint32_t>(max<uint64_t>(1, hash >> (64 - bits)));
+  size_t first = static_cast<size_t>(hash) & mask;
+  size_t second = other(first, fp);
+  if (victim == fp && (victimBucket == first || victimBucket == second)) {
+    return true;
+  }
+  return has(first, fp) || has(second, fp);
+}
+
+bool CuckooFilter::insert(uint64_t hash) {
+  if (full()) {
+    return false;
+  }
+  uint32_t fp = static_cast<uint32_t>(max<uint64_t>(1, hash >> (64 - bits)));
+  size_t bucket = static_cast<size_t>(hash) & mask;
+  count++;
+  if (place(bucket, fp) || place(bucket = other(bucket, fp), fp)) {
+    return true;
+  }
+  // Evict a random fingerprint to its other bucket, and so on down the
+  // chain until one finds room.
+  for (int kick = 0; kick < kMaxKicks; kick++) {
+    rng = packedKeyMix(rng);
+    size_t j = rng % kSlots;
+    uint64_t slots = load(bucket);
+    uint32_t evicted = slot(slots, j);
+    slots &= ~(fpMask << (j * bits));
+    store(bucket, slots | (static_cast<uint64_t>(fp) << (j * bits)));
+    fp = evicted;
+    bucket = other(bucket, fp);
+    if (place(bucket, fp)) {
+      return true;
+    }
+  }
+  victim = fp;
+  victimBucket = bucket;
+  return true;
+}
+
+void CuckooFilter::clear() {
+  fill(words.begin(), words.end(), 0);
+  count = 0;
+  victim = 0;
+}
+
+double CuckooFilter::falsePositiveRate() const {
+  double load = static_cast<double>(count) / static_cast<double>(capacity());
+  return 1.0 - pow(1.0 - ldexp(1.0, -static_cast<int>(bits)),
+                   2.0 * kSlots * min(1.0, load));
+}
+
+SpaceSaving::SpaceSaving(size_t capacity)
+    : capacity(capacity), index(capacity) {
+  if (capacity == 0 || capacity > UINT32_MAX) {
+    throw invalid_argument("Error: SpaceSaving capacity must be in [1, 2^32)");
+  }
+  counters.reserve(capacity);
+  heap.reserve(capacity);
+  place.reserve(capacity);
+}
+
+void SpaceSaving::swapAt(size_t a, size_t b) {
+  swap(heap[a], heap[b]);
+  place[heap[a]] = static_cast<uint32_t>(a);
+  place[heap[b]] = static_cast<uint32_t>(b);
+}
+
+void SpaceSaving::siftUp(size_t at) {
+  while (at > 0 && less(at, (at - 1) / 2)) {
+    swapAt(at, (at - 1) / 2);
+    at = (at - 1) / 2;
+  }
+}
+
+void SpaceSaving::siftDown(size_t at) {
+  while (true) {
+    size_t smallest = at;
+    for (size_t child = 2 * at + 1; child <= 2 * at + 2; child++) {
+      if (child < heap.size() && less(child, smallest)) {
+        smallest = child;
+      }
+    }
+    if (smallest == at) {
+      return;
+    }
+    swapAt(at, smallest);
+    at = smallest;
+  }
+}
+
+void SpaceSaving::add(const PackedKey& key, uint64_t weight) {
+  auto [slot, inserted] = index.findOrInsert(key);
+  if (!inserted) {
+    counters[*slot].count += weight;
+    siftDown(place[*slot]);
+    return;
+  }
+  if (counters.size() < capacity) {
+    uint32_t i = static_cast<uint32_t>(counters.size());
+    *slot = i;
+    counters.push_back({key, weight, 0});
+    heap.push_back(i);
+    place.push_back(static_cast<uint32_t>(heap.size() - 1));
+    siftUp(heap.size() - 1);
+    return;
+  }
+  // Set the slot before the erase, which may move it.
+  uint32_t i = heap.front();
+  *slot = i;
+  Counter& evicted = counters[i];
+  index.erase(evicted.key);
+  evicted.key = key;
+  evicted.error = evicted.count;
+  evicted.count += weight;
+  siftDown(0);
+}
+
+vector<SpaceSaving::Counter> SpaceSaving::top(size_t n) const {
+  vector<uint32_t> order(counters.size());
+  iota(order.begin(), order.end(), 0);
+  size_t m = min(n, order.size());
+  partial_sort(order.begin(), order.begin() + m, order.end(),
+               [this](uint32_t a, uint32_t b) {
+                 const Counter& x = counters[a];
+                 const Counter& y = counters[b];
+                 if (x.count != y.count) {
+                   return x.count > y.count;
+                 }
+                 if (x.error != y.error) {
+                   return x.error < y.error;
+                 }
+                 return a < b;
+               });
+  vector<Counter> out;
+  out.reserve(m);
+  for (size_t i = 0; i < m; i++) {
+    out.push_back(counters[order[i]]);
+  }
+  return out;
+}
+
+void SpaceSaving::clear() {
+  counters.clear();
+  heap.clear();
+  place.clear();
+  index.clear();
+}
+
+OpCreator approxDistinctCreator(GroupingFunc groupby, GroupingFunc distinctKey,
+                                string outKey, SketchOptions options) {
+  FieldId outKeyId = internField(outKey);
+  // Throws for a bad precision before any operator is built.
+  HyperLogLog(options.precision);
+
+  return [groupby, distinctKey, outKeyId, options](Operator nextOp) {
+    struct State {
+      FlatTable<PackedKey, uint32_t, PackedKeyHash> groups{initTableSize()};
+      // Sketches of the current epoch's groups come first; the rest are
+      // left over from busier epochs and are cleared before reuse.
+      vector<HyperLogLog> sketches;
+      size_t used = 0;
+    };
+    auto state = make_shared<State>();
+
+    OpFunc next = [groupby, distinctKey, options,
+                   state](const Headers& headers) {
+      auto [slot, inserted] =
+          state->groups.findOrInsert(packKey(groupby(headers)));
+      if (inserted) {
+        if (state->used == state->sketches.size()) {
+          state->sketches.emplace_back(options.precision);
+        }
+        *slot = static_cast<uint32_t>(state->used++);
+      }
+      state->sketches[*slot].add(hashOf(distinctKey(headers)));
+    };
+
+    OpFunc reset = [state, nextOp, outKeyId](const Headers& headers) {
+      state->groups.forEach([&](const PackedKey& key, uint32_t index) {
+        Headers out = unionHeaders(headers, unpackKey(key));
+        out[outKeyId] =
+            OpResult::Int(llround(state->sketches[index].estimate()));
+        nextOp.next(out);
+      });
+      nextOp.reset(headers);
+      for (size_t i = 0; i < state->used; i++) {
+        state->sketches[i].clear();
+      }
+      state->used = 0;
+      state->groups.clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator approxCountCreator(GroupingFunc groupby, string outKey,
+                             int64_t threshold, SketchOptions options) {
+  FieldId outKeyId = internField(outKey);
+  checkShape(options);
+
+  return [groupby, outKeyId, threshold, options](Operator nextOp) {
+    struct State {
+      CountMinSketch counts;
+      TrackedTable tracked;
+
+      explicit State(const SketchOptions& options)
+          : counts(options.width, options.depth),
+            tracked(min(options.maxHeavyHitters, kInitTableSize)) {}
+    };
+    auto state = make_shared<State>(options);
+
+    OpFunc next = [groupby, threshold, options,
+                   state](const Headers& headers) {
+      PackedKey key = packKey(groupby(headers));
+      uint64_t count = state->counts.add(PackedKeyHash()(key));
+      if (static_cast<int64_t>(count) >= threshold) {
+        track(state->tracked, key, options.maxHeavyHitters);
+      }
+    };
+
+    OpFunc reset = [state, nextOp, outKeyId](const Headers& headers) {
+      emitTracked(state->tracked, headers, outKeyId, nextOp,
+                  [&state](uint64_t hash) {
+                    return static_cast<int64_t>(state->counts.estimate(hash));
+                  });
+      state->counts.clear();
+      state->tracked.clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator approxDistinctCountCreator(GroupingFunc groupby,
+                                     GroupingFunc distinctKey, string outKey,
+                                     int64_t threshold,
+                                     SketchOptions options) {
+  FieldId outKeyId = internField(outKey);
+  checkShape(options);
+  HyperLogLog(options.cellPrecision);
+
+  return [groupby, distinctKey, outKeyId, threshold,
+          options](Operator nextOp) {
+    struct State {
+      DistinctCountSketch counts;
+      TrackedTable tracked;
+
+      explicit State(const SketchOptions& options)
+          : counts(options.width, options.depth, options.cellPrecision),
+            tracked(min(options.maxHeavyHitters, kInitTableSize)) {}
+    };
+    auto state = make_shared<State>(options);
+
+    OpFunc next = [groupby, distinctKey, threshold, options,
+                   state](const Headers& headers) {
+      PackedKey key = packKey(groupby(headers));
+      double count = state->counts.add(PackedKeyHash()(key),
+                                       hashOf(distinctKey(headers)));
+      if (llround(count) >= threshold) {
+        track(state->tracked, key, options.maxHeavyHitters);
+      }
+    };
+
+    OpFunc reset = [state, nextOp, outKeyId](const Headers& headers) {
+      emitTracked(state->tracked, headers, outKeyId, nextOp,
+                  [&state](uint64_t hash) {
+                    return static_cast<int64_t>(
+                        llround(state->counts.estimate(hash)));
+                  });
+      state->counts.clear();
+      state->tracked.clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator topKCreator(GroupingFunc groupby, size_t k, string outKey,
+                      TopKOptions options) {
+  if (k == 0) {
+    throw invalid_argument("Error: topKCreator needs a k of at least 1");
+  }
+  if (options.counters == 0) {
+    options.counters = 4 * k;
+  }
+  if (!options.exact && options.counters < k) {
+    throw invalid_argument("Error: topKCreator needs at least k counters");
+  }
+  FieldId outKeyId = internField(outKey);
+  optional<FieldId> weightKeyId;
+  if (!options.weightKey.empty()) {
+    weightKeyId = internField(options.weightKey);
+  }
+  optional<FieldId> errorKeyId;
+  if (!options.errorKey.empty()) {
+    errorKeyId = internField(options.errorKey);
+  }
+
+  if (options.exact) {
+    return [groupby, k, outKeyId, weightKeyId, errorKeyId](Operator nextOp) {
+      using CountTable = FlatTable<PackedKey, uint64_t, PackedKeyHash>;
+      auto counts = make_shared<CountTable>(initTableSize());
+
+      OpFunc next = [groupby, weightKeyId, counts](const Headers& headers) {
+        *counts->findOrInsert(packKey(groupby(headers))).first +=
+            weightOf(headers, weightKeyId);
+      };
+
+      OpFunc reset = [k, outKeyId, errorKeyId, counts,
+                      nextOp](const Headers& headers) {
+        // A min-heap of the best k so far, ties going to the group seen
+        // first, so that the worst of them is always at the front.
+        struct Pick {
+          uint64_t count;
+          size_t seen;
+          const PackedKey* key;
+        };
+        auto better = [](const Pick& a, const Pick& b) {
+          return a.count != b.count ? a.count > b.count : a.seen < b.seen;
+        };
+        vector<Pick> picks;
+        picks.reserve(min(k, counts->size()));
+        size_t seen = 0;
+        counts->forEach([&](const PackedKey& key, uint64_t count) {
+          Pick pick{count, seen++, &key};
+          if (picks.size() < k) {
+            picks.push_back(pick);
+            push_heap(picks.begin(), picks.end(), better);
+          } else if (better(pick, picks.front())) {
+            pop_heap(picks.begin(), picks.end(), better);
+            picks.back() = pick;
+            push_heap(picks.begin(), picks.end(), better);
+          }
+        });
+        sort_heap(picks.begin(), picks.end(), better);
+        for (const Pick& pick : picks) {
+          emitTop(headers, *pick.key, pick.count, 0, outKeyId, errorKeyId,
+                  nextOp);
+        }
+        nextOp.reset(headers);
+        counts->clear();
+      };
+
+      return Operator(next, reset);
+    };
+  }
+
+  return [groupby, k, outKeyId, weightKeyId, errorKeyId,
+          options](Operator nextOp) {
+    auto saving = make_shared<SpaceSaving>(options.counters);
+
+    OpFunc next = [groupby, weightKeyId, saving](const Headers& headers) {
+      saving->add(packKey(groupby(headers)), weightOf(headers, weightKeyId));
+    };
+
+    OpFunc reset = [k, outKeyId, errorKeyId, saving,
+                    nextOp](const Headers& headers) {
+      for (const SpaceSaving::Counter& counter : saving->top(k)) {
+        emitTop(headers, counter.key, counter.count, counter.error, outKeyId,
+                errorKeyId, nextOp);
+      }
+      nextOp.reset(headers);
+      saving->clear();
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+OpCreator streamingDistinctCreator(KeyProjector groupby,
+                                   DistinctFilterOptions options) {
+  // Throws for a bad rate before any operator is built.
+  CuckooFilter(1, options.falsePositiveRate);
+
+  return [groupby, options](Operator nextOp) {
+    struct State {
+      // Filled in order; a key is looked up in all of them.
+      vector<CuckooFilter> filters;
+      uint64_t keys = 0;
+      uint64_t overflows = 0;
+    };
+    auto state = make_shared<State>();
+    state->filters.emplace_back(options.expectedKeys,
+                                options.falsePositiveRate);
+
+    OpFunc next = [groupby, options, state, nextOp](const Headers& headers) {
+      ProjectedKey projected = groupby.project(headers);
+      for (const CuckooFilter& filter : state->filters) {
+        if (filter.contains(projected.hash)) {
+          return;
+        }
+      }
+      if (!state->filters.back().insert(projected.hash)) {
+        state->filters.emplace_back(2 * state->filters.back().capacity(),
+                                    options.falsePositiveRate);
+        state->filters.back().insert(projected.hash);
+        state->overflows++;
+      }
+      state->keys++;
+      nextOp.next(unpackKey(projected.key));
+    };
+
+    OpFunc reset = [options, state, nextOp](const Headers& headers) {
+      vector<CuckooFilter>& filters = state->filters;
+      if (options.stats) {
+        DistinctFilterStats& stats = *options.stats;
+        stats.keys += state->keys;
+        stats.overflows += state->overflows;
+        stats.bytes = 0;
+        double missed = 1.0;
+        for (const CuckooFilter& filter : filters) {
+          stats.bytes += filter.bytes();
+          missed *= 1.0 - filter.falsePositiveRate();
+        }
+        stats.falsePositiveRate = 1.0 - missed;
+      }
+      nextOp.reset(headers);
+
+      // Size the next epoch's filter for this one, keeping the memory
+      // unless it is too small or far too big.
+      size_t need = max<size_t>(options.expectedKeys, state->keys);
+      size_t have = filters.front().capacity();
+      if (filters.size() > 1 || need > have || need * 4 < have) {
+        filters.clear();
+        filters.emplace_back(need, options.falsePositiveRate);
+      } else {
+        filters.front().clear();
+      }
+      state->keys = 0;
+      state->overflows = 0;
+    };
+
+    return Operator(next, reset);
+  };
+}
@@ -0,0 +1,275 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "builtins.hpp"
+#include "flat_table.hpp"
+#include "key_projector.hpp"
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Cardinality estimator over 64-bit hashes in 2^precision one-byte
+// registers, with a standard error of about 1.04 / sqrt(2^precision). The
+// harmonic sum behind the estimate is kept up to date as registers change,
+// so estimate() costs the same whatever the precision.
+class HyperLogLog {
+ public:
+  // Throws invalid_argument unless 4 <= precision <= 16.
+  explicit HyperLogLog(uint8_t precision);
+
+  void add(uint64_t hash);
+  double estimate() const;
+  // Leaves the union of both inputs in this one; throws invalid_argument if
+  // the precisions differ.
+  void merge(const HyperLogLog& other);
+  void clear();
+
+  uint8_t precision() const { return bits; }
+  size_t bytes() const { return registers.size(); }
+
+ private:
+  uint8_t bits;
+  vector<uint8_t> registers;
+  double inverseSum;
+  size_t zeros;
+
+  void set(size_t index, uint8_t rank);
+};
+
+// Frequency estimator over 64-bit hashes: depth rows of width counters, each
+// row indexed by a different hash of the key. Updates are conservative, only
+// raising the counters that hold the current minimum, which keeps the
+// overestimate of light keys down. Width is rounded up to a power of two.
+class CountMinSketch {
+ public:
+  CountMinSketch(size_t width, size_t depth);
+
+  // Adds count to the key and returns its new estimate.
+  uint64_t add(uint64_t hash, uint64_t count = 1);
+  uint64_t estimate(uint64_t hash) const;
+  void clear();
+
+  size_t bytes() const { return counters.size() * sizeof(uint64_t); }
+
+ private:
+  size_t width;
+  size_t depth;
+  vector<uint64_t> counters;
+};
+
+// The distinct-count counterpart of CountMinSketch: every cell is a small
+// HyperLogLog, and a key's estimate is the least of those of its cells.
+// Memory is fixed at depth * width * 2^precision bytes however many keys
+// there are.
+class DistinctCountSketch {
+ public:
+  DistinctCountSketch(size_t width, size_t depth, uint8_t precision);
+
+  // Records item under key and returns the key's new estimate.
+  double add(uint64_t keyHash, uint64_t itemHash);
+  double estimate(uint64_t keyHash) const;
+  void clear();
+
+  size_t bytes() const;
+
+ private:
+  size_t width;
+  size_t depth;
+  vector<HyperLogLog> cells;
+};
+
+// Approximate set of 64-bit hashes: each is kept as a short fingerprint in
+// one of two buckets of four, found by partial-key cuckoo hashing, with the
+// fingerprints bit-packed so that a set costs a few bytes per member
+// whatever the keys. Lookups of hashes never added come back true with
+// about falsePositiveRate(); members are never lost.
+class CuckooFilter {
+ public:
+  // Room for capacity hashes at about targetRate false positives once
+  // full. Fingerprints are at most 16 bits, which puts a floor of about
+  // 1.2e-4 under the rate. Throws invalid_argument unless 0 < targetRate < 1.
+  CuckooFilter(size_t capacity, double targetRate);
+
+  bool contains(uint64_t hash) const;
+  // Adds hash and returns true, or returns false if the filter is full.
+  // Once it is, contains still answers for everything added.
+  bool insert(uint64_t hash);
+  void clear();
+
+  size_t size() const { return count; }
+  size_t capacity() const { return (mask + 1) * kSlots; }
+  bool full() const { return victim != 0; }
+  size_t bytes() const { return words.size() * sizeof(uint64_t); }
+  // The chance that a lookup of a hash never added comes back true, at the
+  // current load.
+  double falsePositiveRate() const;
+
+ private:
+  static constexpr size_t kSlots = 4;
+  static constexpr int kMaxKicks = 500;
+
+  unsigned bits;
+  uint64_t fpMask;
+  size_t mask;
+  vector<uint64_t> words;
+  size_t count = 0;
+  // The fingerprint left without a slot when the filter filled up, and its
+  // bucket.
+  uint32_t victim = 0;
+  size_t victimBucket = 0;
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+  uint64_t load(size_t bucket) const;
+  void store(size_t bucket, uint64_t slots);
+  uint32_t slot(uint64_t slots, size_t j) const {
+    return static_cast<uint32_t>((slots >> (j * bits)) & fpMask);
+  }
+  bool has(size_t bucket, uint32_t fp) const;
+  bool place(size_t bucket, uint32_t fp);
+  size_t other(size_t bucket, uint32_t fp) const;
+};
+
+// Heavy hitters in a fixed number of counters, by Space-Saving: a key that
+// is not tracked takes over the counter of the smallest tracked one,
+// inheriting its count as possible overestimate. Every key whose true total
+// exceeds total / capacity is tracked, and a tracked key's count exceeds its
+// true total by at most its error.
+class SpaceSaving {
+ public:
+  struct Counter {
+    PackedKey key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  // Throws invalid_argument for a capacity of 0.
+  explicit SpaceSaving(size_t capacity);
+
+  void add(const PackedKey& key, uint64_t weight = 1);
+  // The n tracked keys with the largest counts, largest first; ties go to
+  // the smaller error.
+  vector<Counter> top(size_t n) const;
+  void clear();
+
+  size_t size() const { return counters.size(); }
+
+ private:
+  size_t capacity;
+  // Counters stay where they are; heap orders their indexes by count,
+  // smallest first, and place gives each one's position in heap.
+  vector<Counter> counters;
+  vector<uint32_t> heap;
+  vector<uint32_t> place;
+  FlatTable<PackedKey, uint32_t, PackedKeyHash> index;
+
+  bool less(size_t a, size_t b) const {
+    return counters[heap[a]].count < counters[heap[b]].count;
+  }
+  void swapAt(size_t a, size_t b);
+  void siftUp(size_t at);
+  void siftDown(size_t at);
+};
+
+struct SketchOptions {
+  // HyperLogLog precision for per-group estimates; each one takes
+  // 2^precision bytes.
+  uint8_t precision = 10;
+  // Count-Min shape. The fixed-size distinct sketch uses the same shape with
+  // cellPrecision registers per cell.
+  size_t width = 2048;
+  size_t depth = 4;
+  uint8_t cellPrecision = 6;
+  // Most groups reported per epoch by the threshold sketches; groups that
+  // cross the threshold once this many are tracked go unreported.
+  size_t maxHeavyHitters = 4096;
+};
+
+// Approximate form of distinct(distinctKey) followed by
+// groupby(groupby, counter, outKey), where groupby keeps a subset of the
+// fields of distinctKey: every group keeps one HyperLogLog of the
+// distinctKey values seen in it instead of the values themselves. At reset
+// each group is passed on with its estimate, rounded, in outKey.
+OpCreator approxDistinctCreator(GroupingFunc groupby, GroupingFunc distinctKey,
+                                string outKey,
+                                SketchOptions options = SketchOptions());
+
+// Approximate form of groupby(groupby, counter, outKey) for queries that go
+// on to keep only the groups whose count reaches threshold. Counts live in a
+// Count-Min sketch; a group is remembered once its estimate reaches the
+// threshold, and at reset those groups are passed on with their estimates.
+// Estimates never undercount, so no group over the threshold is missed
+// while fewer than options.maxHeavyHitters are being tracked.
+OpCreator approxCountCreator(GroupingFunc groupby, string outKey,
+                             int64_t threshold,
+                             SketchOptions options = SketchOptions());
+
+// Fixed-memory form of approxDistinctCreator for queries that keep only the
+// groups whose distinct count reaches threshold, built on a
+// DistinctCountSketch and tracking heavy hitters like approxCountCreator.
+OpCreator approxDistinctCountCreator(GroupingFunc groupby,
+                                     GroupingFunc distinctKey, string outKey,
+                                     int64_t threshold,
+                                     SketchOptions options = SketchOptions());
+
+struct DistinctFilterStats {
+  uint64_t keys = 0;
+  // Filters started mid-epoch because the epoch outgrew the one it began
+  // with.
+  uint64_t overflows = 0;
+  // Memory of the filters at the end of the last epoch.
+  size_t bytes = 0;
+  // The chance, at the end of the last epoch, that a new key was taken for
+  // one already seen and dropped.
+  double falsePositiveRate = 0.0;
+};
+
+struct DistinctFilterOptions {
+  // Keys expected in an epoch. Each epoch's filter is sized for the keys of
+  // the epoch before, and never for fewer than this.
+  size_t expectedKeys = size_t{1} << 16;
+  // The chance to aim for that a new key is taken for one already seen.
+  double falsePositiveRate = 1e-3;
+  // Updated at each reset when set.
+  shared_ptr<DistinctFilterStats> stats;
+};
+
+// Membership-only form of distinctCreator for queries that go on to count:
+// passes on each key's fields the first time the key is seen in an epoch,
+// rather than every key at reset, and remembers keys in a CuckooFilter
+// rather than a table of them. A new key is dropped with about the
+// configured false-positive rate, so downstream counts may fall short by
+// that much; a key is never passed on twice in an epoch.
+OpCreator streamingDistinctCreator(
+    KeyProjector groupby,
+    DistinctFilterOptions options = DistinctFilterOptions());
+
+struct TopKOptions {
+  // Counts every group of an epoch in a flat table and picks the top k at
+  // reset, in memory that grows with the groups. Otherwise the groups are
+  // counted by a SpaceSaving of counters entries, in memory fixed by k.
+  bool exact = false;
+  // Counters for the approximate mode; 0 means 4 * k. More counters make
+  // the counts reported for the top k tighter.
+  size_t counters = 0;
+  // The integer field each tuple adds to its group's count; every tuple
+  // adds one when empty.
+  string weightKey;
+  // When set, each group is also passed on with the most its count may be
+  // overestimated by under this field: always 0 in the exact mode.
+  string errorKey;
+};
+
+// Top-k form of groupby(groupby, counter, outKey): at reset, passes on the
+// k groups with the largest counts, largest first, with the count in
+// outKey, then the reset itself. Throws invalid_argument for a k of 0 or
+// fewer counters than k.
+OpCreator topKCreator(GroupingFunc groupby, size_t k, string outKey,
+                      TopKOptions options = TopKOptions());
+
+#endif  // SKETCH_H
@@ -0,0 +1,307 @@
+#include "sliding_window.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "flat_table.hpp"
+#include "metrics.hpp"
+#include "packed_key.hpp"
+
+namespace {
+
+using PaneTable = FlatTable<PackedKey, OpResult, PackedKeyHash>;
+
+struct WindowEntry {
+  OpResult val;
+  // Panes of the window holding the group; it leaves the window with the
+  // last of them.
+  uint32_t panes = 0;
+};
+
+using WindowTable = FlatTable<PackedKey, WindowEntry, PackedKeyHash>;
+
+struct SlidingState {
+  WindowReduction reduct;
+  size_t panesPerWindow;
+  KeyProjector groupby;
+  FieldId keyOutId;
+  FieldId outKeyId;
+  shared_ptr<TableGauge> gauge;
+  Operator nextOp;
+
+  double boundary = 0.0;
+  int64_t eid = 0;
+  size_t tableSize = initTableSize();
+  PaneTable current{tableSize};
+  // Emptied tables, kept so that steady state allocates nothing.
+  vector<PaneTable> spare;
+  Headers out;
+
+  // With subtract: the closed panes of the window, oldest first, and their
+  // running combination.
+  deque<PaneTable> panes;
+  WindowTable window{tableSize};
+
+  // Without: panes are pushed onto back, whose combination backAgg is kept,
+  // and dropped from front, where front[i] is the combination of its panes
+  // from the i-th up to the last, so that front.back() covers all of front.
+  // Once front runs out, back is moved over to it in one pass.
+  vector<PaneTable> front;
+  vector<PaneTable> back;
+  PaneTable backAgg{tableSize};
+
+  SlidingState(WindowReduction reduct, size_t panesPerWindow,
+               KeyProjector groupby, FieldId keyOutId, FieldId outKeyId,
+               Operator nextOp)
+      : reduct(move(reduct)),
+        panesPerWindow(panesPerWindow),
+        groupby(groupby),
+        keyOutId(keyOutId),
+        outKeyId(outKeyId),
+        gauge(meterTable()),
+        nextOp(move(nextOp)) {}
+
+  bool invertible() const { return static_cast<bool>(reduct.subtract); }
+
+  void add(const Headers& headers) {
+    ProjectedKey projected = groupby.project(headers);
+    auto [val, inserted] =
+        current.findOrInsertHashed(projected.key, projected.hash);
+    *val = reduct.add(inserted ? OpResult::Empty() : *val, headers);
+  }
+
+  PaneTable takeSpare() {
+    if (spare.empty()) {
+      return PaneTable(tableSize);
+    }
+    PaneTable table = move(spare.back());
+    spare.pop_back();
+    table.clear();
+    return table;
+  }
+
+  // into = into (+) from, key by key; into holds the older panes.
+  void merge(PaneTable& into, const PaneTable& from) {
+    from.forEach([&](const PackedKey& key, const OpResult& val) {
+      auto [at, inserted] = into.findOrInsert(key);
+      *at = inserted ? val : reduct.combine(*at, val);
+    });
+  }
+
+  void emit(const PackedKey& key, const OpResult& val) {
+    out.clear();
+    out[keyOutId] = OpResult::Int(eid);
+    unpackKeyInto(key, out);
+    out[outKeyId] = val;
+    nextOp.next(out);
+  }
+
+  void closeSlide() {
+    PaneTable closed = move(current);
+    current = takeSpare();
+    if (invertible()) {
+      slideInvertible(move(closed));
+    } else {
+      slideTwoStack(move(closed));
+    }
+    if (gauge) {
+      gauge->record(windowEntries(), bytes());
+    }
+    nextOp.reset(singleton(fieldName(keyOutId), OpResult::Int(eid)));
+  }
+
+  void slideInvertible(PaneTable closed) {
+    closed.forEach([&](const PackedKey& key, const OpResult& val) {
+      auto [entry, inserted] = window.findOrInsert(key);
+      entry->val = inserted ? val : reduct.combine(entry->val, val);
+      entry->panes++;
+    });
+    panes.push_back(move(closed));
+    if (panes.size() > panesPerWindow) {
+      panes.front().forEach([&](const PackedKey& key, const OpResult& val) {
+        WindowEntry* entry = window.find(key);
+        if (--entry->panes == 0) {
+          window.erase(key);
+        } else {
+          entry->val = reduct.subtract(entry->val, val);
+        }
+      });
+      spare.push_back(move(panes.front()));
+      panes.pop_front();
+    }
+    window.forEach([&](const PackedKey& key, const WindowEntry& entry) {
+      emit(key, entry.val);
+    });
+  }
+
+  void slideTwoStack(PaneTable closed) {
+    merge(backAgg, closed);
+    back.push_back(move(closed));
+    if (front.size() + back.size() > panesPerWindow) {
+      if (front.empty()) {
+        // The newest pane goes in first, so that front.back() ends up as
+        // the oldest pane combined with all the others.
+        for (size_t i = back.size(); i-- > 0;) {
+          if (!front.empty()) {
+            merge(back[i], front.back());
+          }
+          front.push_back(move(back[i]));
+        }
+        back.clear();
+        backAgg.clear();
+      }
+      spare.push_back(move(front.back()));
+      front.pop_back();
+    }
+
+    if (front.empty()) {
+      backAgg.forEach(
+          [&](const PackedKey& key, const OpResult& val) { emit(key, val); });
+      return;
+    }
+    const PaneTable& older = front.back();
+    older.forEach([&](const PackedKey& key, const OpResult& val) {
+      const OpResult* newer = backAgg.find(key);
+      emit(key, newer ? reduct.combine(val, *newer) : val);
+    });
+    backAgg.forEach([&](const PackedKey& key, const OpResult& val) {
+      if (!older.find(key)) {
+        emit(key, val);
+      }
+    });
+  }
+
+  size_t windowEntries() const {
+    if (invertible()) {
+      return window.size();
+    }
+    return backAgg.size() + (front.empty() ? 0 : front.back().size());
+  }
+
+  size_t bytes() const {
+    size_t total = current.bytes() + window.bytes() + backAgg.bytes();
+    for (const PaneTable& table : panes) {
+      total += table.bytes();
+    }
+    for (const PaneTable& table : front) {
+      total += table.bytes();
+    }
+    for (const PaneTable& table : back) {
+      total += table.bytes();
+    }
+    return total;
+  }
+
+  void restart() {
+    for (PaneTable& table : panes) {
+      spare.push_back(move(table));
+    }
+    for (PaneTable& table : front) {
+      spare.push_back(move(table));
+    }
+    for (PaneTable& table : back) {
+      spare.push_back(move(table));
+    }
+    panes.clear();
+    front.clear();
+    back.clear();
+    window.clear();
+    backAgg.clear();
+    current.clear();
+    boundary = 0.0;
+    eid = 0;
+  }
+};
+
+OpResult addInts(OpResult a, OpResult b) {
+  return OpResult::Int(a.asInt() + b.asInt());
+}
+
+}  // namespace
+
+WindowReduction windowCounter() {
+  return {counter, addInts, [](OpResult a, OpResult b) {
+            return OpResult::Int(a.asInt() - b.asInt());
+          }};
+}
+
+// Unlike sumInts, which starts each group at 0 and so drops its first
+// tuple, the first tuple of a pane is counted too.
+WindowReduction windowSumInts(string searchKey) {
+  FieldId id = internField(searchKey);
+  ReductionFunc add = [id](OpResult val, const Headers& headers) {
+    int64_t n = headers.at(id).asInt();
+    return OpResult::Int(val.typ == OpResultType::Empty ? n
+                                                         : val.asInt() + n);
+  };
+  return {add, addInts, [](OpResult a, OpResult b) {
+            return OpResult::Int(a.asInt() - b.asInt());
+          }};
+}
+
+WindowReduction windowMaxInts(string searchKey) {
+  FieldId id = internField(searchKey);
+  ReductionFunc add = [id](OpResult val, const Headers& headers) {
+    int64_t n = headers.at(id).asInt();
+    return OpResult::Int(val.typ == OpResultType::Empty
+                             ? n
+                             : max(val.asInt(), n));
+  };
+  CombineFunc combine = [](OpResult a, OpResult b) {
+    return OpResult::Int(max(a.asInt(), b.asInt()));
+  };
+  return {add, combine, nullptr};
+}
+
+OpCreator slidingGroupbyCreator(double windowWidth, double slide,
+                                string keyOut, KeyProjector groupby,
+                                WindowReduction reduct, string outKey) {
+  if (!(slide > 0.0) || windowWidth < slide) {
+    throw invalid_argument(
+        "Error: a sliding window needs a positive slide no wider than the "
+        "window");
+  }
+  double panes = round(windowWidth / slide);
+  if (fabs(panes * slide - windowWidth) > 1e-9 * windowWidth) {
+    throw invalid_argument(
+        "Error: sliding window width must be a whole number of slides");
+  }
+  if (!reduct.add || !reduct.combine) {
+    throw invalid_argument(
+        "Error: a window reduction needs both add and combine");
+  }
+  FieldId keyOutId = internField(keyOut);
+  FieldId outKeyId = internField(outKey);
+  size_t panesPerWindow = static_cast<size_t>(panes);
+
+  return [reduct, panesPerWindow, groupby, keyOutId, outKeyId,
+          slide](Operator nextOp) {
+    auto state = make_shared<SlidingState>(reduct, panesPerWindow, groupby,
+                                           keyOutId, outKeyId, nextOp);
+
+    OpFunc next = [state, slide](const Headers& headers) {
+      double time = headers.at(Field::Time).asFloat();
+      if (state->boundary == 0.0) {
+        state->boundary = time + slide;
+      } else {
+        while (time >= state->boundary) {
+          state->closeSlide();
+          state->boundary += slide;
+          state->eid++;
+        }
+      }
+      state->add(headers);
+    };
+
+    OpFunc reset = [state](const Headers& _) {
+      state->closeSlide();
+      state->restart();
+    };
+
+    return Operator(next, reset);
+  };
+}
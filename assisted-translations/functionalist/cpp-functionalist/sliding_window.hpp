@@ -0,0 +1,51 @@
+#ifndef SLIDING_WINDOW_H
+#define SLIDING_WINDOW_H
+
+#include <functional>
+#include <string>
+
+#include "builtins.hpp"
+#include "key_projector.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+using CombineFunc = function<OpResult(OpResult, OpResult)>;
+
+// A reduction that a sliding window can split into panes. add folds one
+// tuple into a pane's partial result, starting from Empty, as a
+// ReductionFunc does; combine merges two partial results, the older first.
+// subtract, if given, takes a pane's partial result back out of a combined
+// one, letting the window drop its oldest pane in time proportional to that
+// pane; without it the window is kept as a two-stack queue of panes, which
+// costs about twice as many combines but works for any reduction.
+struct WindowReduction {
+  ReductionFunc add;
+  CombineFunc combine;
+  CombineFunc subtract;
+};
+
+WindowReduction windowCounter();
+WindowReduction windowSumInts(string searchKey);
+// Not invertible, so it takes the two-stack path.
+WindowReduction windowMaxInts(string searchKey);
+
+// Hopping-window groupby: the epochCreator and groupbyCreator pair over
+// windows of windowWidth seconds that start every slide seconds, without
+// re-reducing the tuples each window shares with the one before. The
+// window is split into panes of one slide each, and every tuple is reduced
+// into the current pane only. At each slide boundary the pane is folded
+// into the window, the pane that has fallen out of it is dropped, and the
+// window is emitted as groupbyCreator would emit it: one tuple per group
+// with outKey set, followed by a reset, both carrying {keyOut: slide
+// number}.
+//
+// windowWidth must be a whole number of slides. The windows of the first
+// few slides are shorter than windowWidth, since there is no earlier
+// traffic. A reset from upstream closes the current slide and starts over,
+// as epochCreator does.
+OpCreator slidingGroupbyCreator(double windowWidth, double slide,
+                                string keyOut, KeyProjector groupby,
+                                WindowReduction reduct, string outKey);
+
+#endif  // SLIDING_WINDOW_H
@@ -0,0 +1,121 @@
+#include "spill.hpp"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// Tells apart the run files of one process.
+atomic<uint64_t> runFiles{0};
+
+}  // namespace
+
+GroupSpill::GroupSpill(string dir) : dir(move(dir)) {
+  if (this->dir.empty()) {
+    const char* tmp = getenv("TMPDIR");
+    this->dir = tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+  }
+}
+
+GroupSpill::~GroupSpill() { clear(); }
+
+size_t GroupSpill::coldest() const {
+  size_t best = kSpillPartitions;
+  for (size_t i = 0; i < kSpillPartitions; i++) {
+    if (!partitions[i].spilled &&
+        (best == kSpillPartitions ||
+         partitions[i].hits < partitions[best].hits)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void GroupSpill::markSpilled(Partition& partition) {
+  if (!partition.spilled) {
+    partition.spilled = true;
+    spilledCount++;
+  }
+}
+
+void GroupSpill::append(size_t partition, const Headers& headers) {
+  Partition& part = partitions[partition];
+  part.pending += 'T';
+  StateWriter(part.pending).putHeaders(headers);
+  if (part.pending.size() >= kSpillChunkBytes) {
+    flush(part);
+  }
+}
+
+void GroupSpill::flush(Partition& partition) {
+  if (partition.pending.empty()) {
+    return;
+  }
+  if (!run) {
+    path = dir + "/functionalist-spill-" + to_string(getpid()) + "-" +
+           to_string(runFiles.fetch_add(1, memory_order_relaxed));
+    AsyncIoOptions options;
+    options.bufferBytes = kSpillChunkBytes;
+    run = make_unique<AsyncFileWriter>(path, options);
+  }
+  partition.chunks.emplace_back(runBytes, partition.pending.size());
+  const char* data = partition.pending.data();
+  size_t left = partition.pending.size();
+  while (left > 0) {
+    size_t n = min(left, run->capacity() - filled);
+    memcpy(run->buffer() + filled, data, n);
+    filled += n;
+    data += n;
+    left -= n;
+    if (filled == run->capacity()) {
+      run->write(filled);
+      filled = 0;
+    }
+  }
+  runBytes += partition.pending.size();
+  written += partition.pending.size();
+  partition.pending.clear();
+}
+
+bool GroupSpill::finish() {
+  for (Partition& part : partitions) {
+    flush(part);
+  }
+  if (!run) {
+    return false;
+  }
+  if (filled > 0) {
+    run->write(filled);
+    filled = 0;
+  }
+  run->sync();
+  return true;
+}
+
+void GroupSpill::clear() {
+  run.reset();
+  if (!path.empty()) {
+    unlink(path.c_str());
+    path.clear();
+  }
+  for (Partition& part : partitions) {
+    part = Partition();
+  }
+  spilledCount = 0;
+  runBytes = 0;
+  filled = 0;
+}
+
+const vector<FieldId>& GroupSpill::sameFields() {
+  static const vector<FieldId> fields = [] {
+    vector<FieldId> out(kMaxFields);
+    for (size_t i = 0; i < kMaxFields; i++) {
+      out[i] = static_cast<FieldId>(i);
+    }
+    return out;
+  }();
+  return fields;
+}
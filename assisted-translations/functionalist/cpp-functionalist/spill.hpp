@@ -0,0 +1,181 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "async_io.hpp"
+#include "checkpoint.hpp"
+#include "flat_table.hpp"
+#include "mapped_file.hpp"
+#include "packed_key.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Spilling for the tables of groupby and distinct: a table is split by hash
+// into kSpillPartitions partitions, and once its budget runs short its
+// coldest partitions are written out to a run file, groups and all, with
+// the partition's later tuples appended behind them instead of being
+// folded in memory. At reset the spilled partitions are read back one at a
+// time through a mapping of the run file and folded there, so that at most
+// one of them is in memory at once. Folding a partition's tuples onto the
+// groups it had when spilled is what folding them in memory would have
+// done, so any reduction comes out exact.
+//
+// Partitions buffer their records in memory and go to the run file in
+// chunks of kSpillChunkBytes, through an AsyncFileWriter, so the file is
+// written front to back in large writes. A record is a kind byte, then:
+//
+//   'G'  a group as it was spilled: its key and value, laid out with
+//        StateWriter.
+//   'T'  a tuple of the partition seen after it was spilled, with
+//        putHeaders.
+//
+// Field ids are written as they are in this process; run files are not
+// meant to outlive it, and are removed once read back or dropped. For the
+// same reason checkpoints hold only the resident partitions of a table.
+
+constexpr size_t kSpillPartitions = 16;
+constexpr size_t kSpillChunkBytes = size_t{1} << 16;
+
+class GroupSpill {
+ public:
+  // Run files go in dir, or in $TMPDIR or /tmp when dir is empty. Nothing
+  // is created until the first partition is spilled.
+  explicit GroupSpill(string dir);
+  ~GroupSpill();
+
+  GroupSpill(const GroupSpill&) = delete;
+  GroupSpill& operator=(const GroupSpill&) = delete;
+
+  // The partition of a key, from its PackedKeyHash.
+  static size_t partitionOf(size_t hash) {
+    return static_cast<size_t>((hash >> 20) & (kSpillPartitions - 1));
+  }
+
+  bool spilled(size_t partition) const {
+    return partitions[partition].spilled;
+  }
+  bool any() const { return spilledCount != 0; }
+  // Counts a tuple of partition toward its heat for the epoch.
+  void touch(size_t partition) { partitions[partition].hits++; }
+  // The resident partition with the fewest tuples this epoch, or
+  // kSpillPartitions once every one is spilled.
+  size_t coldest() const;
+
+  // Writes the groups of partition out of table, erases them from it and
+  // marks the partition spilled. Returns the groups written.
+  template <typename V>
+  size_t spill(size_t partition,
+               FlatTable<PackedKey, V, PackedKeyHash>& table);
+  // Appends a tuple of a spilled partition.
+  void append(size_t partition, const Headers& headers);
+
+  // Reads back each spilled partition in turn, calling group(key, value)
+  // for the groups spilled from it and tuple(headers) for the tuples
+  // appended to it, in the order they were written, then done(). Leaves
+  // every partition resident and the run file removed.
+  template <typename V, typename G, typename T, typename D>
+  void merge(G group, T tuple, D done);
+  // Drops whatever was spilled, as after a merge.
+  void clear();
+
+  // Bytes written to run files over the spill's life.
+  uint64_t bytesWritten() const { return written; }
+
+ private:
+  struct Partition {
+    bool spilled = false;
+    uint64_t hits = 0;
+    // Records not yet in the run file.
+    string pending;
+    // Where the partition's chunks lie in the run file, in order.
+    vector<pair<uint64_t, size_t>> chunks;
+  };
+
+  string dir;
+  string path;
+  array<Partition, kSpillPartitions> partitions;
+  size_t spilledCount = 0;
+  unique_ptr<AsyncFileWriter> run;
+  // Bytes of the run file queued or in run's current buffer.
+  uint64_t runBytes = 0;
+  size_t filled = 0;
+  uint64_t written = 0;
+
+  // Moves partition's pending records to the run file as one chunk.
+  void flush(Partition& partition);
+  // Writes out everything pending and waits for it; false if the run file
+  // was never made, all spilled partitions having stayed empty.
+  bool finish();
+  void markSpilled(Partition& partition);
+  // StateReader field ids, as written.
+  static const vector<FieldId>& sameFields();
+};
+
+template <typename V>
+size_t GroupSpill::spill(size_t partition,
+                         FlatTable<PackedKey, V, PackedKeyHash>& table) {
+  Partition& part = partitions[partition];
+  markSpilled(part);
+  vector<PackedKey> keys;
+  StateWriter out(part.pending);
+  PackedKeyHash hasher;
+  table.forEach([&](const PackedKey& key, const V& val) {
+    if (partitionOf(hasher(key)) != partition) {
+      return;
+    }
+    part.pending += 'G';
+    out.putKey(key);
+    out.put(val);
+    keys.push_back(key);
+    if (part.pending.size() >= kSpillChunkBytes) {
+      flush(part);
+    }
+  });
+  for (const PackedKey& key : keys) {
+    table.erase(key);
+  }
+  return keys.size();
+}
+
+template <typename V, typename G, typename T, typename D>
+void GroupSpill::merge(G group, T tuple, D done) {
+  if (spilledCount == 0) {
+    clear();
+    return;
+  }
+  optional<MappedFile> file;
+  if (finish()) {
+    file.emplace(path);
+  }
+  for (Partition& part : partitions) {
+    if (!part.spilled) {
+      continue;
+    }
+    for (const auto& [offset, length] : part.chunks) {
+      const char* begin = file->data() + offset;
+      StateReader in(begin, begin + length, sameFields());
+      while (!in.done()) {
+        char kind;
+        in.bytes(&kind, 1);
+        if (kind == 'G') {
+          PackedKey key = in.key();
+          group(key, in.get<V>());
+        } else {
+          tuple(in.headers());
+        }
+      }
+    }
+    done();
+  }
+  clear();
+}
+
+#endif  // SPILL_H
@@ -0,0 +1,460 @@
+// Benchmarks for the builtin operators and the queries in main.cpp.
+//
+// The micro-benchmarks push one tuple per iteration through a single
+// operator, closing an epoch every kMicroEpochTuples tuples, at the key
+// cardinality given as the argument. The macro-benchmarks run each query
+// over a trace of tuples per iteration and report Mpps, time per tuple and the
+// peak RSS of the process so far. The trace is synthetic Zipfian traffic
+// unless STREAM_BENCH_PCAP names a capture, whose first STREAM_BENCH_TUPLES
+// IPv4 packets (default 65536) are then used as well.
+
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+#include "main.h"
+#include "packet.hpp"
+
+using namespace std;
+
+namespace {
+
+constexpr size_t kMicroEpochTuples = 1 << 16;
+constexpr size_t kDefaultTraceTuples = 1 << 16;
+// Synthetic traffic runs at this many packets per second of capture time,
+// so that a trace of the default length spans four one-second epochs.
+constexpr double kSyntheticRate = 16384.0;
+
+// Ranks in [0, n) with P(k) proportional to 1 / (k + 1)^s.
+class Zipf {
+ public:
+  Zipf(size_t n, double s) : cdf(n) {
+    double sum = 0.0;
+    for (size_t k = 0; k < n; k++) {
+      sum += 1.0 / pow(static_cast<double>(k + 1), s);
+      cdf[k] = sum;
+    }
+    for (double& c : cdf) {
+      c /= sum;
+    }
+  }
+
+  template <typename Rng>
+  uint32_t operator()(Rng& rng) {
+    double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+    auto it = lower_bound(cdf.begin(), cdf.end(), u);
+    return static_cast<uint32_t>(min<size_t>(it - cdf.begin(), cdf.size() - 1));
+  }
+
+ private:
+  vector<double> cdf;
+};
+
+size_t traceTuples() {
+  const char* env = getenv("STREAM_BENCH_TUPLES");
+  return env != nullptr ? strtoull(env, nullptr, 10) : kDefaultTraceTuples;
+}
+
+double peakRssMiB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss) / 1024.0;
+}
+
+// A trace, with the original capture times kept apart so that every pass
+// over it can be shifted to follow the one before.
+struct Trace {
+  vector<Headers> tuples;
+  vector<double> times;
+  double span = 0.0;
+};
+
+Trace syntheticTrace(size_t n) {
+  mt19937_64 rng(42);
+  Zipf srcs(65536, 1.1);
+  Zipf dsts(4096, 1.1);
+  Zipf ports(1024, 1.2);
+  discrete_distribution<int> flags({30, 10, 50, 5, 5});
+  const int64_t flagValues[] = {2, 18, 16, 17, 4};
+
+  Trace trace;
+  for (size_t i = 0; i < n; i++) {
+    Headers tup = syntheticTuple(0);
+    bool tcp = rng() % 10 != 0;
+    tup[Field::Ipv4Proto] = OpResult::Int(tcp ? 6 : 17);
+    tup[Field::Ipv4Hlen] = OpResult::Int(20);
+    tup[Field::Ipv4Len] = OpResult::Int(40 + static_cast<int64_t>(rng() % 1460));
+    tup[Field::Ipv4Src] = OpResult::IPv4(IPv4Address(0x0a000000 + srcs(rng)));
+    tup[Field::Ipv4Dst] = OpResult::IPv4(IPv4Address(0xc0a80000 + dsts(rng)));
+    tup[Field::L4Sport] = OpResult::Int(1024 + static_cast<int64_t>(rng() % 60000));
+    tup[Field::L4Dport] = OpResult::Int(ports(rng));
+    tup[Field::L4Flags] = OpResult::Int(tcp ? flagValues[flags(rng)] : 0);
+    trace.tuples.push_back(tup);
+    trace.times.push_back(static_cast<double>(i) / kSyntheticRate);
+  }
+  trace.span = static_cast<double>(n) / kSyntheticRate;
+  return trace;
+}
+
+Trace pcapTrace(const string& filename, size_t n) {
+  PcapReader reader(filename);
+  Batch batch;
+  startPacketBatch(batch, n);
+  PacketView packet;
+  while (batch.rows < n && reader.next(packet)) {
+    appendPacket(batch, packet.data, packet.caplen, packet.time);
+  }
+
+  Trace trace;
+  for (uint32_t row = 0; row < batch.rows; row++) {
+    trace.tuples.push_back(batch.row(row));
+    trace.times.push_back(batch.time[row]);
+  }
+  if (!trace.times.empty()) {
+    // One mean packet gap between the end of a pass and the next.
+    double first = trace.times.front();
+    double last = trace.times.back();
+    trace.span = (last - first) * (1.0 + 1.0 / static_cast<double>(batch.rows));
+    for (double& time : trace.times) {
+      time -= first;
+    }
+  }
+  return trace;
+}
+
+Operator countingSink(uint64_t& count) {
+  return Operator([&count](const Headers&) { count++; },
+                  [](const Headers&) {});
+}
+
+// Queries, each as the operators to feed every tuple of a trace to.
+using QueryFactory = function<vector<Operator>(Operator)>;
+
+QueryFactory single(function<Operator(Operator)> query) {
+  return [query](Operator sink) { return vector<Operator>{query(sink)}; };
+}
+
+QueryFactory batched(function<BatchOperator(Operator)> query) {
+  return [query](Operator sink) {
+    return vector<Operator>{batchTuples(query(sink))};
+  };
+}
+
+const vector<pair<string, QueryFactory>>& allQueries() {
+  static const vector<pair<string, QueryFactory>> queries = {
+      {"ident", single(ident)},
+      {"countPkts", single(countPkts)},
+      {"pktsPerSrcDist", single(pktsPerSrcDist)},
+      {"distinctSrcs", single(distinctSrcs)},
+      {"tcpNewCons", single(tcpNewCons)},
+      {"sshBruteForce", single(sshBruteForce)},
+      {"superSpreader", single(superSpreader)},
+      {"portScan", single(portScan)},
+      {"ddos", single(ddos)},
+      {"synFloodSonata", synFloodSonata},
+      {"completedFlows", completedFlows},
+      {"slowloris", slowloris},
+      {"joinTest", joinTest},
+      {"sonataSuite", sonataSuite},
+      {"sonataSuitePlanned",
+       [](Operator sink) {
+         return vector<Operator>{sonataPlan(sink).compile()};
+       }},
+      {"tcpNewConsSpec", single(tcpNewConsSpec)},
+      {"synFloodSpec", single(synFloodSpec)},
+      {"q3", single(q3)},
+      {"q4", single(q4)},
+      {"distinctSrcsApprox", single(distinctSrcsApprox)},
+      {"tcpNewConsApprox", single(tcpNewConsApprox)},
+      {"portScanApprox", single(portScanApprox)},
+      {"ddosApprox", single(ddosApprox)},
+      {"tcpNewConsBatch", batched(tcpNewConsBatch)},
+      {"portScanBatch", batched(portScanBatch)},
+      {"ddosBatch", batched(ddosBatch)},
+      {"tcpNewConsPipeline",
+       single([](Operator sink) {
+         return pipeline::toOperator(tcpNewConsPipeline(sink));
+       })},
+      {"portScanPipeline",
+       single([](Operator sink) {
+         return pipeline::toOperator(portScanPipeline(sink));
+       })},
+      {"ddosPipeline",
+       single([](Operator sink) {
+         return pipeline::toOperator(ddosPipeline(sink));
+       })},
+      {"portScanSharded/4",
+       single([](Operator sink) { return portScanSharded(sink, 4); })},
+      {"ddosSharded/4",
+       single([](Operator sink) { return ddosSharded(sink, 4); })},
+      {"slowlorisPipelined",
+       single([](Operator sink) { return slowlorisPipelined(sink); })},
+      {"ddosAsync",
+       single([](Operator sink) { return ddosAsync(sink); })},
+      {"ddosSliding/10s/1s",
+       single([](Operator sink) { return ddosSliding(sink); })},
+      {"slowlorisSliding/10s/1s",
+       single([](Operator sink) { return slowlorisSliding(sink); })},
+  };
+  return queries;
+}
+
+void runQuery(benchmark::State& state, const QueryFactory& query,
+              Trace& trace) {
+  if (trace.tuples.empty()) {
+    state.SkipWithError("empty trace");
+    return;
+  }
+  uint64_t results = 0;
+  try {
+    vector<Operator> ops = query(countingSink(results));
+    double offset = 0.0;
+    for (auto _ : state) {
+      state.PauseTiming();
+      for (size_t i = 0; i < trace.tuples.size(); i++) {
+        trace.tuples[i][Field::Time] = OpResult::Float(trace.times[i] + offset);
+      }
+      offset += trace.span;
+      state.ResumeTiming();
+
+      for (const Headers& tup : trace.tuples) {
+        for (const Operator& op : ops) {
+          op.next(tup);
+        }
+      }
+    }
+    // The clock stops with tuples possibly still queued inside threaded
+    // queries; they are drained as the operators go away here.
+  } catch (const exception& e) {
+    state.SkipWithError(e.what());
+    return;
+  }
+
+  double n = static_cast<double>(trace.tuples.size());
+  state.SetItemsProcessed(state.iterations() *
+                          static_cast<int64_t>(trace.tuples.size()));
+  state.counters["Mpps"] = benchmark::Counter(
+      n * 1e-6, benchmark::Counter::kIsIterationInvariantRate);
+  // Seconds per tuple, printed with an SI prefix.
+  state.counters["time_per_tuple"] = benchmark::Counter(
+      n, benchmark::Counter::kIsIterationInvariantRate |
+             benchmark::Counter::kInvert);
+  state.counters["peak_rss_MiB"] = peakRssMiB();
+  state.counters["results"] = static_cast<double>(results);
+}
+
+// A reusable tuple whose source address takes one of cardinality values,
+// drawn in a fixed random order.
+struct KeyedTuples {
+  Headers tup = syntheticTuple(0);
+  vector<uint32_t> keys;
+  size_t next = 0;
+
+  explicit KeyedTuples(size_t cardinality) : keys(kMicroEpochTuples) {
+    mt19937 rng(7);
+    for (uint32_t& key : keys) {
+      key = static_cast<uint32_t>(rng() % cardinality);
+    }
+  }
+
+  const Headers& advance() {
+    tup[Field::Ipv4Src] = OpResult::IPv4(IPv4Address(keys[next]));
+    next = (next + 1) % keys.size();
+    return tup;
+  }
+};
+
+// Feeds op one tuple per iteration, closing an epoch every
+// kMicroEpochTuples tuples.
+void runOperator(benchmark::State& state, const Operator& op,
+                 KeyedTuples& tuples) {
+  Headers epoch = singleton("eid", OpResult::Int(0));
+  size_t n = 0;
+  for (auto _ : state) {
+    op.next(tuples.advance());
+    if (++n == kMicroEpochTuples) {
+      op.reset(epoch);
+      n = 0;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+Headers bySrc(const Headers& headers) {
+  return filterGroups({"ipv4.src"}, headers);
+}
+
+void BM_Filter(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op = __(filterCreator([](const Headers& headers) {
+                     return headers.at(Field::Ipv4Src).asIPv4().getPart(3) % 2 == 0;
+                   }),
+                   countingSink(results));
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_Filter)->Arg(1 << 10);
+
+void BM_Map(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op = __(mapCreator(bySrc), countingSink(results));
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_Map)->Arg(1 << 10);
+
+void BM_Groupby(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op =
+      __(groupbyCreator({"ipv4.src"}, counter, "n"), countingSink(results));
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_Groupby)->RangeMultiplier(16)->Range(16, 1 << 16);
+
+// slowloris's n_bytes stage, through a ReductionFunc and a typed reducer.
+void BM_GroupbySumInts(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op = __(groupbyCreator({"ipv4.src"},
+                                  [](OpResult val, const Headers& headers) {
+                                    return sumInts("ipv4.len", val, headers);
+                                  },
+                                  "n_bytes"),
+                   countingSink(results));
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_GroupbySumInts)->RangeMultiplier(16)->Range(16, 1 << 16);
+
+void BM_TypedGroupbySumInts(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op = __(typedGroupbyCreator({"ipv4.src"},
+                                       SumIntsReducer("ipv4.len"), "n_bytes"),
+                   countingSink(results));
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_TypedGroupbySumInts)->RangeMultiplier(16)->Range(16, 1 << 16);
+
+void BM_Distinct(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op = __(distinctCreator({"ipv4.src"}), countingSink(results));
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_Distinct)->RangeMultiplier(16)->Range(16, 1 << 16);
+
+// Both sides see the same keys, the right side one tuple behind the left,
+// so most tuples on the right find a match.
+void BM_Join(benchmark::State& state) {
+  uint64_t results = 0;
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  KeyExtractor extract = [](const Headers& headers) {
+    return make_pair(bySrc(headers), filterGroups({"ipv4.len"}, headers));
+  };
+  auto [left, right] = ___(join(extract, extract), countingSink(results));
+  FieldId eidId = internField("eid");
+  tuples.tup[eidId] = OpResult::Int(0);
+
+  int64_t eid = 0;
+  size_t n = 0;
+  for (auto _ : state) {
+    const Headers& tup = tuples.advance();
+    left.next(tup);
+    right.next(tup);
+    if (++n == kMicroEpochTuples) {
+      n = 0;
+      tuples.tup[eidId] = OpResult::Int(++eid);
+      Headers epoch = singleton("eid", OpResult::Int(eid));
+      left.reset(epoch);
+      right.reset(epoch);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_Join)->RangeMultiplier(16)->Range(16, 1 << 16);
+
+// The sinks format every field of each packet tuple, written to /dev/null.
+void BM_CSVSink(benchmark::State& state) {
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  ofstream devNull("/dev/null");
+  Operator op = dumpAsCSV(nullopt, true, devNull);
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_CSVSink)->Arg(1 << 10);
+
+void BM_BinarySink(benchmark::State& state) {
+  KeyedTuples tuples(static_cast<size_t>(state.range(0)));
+  Operator op = dumpAsBinary("/dev/null");
+  runOperator(state, op, tuples);
+}
+BENCHMARK(BM_BinarySink)->Arg(1 << 10);
+
+// Two tuples of range(0) packet fields each, half of which overlap. Only
+// fields of the schema are used, so that no names are added to the 64-slot
+// field registry.
+void BM_UnionHeaders(benchmark::State& state) {
+  size_t fields = static_cast<size_t>(state.range(0));
+  Headers packet = syntheticTuple(0);
+  vector<FieldId> ids;
+  for (auto it = packet.begin(); it != packet.end(); ++it) {
+    ids.push_back(it.id());
+  }
+  Headers lhs;
+  Headers rhs;
+  for (size_t i = 0; i < fields; i++) {
+    lhs[ids[i % ids.size()]] = packet.at(ids[i % ids.size()]);
+    rhs[ids[(i + fields / 2) % ids.size()]] = OpResult::Int(0);
+  }
+  for (auto _ : state) {
+    Headers out = unionHeaders(lhs, rhs);
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UnionHeaders)->Arg(2)->Arg(6)->Arg(12);
+
+void registerMacroBenchmarks() {
+  static Trace synthetic = syntheticTrace(traceTuples());
+  for (const auto& [name, query] : allQueries()) {
+    benchmark::RegisterBenchmark(
+        ("BM_Query/zipf/" + name).c_str(),
+        [query = query](benchmark::State& state) {
+          runQuery(state, query, synthetic);
+        })
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+  }
+
+  const char* pcap = getenv("STREAM_BENCH_PCAP");
+  if (pcap == nullptr) {
+    return;
+  }
+  static Trace recorded = pcapTrace(pcap, traceTuples());
+  for (const auto& [name, query] : allQueries()) {
+    benchmark::RegisterBenchmark(
+        ("BM_Query/pcap/" + name).c_str(),
+        [query = query](benchmark::State& state) {
+          runQuery(state, query, recorded);
+        })
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  registerMacroBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include "tcp_flags.hpp"
+
+#include <cstddef>
+
+namespace {
+
+constexpr const char* kFlagName[8] = {"FIN", "SYN", "RST", "PSH",
+                                      "ACK", "URG", "ECE", "CWR"};
+
+// Eight names of three letters and seven separators.
+constexpr size_t kMaxNamesLength = 8 * 3 + 7;
+
+struct FlagNameTable {
+  char text[256][kMaxNamesLength];
+  uint8_t length[256];
+};
+
+constexpr FlagNameTable makeFlagNames() {
+  FlagNameTable table{};
+  for (size_t flags = 0; flags < 256; flags++) {
+    size_t at = 0;
+    for (size_t bit = 0; bit < 8; bit++) {
+      if ((flags & (size_t{1} << bit)) == 0) {
+        continue;
+      }
+      if (at > 0) {
+        table.text[flags][at++] = '|';
+      }
+      for (size_t i = 0; i < 3; i++) {
+        table.text[flags][at++] = kFlagName[bit][i];
+      }
+    }
+    table.length[flags] = static_cast<uint8_t>(at);
+  }
+  return table;
+}
+
+constexpr FlagNameTable kFlagNames = makeFlagNames();
+
+}  // namespace
+
+string_view tcpFlagNames(TcpFlags flags) {
+  return string_view(kFlagNames.text[flags.bits()],
+                     kFlagNames.length[flags.bits()]);
+}
@@ -0,0 +1,103 @@
+#ifndef TCP_FLAGS_H
+#define TCP_FLAGS_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+using namespace std;
+
+// The TCP flags byte, as the l4.flags field holds it, and tests on it built
+// at compile time. Every test, however it is put together, is one
+// (flags & mask) == value, so a tuple filter costs an and and a compare and
+// a column filter is a single maskEq kernel (see ColumnPredicate::tcpFlags).
+
+class TcpFlags {
+ public:
+  constexpr TcpFlags() = default;
+  constexpr explicit TcpFlags(uint8_t bits) : flagBits(bits) {}
+
+  constexpr uint8_t bits() const { return flagBits; }
+  // Whether every flag of flags is set.
+  constexpr bool has(TcpFlags flags) const {
+    return (flagBits & flags.flagBits) == flags.flagBits;
+  }
+  // Whether any flag of flags is set.
+  constexpr bool any(TcpFlags flags) const {
+    return (flagBits & flags.flagBits) != 0;
+  }
+
+  constexpr TcpFlags operator|(TcpFlags other) const {
+    return TcpFlags(static_cast<uint8_t>(flagBits | other.flagBits));
+  }
+  constexpr bool operator==(TcpFlags other) const {
+    return flagBits == other.flagBits;
+  }
+  constexpr bool operator!=(TcpFlags other) const {
+    return flagBits != other.flagBits;
+  }
+
+ private:
+  uint8_t flagBits = 0;
+};
+
+// A test of the flags byte: (flags & mask) == value. Tests combine with &&
+// into one test; a test that no flags byte can pass has a mask of 0 and a
+// value of 1.
+struct TcpFlagTest {
+  uint8_t mask = 0;
+  uint8_t value = 0;
+
+  constexpr bool operator()(TcpFlags flags) const {
+    return (flags.bits() & mask) == value;
+  }
+  // For the l4.flags field as getMappedInt gives it.
+  constexpr bool operator()(int64_t flags) const {
+    return (static_cast<uint64_t>(flags) & mask) == value;
+  }
+
+  constexpr TcpFlagTest operator&&(TcpFlagTest other) const {
+    if (((mask & other.mask) & (value ^ other.value)) != 0 ||
+        (mask == 0 && value != 0) || (other.mask == 0 && other.value != 0)) {
+      return {0, 1};
+    }
+    return {static_cast<uint8_t>(mask | other.mask),
+            static_cast<uint8_t>(value | other.value)};
+  }
+  // Only a test of one flag has a negation of this form; negating anything
+  // else throws, which fails the build when the test is constexpr.
+  constexpr TcpFlagTest operator!() const {
+    if (mask == 0 || (mask & (mask - 1)) != 0) {
+      throw invalid_argument("Error: only a test of one TCP flag negates");
+    }
+    return {mask, static_cast<uint8_t>(value ^ mask)};
+  }
+};
+
+namespace tcp {
+
+constexpr TcpFlags FIN{1 << 0};
+constexpr TcpFlags SYN{1 << 1};
+constexpr TcpFlags RST{1 << 2};
+constexpr TcpFlags PSH{1 << 3};
+constexpr TcpFlags ACK{1 << 4};
+constexpr TcpFlags URG{1 << 5};
+constexpr TcpFlags ECE{1 << 6};
+constexpr TcpFlags CWR{1 << 7};
+
+// Every flag of flags set, whatever the others.
+constexpr TcpFlagTest has(TcpFlags flags) {
+  return {flags.bits(), flags.bits()};
+}
+// No flag of flags set.
+constexpr TcpFlagTest lacks(TcpFlags flags) { return {flags.bits(), 0}; }
+// Exactly flags set, as l4.flags == flags.bits() tests.
+constexpr TcpFlagTest is(TcpFlags flags) { return {0xff, flags.bits()}; }
+
+}  // namespace tcp
+
+// The names of the flags set, lowest bit first and joined by '|', e.g.
+// "SYN|ACK"; empty when none is. Views a table built at compile time.
+string_view tcpFlagNames(TcpFlags flags);
+
+#endif  // TCP_FLAGS_H
@@ -0,0 +1,225 @@
+#include "topology.hpp"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+constexpr char kNodeDir[] = "/sys/devices/system/node/";
+constexpr size_t kMaskWords = 1024 / (8 * sizeof(unsigned long));
+
+// A kernel list such as "0-3,8,10-11".
+vector<int> parseList(const string& text) {
+  vector<int> out;
+  stringstream in(text);
+  string range;
+  while (getline(in, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    size_t dash = range.find('-');
+    int first = stoi(range.substr(0, dash));
+    int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+    for (int i = first; i <= last; i++) {
+      out.push_back(i);
+    }
+  }
+  return out;
+}
+
+string readLine(const string& path) {
+  ifstream in(path);
+  string line;
+  getline(in, line);
+  return line;
+}
+
+CpuTopology readTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  CpuTopology topology;
+  for (int node : parseList(readLine(string(kNodeDir) + "online"))) {
+    if (static_cast<size_t>(node) >= topology.nodeCpus.size()) {
+      topology.nodeCpus.resize(node + 1);
+    }
+    string cpulist =
+        readLine(string(kNodeDir) + "node" + to_string(node) + "/cpulist");
+    for (int cpu : parseList(cpulist)) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        topology.nodeCpus[node].push_back(cpu);
+      }
+    }
+  }
+  if (topology.nodeCpus.empty()) {
+    topology.nodeCpus.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        topology.nodeCpus[0].push_back(cpu);
+      }
+    }
+  }
+  return topology;
+}
+
+long setMempolicy(int mode, const unsigned long* mask, unsigned long maxNode) {
+  return syscall(SYS_set_mempolicy, mode, mask, maxNode);
+}
+
+// A node mask holding node, as the mempolicy calls take it.
+vector<unsigned long> nodeMask(int node) {
+  vector<unsigned long> mask(node / (8 * sizeof(unsigned long)) + 1, 0);
+  mask[node / (8 * sizeof(unsigned long))] |=
+      1UL << (node % (8 * sizeof(unsigned long)));
+  return mask;
+}
+
+void preferNode(int node) {
+  if (node < 0 || cpuTopology().nodes() < 2) {
+    return;
+  }
+  vector<unsigned long> mask = nodeMask(node);
+  // Best effort: a kernel without NUMA support leaves placement alone.
+  setMempolicy(MPOL_PREFERRED, mask.data(), mask.size() * 8 * sizeof(long));
+}
+
+}  // namespace
+
+int CpuTopology::nodeOf(int cpu) const {
+  for (size_t node = 0; node < nodeCpus.size(); node++) {
+    for (int c : nodeCpus[node]) {
+      if (c == cpu) {
+        return static_cast<int>(node);
+      }
+    }
+  }
+  return -1;
+}
+
+const CpuTopology& cpuTopology() {
+  static const CpuTopology topology = readTopology();
+  return topology;
+}
+
+int interfaceNode(const string& interface) {
+  string line =
+      readLine("/sys/class/net/" + interface + "/device/numa_node");
+  if (line.empty()) {
+    return -1;
+  }
+  int node = stoi(line);
+  return node >= 0 && static_cast<size_t>(node) < cpuTopology().nodes()
+             ? node
+             : -1;
+}
+
+vector<int> placeWorkers(size_t n, int node) {
+  const CpuTopology& topology = cpuTopology();
+  vector<int> order;
+  if (node >= 0 && static_cast<size_t>(node) < topology.nodes()) {
+    order = topology.nodeCpus[node];
+  }
+  for (size_t other = 0; other < topology.nodes(); other++) {
+    if (static_cast<int>(other) != node) {
+      order.insert(order.end(), topology.nodeCpus[other].begin(),
+                   topology.nodeCpus[other].end());
+    }
+  }
+  vector<int> out;
+  for (size_t i = 0; i < n && !order.empty(); i++) {
+    out.push_back(order[i % order.size()]);
+  }
+  return out;
+}
+
+void pinThread(int cpu, const string& what) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (err != 0) {
+    throw runtime_error("Error: could not pin " + what + " to CPU " +
+                        to_string(cpu) + ": " + strerror(err));
+  }
+  preferNode(cpuTopology().nodeOf(cpu));
+}
+
+NodeMemoryScope::NodeMemoryScope(int node) {
+  if (node < 0 || cpuTopology().nodes() < 2) {
+    return;
+  }
+  // Room for every node the kernel could name.
+  oldMask.assign(kMaskWords, 0);
+  if (syscall(SYS_get_mempolicy, &oldMode, oldMask.data(),
+              oldMask.size() * 8 * sizeof(long), nullptr, 0) != 0) {
+    return;
+  }
+  preferNode(node);
+  active = true;
+}
+
+NodeMemoryScope::~NodeMemoryScope() {
+  if (!active) {
+    return;
+  }
+  if (oldMode == MPOL_DEFAULT) {
+    setMempolicy(MPOL_DEFAULT, nullptr, 0);
+  } else {
+    setMempolicy(oldMode, oldMask.data(), oldMask.size() * 8 * sizeof(long));
+  }
+}
+
+vector<NodeAllocStats> nodeAllocStats() {
+  vector<NodeAllocStats> out(cpuTopology().nodes());
+  for (size_t node = 0; node < out.size(); node++) {
+    ifstream in(string(kNodeDir) + "node" + to_string(node) + "/numastat");
+    string key;
+    uint64_t val;
+    while (in >> key >> val) {
+      if (key == "local_node") {
+        out[node].local = val;
+      } else if (key == "other_node") {
+        out[node].remote = val;
+      }
+    }
+  }
+  return out;
+}
+
+OpCreator numaMeterCreator(string name, ofstream outc) {
+  auto shared = make_shared<ofstream>(move(outc));
+
+  return [name, shared](Operator nextOp) {
+    auto sharedNextOp = make_shared<Operator>(nextOp);
+    auto epochCount = make_shared<int>(0);
+    auto last = make_shared<vector<NodeAllocStats>>(nodeAllocStats());
+
+    OpFunc next = [sharedNextOp](const Headers& headers) {
+      sharedNextOp->next(headers);
+    };
+
+    OpFunc reset = [shared, epochCount, name, last,
+                    sharedNextOp](const Headers& headers) {
+      vector<NodeAllocStats> now = nodeAllocStats();
+      for (size_t node = 0; node < now.size(); node++) {
+        *shared << *epochCount << "," << name << "," << node << ","
+                << now[node].local - (*last)[node].local << ","
+                << now[node].remote - (*last)[node].remote << "\n";
+      }
+      *last = move(now);
+      (*epochCount)++;
+      sharedNextOp->reset(headers);
+    };
+
+    return Operator(next, reset);
+  };
+}
@@ -0,0 +1,77 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+using namespace std;
+
+// The NUMA layout of the machine, read from sysfs the first time it is
+// asked for.
+struct CpuTopology {
+  // The CPUs of each node the process may run on, by node id. A machine
+  // whose kernel reports no nodes is one node holding them all.
+  vector<vector<int>> nodeCpus;
+
+  size_t nodes() const { return nodeCpus.size(); }
+  // The node of cpu, or -1 if it is not one the process may run on.
+  int nodeOf(int cpu) const;
+};
+
+const CpuTopology& cpuTopology();
+
+// The node the NIC behind interface is attached to, or -1 if the kernel
+// does not say, as for virtual interfaces.
+int interfaceNode(const string& interface);
+
+// A CPU for each of n workers: the CPUs of node first, when node is not
+// -1, then those of the other nodes in turn, wrapping around once every CPU
+// has a worker.
+vector<int> placeWorkers(size_t n, int node = -1);
+
+// Pins the calling thread to cpu and makes it prefer memory on cpu's node.
+// Throws runtime_error if it cannot be pinned.
+void pinThread(int cpu, const string& what = "thread");
+
+// While alive, makes memory the calling thread touches first prefer node,
+// so that a structure built on one thread for another lands where it will
+// be used. Restores the thread's previous policy when destroyed. Does
+// nothing for node -1 or on a one-node machine.
+class NodeMemoryScope {
+ public:
+  explicit NodeMemoryScope(int node);
+  ~NodeMemoryScope();
+
+  NodeMemoryScope(const NodeMemoryScope&) = delete;
+  NodeMemoryScope& operator=(const NodeMemoryScope&) = delete;
+
+ private:
+  bool active = false;
+  int oldMode = 0;
+  vector<unsigned long> oldMask;
+};
+
+// The kernel's allocation counters for one node, in pages, summed over
+// the whole machine: pages placed on the node for a thread running there,
+// and for a thread running on another node.
+struct NodeAllocStats {
+  uint64_t local = 0;
+  uint64_t remote = 0;
+};
+
+vector<NodeAllocStats> nodeAllocStats();
+
+// Passes everything through, and at each reset writes
+// "epoch,name,node,localPages,remotePages" for every node to outc, with the
+// pages allocated on the node since the previous reset. Remote pages are
+// the ones placed for a thread on another node; the kernel does not count
+// remote accesses, which need hardware counters, so this is a proxy for
+// them, machine-wide.
+OpCreator numaMeterCreator(string name, ofstream outc);
+
+#endif  // TOPOLOGY_H
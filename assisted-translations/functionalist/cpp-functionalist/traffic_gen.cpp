@@ -0,0 +1,422 @@
+#include "traffic_gen.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "packet.hpp"
+#include "ring.hpp"
+#include "tcp_flags.hpp"
+
+namespace {
+
+constexpr uint8_t kProtoTcp = 6;
+constexpr uint8_t kProtoUdp = 17;
+constexpr uint64_t kLocalMac = 0x020000000000ull;
+// Attackers of attack i are numbered from kAttackerBase + (i << 16), in
+// 172.16.0.0/12, apart from the hosts.
+constexpr uint32_t kAttackerBase = 0xAC100000u;
+constexpr size_t kMaxAttacks = 16;
+// Batches a generator thread may have ready before it waits.
+constexpr size_t kTrafficRingDepth = 8;
+
+// Destination ports of background traffic by rank, most used first; ranks
+// past these go to 1024 and up.
+constexpr uint16_t kCommonPorts[] = {443, 80, 53, 22, 123, 25, 8080, 993,
+                                     3389, 445, 110, 143, 5060, 8443};
+constexpr uint32_t kPortRanks = 1024;
+
+// wyrand: one multiply a number, and a full period of 2^64.
+class Rng {
+ public:
+  explicit Rng(uint64_t seed) : state(seed) {}
+
+  uint64_t operator()() {
+    state += 0xa0761d6478bd642full;
+    __uint128_t t = static_cast<__uint128_t>(state) *
+                    (state ^ 0xe7037ed1a0b428dbull);
+    return static_cast<uint64_t>(t >> 64) ^ static_cast<uint64_t>(t);
+  }
+
+ private:
+  uint64_t state;
+};
+
+uint64_t mixSeed(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+// Uniform in [0, n), from the top 32 bits of random.
+uint32_t below(uint64_t random, uint32_t n) {
+  return static_cast<uint32_t>(((random >> 32) * n) >> 32);
+}
+
+uint32_t attackerAddress(size_t attack, uint32_t attacker) {
+  return kAttackerBase + (static_cast<uint32_t>(attack) << 16) +
+         (attacker & 0xffffu);
+}
+
+uint16_t portOfRank(uint32_t rank) {
+  constexpr uint32_t common = sizeof(kCommonPorts) / sizeof(kCommonPorts[0]);
+  return rank < common ? kCommonPorts[rank]
+                       : static_cast<uint16_t>(1024 + rank - common);
+}
+
+// Background TCP segments: mostly data and acks, with the odd handshake and
+// teardown.
+uint8_t backgroundFlags(uint64_t random) {
+  uint32_t pick = static_cast<uint32_t>(random & 0xff);
+  if (pick < 154) {
+    return tcp::ACK.bits();
+  }
+  if (pick < 192) {
+    return (tcp::PSH | tcp::ACK).bits();
+  }
+  if (pick < 218) {
+    return tcp::SYN.bits();
+  }
+  if (pick < 243) {
+    return (tcp::SYN | tcp::ACK).bits();
+  }
+  return (tcp::FIN | tcp::ACK).bits();
+}
+
+struct Row {
+  uint32_t src;
+  uint32_t dst;
+  uint8_t proto;
+  uint16_t sport;
+  uint16_t dport;
+  uint8_t flags;
+  uint16_t len;
+};
+
+Row attackRow(const AttackScenario& attack, size_t which, uint32_t victim,
+              uint64_t packet, Rng& rng) {
+  uint64_t r = rng();
+  uint16_t sport = static_cast<uint16_t>(1024 + below(r, 64512));
+  uint32_t attacker =
+      attackerAddress(which, static_cast<uint32_t>(r) % attack.attackers);
+  switch (attack.kind) {
+    case AttackKind::SynFlood:
+      return {static_cast<uint32_t>(rng()), victim, kProtoTcp, sport, 80,
+              tcp::SYN.bits(), 40};
+    case AttackKind::PortScan:
+      return {attacker, victim, kProtoTcp, sport,
+              static_cast<uint16_t>(1 + packet % 65535), tcp::SYN.bits(), 40};
+    case AttackKind::Slowloris:
+      return {attacker, victim, kProtoTcp,
+              static_cast<uint16_t>(1024 + (r >> 16) % 4096), 80,
+              (tcp::PSH | tcp::ACK).bits(),
+              static_cast<uint16_t>(41 + (r >> 8) % 20)};
+    case AttackKind::SshBruteForce:
+      return {attacker, victim, kProtoTcp, sport, 22,
+              (tcp::PSH | tcp::ACK).bits(), 100};
+    case AttackKind::SuperSpreader:
+      return {attacker, static_cast<uint32_t>(rng()), kProtoTcp, sport, 80,
+              tcp::SYN.bits(), 40};
+  }
+  return {};
+}
+
+TrafficOptions checked(TrafficOptions options) {
+  if (options.hosts == 0 || options.hosts > (1u << 24)) {
+    throw invalid_argument(
+        "Error: generated traffic needs between 1 and 2^24 hosts");
+  }
+  if (!(options.packetsPerSecond > 0.0) || options.batchSize == 0) {
+    throw invalid_argument(
+        "Error: generated traffic needs a positive rate and batch size");
+  }
+  double shares = 0.0;
+  for (const AttackScenario& attack : options.attacks) {
+    if (attack.share < 0.0 || attack.attackers == 0) {
+      throw invalid_argument(
+          "Error: an attack needs a share of at least 0 and an attacker");
+    }
+    shares += attack.share;
+  }
+  if (shares > 1.0 || options.attacks.size() > kMaxAttacks) {
+    throw invalid_argument("Error: generated traffic takes at most " +
+                           to_string(kMaxAttacks) +
+                           " attacks, with shares summing to at most 1");
+  }
+  return options;
+}
+
+int64_t steadyNanos() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+TrafficGenerator::AliasTable::AliasTable(uint32_t n, double skew)
+    : threshold(n), alias(n) {
+  // Vose's construction: scaled probabilities below 1 are topped up from
+  // one above 1, which becomes their alias.
+  vector<double> scaled(n);
+  double sum = 0.0;
+  for (uint32_t k = 0; k < n; k++) {
+    scaled[k] = 1.0 / pow(static_cast<double>(k + 1), skew);
+    sum += scaled[k];
+  }
+  vector<uint32_t> small;
+  vector<uint32_t> large;
+  for (uint32_t k = 0; k < n; k++) {
+    scaled[k] *= static_cast<double>(n) / sum;
+    (scaled[k] < 1.0 ? small : large).push_back(k);
+  }
+  while (!small.empty() && !large.empty()) {
+    uint32_t less = small.back();
+    small.pop_back();
+    uint32_t more = large.back();
+    threshold[less] = static_cast<uint32_t>(scaled[less] * 4294967295.0);
+    alias[less] = more;
+    scaled[more] -= 1.0 - scaled[less];
+    if (scaled[more] < 1.0) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+  for (uint32_t k : small) {
+    threshold[k] = UINT32_MAX;
+    alias[k] = k;
+  }
+  for (uint32_t k : large) {
+    threshold[k] = UINT32_MAX;
+    alias[k] = k;
+  }
+}
+
+uint32_t TrafficGenerator::AliasTable::sample(uint64_t random) const {
+  uint32_t k = below(random, static_cast<uint32_t>(threshold.size()));
+  return static_cast<uint32_t>(random) <= threshold[k] ? k : alias[k];
+}
+
+TrafficGenerator::TrafficGenerator(TrafficOptions options)
+    : config(checked(move(options))),
+      srcs(config.hosts, config.srcSkew),
+      dsts(config.hosts, config.dstSkew),
+      ports(kPortRanks, 1.0) {}
+
+uint32_t TrafficGenerator::hostAddress(uint32_t host) {
+  // An odd multiplier permutes the 24 host bits, so that ranks next to one
+  // another do not get addresses next to one another.
+  return 0x0A000000u | ((host * 0x9E3779B1u) & 0xFFFFFFu);
+}
+
+void TrafficGenerator::fill(Batch& batch, uint64_t index) const {
+  size_t n = config.batchSize;
+  uint64_t first = index * n;
+  Rng rng(mixSeed(config.seed ^ mixSeed(index + 1)));
+
+  // Which attacks run is settled once a batch, at its first packet; each
+  // takes the slice of [0, 2^32) above the previous one's.
+  double start = static_cast<double>(first) / config.packetsPerSecond;
+  uint64_t bounds[kMaxAttacks];
+  size_t running[kMaxAttacks];
+  size_t active = 0;
+  double cumulative = 0.0;
+  for (size_t i = 0; i < config.attacks.size(); i++) {
+    const AttackScenario& attack = config.attacks[i];
+    if (start < attack.start || (attack.end > 0.0 && start >= attack.end)) {
+      continue;
+    }
+    cumulative += attack.share;
+    bounds[active] = static_cast<uint64_t>(cumulative * 4294967296.0);
+    running[active] = i;
+    active++;
+  }
+  uint64_t background = active == 0 ? 0 : bounds[active - 1];
+  uint32_t udp = static_cast<uint32_t>(config.udpShare * 65536.0);
+
+  batch.clear();
+  batch.reserveColumns(kPacketColumns);
+  batch.resize(n);
+  for (size_t row = 0; row < n; row++) {
+    uint64_t packet = first + row;
+    uint64_t pick = rng() & 0xffffffffull;
+    Row out;
+    if (pick < background) {
+      size_t a = 0;
+      while (pick >= bounds[a]) {
+        a++;
+      }
+      const AttackScenario& attack = config.attacks[running[a]];
+      out = attackRow(attack, running[a], hostAddress(attack.victim), packet,
+                      rng);
+    } else {
+      uint64_t r = rng();
+      bool isUdp = (r & 0xffff) < udp;
+      out = {hostAddress(srcs.sample(rng())),
+             hostAddress(dsts.sample(rng())),
+             isUdp ? kProtoUdp : kProtoTcp,
+             static_cast<uint16_t>(1024 + below(r, 64512)),
+             portOfRank(ports.sample(rng())),
+             isUdp ? uint8_t{0} : backgroundFlags(r >> 16),
+             static_cast<uint16_t>(40 + below(rng(), 1461))};
+    }
+
+    batch.time[row] = static_cast<double>(packet) / config.packetsPerSecond;
+    batch.ethSrc[row] = kLocalMac | out.src;
+    batch.ethDst[row] = kLocalMac | out.dst;
+    batch.ethEthertype[row] = 0x0800;
+    batch.ipv4Hlen[row] = 20;
+    batch.ipv4Proto[row] = out.proto;
+    batch.ipv4Len[row] = out.len;
+    batch.ipv4Src[row] = out.src;
+    batch.ipv4Dst[row] = out.dst;
+    batch.l4Sport[row] = out.sport;
+    batch.l4Dport[row] = out.dport;
+    batch.l4Flags[row] = out.flags;
+  }
+}
+
+TrafficStats runTraffic(const TrafficGenerator& generator, BatchOperator& op,
+                        uint64_t packets, size_t numThreads,
+                        const atomic<bool>* stop) {
+  size_t batchSize = generator.options().batchSize;
+  uint64_t batches = (packets + batchSize - 1) / batchSize;
+  auto stopped = [stop]() {
+    return stop != nullptr && stop->load(memory_order_relaxed);
+  };
+  // The last batch is cut short to packets.
+  auto deliver = [&](Batch& batch, uint64_t index) {
+    if (index == batches - 1 && packets % batchSize != 0) {
+      batch.resize(packets % batchSize);
+    }
+    op.next(batch);
+  };
+
+  TrafficStats stats;
+  int64_t began = steadyNanos();
+  uint64_t index = 0;
+  if (numThreads == 0) {
+    Batch batch;
+    for (; index < batches && !stopped(); index++) {
+      generator.fill(batch, index);
+      deliver(batch, index);
+    }
+  } else {
+    // Thread k makes batches k, k + numThreads, ... into ready[k] and takes
+    // spent ones back from spent[k], so that batches are reused.
+    struct Lane {
+      SpscRing<unique_ptr<Batch>> ready{kTrafficRingDepth};
+      SpscRing<unique_ptr<Batch>> spent{kTrafficRingDepth};
+    };
+    vector<unique_ptr<Lane>> lanes;
+    for (size_t k = 0; k < numThreads; k++) {
+      lanes.push_back(make_unique<Lane>());
+    }
+    atomic<bool> done{false};
+    vector<thread> workers;
+    for (size_t k = 0; k < numThreads; k++) {
+      workers.emplace_back([&, k]() {
+        Lane& lane = *lanes[k];
+        Backoff backoff;
+        for (uint64_t i = k; i < batches; i += numThreads) {
+          unique_ptr<Batch> batch;
+          if (!lane.spent.tryPop(batch)) {
+            batch = make_unique<Batch>();
+          }
+          generator.fill(*batch, i);
+          while (!lane.ready.tryPush(move(batch))) {
+            if (done.load(memory_order_relaxed)) {
+              return;
+            }
+            backoff.pause();
+          }
+          backoff.reset();
+        }
+      });
+    }
+    exception_ptr error;
+    try {
+      for (; index < batches && !stopped(); index++) {
+        Lane& lane = *lanes[index % numThreads];
+        unique_ptr<Batch> batch;
+        lane.ready.pop(batch);
+        deliver(*batch, index);
+        lane.spent.tryPush(move(batch));
+      }
+    } catch (...) {
+      error = current_exception();
+    }
+    done.store(true, memory_order_relaxed);
+    for (thread& worker : workers) {
+      worker.join();
+    }
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+  op.reset(Headers());
+  stats.packets = min<uint64_t>(index * batchSize, packets);
+  stats.seconds = static_cast<double>(steadyNanos() - began) * 1e-9;
+  return stats;
+}
+
+BatchSource trafficSource(shared_ptr<const TrafficGenerator> generator,
+                          uint64_t packets) {
+  size_t batchSize = generator->options().batchSize;
+  uint64_t batches = (packets + batchSize - 1) / batchSize;
+  auto batch = make_shared<Batch>();
+  auto index = make_shared<uint64_t>(0);
+  return [generator, packets, batchSize, batches, batch,
+          index](const BatchOperator& op) {
+    if (*index == batches) {
+      op.reset(Headers());
+      return false;
+    }
+    generator->fill(*batch, *index);
+    if (*index == batches - 1 && packets % batchSize != 0) {
+      batch->resize(packets % batchSize);
+    }
+    (*index)++;
+    op.next(*batch);
+    return true;
+  };
+}
+
+TrafficStats runTrafficParallel(const TrafficGenerator& generator,
+                                vector<BatchOperator>& ops,
+                                uint64_t packets) {
+  size_t batchSize = generator.options().batchSize;
+  uint64_t batches = (packets + batchSize - 1) / batchSize;
+  size_t numOps = ops.size();
+
+  int64_t began = steadyNanos();
+  vector<thread> workers;
+  for (size_t k = 0; k < numOps; k++) {
+    workers.emplace_back([&, k]() {
+      Batch batch;
+      for (uint64_t i = k; i < batches; i += numOps) {
+        generator.fill(batch, i);
+        if (i == batches - 1 && packets % batchSize != 0) {
+          batch.resize(packets % batchSize);
+        }
+        ops[k].next(batch);
+      }
+      ops[k].reset(Headers());
+    });
+  }
+  for (thread& worker : workers) {
+    worker.join();
+  }
+
+  TrafficStats stats;
+  stats.packets = packets;
+  stats.seconds = static_cast<double>(steadyNanos() - began) * 1e-9;
+  return stats;
+}
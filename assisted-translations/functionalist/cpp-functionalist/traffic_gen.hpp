@@ -0,0 +1,130 @@
+#ifndef TRAFFIC_GEN_H
+#define TRAFFIC_GEN_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "batch.hpp"
+#include "cooperative.hpp"
+
+using namespace std;
+
+// Synthetic packet traffic for load tests: Zipfian background traffic
+// between a population of hosts, with attacks of the kinds the Sonata
+// queries detect mixed in. Packets are written straight into the typed
+// columns of batches, as a capture would decode them, so that a query can
+// be driven past its saturation point without a NIC or a capture file.
+
+enum class AttackKind {
+  // Spoofed sources sending SYNs to one victim's port 80: tcpNewCons,
+  // synFloodSonata and ddos.
+  SynFlood,
+  // One attacker sending SYNs to every port of a victim in turn: portScan.
+  PortScan,
+  // A few attackers holding many connections to a victim's port 80, each
+  // sending small segments: slowloris.
+  Slowloris,
+  // Many attackers trying logins on a victim's port 22 with packets of one
+  // length: sshBruteForce.
+  SshBruteForce,
+  // One attacker sending to a fresh destination with every packet:
+  // superSpreader.
+  SuperSpreader,
+};
+
+struct AttackScenario {
+  AttackKind kind = AttackKind::SynFlood;
+  // Share of all packets that belong to the attack while it runs.
+  double share = 0.01;
+  // When it runs, in seconds of generated time; an end of 0 is never.
+  double start = 0.0;
+  double end = 0.0;
+  // Distinct attacking sources; a SynFlood spoofs fresh ones instead.
+  uint32_t attackers = 64;
+  // The host attacked, as a rank of the destination distribution.
+  uint32_t victim = 0;
+};
+
+struct TrafficOptions {
+  // Packets per second of generated time; the time column advances by its
+  // inverse with every packet.
+  double packetsPerSecond = 1e6;
+  // Background traffic is between hosts of 10.0.0.0/8, numbered by rank:
+  // sources and destinations follow Zipf laws of these exponents over
+  // them, so that a few hosts carry most of it.
+  uint32_t hosts = 1 << 16;
+  double srcSkew = 1.0;
+  double dstSkew = 1.2;
+  // Share of background packets that are UDP rather than TCP.
+  double udpShare = 0.15;
+  vector<AttackScenario> attacks;
+  size_t batchSize = kDefaultBatchSize;
+  uint64_t seed = 1;
+};
+
+// Generates the traffic of options in batches numbered from 0. Batch i
+// holds packets [i * batchSize, (i + 1) * batchSize) and depends only on
+// options and i, so that threads can make different batches of one stream
+// at once and still produce it exactly. Safe to share between threads once
+// built. Throws invalid_argument for no hosts, more than 2^24 hosts, a
+// nonpositive rate, an empty batch or attack shares summing past 1.
+class TrafficGenerator {
+ public:
+  explicit TrafficGenerator(TrafficOptions options);
+
+  // Overwrites batch with batch number index, every row selected.
+  void fill(Batch& batch, uint64_t index) const;
+
+  const TrafficOptions& options() const { return config; }
+  // The address of the host of rank host.
+  static uint32_t hostAddress(uint32_t host);
+
+ private:
+  // Zipf law over [0, n) sampled by Walker's alias method: one random
+  // number and one table lookup a sample.
+  struct AliasTable {
+    vector<uint32_t> threshold;
+    vector<uint32_t> alias;
+
+    AliasTable(uint32_t n, double skew);
+    uint32_t sample(uint64_t random) const;
+  };
+
+  TrafficOptions config;
+  AliasTable srcs;
+  AliasTable dsts;
+  AliasTable ports;
+};
+
+struct TrafficStats {
+  uint64_t packets = 0;
+  double seconds = 0.0;
+
+  double packetsPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(packets) / seconds : 0.0;
+  }
+};
+
+// Generates packets batches on numThreads threads and passes them to op on
+// the calling thread, in order, until packets have been passed on or stop
+// is set; then resets op once, as replayPcap does. The rate measured is
+// that of op, the generator threads being there to keep it fed.
+TrafficStats runTraffic(const TrafficGenerator& generator, BatchOperator& op,
+                        uint64_t packets, size_t numThreads = 1,
+                        const atomic<bool>* stop = nullptr);
+
+// The first packets of generator's traffic as a source of a CoopScheduler,
+// one batch a step and a reset at the end, as runTraffic sends them.
+BatchSource trafficSource(shared_ptr<const TrafficGenerator> generator,
+                          uint64_t packets);
+
+// Drives each of ops from a thread of its own, each with every
+// ops.size()-th batch of the stream, for packets in all. For measuring
+// copies of a query side by side, such as one per core.
+TrafficStats runTrafficParallel(const TrafficGenerator& generator,
+                                vector<BatchOperator>& ops, uint64_t packets);
+
+#endif  // TRAFFIC_GEN_H
@@ -0,0 +1,422 @@
+#include "tuple_log.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "flat_table.hpp"
+#include "mapped_file.hpp"
+
+namespace {
+
+constexpr uint8_t kMixedType = 0xff;
+
+void putVarint(string& out, uint64_t val) {
+  while (val >= 0x80) {
+    out += static_cast<char>(val | 0x80);
+    val >>= 7;
+  }
+  out += static_cast<char>(val);
+}
+
+void putLittleEndian(string& out, uint64_t val, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out += static_cast<char>(val >> (8 * i));
+  }
+}
+
+uint64_t zigzag(uint64_t delta) {
+  return (delta << 1) ^
+         static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+}
+
+uint64_t unzigzag(uint64_t val) {
+  return (val >> 1) ^ (uint64_t{0} - (val & 1));
+}
+
+class TupleLogWriter {
+ public:
+  TupleLogWriter(const string& filename, size_t chunkRows)
+      : out(filename, ios::binary), chunkRows(max<size_t>(chunkRows, 1)) {
+    if (!out) {
+      throw runtime_error("Error: could not open \"" + filename +
+                          "\" for writing");
+    }
+    out.write(kTupleLogMagic, 4);
+    out.put(static_cast<char>(kTupleLogVersion));
+  }
+
+  ~TupleLogWriter() {
+    try {
+      writeChunk('T');
+    } catch (...) {
+    }
+  }
+
+  void next(const Headers& headers) {
+    if (rows != 0 && headers.fieldMask() != schema) {
+      writeChunk('T');
+    }
+    append(headers);
+    if (rows == chunkRows) {
+      writeChunk('T');
+    }
+  }
+
+  void reset(const Headers& headers) {
+    writeChunk('T');
+    append(headers);
+    writeChunk('R');
+    out.flush();
+  }
+
+ private:
+  ofstream out;
+  size_t chunkRows;
+
+  // The fields and values of the rows not yet written, by column.
+  uint64_t schema = 0;
+  vector<FieldId> ids;
+  vector<vector<OpResult>> columns;
+  size_t rows = 0;
+
+  // Scratch space, kept between chunks.
+  string chunk;
+  string plain;
+  string encoded;
+  FlatTable<uint64_t, uint32_t> dictionary;
+
+  void append(const Headers& headers) {
+    if (rows == 0) {
+      schema = headers.fieldMask();
+      ids.clear();
+      for (auto it = headers.begin(); it != headers.end(); ++it) {
+        ids.push_back(it.id());
+      }
+      columns.resize(ids.size());
+      for (vector<OpResult>& column : columns) {
+        column.clear();
+      }
+    }
+    for (size_t c = 0; c < ids.size(); c++) {
+      columns[c].push_back(headers.at(ids[c]));
+    }
+    rows++;
+  }
+
+  void writeChunk(char kind) {
+    if (rows == 0) {
+      return;
+    }
+    chunk.clear();
+    chunk += kind;
+    putVarint(chunk, rows);
+    chunk += static_cast<char>(ids.size());
+    for (size_t c = 0; c < ids.size(); c++) {
+      const string& name = fieldName(ids[c]);
+      if (name.size() > UINT8_MAX) {
+        throw length_error("Error: field name too long for a tuple log: " +
+                           name);
+      }
+      chunk += static_cast<char>(name.size());
+      chunk += name;
+      writeColumn(columns[c]);
+    }
+    string length;
+    putLittleEndian(length, chunk.size(), 8);
+    out.write(length.data(), 8);
+    out.write(chunk.data(), static_cast<streamsize>(chunk.size()));
+    rows = 0;
+  }
+
+  void writeColumn(const vector<OpResult>& vals) {
+    OpResultType typ = vals[0].typ;
+    bool mixed = false;
+    for (const OpResult& val : vals) {
+      mixed |= val.typ != typ;
+    }
+
+    plain.clear();
+    for (const OpResult& val : vals) {
+      putLittleEndian(plain, val.bits(), 8);
+    }
+    TupleLogEncoding encoding = TupleLogEncoding::Plain;
+    if (!mixed && (typ == OpResultType::IPv4 || typ == OpResultType::MAC)) {
+      encodeDictionary(vals);
+      encoding = TupleLogEncoding::Dictionary;
+    } else if (!mixed) {
+      encodeDelta(vals);
+      encoding = TupleLogEncoding::Delta;
+    }
+    const string* payload = &encoded;
+    if (encoding == TupleLogEncoding::Plain ||
+        encoded.size() >= plain.size()) {
+      encoding = TupleLogEncoding::Plain;
+      payload = &plain;
+    }
+
+    chunk +=
+        static_cast<char>(mixed ? kMixedType : static_cast<uint8_t>(typ));
+    chunk += static_cast<char>(encoding);
+    putVarint(chunk, payload->size());
+    if (mixed) {
+      for (const OpResult& val : vals) {
+        chunk += static_cast<char>(val.typ);
+      }
+    }
+    chunk += *payload;
+  }
+
+  void encodeDelta(const vector<OpResult>& vals) {
+    encoded.clear();
+    uint64_t prev = 0;
+    for (const OpResult& val : vals) {
+      uint64_t bits = val.bits();
+      putVarint(encoded, zigzag(bits - prev));
+      prev = bits;
+    }
+  }
+
+  void encodeDictionary(const vector<OpResult>& vals) {
+    dictionary.clear();
+    vector<uint64_t> distinct;
+    vector<uint32_t> index(vals.size());
+    for (size_t r = 0; r < vals.size(); r++) {
+      uint64_t bits = vals[r].bits();
+      auto [at, inserted] = dictionary.findOrInsert(bits);
+      if (inserted) {
+        *at = static_cast<uint32_t>(distinct.size());
+        distinct.push_back(bits);
+      }
+      index[r] = *at;
+    }
+    size_t width = distinct.size() <= 0x100 ? 1
+                   : distinct.size() <= 0x10000 ? 2
+                                                 : 4;
+    encoded.clear();
+    putVarint(encoded, distinct.size());
+    for (uint64_t bits : distinct) {
+      putLittleEndian(encoded, bits, 8);
+    }
+    encoded += static_cast<char>(width);
+    for (uint32_t i : index) {
+      putLittleEndian(encoded, i, width);
+    }
+  }
+};
+
+// Bounds-checked reads from the mapping, reporting errors by file offset.
+class Cursor {
+ public:
+  Cursor(const MappedFile& file, const char* begin, const char* end)
+      : file(file), at(begin), end(end) {}
+
+  bool done() const { return at == end; }
+  size_t remaining() const { return static_cast<size_t>(end - at); }
+
+  const char* take(size_t n) {
+    if (remaining() < n) {
+      fail("truncated");
+    }
+    const char* out = at;
+    at += n;
+    return out;
+  }
+
+  // The next n bytes, as a cursor of their own.
+  Cursor sub(size_t n) {
+    const char* begin = take(n);
+    return Cursor(file, begin, begin + n);
+  }
+
+  uint8_t byte() { return static_cast<uint8_t>(*take(1)); }
+
+  uint64_t littleEndian(size_t n) {
+    const char* p = take(n);
+    uint64_t val = 0;
+    for (size_t i = 0; i < n; i++) {
+      val |= uint64_t{static_cast<uint8_t>(p[i])} << (8 * i);
+    }
+    return val;
+  }
+
+  uint64_t varint() {
+    uint64_t val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t b = byte();
+      val |= uint64_t{b & 0x7fu} << shift;
+      if ((b & 0x80) == 0) {
+        return val;
+      }
+    }
+    fail("malformed varint");
+  }
+
+  [[noreturn]] void fail(const string& what) const {
+    throw runtime_error("Error: tuple log \"" + file.name() + "\" is " + what +
+                        " at offset " + to_string(at - file.data()));
+  }
+
+ private:
+  const MappedFile& file;
+  const char* at;
+  const char* end;
+};
+
+void readColumn(Cursor& in, size_t rows, vector<OpResult>& column) {
+  uint8_t typ = in.byte();
+  uint8_t encodingByte = in.byte();
+  uint64_t payloadBytes = in.varint();
+  bool mixed = typ == kMixedType;
+  if (!mixed && typ > static_cast<uint8_t>(OpResultType::Empty)) {
+    in.fail("malformed (bad column type)");
+  }
+  // Every encoding takes at least a byte a row.
+  if (payloadBytes < rows) {
+    in.fail("malformed (column payload too short)");
+  }
+  const char* types = mixed ? in.take(rows) : nullptr;
+  Cursor body = in.sub(payloadBytes);
+
+  auto typeOf = [&](size_t r) {
+    uint8_t t = mixed ? static_cast<uint8_t>(types[r]) : typ;
+    if (t > static_cast<uint8_t>(OpResultType::Empty)) {
+      in.fail("malformed (bad value type)");
+    }
+    return static_cast<OpResultType>(t);
+  };
+
+  column.resize(rows);
+  switch (static_cast<TupleLogEncoding>(encodingByte)) {
+    case TupleLogEncoding::Plain:
+      if (payloadBytes != rows * 8) {
+        in.fail("malformed (bad plain column)");
+      }
+      for (size_t r = 0; r < rows; r++) {
+        column[r] = OpResult::fromBits(typeOf(r), body.littleEndian(8));
+      }
+      break;
+    case TupleLogEncoding::Delta: {
+      uint64_t prev = 0;
+      for (size_t r = 0; r < rows; r++) {
+        prev += unzigzag(body.varint());
+        column[r] = OpResult::fromBits(typeOf(r), prev);
+      }
+      break;
+    }
+    case TupleLogEncoding::Dictionary: {
+      uint64_t size = body.varint();
+      // Checked before multiplying, which a crafted size could wrap to 0.
+      if (size > body.remaining() / 8) {
+        body.fail("truncated");
+      }
+      const char* values = body.take(size * 8);
+      size_t width = body.byte();
+      if (width != 1 && width != 2 && width != 4) {
+        in.fail("malformed (bad dictionary index width)");
+      }
+      for (size_t r = 0; r < rows; r++) {
+        uint64_t i = body.littleEndian(width);
+        if (i >= size) {
+          in.fail("malformed (dictionary index out of range)");
+        }
+        uint64_t bits;
+        memcpy(&bits, values + 8 * i, 8);
+        column[r] = OpResult::fromBits(typeOf(r), bits);
+      }
+      break;
+    }
+    default:
+      in.fail("malformed (unknown column encoding)");
+  }
+  if (!body.done()) {
+    body.fail("malformed (column payload too long)");
+  }
+}
+
+}  // namespace
+
+Operator dumpTupleLog(string filename, size_t chunkRows) {
+  auto writer = make_shared<TupleLogWriter>(filename, chunkRows);
+
+  OpFunc next = [writer](const Headers& headers) { writer->next(headers); };
+  OpFunc reset = [writer](const Headers& headers) { writer->reset(headers); };
+
+  return Operator(next, reset);
+}
+
+OpCreator tupleLogCreator(string filename, size_t chunkRows) {
+  return [filename, chunkRows](Operator nextOp) {
+    auto writer = make_shared<TupleLogWriter>(filename, chunkRows);
+
+    OpFunc next = [writer, nextOp](const Headers& headers) {
+      writer->next(headers);
+      nextOp.next(headers);
+    };
+
+    OpFunc reset = [writer, nextOp](const Headers& headers) {
+      writer->reset(headers);
+      nextOp.reset(headers);
+    };
+
+    return Operator(next, reset);
+  };
+}
+
+uint64_t replayTupleLog(const string& filename, const Operator& op) {
+  MappedFile file(filename);
+  Cursor in(file, file.data(), file.data() + file.size());
+  if (memcmp(in.take(4), kTupleLogMagic, 4) != 0) {
+    throw runtime_error("Error: \"" + filename + "\" is not a tuple log");
+  }
+  uint8_t version = in.byte();
+  if (version != kTupleLogVersion) {
+    throw runtime_error("Error: tuple log \"" + filename +
+                        "\" has unsupported version " + to_string(version));
+  }
+
+  vector<FieldId> ids;
+  vector<vector<OpResult>> columns;
+  uint64_t tuples = 0;
+  while (!in.done()) {
+    Cursor chunk = in.sub(in.littleEndian(8));
+
+    char kind = static_cast<char>(chunk.byte());
+    uint64_t rows = chunk.varint();
+    if ((kind != 'T' && kind != 'R') || (kind == 'R' && rows != 1)) {
+      chunk.fail("malformed (bad chunk header)");
+    }
+    size_t count = chunk.byte();
+    ids.resize(count);
+    columns.resize(count);
+    for (size_t c = 0; c < count; c++) {
+      size_t nameLength = chunk.byte();
+      string text(chunk.take(nameLength), nameLength);
+      try {
+        ids[c] = internField(text);
+      } catch (const out_of_range&) {
+        chunk.fail("over the limit of " + to_string(kMaxFields) +
+                   " field names");
+      }
+      readColumn(chunk, rows, columns[c]);
+    }
+
+    Headers headers;
+    for (size_t r = 0; r < rows; r++) {
+      for (size_t c = 0; c < count; c++) {
+        headers[ids[c]] = columns[c][r];
+      }
+      if (kind == 'T') {
+        op.next(headers);
+      } else {
+        op.reset(headers);
+      }
+    }
+    if (kind == 'T') {
+      tuples += rows;
+    }
+  }
+  return tuples;
+}
@@ -0,0 +1,64 @@
+#ifndef TUPLE_LOG_H
+#define TUPLE_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "utils.hpp"
+
+using namespace std;
+
+// A typed, column-chunked file of tuples and resets, for archiving query
+// output and intermediate streams and replaying them into later stages.
+//
+// A file is the magic "FNTL" and a version byte, then a sequence of chunks.
+// Each chunk holds up to kTupleLogChunkRows consecutive tuples with the same
+// fields, or one reset, and starts with its length in bytes (8 bytes), so
+// that readers can step over it. All integers are little-endian; varints
+// are LEB128.
+//
+//   u8 kind ('T' tuples, 'R' reset), varint rows, u8 columns, then for each
+//   column: u8 name length, the name, u8 type (an OpResultType, or 0xff if
+//   the column holds more than one), u8 encoding, varint payload bytes,
+//   and, for a mixed column only, one type byte per row, then the payload.
+//
+// A column is written in whichever of these is smallest for the values at
+// hand:
+//
+//   Plain       the 8-byte bits() of each value.
+//   Delta       the zigzag varint of each bits() minus the one before (the
+//               first minus 0), which is exact for floats too and takes a
+//               byte or two for time, eid and other slowly moving columns.
+//   Dictionary  the distinct values as a varint count and 8-byte bits(),
+//               then a u8 index width and each row's index; for IPv4 and MAC
+//               columns only.
+
+constexpr size_t kTupleLogChunkRows = 4096;
+constexpr char kTupleLogMagic[] = "FNTL";
+constexpr uint8_t kTupleLogVersion = 1;
+
+enum class TupleLogEncoding : uint8_t {
+  Plain,
+  Delta,
+  Dictionary,
+};
+
+// Writes every tuple and reset it sees to filename. Rows are written out a
+// chunk at a time, and at every reset, after which the file holds all the
+// output up to that point.
+Operator dumpTupleLog(string filename, size_t chunkRows = kTupleLogChunkRows);
+
+// Archives the stream at this point of a query to filename, as dumpTupleLog
+// does, and passes it on unchanged.
+OpCreator tupleLogCreator(string filename,
+                          size_t chunkRows = kTupleLogChunkRows);
+
+// Maps filename and feeds its tuples and resets to op in the order they were
+// written, decoding columns straight out of the mapping. Returns the number
+// of tuples replayed. Throws runtime_error if the file is not a tuple log,
+// is truncated or malformed, or names fields that would take the intern
+// table past kMaxFields.
+uint64_t replayTupleLog(const string& filename, const Operator& op);
+
+#endif  // TUPLE_LOG_H
@@ -1,69 +1,37 @@
 #include "utils.hpp"
 
-string tcpFlagsToStrings(int flags) {
-  unordered_map<string, int> tcpFlagsMap = {
-      {"FIN", 1 << 0}, {"SYN", 1 << 1}, {"RST", 1 << 2}, {"PSH", 1 << 3},
-      {"ACK", 1 << 4}, {"URG", 1 << 5}, {"ECE", 1 << 6}, {"CWR", 1 << 7}};
+#include "tcp_flags.hpp"
 
-  vector<string> activeFlags;
-  for (const auto &[key, value] : tcpFlagsMap) {
-    if ((flags & value) == value) {
-      activeFlags.push_back(key);
-    }
-  }
-
-  string result;
-  for (int i = 0; i < activeFlags.size(); i++) {
-    if (i > 0) result += "|";
-    result += activeFlags[i];
-  }
-
-  return result;
-}
-
-int intOfOpResult(OpResult input) {
-  switch (input.typ) {
-    case OpResultType::Int:
-      return get<int>(input.val);
-    default:
-      throw invalid_argument(
-          "Error: attempt made to extract an int value out of a non-"
-          "int OpResult");
-  }
-}
-
-float floatOfOpResult(OpResult input) {
-  switch (input.typ) {
-    case OpResultType::Float:
-      return get<float>(input.val);
-    default:
-      throw invalid_argument(
-          "Error: attempt made to extract a float value out of a non-"
-          "float OpResult");
-  }
+string_view tcpFlagsToStrings(int flags) {
+  return tcpFlagNames(TcpFlags(static_cast<uint8_t>(flags)));
 }
 
 string stringOfOpResult(OpResult input) {
   switch (input.typ) {
     case OpResultType::Float:
-      return to_string(get<float>(input.val));
+      return to_string(input.asFloat());
     case OpResultType::Int:
-      return to_string(get<int>(input.val));
+      return to_string(input.asInt());
     case OpResultType::IPv4:
-      return get<IPv4Address>(input.val).toString();
+      return input.asIPv4().toString();
     case OpResultType::MAC:
-      return get<MACAddress>(input.val).toString();
+      return input.asMAC().toString();
     case OpResultType::Empty:
       return "Empty";
   }
+  return "Empty";
 }
 
-string stringOfHeaders(Headers inputHeaders) {
-  reduce(inputHeaders.begin(), inputHeaders.end(), string(),
-         [](string acc, const std::pair<const std::string, OpResult> &header) {
-           return acc + "\"" + header.first + "\"" +
-                  stringOfOpResult(header.second);
-         });
+string stringOfHeaders(const Headers &inputHeaders) {
+  string out;
+  for (const auto &[key, val] : inputHeaders) {
+    out += '"';
+    out += key;
+    out += "\" => ";
+    out += stringOfOpResult(val);
+    out += ", ";
+  }
+  return out;
 }
 
 Headers headersOfList(vector<pair<string, OpResult>> headersList) {
@@ -75,18 +43,50 @@ Headers headersOfList(vector<pair<string, OpResult>> headersList) {
   return newMap;
 }
 
-void dumpHeaders(Headers headers) {
-  cout << stringOfHeaders(headers) << endl;
+void dumpHeaders(ostream &outc, const Headers &headers) {
+  outc << stringOfHeaders(headers) << "\n";
+}
+
+bool Headers::operator==(const Headers &other) const {
+  if (present != other.present) {
+    return false;
+  }
+  for (uint64_t rest = present; rest != 0; rest &= rest - 1) {
+    FieldId id = static_cast<FieldId>(__builtin_ctzll(rest));
+    if (!(slots[id] == other.slots[id])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t hash<Headers>::operator()(const Headers &headers) const {
+  size_t seed = headers.fieldMask();
+  for (auto it = headers.begin(); it != headers.end(); ++it) {
+    const OpResult &val = headers.at(it.id());
+    size_t h = static_cast<size_t>(val.typ) ^ hash<uint64_t>()(val.bits());
+    seed ^= h + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+  }
+  return seed;
 }
 
-int lookupInt(string key, Headers headers) {
+int64_t lookupInt(string key, const Headers &headers) {
   auto found = headers.find(key);
-  return found != headers.end() ? intOfOpResult(found->second)
-                                : intOfOpResult(OpResult::Empty());
+  return found != headers.end() ? found->second.asInt()
+                                : OpResult::Empty().asInt();
 }
 
-float lookupFloats(string key, Headers headers) {
+double lookupFloats(string key, const Headers &headers) {
   auto found = headers.find(key);
-  return found != headers.end() ? floatOfOpResult(found->second)
-                                : floatOfOpResult(OpResult::Empty());
-}
\ No newline at end of file
+  return found != headers.end() ? found->second.asFloat()
+                                : OpResult::Empty().asFloat();
+}
+
+int64_t lookupInt(FieldId key, const Headers &headers) {
+  return (headers.contains(key) ? headers.at(key) : OpResult::Empty()).asInt();
+}
+
+double lookupFloats(FieldId key, const Headers &headers) {
+  return (headers.contains(key) ? headers.at(key) : OpResult::Empty())
+      .asFloat();
+}
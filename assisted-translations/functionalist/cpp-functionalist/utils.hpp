@@ -2,116 +2,273 @@
 #define UTILS_H
 
 #include <array>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iomanip>
 #include <iostream>
 #include <numeric>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <type_traits>
 #include <utility>
-#include <variant>
 #include <vector>
 
+#include "schema.hpp"
+
 using namespace std;
 
+namespace address_detail {
+
+constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+constexpr int hexValue(char c) {
+  return c >= '0' && c <= '9'   ? c - '0'
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                : -1;
+}
+
+// Each octet's decimal digits, left-aligned, and their count in the last
+// byte, so that an octet is formatted with one 4-byte copy.
+struct OctetText {
+  array<array<char, 4>, 256> text{};
+
+  constexpr OctetText() {
+    for (int i = 0; i < 256; i++) {
+      int n = 0;
+      if (i >= 100) {
+        text[i][n++] = static_cast<char>('0' + i / 100);
+      }
+      if (i >= 10) {
+        text[i][n++] = static_cast<char>('0' + i / 10 % 10);
+      }
+      text[i][n++] = static_cast<char>('0' + i % 10);
+      text[i][3] = static_cast<char>(n);
+    }
+  }
+};
+
+inline constexpr OctetText kOctetText{};
+inline constexpr char kHexDigits[] = "0123456789abcdef";
+
+}  // namespace address_detail
+
 class IPv4Address {
  private:
-  array<uint8_t, 4> address;
+  // Host byte order, first dotted-quad segment in the most significant byte.
+  uint32_t address;
 
  public:
-  IPv4Address(const string& ipString) {
-    stringstream str(ipString);
-    string segment;
-    array<int, 4> parts;
-    int i = 0;
-
-    while (getline(str, segment, '.')) {
-      if (i >= 4) {
-        throw invalid_argument(
-            "Error: given IPv4Address value has too many segments");
-      }
-      address[i++] = stoi(segment);
-    }
+  static constexpr size_t kMaxChars = 15;
+  // Room format needs at out: it may write one byte past the text.
+  static constexpr size_t kFormatRoom = kMaxChars + 1;
 
-    if (i != 4) {
+  // Throws invalid_argument unless ipString is a dotted quad.
+  IPv4Address(const string& ipString) : address(0) {
+    optional<IPv4Address> parsed = parse(ipString);
+    if (!parsed) {
       throw invalid_argument(
           "Error: IPv4 address attempted to be made out of an argument"
           " with the incorrect format");
     }
+    address = parsed->address;
+  }
+
+  constexpr explicit IPv4Address(uint32_t address) : address(address) {}
+
+  // From the four bytes of an address as carried in a packet header.
+  static constexpr IPv4Address fromBytes(const uint8_t* networkOrder) {
+    return IPv4Address(static_cast<uint32_t>(networkOrder[0]) << 24 |
+                       static_cast<uint32_t>(networkOrder[1]) << 16 |
+                       static_cast<uint32_t>(networkOrder[2]) << 8 |
+                       static_cast<uint32_t>(networkOrder[3]));
+  }
+
+  // Four decimal octets of one to three digits each, up to 255, separated
+  // by dots; nullopt for anything else. One pass, with no allocation.
+  static constexpr optional<IPv4Address> parse(string_view text) {
+    uint32_t address = 0;
+    size_t i = 0;
+    for (int octet = 0; octet < 4; octet++) {
+      if (octet != 0) {
+        if (i == text.size() || text[i] != '.') {
+          return nullopt;
+        }
+        i++;
+      }
+      size_t start = i;
+      uint32_t val = 0;
+      while (i < text.size() && i - start < 3 &&
+             address_detail::isDigit(text[i])) {
+        val = val * 10 + static_cast<uint32_t>(text[i] - '0');
+        i++;
+      }
+      if (i == start || val > 255) {
+        return nullopt;
+      }
+      address = address << 8 | val;
+    }
+    if (i != text.size()) {
+      return nullopt;
+    }
+    return IPv4Address(address);
+  }
+
+  constexpr uint32_t toUint32() const { return address; }
+
+  constexpr void toBytes(uint8_t* networkOrder) const {
+    for (size_t i = 0; i < 4; i++) {
+      networkOrder[i] = static_cast<uint8_t>(address >> (24 - 8 * i));
+    }
+  }
+
+  constexpr bool operator==(const IPv4Address& other) const {
+    return address == other.address;
   }
 
-  uint8_t getPart(size_t index) {
+  uint8_t getPart(size_t index) const {
     if (index >= 4) {
       throw out_of_range("Index out of bounds for IPv4 address getPart");
     }
-    return address[index];
+    return static_cast<uint8_t>(address >> (24 - 8 * index));
   }
 
-  string toString() {
-    stringstream str;
-    for (auto part : address) {
-      str << static_cast<int>(part) << ".";
+  // Writes the dotted quad to out, which must have room for kFormatRoom,
+  // and returns the end of it. Each octet is one 4-byte copy from a table.
+  char* format(char* out) const {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      const array<char, 4>& octet =
+          address_detail::kOctetText.text[(address >> shift) & 0xff];
+      memcpy(out, octet.data(), 4);
+      out += octet[3];
+      *out = '.';
+      out += shift != 0;
     }
-    str << endl;
-    return str.str();
+    return out;
   }
 
-  void print() { cout << this->toString() << endl; }
+  string toString() const {
+    char text[kFormatRoom];
+    return string(text, format(text));
+  }
+
+  void print() const { cout << this->toString() << endl; }
 };
 
 class MACAddress {
  private:
-  array<uint8_t, 6> address;
+  // The six octets packed into the low 48 bits, first octet most significant.
+  uint64_t address;
 
  public:
-  MACAddress(const string& macString) {
-    stringstream ss(macString);
-    string segment;
-    int i = 0;
-
-    while (getline(ss, segment, ':')) {
-      if (i >= 6) {
-        throw invalid_argument("Invalid MAC address string: too many segments");
-      }
-      size_t pos = 0;
-      address[i++] = stoi(segment, &pos, 16);
-    }
+  static constexpr size_t kMaxChars = 17;
 
-    if (i != 6) {
+  // Throws invalid_argument unless macString is six colon-separated hex
+  // octets.
+  MACAddress(const string& macString) : address(0) {
+    optional<MACAddress> parsed = parse(macString);
+    if (!parsed) {
       throw invalid_argument(
           "Error: MAC address attempted to be made out of an argument"
           " with the incorrect format");
     }
+    address = parsed->address;
+  }
+
+  constexpr explicit MACAddress(uint64_t address)
+      : address(address & 0xFFFFFFFFFFFFULL) {}
+
+  // From the six bytes of an address as carried in a frame header.
+  static constexpr MACAddress fromBytes(const uint8_t* networkOrder) {
+    uint64_t address = 0;
+    for (size_t i = 0; i < 6; i++) {
+      address = address << 8 | networkOrder[i];
+    }
+    return MACAddress(address);
   }
 
-  uint8_t getPart(size_t index) {
+  // Six hex octets of one or two digits each, in either case, separated by
+  // colons; nullopt for anything else.
+  static constexpr optional<MACAddress> parse(string_view text) {
+    uint64_t address = 0;
+    size_t i = 0;
+    for (int octet = 0; octet < 6; octet++) {
+      if (octet != 0) {
+        if (i == text.size() || text[i] != ':') {
+          return nullopt;
+        }
+        i++;
+      }
+      size_t start = i;
+      uint64_t val = 0;
+      while (i < text.size() && i - start < 2 &&
+             address_detail::hexValue(text[i]) >= 0) {
+        val = val << 4 |
+              static_cast<uint64_t>(address_detail::hexValue(text[i]));
+        i++;
+      }
+      if (i == start) {
+        return nullopt;
+      }
+      address = address << 8 | val;
+    }
+    if (i != text.size()) {
+      return nullopt;
+    }
+    return MACAddress(address);
+  }
+
+  constexpr uint64_t toUint64() const { return address; }
+
+  constexpr bool operator==(const MACAddress& other) const {
+    return address == other.address;
+  }
+
+  uint8_t getPart(size_t index) const {
     if (index >= 6) {
       throw out_of_range("Index out of bounds for MAC address getPart");
     }
-    return address[index];
+    return static_cast<uint8_t>(address >> (40 - 8 * index));
   }
 
-  array<uint8_t, 6> parts() { return address; }
-
-  string toString() const {
-    stringstream str;
+  array<uint8_t, 6> parts() const {
+    array<uint8_t, 6> octets;
     for (size_t i = 0; i < 6; i++) {
-      str << hex << setw(2) << setfill('0') << static_cast<int>(address[i]);
-      if (i < 5) {
-        str << ":";
+      octets[i] = getPart(i);
+    }
+    return octets;
+  }
+
+  // Writes the address to out, which must have room for kMaxChars, and
+  // returns the end of it.
+  char* format(char* out) const {
+    for (int shift = 40; shift >= 0; shift -= 8) {
+      uint8_t octet = static_cast<uint8_t>(address >> shift);
+      *out++ = address_detail::kHexDigits[octet >> 4];
+      *out++ = address_detail::kHexDigits[octet & 0xf];
+      if (shift != 0) {
+        *out++ = ':';
       }
     }
-    return str.str();
+    return out;
+  }
+
+  string toString() const {
+    char text[kMaxChars];
+    return string(text, format(text));
   }
 
   void print() const { cout << toString() << endl; }
 };
 
-using opKinds = variant<float, int, IPv4Address, MACAddress, monostate>;
-
-enum class OpResultType {
+enum class OpResultType : uint8_t {
   Float,
   Int,
   IPv4,
@@ -119,26 +276,269 @@ enum class OpResultType {
   Empty,
 };
 
+// A one-byte tag and an 8-byte payload. Trivially copyable, so copying a
+// tuple's slots is a plain memcpy.
 struct OpResult {
   OpResultType typ;
-  opKinds val;
+  union {
+    double f;
+    int64_t i;
+    uint32_t ipv4;
+    uint64_t mac;
+  };
+
+  constexpr OpResult() : typ(OpResultType::Empty), i(0) {}
+
+  static constexpr OpResult Float(double val) { return OpResult(val); }
+  static constexpr OpResult Int(int64_t val) { return OpResult(val); }
+  static constexpr OpResult IPv4(IPv4Address val) { return OpResult(val); }
+  static constexpr OpResult MAC(MACAddress val) { return OpResult(val); }
+  static constexpr OpResult Empty() { return OpResult(); }
 
-  static OpResult Float(float val) {
-    return {OpResultType::Float, opKinds(val)};
+  constexpr double asFloat() const {
+    return typ == OpResultType::Float
+               ? f
+               : throw invalid_argument(
+                     "Error: attempt made to extract a float value out of a "
+                     "non-float OpResult");
   }
-  static OpResult Int(int val) { return {OpResultType::Int, opKinds(val)}; }
-  static OpResult IPv4(IPv4Address val) {
-    return {OpResultType::IPv4, opKinds(val)};
+
+  constexpr int64_t asInt() const {
+    return typ == OpResultType::Int
+               ? i
+               : throw invalid_argument(
+                     "Error: attempt made to extract an int value out of a "
+                     "non-int OpResult");
+  }
+
+  constexpr IPv4Address asIPv4() const {
+    return typ == OpResultType::IPv4
+               ? IPv4Address(ipv4)
+               : throw invalid_argument(
+                     "Error: attempt made to extract an IPv4 address out of a "
+                     "non-IPv4 OpResult");
+  }
+
+  constexpr MACAddress asMAC() const {
+    return typ == OpResultType::MAC
+               ? MACAddress(mac)
+               : throw invalid_argument(
+                     "Error: attempt made to extract a MAC address out of a "
+                     "non-MAC OpResult");
+  }
+
+  // The payload as raw bits, zero-extended, for hashing and key packing.
+  uint64_t bits() const {
+    switch (typ) {
+      case OpResultType::Float: {
+        uint64_t out;
+        memcpy(&out, &f, sizeof(out));
+        return out;
+      }
+      case OpResultType::Int:
+        return static_cast<uint64_t>(i);
+      case OpResultType::IPv4:
+        return ipv4;
+      case OpResultType::MAC:
+        return mac;
+      case OpResultType::Empty:
+        break;
+    }
+    return 0;
+  }
+
+  // Inverse of bits().
+  static OpResult fromBits(OpResultType typ, uint64_t bits) {
+    switch (typ) {
+      case OpResultType::Float: {
+        double val;
+        memcpy(&val, &bits, sizeof(val));
+        return Float(val);
+      }
+      case OpResultType::Int:
+        return Int(static_cast<int64_t>(bits));
+      case OpResultType::IPv4:
+        return IPv4(IPv4Address(static_cast<uint32_t>(bits)));
+      case OpResultType::MAC:
+        return MAC(MACAddress(bits));
+      case OpResultType::Empty:
+        break;
+    }
+    return Empty();
+  }
+
+  bool operator==(const OpResult& other) const {
+    return typ == other.typ && bits() == other.bits();
+  }
+
+ private:
+  constexpr explicit OpResult(double val) : typ(OpResultType::Float), f(val) {}
+  constexpr explicit OpResult(int64_t val) : typ(OpResultType::Int), i(val) {}
+  constexpr explicit OpResult(IPv4Address val)
+      : typ(OpResultType::IPv4), ipv4(val.toUint32()) {}
+  constexpr explicit OpResult(MACAddress val)
+      : typ(OpResultType::MAC), mac(val.toUint64()) {}
+};
+
+static_assert(is_trivially_copyable<OpResult>::value,
+              "OpResult must stay trivially copyable");
+static_assert(sizeof(OpResult) == 16, "OpResult must stay 16 bytes");
+
+// A tuple is a fixed-slot record indexed by FieldId, with a bitmask marking
+// which slots are set. The string-keyed members mirror unordered_map so that
+// code written against the old map type keeps working; hot paths should
+// resolve a FieldId once at query-build time and use the id overloads.
+//
+// Slots outside the mask are never read, so they are left uninitialised and
+// a copy copies only the set ones: a dozen fields rather than the whole
+// kMaxFields-slot array.
+class Headers {
+ private:
+  uint64_t present = 0;
+  union {
+    array<OpResult, kMaxFields> slots;
+  };
+
+  static uint64_t bit(FieldId id) { return uint64_t{1} << id; }
+
+  void copySlots(const Headers& other) {
+    for (uint64_t rest = present; rest != 0; rest &= rest - 1) {
+      size_t id = __builtin_ctzll(rest);
+      slots[id] = other.slots[id];
+    }
+  }
+
+ public:
+  template <typename Slot>
+  class Iter {
+   private:
+    Slot* slots;
+    uint64_t remaining;
+
+   public:
+    using value_type = pair<const string&, Slot&>;
+    using reference = value_type;
+    using difference_type = ptrdiff_t;
+    using iterator_category = forward_iterator_tag;
+
+    struct Arrow {
+      value_type entry;
+      value_type* operator->() { return &entry; }
+    };
+    using pointer = Arrow;
+
+    Iter(Slot* slots, uint64_t remaining)
+        : slots(slots), remaining(remaining) {}
+
+    FieldId id() const {
+      return static_cast<FieldId>(__builtin_ctzll(remaining));
+    }
+
+    reference operator*() const { return {fieldName(id()), slots[id()]}; }
+    Arrow operator->() const { return {**this}; }
+
+    Iter& operator++() {
+      remaining &= remaining - 1;
+      return *this;
+    }
+
+    bool operator==(const Iter& other) const {
+      return remaining == other.remaining;
+    }
+    bool operator!=(const Iter& other) const { return !(*this == other); }
+  };
+
+  using iterator = Iter<OpResult>;
+  using const_iterator = Iter<const OpResult>;
+
+  Headers() {}
+  Headers(const Headers& other) : present(other.present) { copySlots(other); }
+  Headers& operator=(const Headers& other) {
+    present = other.present;
+    copySlots(other);
+    return *this;
+  }
+  Headers(initializer_list<pair<string, OpResult>> entries) {
+    for (const auto& [key, val] : entries) {
+      (*this)[internField(key)] = val;
+    }
   }
-  static OpResult MAC(MACAddress val) {
-    return {OpResultType::MAC, opKinds(val)};
+
+  bool contains(FieldId id) const { return present & bit(id); }
+  bool contains(Field field) const { return contains(fid(field)); }
+
+  const OpResult& at(FieldId id) const {
+    if (!contains(id)) {
+      throw out_of_range("Error: tuple has no value for field \"" +
+                         fieldName(id) + "\"");
+    }
+    return slots[id];
   }
-  static OpResult Empty() { return {OpResultType::Empty, monostate{}}; }
+  const OpResult& at(Field field) const { return at(fid(field)); }
+
+  OpResult& operator[](FieldId id) {
+    if (!contains(id)) {
+      present |= bit(id);
+      slots[id] = OpResult::Empty();
+    }
+    return slots[id];
+  }
+  OpResult& operator[](Field field) { return (*this)[fid(field)]; }
+
+  void erase(FieldId id) { present &= ~bit(id); }
+
+  uint64_t fieldMask() const { return present; }
+  size_t size() const { return __builtin_popcountll(present); }
+  bool empty() const { return present == 0; }
+  void clear() { present = 0; }
+
+  iterator begin() { return {slots.data(), present}; }
+  iterator end() { return {slots.data(), 0}; }
+  const_iterator begin() const { return {slots.data(), present}; }
+  const_iterator end() const { return {slots.data(), 0}; }
+
+  // String-keyed compatibility layer; each call costs one registry lookup.
+  iterator find(const string& key) {
+    optional<FieldId> id = findField(key);
+    return id && contains(*id)
+               ? iterator(slots.data(), present & ~(bit(*id) - 1))
+               : end();
+  }
+  const_iterator find(const string& key) const {
+    optional<FieldId> id = findField(key);
+    return id && contains(*id)
+               ? const_iterator(slots.data(), present & ~(bit(*id) - 1))
+               : end();
+  }
+  size_t count(const string& key) const { return find(key) != end() ? 1 : 0; }
+  OpResult& operator[](const string& key) { return (*this)[internField(key)]; }
+  void insert(const pair<string, OpResult>& entry) {
+    FieldId id = internField(entry.first);
+    if (!contains(id)) {
+      (*this)[id] = entry.second;
+    }
+  }
+  void erase(const string& key) {
+    optional<FieldId> id = findField(key);
+    if (id) {
+      erase(*id);
+    }
+  }
+
+  bool operator==(const Headers& other) const;
+  bool operator!=(const Headers& other) const { return !(*this == other); }
 };
 
-using Headers = unordered_map<string, OpResult>;
+namespace std {
+template <>
+struct hash<Headers> {
+  size_t operator()(const Headers& headers) const;
+};
+}  // namespace std
 
-using OpFunc = function<void(Headers)>;
+// Tuples are passed by reference; a stage that needs to add fields copies
+// the tuple into storage of its own first.
+using OpFunc = function<void(const Headers&)>;
 
 struct Operator {
   OpFunc next;
@@ -151,20 +551,23 @@ using OpCreator = function<Operator(Operator)>;
 using DblOpCreator = function<pair<Operator, Operator>(Operator)>;
 using DblOpAcceptorOpCreator = function<Operator(pair<Operator, Operator>)>;
 
-Operator __(OpCreator opCreator, Operator nextOp) { return opCreator(nextOp); }
+inline Operator __(OpCreator opCreator, Operator nextOp) {
+  return opCreator(nextOp);
+}
 
-pair<Operator, Operator> ___(DblOpCreator opCreator, Operator nextOp) {
+inline pair<Operator, Operator> ___(DblOpCreator opCreator, Operator nextOp) {
   return opCreator(nextOp);
 }
 
-string tcpFlagsToStrings(int flags);
-int intOfOpResult(OpResult input);
-float floatOfOpResult(OpResult input);
+// tcpFlagNames of the low byte of flags.
+string_view tcpFlagsToStrings(int flags);
 string stringOfOpResult(OpResult input);
-string stringOfHeaders(Headers inputHeaders);
+string stringOfHeaders(const Headers& inputHeaders);
 Headers headersOfList(vector<pair<string, OpResult>> headersList);
-void dumpHeaders(ofstream outc, Headers headers);
-int lookupInt(string key, Headers headers);
-float lookupFloats(string key, Headers headers);
+void dumpHeaders(ostream& outc, const Headers& headers);
+int64_t lookupInt(string key, const Headers& headers);
+double lookupFloats(string key, const Headers& headers);
+int64_t lookupInt(FieldId key, const Headers& headers);
+double lookupFloats(FieldId key, const Headers& headers);
 
 #endif  // UTILS_H
\ No newline at end of file
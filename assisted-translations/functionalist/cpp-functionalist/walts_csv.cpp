@@ -0,0 +1,466 @@
+#include "walts_csv.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "async_io.hpp"
+#include "mapped_file.hpp"
+
+namespace {
+
+// The scanners below advance p past what they consume and return false on
+// malformed input. They only look at one byte at a time and never allocate,
+// so the compiler is free to unroll and vectorize the digit loops.
+
+inline bool isDigit(char c) { return static_cast<unsigned>(c - '0') < 10; }
+
+inline bool scanChar(const char*& p, const char* end, char c) {
+  if (p == end || *p != c) {
+    return false;
+  }
+  p++;
+  return true;
+}
+
+inline bool scanInt(const char*& p, const char* end, int64_t& out) {
+  bool negative = p != end && *p == '-';
+  if (negative) {
+    p++;
+  }
+  const char* start = p;
+  uint64_t val = 0;
+  while (p != end && isDigit(*p)) {
+    val = val * 10 + static_cast<uint64_t>(*p - '0');
+    p++;
+  }
+  if (p == start) {
+    return false;
+  }
+  out = negative ? -static_cast<int64_t>(val) : static_cast<int64_t>(val);
+  return true;
+}
+
+// Either a dotted quad or a lone "0" for a missing address.
+inline bool scanIp(const char*& p, const char* end, uint32_t& out) {
+  uint32_t address = 0;
+  int dots = 0;
+  while (true) {
+    const char* start = p;
+    uint32_t octet = 0;
+    while (p != end && isDigit(*p)) {
+      octet = octet * 10 + static_cast<uint32_t>(*p - '0');
+      p++;
+    }
+    if (p == start || p - start > 3 || octet > 255) {
+      return false;
+    }
+    address = (address << 8) | octet;
+    if (p == end || *p != '.') {
+      break;
+    }
+    p++;
+    dots++;
+  }
+  if (dots == 3) {
+    out = address;
+    return true;
+  }
+  if (dots == 0 && address == 0) {
+    out = 0;
+    return true;
+  }
+  return false;
+}
+
+inline bool scanLineEnd(const char*& p, const char* end) {
+  if (p != end && *p == '\r') {
+    p++;
+  }
+  return p == end || scanChar(p, end, '\n');
+}
+
+constexpr uint64_t kWaltsColumns = (uint64_t{1} << fid(Field::Ipv4Src)) |
+                                   (uint64_t{1} << fid(Field::Ipv4Dst)) |
+                                   (uint64_t{1} << fid(Field::L4Sport)) |
+                                   (uint64_t{1} << fid(Field::L4Dport));
+
+vector<OpResult>& addExtraColumn(Batch& batch, FieldId id) {
+  batch.columns |= uint64_t{1} << id;
+  batch.extra.emplace_back(id, vector<OpResult>());
+  return batch.extra.back().second;
+}
+
+void startChunk(WaltsChunk& chunk, FieldId epochIdKey, size_t batchSize) {
+  chunk.batch.reserveColumns(kWaltsColumns);
+  chunk.batch.ipv4Src.reserve(batchSize);
+  chunk.batch.ipv4Dst.reserve(batchSize);
+  chunk.batch.l4Sport.reserve(batchSize);
+  chunk.batch.l4Dport.reserve(batchSize);
+  addExtraColumn(chunk.batch, fid(Field::PacketCount)).reserve(batchSize);
+  addExtraColumn(chunk.batch, fid(Field::ByteCount)).reserve(batchSize);
+  if (epochIdKey != fid(Field::Eid)) {
+    addExtraColumn(chunk.batch, epochIdKey).reserve(batchSize);
+  }
+  chunk.epochIds.reserve(batchSize);
+}
+
+void finishChunk(WaltsChunk& chunk, FieldId epochIdKey) {
+  Batch& batch = chunk.batch;
+  if (epochIdKey == fid(Field::Eid)) {
+    batch.columns |= uint64_t{1} << epochIdKey;
+    batch.eid = chunk.epochIds;
+  } else {
+    vector<OpResult>& column = batch.extra.back().second;
+    for (int64_t eid : chunk.epochIds) {
+      column.push_back(OpResult::Int(eid));
+    }
+  }
+  batch.resize(chunk.epochIds.size());
+}
+
+}  // namespace
+
+vector<pair<size_t, size_t>> splitAtNewlines(const char* data, size_t size,
+                                             size_t n) {
+  vector<pair<size_t, size_t>> ranges;
+  n = max<size_t>(1, n);
+  size_t step = max<size_t>(1, (size + n - 1) / n);
+  size_t begin = 0;
+  while (begin < size) {
+    size_t end = min(size, begin + step);
+    if (end < size) {
+      const void* nl = memchr(data + end - 1, '\n', size - (end - 1));
+      end = nl == nullptr ? size : static_cast<const char*>(nl) - data + 1;
+    }
+    ranges.emplace_back(begin, end);
+    begin = end;
+  }
+  return ranges;
+}
+
+vector<WaltsChunk> parseWaltsCSV(const char* begin, const char* end,
+                                 FieldId epochIdKey, size_t batchSize,
+                                 size_t baseOffset) {
+  vector<WaltsChunk> chunks;
+  const char* p = begin;
+  while (p != end) {
+    chunks.emplace_back();
+    WaltsChunk& chunk = chunks.back();
+    startChunk(chunk, epochIdKey, batchSize);
+    Batch& batch = chunk.batch;
+    vector<OpResult>& packetCounts = batch.extra[0].second;
+    vector<OpResult>& byteCounts = batch.extra[1].second;
+
+    while (p != end && chunk.epochIds.size() < batchSize) {
+      const char* line = p;
+      uint32_t src, dst;
+      int64_t sport, dport, packets, bytes, eid;
+      bool ok = scanIp(p, end, src) && scanChar(p, end, ',') &&
+                scanIp(p, end, dst) && scanChar(p, end, ',') &&
+                scanInt(p, end, sport) && scanChar(p, end, ',') &&
+                scanInt(p, end, dport) && scanChar(p, end, ',') &&
+                scanInt(p, end, packets) && scanChar(p, end, ',') &&
+                scanInt(p, end, bytes) && scanChar(p, end, ',') &&
+                scanInt(p, end, eid) && scanLineEnd(p, end);
+      if (!ok) {
+        const char* nl = static_cast<const char*>(
+            memchr(line, '\n', static_cast<size_t>(end - line)));
+        throw runtime_error("Error: failed to scan Walt's CSV line at byte " +
+                            to_string(baseOffset + (line - begin)) + ": \"" +
+                            string(line, nl == nullptr ? end : nl) + "\"");
+      }
+      batch.ipv4Src.push_back(src);
+      batch.ipv4Dst.push_back(dst);
+      batch.l4Sport.push_back(static_cast<uint16_t>(sport));
+      batch.l4Dport.push_back(static_cast<uint16_t>(dport));
+      packetCounts.push_back(OpResult::Int(packets));
+      byteCounts.push_back(OpResult::Int(bytes));
+      chunk.epochIds.push_back(eid);
+    }
+    finishChunk(chunk, epochIdKey);
+  }
+  return chunks;
+}
+
+namespace {
+
+// Windows a file's parsers may run ahead of the calling thread, per parser.
+constexpr size_t kWaltsWindowsAhead = 2;
+
+// One input file and the parser threads of its own. Parser j takes windows
+// j, j + parsers, ... of kWaltsChunkBytes each, cut at line boundaries, and
+// files each one under its index; the calling thread takes them back out in
+// index order, so the file is emitted exactly as if it had been parsed
+// front to back. The kernel is kept reading the file ahead of the furthest
+// window a parser may be working on. With no parsers, the calling thread
+// parses each window itself when it gets to it.
+class WaltsFile {
+ public:
+  WaltsFile(const string& filename, FieldId epochIdKey, size_t parsers)
+      : file(filename),
+        readAhead(filename, (max<size_t>(1, parsers) * kWaltsWindowsAhead + 2) *
+                                kWaltsChunkBytes),
+        epochIdKey(epochIdKey) {
+    readAhead.advance(0);
+    const char* data = file.data();
+    size_t size = file.size();
+    starts.push_back(0);
+    for (size_t at = kWaltsChunkBytes; at < size; at += kWaltsChunkBytes) {
+      const void* nl = memchr(data + at - 1, '\n', size - (at - 1));
+      size_t start =
+          nl == nullptr ? size : static_cast<const char*>(nl) - data + 1;
+      if (start > starts.back() && start < size) {
+        starts.push_back(start);
+      }
+      at = max(at, start);
+    }
+    starts.push_back(size);
+    windows = size == 0 ? 0 : starts.size() - 1;
+
+    parsers = min(parsers, windows);
+    ahead = parsers * kWaltsWindowsAhead;
+    for (size_t j = 0; j < parsers; j++) {
+      workers.emplace_back([this, j, parsers]() { parse(j, parsers); });
+    }
+  }
+
+  ~WaltsFile() {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    space.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  WaltsFile(const WaltsFile&) = delete;
+  WaltsFile& operator=(const WaltsFile&) = delete;
+
+  // The next batch of rows in file order, or nullptr at end of file. Blocks
+  // until its window is parsed, and rethrows the window's parse error.
+  WaltsChunk* nextChunk() {
+    if (!pending.empty()) {
+      pending.pop_front();
+    }
+    while (pending.empty()) {
+      if (consumed == windows) {
+        return nullptr;
+      }
+      Parsed window;
+      if (workers.empty()) {
+        window = parseWindow(consumed);
+        consumed++;
+      } else {
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard, [this]() { return parsed.count(consumed) != 0; });
+        window = move(parsed[consumed]);
+        parsed.erase(consumed);
+        consumed++;
+        guard.unlock();
+        space.notify_all();
+      }
+      readAhead.advance(starts[consumed]);
+
+      if (window.error) {
+        rethrow_exception(window.error);
+      }
+      for (auto& chunk : window.chunks) {
+        pending.push_back(move(chunk));
+      }
+    }
+    return &pending.front();
+  }
+
+  // Kept by the calling thread only.
+  int64_t eid = 0;
+  int64_t tupCount = 0;
+  bool done = false;
+
+ private:
+  struct Parsed {
+    vector<WaltsChunk> chunks;
+    exception_ptr error;
+  };
+
+  MappedFile file;
+  ReadAhead readAhead;
+  FieldId epochIdKey;
+  vector<size_t> starts;
+  size_t windows = 0;
+  size_t ahead = 0;
+
+  mutex lock;
+  condition_variable ready;
+  condition_variable space;
+  map<size_t, Parsed> parsed;
+  size_t consumed = 0;
+  bool stopping = false;
+  deque<WaltsChunk> pending;
+  vector<thread> workers;
+
+  Parsed parseWindow(size_t k) {
+    Parsed window;
+    try {
+      window.chunks = parseWaltsCSV(file.data() + starts[k],
+                                    file.data() + starts[k + 1], epochIdKey,
+                                    kDefaultBatchSize, starts[k]);
+    } catch (const runtime_error& e) {
+      window.error =
+          make_exception_ptr(runtime_error(file.name() + ": " + e.what()));
+    } catch (...) {
+      window.error = current_exception();
+    }
+    return window;
+  }
+
+  void parse(size_t first, size_t stride) {
+    for (size_t k = first; k < windows; k += stride) {
+      {
+        unique_lock<mutex> guard(lock);
+        space.wait(guard,
+                   [this, k]() { return stopping || k < consumed + ahead; });
+        if (stopping) {
+          return;
+        }
+      }
+      Parsed window = parseWindow(k);
+      {
+        lock_guard<mutex> guard(lock);
+        parsed[k] = move(window);
+      }
+      ready.notify_one();
+    }
+  }
+};
+
+Headers epochReset(const string& epochIdKey, int64_t eid, int64_t tupCount) {
+  Headers headers = singleton(epochIdKey, OpResult::Int(eid));
+  headers[Field::Tuples] = OpResult::Int(tupCount);
+  return headers;
+}
+
+// Sends one chunk to op, splitting it wherever epoch_id moves forward so the
+// resets land between the right rows.
+void emitChunk(WaltsFile& wf, WaltsChunk& chunk, const BatchOperator& op,
+               const string& epochIdKey) {
+  Batch& batch = chunk.batch;
+  vector<OpResult>& tuples = addExtraColumn(batch, fid(Field::Tuples));
+  tuples.resize(batch.rows);
+
+  vector<uint32_t> all;
+  all.swap(batch.sel);
+  vector<uint32_t> run;
+  auto flush = [&batch, &run, &op]() {
+    if (!run.empty()) {
+      batch.sel.swap(run);
+      op.next(batch);
+      batch.sel.swap(run);
+      run.clear();
+    }
+  };
+
+  for (uint32_t row : all) {
+    int64_t epochId = chunk.epochIds[row];
+    wf.tupCount++;
+    if (epochId > wf.eid) {
+      flush();
+      while (epochId > wf.eid) {
+        op.reset(epochReset(epochIdKey, wf.eid, wf.tupCount));
+        wf.tupCount = 0;
+        wf.eid++;
+      }
+    }
+    tuples[row] = OpResult::Int(wf.tupCount);
+    run.push_back(row);
+  }
+  flush();
+}
+
+}  // namespace
+
+void readWaltsCSV(const vector<string>& fileNames,
+                  const vector<BatchOperator>& ops, string epochIdKey,
+                  size_t numThreads) {
+  if (fileNames.size() != ops.size()) {
+    throw invalid_argument(
+        "Error: readWaltsCSV needs exactly one operator per file");
+  }
+  if (numThreads == 0) {
+    numThreads = max(1u, thread::hardware_concurrency());
+  }
+  FieldId epochIdKeyId = internField(epochIdKey);
+  size_t parsers = max<size_t>(1, numThreads / fileNames.size());
+
+  vector<unique_ptr<WaltsFile>> files;
+  files.reserve(fileNames.size());
+  for (const auto& name : fileNames) {
+    files.push_back(make_unique<WaltsFile>(name, epochIdKeyId, parsers));
+  }
+
+  size_t running = files.size();
+  while (running > 0) {
+    for (size_t i = 0; i < files.size(); i++) {
+      WaltsFile& wf = *files[i];
+      if (wf.done) {
+        continue;
+      }
+      WaltsChunk* chunk = wf.nextChunk();
+      if (chunk == nullptr) {
+        ops[i].reset(epochReset(epochIdKey, wf.eid + 1, wf.tupCount));
+        wf.done = true;
+        running--;
+        continue;
+      }
+      emitChunk(wf, *chunk, ops[i], epochIdKey);
+    }
+  }
+  cout << "Done." << endl;
+}
+
+BatchSource waltsSource(const string& fileName, string epochIdKey) {
+  auto wf = make_shared<WaltsFile>(fileName, internField(epochIdKey), 0);
+  return [wf, epochIdKey](const BatchOperator& op) {
+    WaltsChunk* chunk = wf->nextChunk();
+    if (chunk == nullptr) {
+      op.reset(epochReset(epochIdKey, wf->eid + 1, wf->tupCount));
+      return false;
+    }
+    emitChunk(*wf, *chunk, op, epochIdKey);
+    return true;
+  };
+}
+
+void readWaltsCSVCooperative(const vector<string>& fileNames,
+                             const vector<BatchOperator>& ops,
+                             string epochIdKey) {
+  if (fileNames.size() != ops.size()) {
+    throw invalid_argument(
+        "Error: readWaltsCSV needs exactly one operator per file");
+  }
+  CoopScheduler scheduler;
+  for (size_t i = 0; i < fileNames.size(); i++) {
+    spawnStream(scheduler, waltsSource(fileNames[i], epochIdKey), {ops[i]});
+  }
+  scheduler.run();
+  cout << "Done." << endl;
+}
+
+void readWaltsCSV(const vector<string>& fileNames, const vector<Operator>& ops,
+                  string epochIdKey, size_t numThreads) {
+  vector<BatchOperator> batchOps;
+  batchOps.reserve(ops.size());
+  for (const auto& op : ops) {
+    batchOps.push_back(unbatch(op));
+  }
+  readWaltsCSV(fileNames, batchOps, move(epochIdKey), numThreads);
+}
@@ -0,0 +1,78 @@
+#ifndef WALTS_CSV_H
+#define WALTS_CSV_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "batch.hpp"
+#include "cooperative.hpp"
+#include "schema.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+// Reader for Walt's flow-trace CSV format,
+//
+//   src_ip,dst_ip,src_l4_port,dst_l4_port,packet_count,byte_count,epoch_id
+//
+// Files are memory-mapped and cut into windows at line boundaries. Each file
+// has parser threads of its own, which parse its windows straight into
+// typed batches while the calling thread hands the batches already parsed
+// to the operators in file order, so that reading scales with the number of
+// files.
+
+constexpr size_t kWaltsChunkBytes = size_t{1} << 20;
+
+// Rows parsed from one run of lines. epochIds holds the epoch_id column;
+// it is also written to the batch under the epoch id key.
+struct WaltsChunk {
+  Batch batch;
+  vector<int64_t> epochIds;
+};
+
+// Cuts [0, size) into at most n ranges of roughly equal length, each ending
+// just past a newline (or at size).
+vector<pair<size_t, size_t>> splitAtNewlines(const char* data, size_t size,
+                                             size_t n);
+
+// Parses every line in [begin, end) into batches of at most batchSize rows.
+// An address of "0" is read as 0.0.0.0. Throws runtime_error giving the
+// offset of a line that fails to scan, counted from baseOffset.
+vector<WaltsChunk> parseWaltsCSV(const char* begin, const char* end,
+                                 FieldId epochIdKey,
+                                 size_t batchSize = kDefaultBatchSize,
+                                 size_t baseOffset = 0);
+
+// Feeds the i-th file to the i-th operator, as read_walts_csv does: files
+// are visited round-robin (here one batch at a time), each carries its own
+// epoch counter, every epoch_id change resets the operator with
+// {epochIdKey, tuples}, and end of file sends one last reset. The resets
+// and batches reach each operator in the order the sequential reader would
+// send them, and all calls are made on the calling thread. numThreads
+// parser threads are shared out evenly between the files, with at least
+// one each; 0 uses every hardware thread.
+void readWaltsCSV(const vector<string>& fileNames,
+                  const vector<BatchOperator>& ops, string epochIdKey = "eid",
+                  size_t numThreads = 0);
+void readWaltsCSV(const vector<string>& fileNames, const vector<Operator>& ops,
+                  string epochIdKey = "eid", size_t numThreads = 0);
+
+// One file as a source of a CoopScheduler: each step parses what it needs
+// of the file on the stepping thread and passes on one batch, split around
+// its resets, as readWaltsCSV would; the last step sends the end of file
+// reset. Throws as parseWaltsCSV does, from the step that reaches the bad
+// line.
+BatchSource waltsSource(const string& fileName, string epochIdKey = "eid");
+
+// readWaltsCSV with no thread but the caller's: every file is a waltsSource
+// feeding its operator through a channel, all of them tasks of one
+// scheduler, so that parsing one file interleaves with the queries of the
+// others while the kernel reads ahead.
+void readWaltsCSVCooperative(const vector<string>& fileNames,
+                             const vector<BatchOperator>& ops,
+                             string epochIdKey = "eid");
+
+#endif  // WALTS_CSV_H
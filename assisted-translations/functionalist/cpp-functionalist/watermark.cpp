@@ -0,0 +1,193 @@
+#include "watermark.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "builtins.hpp"
+#include "checkpoint.hpp"
+
+namespace {
+
+class WatermarkState {
+ public:
+  WatermarkState(double epochWidth, string keyOut, WatermarkOptions options,
+                 Operator nextOp)
+      : epochWidth(epochWidth),
+        keyOut(move(keyOut)),
+        keyOutId(internField(this->keyOut)),
+        options(move(options)),
+        stats(this->options.stats ? this->options.stats
+                                  : make_shared<WatermarkStats>()),
+        nextOp(move(nextOp)) {}
+
+  shared_ptr<CheckpointState> checkpoint;
+
+  void next(const Headers& headers) {
+    markChanged(checkpoint);
+    double time = headers.at(Field::Time).asFloat();
+    if (epochBoundary != 0.0 && time < epochBoundary - epochWidth) {
+      stats->late++;
+      if (!options.dropLate) {
+        emit(headers);
+      }
+      return;
+    }
+    if (time < maxTime) {
+      stats->reordered++;
+    }
+    maxTime = max(maxTime, time);
+    hold(headers, time);
+
+    double watermark = maxTime - options.allowedLateness;
+    while (!heap.empty() && heap.front().time <= watermark) {
+      release();
+    }
+    while (heap.size() > options.maxBuffered) {
+      stats->forced++;
+      release();
+    }
+  }
+
+  void reset() {
+    markChanged(checkpoint);
+    while (!heap.empty()) {
+      release();
+    }
+    nextOp.reset(singleton(keyOut, OpResult::Int(eid)));
+    epochBoundary = 0.0;
+    eid = 0;
+    maxTime = -numeric_limits<double>::infinity();
+  }
+
+  // The epoch, the latest time seen, then the tuples held back.
+  void save(StateWriter& out) const {
+    out.putDouble(epochBoundary);
+    out.putI64(eid);
+    out.putDouble(maxTime);
+    out.putVarint(heap.size());
+    for (const Pending& pending : heap) {
+      out.putHeaders(slab[pending.slot]);
+    }
+  }
+
+  void load(StateReader& in) {
+    heap.clear();
+    slab.clear();
+    freeSlots.clear();
+    epochBoundary = in.real();
+    eid = in.i64();
+    maxTime = in.real();
+    uint64_t n = in.varint();
+    for (uint64_t i = 0; i < n; i++) {
+      Headers headers = in.headers();
+      hold(headers, headers.at(Field::Time).asFloat());
+    }
+  }
+
+ private:
+  struct Pending {
+    double time;
+    // Arrival order, so that tuples with equal times keep it.
+    uint64_t seq;
+    uint32_t slot;
+
+    bool operator>(const Pending& other) const {
+      return time != other.time ? time > other.time : seq > other.seq;
+    }
+  };
+
+  double epochWidth;
+  string keyOut;
+  FieldId keyOutId;
+  WatermarkOptions options;
+  shared_ptr<WatermarkStats> stats;
+  Operator nextOp;
+
+  double epochBoundary = 0.0;
+  int64_t eid = 0;
+  double maxTime = -numeric_limits<double>::infinity();
+
+  // The heap orders small handles; the tuples stay put in the slab, whose
+  // freed slots are reused.
+  vector<Pending> heap;
+  vector<Headers> slab;
+  vector<uint32_t> freeSlots;
+  uint64_t seq = 0;
+  Headers out;
+
+  void hold(const Headers& headers, double time) {
+    uint32_t slot;
+    if (freeSlots.empty()) {
+      slot = static_cast<uint32_t>(slab.size());
+      slab.push_back(headers);
+    } else {
+      slot = freeSlots.back();
+      freeSlots.pop_back();
+      slab[slot] = headers;
+    }
+    heap.push_back({time, seq++, slot});
+    push_heap(heap.begin(), heap.end(), greater<Pending>());
+    stats->buffered = heap.size();
+    stats->peakBuffered = max(stats->peakBuffered, heap.size());
+  }
+
+  // Passes on the earliest tuple held, closing the epochs before it as
+  // epochCreator does.
+  void release() {
+    pop_heap(heap.begin(), heap.end(), greater<Pending>());
+    Pending pending = heap.back();
+    heap.pop_back();
+    stats->buffered = heap.size();
+
+    if (epochBoundary == 0.0) {
+      epochBoundary = pending.time + epochWidth;
+    } else if (pending.time >= epochBoundary) {
+      while (pending.time >= epochBoundary) {
+        nextOp.reset(singleton(keyOut, OpResult::Int(eid)));
+        epochBoundary += epochWidth;
+        eid++;
+      }
+      if (checkpoint) {
+        checkpoint->registry->epochStarted(eid);
+      }
+    }
+    emit(slab[pending.slot]);
+    freeSlots.push_back(pending.slot);
+  }
+
+  void emit(const Headers& headers) {
+    out = headers;
+    out[keyOutId] = OpResult::Int(eid);
+    nextOp.next(out);
+  }
+};
+
+}  // namespace
+
+OpCreator watermarkEpochCreator(double epochWidth, string keyOut,
+                                WatermarkOptions options) {
+  return [epochWidth, keyOut, options](Operator nextOp) {
+    auto state =
+        make_shared<WatermarkState>(epochWidth, keyOut, options, nextOp);
+    // Weak, so that the registry does not keep the stage alive.
+    weak_ptr<WatermarkState> weak = state;
+    state->checkpoint = checkpointState(
+        [weak](StateWriter& out) {
+          if (auto live = weak.lock()) {
+            live->save(out);
+          }
+        },
+        [weak](StateReader& in) {
+          auto live = weak.lock();
+          if (live && !in.done()) {
+            live->load(in);
+          }
+        });
+
+    OpFunc next = [state](const Headers& headers) { state->next(headers); };
+    OpFunc reset = [state](const Headers& _) { state->reset(); };
+
+    return Operator(next, reset);
+  };
+}
@@ -0,0 +1,53 @@
+#ifndef WATERMARK_H
+#define WATERMARK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "utils.hpp"
+
+using namespace std;
+
+struct WatermarkStats {
+  // Tuples that arrived with a time below the latest seen so far.
+  uint64_t reordered = 0;
+  // Tuples whose epoch had already closed when they arrived.
+  uint64_t late = 0;
+  // Tuples released before the watermark passed them, to stay within
+  // WatermarkOptions::maxBuffered.
+  uint64_t forced = 0;
+  size_t buffered = 0;
+  size_t peakBuffered = 0;
+};
+
+struct WatermarkOptions {
+  // How far behind the latest time seen a tuple may arrive and still be
+  // put in order, in seconds. 0 makes the stage epochCreator.
+  double allowedLateness = 0.0;
+  // Cap on the tuples held back; past it the oldest is released early.
+  size_t maxBuffered = 65536;
+  // Late tuples are dropped when set, and otherwise passed on with the
+  // current eid.
+  bool dropLate = true;
+  // Updated as the stage runs when set.
+  shared_ptr<WatermarkStats> stats;
+};
+
+// epochCreator for input whose time may go backwards by a bounded amount,
+// as when several capture queues or collectors are interleaved. Tuples are
+// held in a min-heap on time until the watermark, the latest time seen
+// minus allowedLateness, passes them, and are then tagged and passed on in
+// time order with the resets between them, exactly as epochCreator would
+// for the sorted stream. A tuple arriving after its epoch has closed is
+// late. A reset from upstream releases everything held, then resets as
+// epochCreator does.
+//
+// The stage, like every operator, is called from one thread at a time;
+// shards merging into one query still go through an exchange, but no
+// longer have to restore time order before it.
+OpCreator watermarkEpochCreator(double epochWidth, string keyOut,
+                                WatermarkOptions options = WatermarkOptions());
+
+#endif  // WATERMARK_H
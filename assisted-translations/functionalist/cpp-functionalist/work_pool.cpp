@@ -0,0 +1,127 @@
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// The pool and worker index of the calling thread, if it is a pool thread.
+thread_local const WorkStealingPool* currentPool = nullptr;
+thread_local size_t currentWorker = 0;
+
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(size_t numThreads) {
+  if (numThreads == 0) {
+    numThreads = max<size_t>(thread::hardware_concurrency(), 1);
+  }
+  for (size_t i = 0; i < numThreads; i++) {
+    workers.push_back(make_unique<Worker>());
+  }
+  for (size_t i = 0; i < numThreads; i++) {
+    threads.emplace_back([this, i]() { run(i); });
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    lock_guard<mutex> guard(stateLock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (thread& t : threads) {
+    t.join();
+  }
+}
+
+void WorkStealingPool::submit(function<void()> task) {
+  size_t target = currentPool == this
+                      ? currentWorker
+                      : nextWorker.fetch_add(1, memory_order_relaxed) %
+                            workers.size();
+  {
+    lock_guard<mutex> guard(workers[target]->lock);
+    workers[target]->tasks.push_back(move(task));
+  }
+  {
+    lock_guard<mutex> guard(stateLock);
+    queued++;
+    unfinished++;
+  }
+  wake.notify_one();
+}
+
+void WorkStealingPool::wait() {
+  unique_lock<mutex> guard(stateLock);
+  done.wait(guard, [this]() { return unfinished == 0; });
+  if (error) {
+    exception_ptr e = error;
+    error = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+bool WorkStealingPool::take(size_t self, function<void()>& task) {
+  {
+    Worker& own = *workers[self];
+    lock_guard<mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); i++) {
+    Worker& victim = *workers[(self + i) % workers.size()];
+    lock_guard<mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::run(size_t self) {
+  currentPool = this;
+  currentWorker = self;
+
+  function<void()> task;
+  for (;;) {
+    {
+      unique_lock<mutex> guard(stateLock);
+      wake.wait(guard, [this]() { return queued > 0 || stopping; });
+      if (queued == 0) {
+        return;
+      }
+      queued--;
+    }
+
+    // queued counted this task, so some deque is holding it until it is
+    // taken; another worker may get there first, in which case keep looking.
+    while (!take(self, task)) {
+      this_thread::yield();
+    }
+
+    exception_ptr failure;
+    try {
+      task();
+    } catch (...) {
+      failure = current_exception();
+    }
+    task = nullptr;
+
+    bool finished;
+    {
+      lock_guard<mutex> guard(stateLock);
+      if (failure && !error) {
+        error = failure;
+      }
+      finished = --unfinished == 0;
+    }
+    if (finished) {
+      done.notify_all();
+    }
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Fixed set of threads, each with a task deque of its own. A worker pops
+// its newest task first and, once its deque is empty, steals the oldest task
+// of another worker, so that a burst of work submitted to one queue spreads
+// over every core.
+class WorkStealingPool {
+ public:
+  // 0 threads means one per hardware thread.
+  explicit WorkStealingPool(size_t numThreads = 0);
+
+  // Runs every task already submitted, then joins the threads.
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  // Tasks submitted from a pool thread go to that thread's own deque; others
+  // are spread round-robin.
+  void submit(function<void()> task);
+
+  // Blocks until every task submitted so far has finished, then rethrows the
+  // first exception a task raised, if any. Must not be called from a pool
+  // thread.
+  void wait();
+
+  size_t size() const { return workers.size(); }
+
+ private:
+  struct Worker {
+    mutex lock;
+    deque<function<void()>> tasks;
+  };
+
+  vector<unique_ptr<Worker>> workers;
+  vector<thread> threads;
+  atomic<size_t> nextWorker{0};
+
+  mutex stateLock;
+  condition_variable wake;
+  condition_variable done;
+  size_t queued = 0;
+  size_t unfinished = 0;
+  bool stopping = false;
+  exception_ptr error;
+
+  bool take(size_t self, function<void()>& task);
+  void run(size_t self);
+};
+
+#endif  // WORK_POOL_H
@@ -0,0 +1,95 @@
+// Adapter for assisted-translations/functionalist/cpp-functionalist.
+
+#include <functional>
+#include <map>
+
+#include "main.h"
+#include "port_adapter.hpp"
+
+namespace {
+
+using Query = function<vector<Operator>(Operator)>;
+
+Query single(function<Operator(Operator)> query) {
+  return [query](Operator sink) { return vector<Operator>{query(sink)}; };
+}
+
+const map<string, Query>& queriesByName() {
+  static const map<string, Query> queries = {
+      {"count_pkts", single(countPkts)},
+      {"pkts_per_src_dst", single(pktsPerSrcDist)},
+      {"distinct_srcs", single(distinctSrcs)},
+      {"tcp_new_cons", single(tcpNewCons)},
+      {"ssh_brute_force", single(sshBruteForce)},
+      {"super_spreader", single(superSpreader)},
+      {"port_scan", single(portScan)},
+      {"ddos", single(ddos)},
+      {"syn_flood_sonata", synFloodSonata},
+      {"completed_flows", completedFlows},
+      {"slowloris", slowloris},
+  };
+  return queries;
+}
+
+class FunctionalistAdapter : public PortAdapter {
+ public:
+  string name() const override { return "cpp-functionalist"; }
+
+  bool supports(const string& query) const override {
+    return queriesByName().count(query) != 0;
+  }
+
+  void load(const vector<PacketRecord>& packets) override {
+    tuples.clear();
+    tuples.reserve(packets.size());
+    for (const PacketRecord& p : packets) {
+      Headers tup;
+      tup[Field::Time] = OpResult::Float(p.time);
+      tup[Field::EthSrc] = OpResult::MAC(MACAddress(p.ethSrc));
+      tup[Field::EthDst] = OpResult::MAC(MACAddress(p.ethDst));
+      tup[Field::EthEthertype] = OpResult::Int(p.ethEthertype);
+      tup[Field::Ipv4Hlen] = OpResult::Int(p.ipv4Hlen);
+      tup[Field::Ipv4Proto] = OpResult::Int(p.ipv4Proto);
+      tup[Field::Ipv4Len] = OpResult::Int(p.ipv4Len);
+      tup[Field::Ipv4Src] = OpResult::IPv4(IPv4Address(p.ipv4Src));
+      tup[Field::Ipv4Dst] = OpResult::IPv4(IPv4Address(p.ipv4Dst));
+      tup[Field::L4Sport] = OpResult::Int(p.l4Sport);
+      tup[Field::L4Dport] = OpResult::Int(p.l4Dport);
+      tup[Field::L4Flags] = OpResult::Int(p.l4Flags);
+      tuples.push_back(tup);
+    }
+  }
+
+  void build(const string& query) override {
+    ops.clear();
+    results = 0;
+    uint64_t* count = &results;
+    Operator sink([count](const Headers&) { (*count)++; },
+                  [](const Headers&) {});
+    ops = queriesByName().at(query)(sink);
+  }
+
+  void push(size_t begin, size_t end) override {
+    for (size_t i = begin; i < end; i++) {
+      for (const Operator& op : ops) {
+        op.next(tuples[i]);
+      }
+    }
+  }
+
+  uint64_t finish() override {
+    ops.clear();
+    return results;
+  }
+
+ private:
+  vector<Headers> tuples;
+  vector<Operator> ops;
+  uint64_t results = 0;
+};
+
+}  // namespace
+
+unique_ptr<PortAdapter> makePortAdapter() {
+  return make_unique<FunctionalistAdapter>();
+}
@@ -0,0 +1,328 @@
+// Adapter for LLM-linguistic-translations/google-gemini/2.5-Pro/
+// cpp-translations, the Gemini 2.5-Pro line-by-line port.
+//
+// The port's own queries, in sonata_queries.cpp, pass its stages fewer
+// arguments than they take and do not compile, so the queries below are
+// built here from its builtins, stage for stage as in
+// original-ocaml/main.ml.
+
+#include <functional>
+#include <map>
+
+#include "builtins.hpp"
+#include "common_utils.hpp"
+#include "port_adapter.hpp"
+
+namespace {
+
+using Utils::MACAddress;
+using Utils::OpResult;
+using Utils::Operator;
+using Utils::Tuple;
+using Builtins::counter;
+using Builtins::distinct;
+using Builtins::epoch;
+using Builtins::filter;
+using Builtins::GroupingFunc;
+using Builtins::groupby;
+using Builtins::join;
+using Builtins::single_group;
+
+using Query = function<vector<Operator>(Operator)>;
+using Predicate = function<bool(const Tuple&)>;
+
+Query single(function<Operator(Operator)> query) {
+  return [query](Operator sink) { return vector<Operator>{query(sink)}; };
+}
+
+GroupingFunc groups(vector<string> keys) {
+  return [keys](const Tuple& tup) { return Builtins::filter_groups(keys, tup); };
+}
+
+Tuple renamed(const string& from, const string& to, const Tuple& tup) {
+  return Builtins::rename_filtered_keys({{from, to}}, tup);
+}
+
+Predicate atLeast(string key, int threshold) {
+  return [key, threshold](const Tuple& tup) {
+    return Builtins::key_geq_int(key, threshold, tup);
+  };
+}
+
+int mapped(const string& key, const Tuple& tup) {
+  return Builtins::get_mapped_int(key, tup);
+}
+
+Predicate tcpFlags(int flags) {
+  return [flags](const Tuple& tup) {
+    return mapped("ipv4.proto", tup) == 6 && mapped("l4.flags", tup) == flags;
+  };
+}
+
+// A map stage adding out = f(tuple).
+Operator adding(string out, function<int(const Tuple&)> f, Operator next) {
+  return Builtins::map(
+      [out, f](const Tuple& tup) {
+        Tuple added = tup;
+        added[out] = f(tup);
+        return added;
+      },
+      next);
+}
+
+Operator countPkts(Operator next) {
+  return epoch(1.0, "eid", groupby(single_group, counter, "pkts", next));
+}
+
+Operator pktsPerSrcDst(Operator next) {
+  return epoch(1.0, "eid",
+               groupby(groups({"ipv4.src", "ipv4.dst"}), counter, "pkts",
+                       next));
+}
+
+Operator distinctSrcs(Operator next) {
+  return epoch(1.0, "eid",
+               distinct(groups({"ipv4.src"}),
+                        groupby(single_group, counter, "srcs", next)));
+}
+
+Operator tcpNewCons(Operator next) {
+  return epoch(1.0, "eid",
+               filter(tcpFlags(2),
+                      groupby(groups({"ipv4.dst"}), counter, "cons",
+                              filter(atLeast("cons", 40), next))));
+}
+
+Operator sshBruteForce(Operator next) {
+  Predicate ssh = [](const Tuple& tup) {
+    return mapped("ipv4.proto", tup) == 6 && mapped("l4.dport", tup) == 22;
+  };
+  return epoch(
+      1.0, "eid",
+      filter(ssh, distinct(groups({"ipv4.src", "ipv4.dst", "ipv4.len"}),
+                           groupby(groups({"ipv4.dst", "ipv4.len"}), counter,
+                                   "srcs", filter(atLeast("srcs", 40), next)))));
+}
+
+// The distinct-then-count shape of super_spreader, port_scan and ddos.
+Operator distinctCount(vector<string> pairKeys, string groupKey, string out,
+                       int threshold, Operator next) {
+  return epoch(1.0, "eid",
+               distinct(groups(pairKeys),
+                        groupby(groups({groupKey}), counter, out,
+                                filter(atLeast(out, threshold), next))));
+}
+
+Operator superSpreader(Operator next) {
+  return distinctCount({"ipv4.src", "ipv4.dst"}, "ipv4.src", "dsts", 40, next);
+}
+
+Operator portScan(Operator next) {
+  return distinctCount({"ipv4.src", "l4.dport"}, "ipv4.src", "ports", 40,
+                       next);
+}
+
+Operator ddos(Operator next) {
+  return distinctCount({"ipv4.src", "ipv4.dst"}, "ipv4.dst", "srcs", 45, next);
+}
+
+// Counts the tuples of a TCP flag pattern per host in epochs of width.
+Operator flagCount(double width, Predicate flags, string hostKey, string out,
+                   Operator next) {
+  return epoch(width, "eid",
+               filter(flags, groupby(groups({hostKey}), counter, out, next)));
+}
+
+vector<Operator> synFloodSonata(Operator next) {
+  int threshold = 3;
+  auto [join1, join2] = join(
+      [](const Tuple& tup) {
+        return make_pair(Builtins::filter_groups({"host"}, tup),
+                         Builtins::filter_groups({"syns+synacks"}, tup));
+      },
+      [](const Tuple& tup) {
+        return make_pair(renamed("ipv4.dst", "host", tup),
+                         Builtins::filter_groups({"acks"}, tup));
+      },
+      adding("syns+synacks-acks",
+             [](const Tuple& tup) {
+               return mapped("syns+synacks", tup) - mapped("acks", tup);
+             },
+             filter(atLeast("syns+synacks-acks", threshold), next)));
+  auto [join3, join4] = join(
+      [](const Tuple& tup) {
+        return make_pair(renamed("ipv4.dst", "host", tup),
+                         Builtins::filter_groups({"syns"}, tup));
+      },
+      [](const Tuple& tup) {
+        return make_pair(renamed("ipv4.src", "host", tup),
+                         Builtins::filter_groups({"synacks"}, tup));
+      },
+      adding("syns+synacks",
+             [](const Tuple& tup) {
+               return mapped("syns", tup) + mapped("synacks", tup);
+             },
+             join1));
+  return {flagCount(1.0, tcpFlags(2), "ipv4.dst", "syns", join3),
+          flagCount(1.0, tcpFlags(18), "ipv4.src", "synacks", join4),
+          flagCount(1.0, tcpFlags(16), "ipv4.dst", "acks", join2)};
+}
+
+vector<Operator> completedFlows(Operator next) {
+  int threshold = 1;
+  double width = 30.0;
+  auto [op1, op2] = join(
+      [](const Tuple& tup) {
+        return make_pair(renamed("ipv4.dst", "host", tup),
+                         Builtins::filter_groups({"syns"}, tup));
+      },
+      [](const Tuple& tup) {
+        return make_pair(renamed("ipv4.src", "host", tup),
+                         Builtins::filter_groups({"fins"}, tup));
+      },
+      adding("diff",
+             [](const Tuple& tup) {
+               return mapped("syns", tup) - mapped("fins", tup);
+             },
+             filter(atLeast("diff", threshold), next)));
+  Predicate fin = [](const Tuple& tup) {
+    return mapped("ipv4.proto", tup) == 6 && (mapped("l4.flags", tup) & 1) == 1;
+  };
+  return {flagCount(width, tcpFlags(2), "ipv4.dst", "syns", op1),
+          flagCount(width, fin, "ipv4.src", "fins", op2)};
+}
+
+vector<Operator> slowloris(Operator next) {
+  int t1 = 5;
+  int t2 = 500;
+  int t3 = 90;
+  Predicate tcp = [](const Tuple& tup) {
+    return mapped("ipv4.proto", tup) == 6;
+  };
+  auto [op1, op2] = join(
+      [](const Tuple& tup) {
+        return make_pair(Builtins::filter_groups({"ipv4.dst"}, tup),
+                         Builtins::filter_groups({"n_conns"}, tup));
+      },
+      [](const Tuple& tup) {
+        return make_pair(Builtins::filter_groups({"ipv4.dst"}, tup),
+                         Builtins::filter_groups({"n_bytes"}, tup));
+      },
+      adding("bytes_per_conn",
+             [](const Tuple& tup) {
+               return mapped("n_bytes", tup) / mapped("n_conns", tup);
+             },
+             filter(
+                 [t3](const Tuple& tup) {
+                   return mapped("bytes_per_conn", tup) <= t3;
+                 },
+                 next)));
+  Operator nConns = epoch(
+      1.0, "eid",
+      filter(tcp, distinct(groups({"ipv4.src", "ipv4.dst", "l4.sport"}),
+                           groupby(groups({"ipv4.dst"}), counter, "n_conns",
+                                   filter(atLeast("n_conns", t1), op1)))));
+  Builtins::ReductionFunc sumLen = [](OpResult val, const Tuple& tup) {
+    return Builtins::sum_ints("ipv4.len", val, tup);
+  };
+  Operator nBytes = epoch(
+      1.0, "eid",
+      filter(tcp, groupby(groups({"ipv4.dst"}), sumLen, "n_bytes",
+                          filter(atLeast("n_bytes", t2), op2))));
+  return {nConns, nBytes};
+}
+
+const std::map<string, Query>& queriesByName() {
+  static const std::map<string, Query> queries = {
+      {"count_pkts", single(countPkts)},
+      {"pkts_per_src_dst", single(pktsPerSrcDst)},
+      {"distinct_srcs", single(distinctSrcs)},
+      {"tcp_new_cons", single(tcpNewCons)},
+      {"ssh_brute_force", single(sshBruteForce)},
+      {"super_spreader", single(superSpreader)},
+      {"port_scan", single(portScan)},
+      {"ddos", single(ddos)},
+      {"syn_flood_sonata", synFloodSonata},
+      {"completed_flows", completedFlows},
+      {"slowloris", slowloris},
+  };
+  return queries;
+}
+
+Utils::IPv4Address ipv4(uint32_t address) {
+  return Utils::IPv4Address(
+      to_string(address >> 24) + "." + to_string((address >> 16) & 0xff) +
+      "." + to_string((address >> 8) & 0xff) + "." +
+      to_string(address & 0xff));
+}
+
+MACAddress mac(uint64_t address) {
+  array<unsigned char, 6> bytes;
+  for (size_t i = 0; i < bytes.size(); i++) {
+    bytes[i] = static_cast<unsigned char>(address >> (8 * (5 - i)));
+  }
+  return MACAddress(bytes);
+}
+
+class GeminiLinguisticAdapter : public PortAdapter {
+ public:
+  string name() const override { return "gemini-linguistic"; }
+
+  bool supports(const string& query) const override {
+    return queriesByName().count(query) != 0;
+  }
+
+  void load(const vector<PacketRecord>& packets) override {
+    tuples.clear();
+    tuples.reserve(packets.size());
+    for (const PacketRecord& p : packets) {
+      Tuple tup;
+      tup["time"] = p.time;
+      tup["eth.src"] = mac(p.ethSrc);
+      tup["eth.dst"] = mac(p.ethDst);
+      tup["eth.ethertype"] = static_cast<int>(p.ethEthertype);
+      tup["ipv4.hlen"] = static_cast<int>(p.ipv4Hlen);
+      tup["ipv4.proto"] = static_cast<int>(p.ipv4Proto);
+      tup["ipv4.len"] = static_cast<int>(p.ipv4Len);
+      tup["ipv4.src"] = ipv4(p.ipv4Src);
+      tup["ipv4.dst"] = ipv4(p.ipv4Dst);
+      tup["l4.sport"] = static_cast<int>(p.l4Sport);
+      tup["l4.dport"] = static_cast<int>(p.l4Dport);
+      tup["l4.flags"] = static_cast<int>(p.l4Flags);
+      tuples.push_back(move(tup));
+    }
+  }
+
+  void build(const string& query) override {
+    ops.clear();
+    results = 0;
+    uint64_t* count = &results;
+    Operator sink{[count](const Tuple&) { (*count)++; },
+                  [](const Tuple&) {}};
+    ops = queriesByName().at(query)(sink);
+  }
+
+  void push(size_t begin, size_t end) override {
+    for (size_t i = begin; i < end; i++) {
+      for (const Operator& op : ops) {
+        op.next(tuples[i]);
+      }
+    }
+  }
+
+  uint64_t finish() override {
+    ops.clear();
+    return results;
+  }
+
+ private:
+  vector<Tuple> tuples;
+  vector<Operator> ops;
+  uint64_t results = 0;
+};
+
+}  // namespace
+
+unique_ptr<PortAdapter> makePortAdapter() {
+  return make_unique<GeminiLinguisticAdapter>();
+}
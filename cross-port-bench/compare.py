@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""Runs every bench_<port> binary on every reference query, one process per
+run, and prints a Markdown table of throughput, per-packet latency and memory.
+
+usage: compare.py BUILD_DIR [--packets N] [--seed S] [--rate PPS]
+
+A query's results column is marked with * where ports disagree on the number
+of tuples the query produced over the same workload.
+"""
+
+import argparse
+import csv
+import glob
+import io
+import os
+import subprocess
+import sys
+
+QUERIES = [
+    "count_pkts", "pkts_per_src_dst", "distinct_srcs", "tcp_new_cons",
+    "ssh_brute_force", "super_spreader", "port_scan", "ddos",
+    "syn_flood_sonata", "completed_flows", "slowloris",
+]
+
+
+def run(binary, query, args):
+    cmd = [binary, "--query", query, "--packets", str(args.packets),
+           "--seed", str(args.seed), "--rate", str(args.rate)]
+    proc = subprocess.run(cmd, capture_output=True, text=True)
+    rows = list(csv.reader(io.StringIO(proc.stdout)))
+    if proc.returncode != 0 or not rows:
+        err = proc.stderr.strip().splitlines()
+        return None, err[-1] if err else "exit %d" % proc.returncode
+    return rows[-1], None
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("build_dir")
+    parser.add_argument("--packets", type=int, default=1 << 18)
+    parser.add_argument("--seed", type=int, default=42)
+    parser.add_argument("--rate", type=float, default=65536.0)
+    args = parser.parse_args()
+
+    binaries = sorted(glob.glob(os.path.join(args.build_dir, "bench_*")))
+    if not binaries:
+        sys.exit("no bench_* binaries in " + args.build_dir)
+
+    print("| query | port | Mpps | p50 ns/pkt | p99 ns/pkt | max ns/pkt "
+          "| peak RSS growth MiB | results |")
+    print("|---|---|---:|---:|---:|---:|---:|---:|")
+    for query in QUERIES:
+        rows = []
+        for binary in binaries:
+            port = os.path.basename(binary)[len("bench_"):]
+            row, err = run(binary, query, args)
+            rows.append((port, row, err))
+        counts = {row[9] for _, row, _ in rows if row is not None}
+        mark = "*" if len(counts) > 1 else ""
+        for port, row, err in rows:
+            if row is None:
+                print("| %s | %s | %s | | | | | |" % (query, port, err))
+                continue
+            print("| %s | %s | %.2f | %.0f | %.0f | %.0f | %.1f | %s%s |" % (
+                query, row[0], float(row[4]), float(row[5]), float(row[6]),
+                float(row[7]), float(row[8]), row[9], mark))
+
+
+if __name__ == "__main__":
+    main()
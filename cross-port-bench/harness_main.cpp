@@ -0,0 +1,145 @@
+// Runs reference queries of one port over the shared workload and prints
+// one CSV row per query:
+//
+//   port,query,packets,seconds,mpps,p50_ns,p99_ns,max_ns,rss_mib,results
+//
+// The latency columns are per packet, over chunks of kChunkPackets, so
+// p99 and max show the cost of epoch closes. rss_mib is the growth in peak
+// RSS over the run, meaningful only when one query runs per process, which
+// is how compare.py invokes the harness.
+//
+// Usage: bench_<port> [--query NAME|all] [--packets N] [--seed S]
+//                     [--rate PPS] [--header]
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+#include "port_adapter.hpp"
+#include "workload.hpp"
+
+namespace {
+
+constexpr size_t kChunkPackets = 1024;
+
+double peakRssMiB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss) / 1024.0;
+}
+
+double percentile(vector<double> values, double p) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  size_t at = static_cast<size_t>(p * static_cast<double>(values.size() - 1));
+  nth_element(values.begin(), values.begin() + at, values.end());
+  return values[at];
+}
+
+void run(PortAdapter& adapter, const string& query, size_t packets) {
+  double rssBefore = peakRssMiB();
+  adapter.build(query);
+
+  vector<double> chunkNanos;
+  auto start = chrono::steady_clock::now();
+  for (size_t begin = 0; begin < packets; begin += kChunkPackets) {
+    size_t end = min(packets, begin + kChunkPackets);
+    auto chunkStart = chrono::steady_clock::now();
+    adapter.push(begin, end);
+    chrono::duration<double, nano> spent =
+        chrono::steady_clock::now() - chunkStart;
+    chunkNanos.push_back(spent.count() / static_cast<double>(end - begin));
+  }
+  uint64_t results = adapter.finish();
+  chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+
+  printf("%s,%s,%zu,%.6f,%.4f,%.1f,%.1f,%.1f,%.2f,%llu\n",
+         adapter.name().c_str(), query.c_str(), packets, seconds.count(),
+         static_cast<double>(packets) / seconds.count() * 1e-6,
+         percentile(chunkNanos, 0.5), percentile(chunkNanos, 0.99),
+         *max_element(chunkNanos.begin(), chunkNanos.end()),
+         peakRssMiB() - rssBefore, static_cast<unsigned long long>(results));
+  fflush(stdout);
+}
+
+[[noreturn]] void usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--query NAME|all] [--packets N] [--seed S] "
+          "[--rate PPS] [--header]\n",
+          argv0);
+  exit(2);
+}
+
+}  // namespace
+
+const vector<string>& referenceQueries() {
+  static const vector<string> queries = {
+      "count_pkts",      "pkts_per_src_dst", "distinct_srcs",
+      "tcp_new_cons",    "ssh_brute_force",  "super_spreader",
+      "port_scan",       "ddos",             "syn_flood_sonata",
+      "completed_flows", "slowloris",
+  };
+  return queries;
+}
+
+int main(int argc, char** argv) {
+  WorkloadOptions options;
+  string query = "all";
+  bool header = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--header") {
+      header = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      usage(argv[0]);
+    }
+    string value = argv[++i];
+    if (arg == "--query") {
+      query = value;
+    } else if (arg == "--packets") {
+      options.packets = strtoull(value.c_str(), nullptr, 10);
+    } else if (arg == "--seed") {
+      options.seed = strtoull(value.c_str(), nullptr, 10);
+    } else if (arg == "--rate") {
+      options.rate = strtod(value.c_str(), nullptr);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  unique_ptr<PortAdapter> adapter = makePortAdapter();
+  adapter->load(generateWorkload(options));
+  if (header) {
+    printf("port,query,packets,seconds,mpps,p50_ns,p99_ns,max_ns,rss_mib,"
+           "results\n");
+  }
+
+  vector<string> queries =
+      query == "all" ? referenceQueries() : vector<string>{query};
+  int status = 0;
+  for (const string& name : queries) {
+    if (!adapter->supports(name)) {
+      fprintf(stderr, "%s: %s is not implemented\n", adapter->name().c_str(),
+              name.c_str());
+      status = 1;
+      continue;
+    }
+    try {
+      run(*adapter, name, options.packets);
+    } catch (const exception& e) {
+      fprintf(stderr, "%s: %s failed: %s\n", adapter->name().c_str(),
+              name.c_str(), e.what());
+      status = 1;
+    }
+  }
+  return status;
+}
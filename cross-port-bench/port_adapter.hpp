@@ -0,0 +1,45 @@
+#ifndef PORT_ADAPTER_H
+#define PORT_ADAPTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "workload.hpp"
+
+using namespace std;
+
+// The queries of the original implementation every port is measured on,
+// under their OCaml names. An adapter runs each as its port implements it,
+// starting from the packet fields and ending at a counting sink.
+const vector<string>& referenceQueries();
+
+// What the harness needs from a port. Each port is built into a binary of
+// its own, since the ports define the same global names, and supplies one
+// adapter through makePortAdapter().
+class PortAdapter {
+ public:
+  virtual ~PortAdapter() = default;
+
+  // The port, as reported in the results.
+  virtual string name() const = 0;
+  virtual bool supports(const string& query) const = 0;
+
+  // Converts the workload into the port's own tuples ahead of the timed run.
+  virtual void load(const vector<PacketRecord>& packets) = 0;
+
+  // Builds a fresh instance of query, replacing any earlier one.
+  virtual void build(const string& query) = 0;
+  // Passes loaded packets [begin, end) to the query, in order.
+  virtual void push(size_t begin, size_t end) = 0;
+  // Tears the query down, waiting for any threads it runs, and returns the
+  // number of tuples it passed to its sink. No final reset is sent, so only
+  // epochs closed by the traffic itself count.
+  virtual uint64_t finish() = 0;
+};
+
+unique_ptr<PortAdapter> makePortAdapter();
+
+#endif  // PORT_ADAPTER_H
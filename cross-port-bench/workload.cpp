@@ -0,0 +1,77 @@
+#include "workload.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace {
+
+// Ranks in [0, n) with P(k) proportional to 1 / (k + 1)^s. Draws are made
+// from raw 64-bit outputs rather than through the standard distributions,
+// whose algorithms differ between standard libraries.
+class Zipf {
+ public:
+  Zipf(uint32_t n, double s) : cdf(n) {
+    double sum = 0.0;
+    for (uint32_t k = 0; k < n; k++) {
+      sum += 1.0 / pow(static_cast<double>(k + 1), s);
+      cdf[k] = sum;
+    }
+    for (double& c : cdf) {
+      c /= sum;
+    }
+  }
+
+  uint32_t operator()(mt19937_64& rng) const {
+    double u = static_cast<double>(rng() >> 11) * 0x1.0p-53;
+    auto it = upper_bound(cdf.begin(), cdf.end(), u);
+    return static_cast<uint32_t>(
+        min<size_t>(it - cdf.begin(), cdf.size() - 1));
+  }
+
+ private:
+  vector<double> cdf;
+};
+
+}  // namespace
+
+vector<PacketRecord> generateWorkload(const WorkloadOptions& options) {
+  mt19937_64 rng(options.seed);
+  Zipf srcs(max<uint32_t>(options.srcHosts, 1), options.skew);
+  Zipf dsts(max<uint32_t>(options.dstHosts, 1), options.skew);
+  Zipf ports(max<uint32_t>(options.dstPorts, 1), options.skew);
+
+  vector<PacketRecord> packets(options.packets);
+  for (size_t i = 0; i < packets.size(); i++) {
+    PacketRecord& p = packets[i];
+    p.time = static_cast<double>(i) / options.rate;
+    p.ethSrc = 0x001122334455;
+    p.ethDst = 0xAABBCCDDEEFF;
+    p.ethEthertype = 0x0800;
+    p.ipv4Hlen = 20;
+    p.ipv4Src = 0x0a000000 + srcs(rng);
+    p.ipv4Dst = 0xc0a80000 + dsts(rng);
+    p.ipv4Len = static_cast<uint16_t>(40 + rng() % 1460);
+    p.l4Sport = static_cast<uint16_t>(1024 + rng() % 60000);
+    p.l4Dport = static_cast<uint16_t>(ports(rng));
+
+    // Nine in ten packets are TCP: 30% SYN, 10% SYN-ACK, 50% ACK, 5% FIN-ACK
+    // and 5% RST. The rest are UDP.
+    uint64_t kind = rng() % 100;
+    p.ipv4Proto = kind < 90 ? 6 : 17;
+    if (kind < 27) {
+      p.l4Flags = 2;
+    } else if (kind < 36) {
+      p.l4Flags = 18;
+    } else if (kind < 81) {
+      p.l4Flags = 16;
+    } else if (kind < 86) {
+      p.l4Flags = 17;
+    } else if (kind < 90) {
+      p.l4Flags = 4;
+    } else {
+      p.l4Flags = 0;
+    }
+  }
+  return packets;
+}
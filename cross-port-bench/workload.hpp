@@ -0,0 +1,43 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// One packet in a port-neutral form: the header fields every port's queries
+// read, under the names of the original implementation.
+struct PacketRecord {
+  double time;             // time
+  uint64_t ethSrc;         // eth.src
+  uint64_t ethDst;         // eth.dst
+  uint16_t ethEthertype;   // eth.ethertype
+  uint8_t ipv4Hlen;        // ipv4.hlen
+  uint8_t ipv4Proto;       // ipv4.proto
+  uint16_t ipv4Len;        // ipv4.len
+  uint32_t ipv4Src;        // ipv4.src
+  uint32_t ipv4Dst;        // ipv4.dst
+  uint16_t l4Sport;        // l4.sport
+  uint16_t l4Dport;        // l4.dport
+  uint8_t l4Flags;         // l4.flags
+};
+
+struct WorkloadOptions {
+  size_t packets = 1 << 18;
+  uint64_t seed = 42;
+  // Packets per second of capture time.
+  double rate = 65536.0;
+  // Sizes of the address and port populations, each drawn from a Zipf
+  // distribution with exponent skew.
+  uint32_t srcHosts = 65536;
+  uint32_t dstHosts = 4096;
+  uint32_t dstPorts = 1024;
+  double skew = 1.1;
+};
+
+// The same options always give the same packets, whichever binary asks.
+vector<PacketRecord> generateWorkload(const WorkloadOptions& options);
+
+#endif  // WORKLOAD_H